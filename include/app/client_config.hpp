@@ -0,0 +1,167 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * @file client_config.hpp
+ * @brief Runtime tuning knobs shared by the app layer.
+ *
+ * The defaults tune a regular desktop client, but everything that opens sockets or files of its
+ * own is off: a default constructed ClientConfig accepts no connections, speaks TCP only, stays
+ * out of the DHT and the LAN and writes nothing but the download. Embedders and tests get a
+ * client that only talks to its trackers, the command line client turns the rest on.
+ */
+
+namespace bt {
+
+/** Piece picker behaviour. */
+struct PickerConfig {
+    // Download pieces in file order around a read cursor instead of plain index order
+    bool sequential = false;
+    // Number of pieces ahead of the read cursor that are picked before anything else
+    uint32_t streamingWindow = 16;
+    // Time budget per piece inside the streaming window, counted from the cursor
+    std::chrono::milliseconds deadlineStep{500};
+    // Upper bound for partially downloaded pieces, each one holds a full piece buffer
+    uint32_t maxOpenPieces = 64;
+    // Upper bound for the bytes held by those piece buffers
+    size_t maxBufferedBytes = 128 * 1024 * 1024;
+    // Pieces a peer (by IP) may be proven to have corrupted before it gets banned
+    uint32_t hashFailuresBeforeBan = 2;
+};
+
+/** Outstanding block requests per peer. */
+struct PipelineConfig {
+    // Bounds for the depth, which follows the peer's bandwidth-delay product in between
+    uint32_t minDepth = 2;
+    uint32_t maxDepth = 256;
+    // Depth until the first throughput sample is in
+    uint32_t initialDepth = 32;
+    // A request unanswered for this long goes back to the picker
+    std::chrono::milliseconds requestTimeout{20000};
+    // A peer that sends no data for this long while we wait is snubbed: all its requests go
+    // back to the picker and it only gets one at a time until it delivers again
+    std::chrono::milliseconds snubTimeout{30000};
+};
+
+/** Peer connections. */
+struct ConnectionConfig {
+    // Port for incoming connections, also announced to the tracker. 0 disables the listener
+    uint16_t listenPort = 0;
+    // Established connections and connects/handshakes in progress at the same time
+    uint32_t maxPeers = 50;
+    uint32_t maxHalfOpen = 8;
+    std::chrono::milliseconds connectTimeout{5000};
+    std::chrono::milliseconds handshakeTimeout{10000};
+    // Wait before reconnecting, doubled with every failure in a row up to maxRetryBackoff
+    std::chrono::milliseconds retryBackoff{5000};
+    std::chrono::milliseconds maxRetryBackoff{10 * 60 * 1000};
+    // Failures in a row after which a peer is forgotten
+    uint32_t maxFailures = 5;
+    // Swap peer lists with peers that support it (ut_pex), at most once per pexInterval
+    bool peerExchange = true;
+    std::chrono::milliseconds pexInterval{60000};
+    // Magnet links: time to fetch the info dictionary from peers, maxHalfOpen peers at a time
+    std::chrono::milliseconds metadataTimeout{120000};
+    // Time trackers, DHT and local discovery get to find the first peers before we give up.
+    // With trackers alone the first round in which all of them fail ends the wait
+    std::chrono::milliseconds peerSearchTimeout{120000};
+    // Connect over uTP (BEP 29) first and fall back to TCP, accept uTP on listenPort as well
+    bool utp = false;
+};
+
+/** Uploading to other peers. */
+struct UploadConfig {
+    // Peers we upload to at the same time, one of them is the optimistic unchoke
+    uint32_t uploadSlots = 4;
+    std::chrono::milliseconds chokeInterval{10000};
+    // The optimistic unchoke moves on every this many choke rounds
+    uint32_t optimisticRounds = 3;
+    // Requests a peer may have queued with us, any beyond are dropped
+    uint32_t maxPeerRequests = 256;
+    // Send block data straight from the file (sendfile) instead of reading it into a buffer
+    // first. Falls back to buffered uploads where the platform or file system can't do it.
+    bool zeroCopy = false;
+    // Memory for pieces read from storage for buffered uploads, 0 disables the cache. Zero-copy
+    // uploads rely on the kernel's page cache instead.
+    size_t readCacheBytes = 64 * 1024 * 1024;
+    // Keep running and serving the torrent once it's complete
+    bool seedAfterDownload = false;
+};
+
+/**
+ * Rate limits, bytes/s, 0 means unlimited. Downloads are limited by holding back requests,
+ * uploads by holding back the blocks peers asked for; protocol messages always go through.
+ */
+struct BandwidthConfig {
+    // All torrents of the client together
+    uint64_t downloadRate = 0;
+    uint64_t uploadRate = 0;
+    // Each torrent
+    uint64_t torrentDownloadRate = 0;
+    uint64_t torrentUploadRate = 0;
+    // Each peer connection
+    uint64_t peerDownloadRate = 0;
+    uint64_t peerUploadRate = 0;
+    // Unused bandwidth saved up for later, as time at the rate (at least one block)
+    std::chrono::milliseconds burst{1000};
+    // Peers waiting for a shared limit take turns, instead of the first to ask winning
+    bool fairQueueing = true;
+};
+
+/** Announces to the tracker. */
+struct TrackerConfig {
+    // Until the tracker sends intervals of its own. The short one is used while we are short of
+    // peers or have news for the tracker
+    std::chrono::seconds announceInterval{1800};
+    std::chrono::seconds minAnnounceInterval{300};
+    // Wait after a failed announce, doubled with every failure in a row up to maxRetryBackoff
+    std::chrono::milliseconds retryBackoff{15000};
+    std::chrono::milliseconds maxRetryBackoff{30 * 60 * 1000};
+    std::chrono::milliseconds announceTimeout{15000};
+};
+
+/** Mainline DHT (BEP 5), finds peers without a tracker. */
+struct DhtConfig {
+    bool enabled = false;
+    // UDP port of the DHT node, 0 picks a free one
+    uint16_t port = 0;
+    // host:port of nodes to join through when the saved nodes don't answer
+    std::vector<std::string> routers{"router.bittorrent.com:6881", "dht.transmissionbt.com:6881",
+                                     "router.utorrent.com:6881"};
+    // Routing table kept across runs for a fast bootstrap, empty to keep none
+    std::string stateFile;
+    // Lookups for peers, which announce us as well. Sooner while they find none
+    std::chrono::seconds announceInterval{900};
+    std::chrono::seconds retryInterval{60};
+};
+
+/** Local Service Discovery (BEP 14), finds peers on the LAN by multicast. */
+struct LsdConfig {
+    bool enabled = false;
+    // Announces of our torrents to the LAN, never more often than the minimum
+    std::chrono::seconds announceInterval{300};
+    std::chrono::seconds minAnnounceInterval{60};
+};
+
+/** Threads driving the peer connections. */
+struct IoConfig {
+    // Number of io_contexts, each run by a thread of its own. 0 means one per core
+    uint32_t threads = 0;
+};
+
+struct ClientConfig {
+    PickerConfig picker;
+    PipelineConfig pipeline;
+    ConnectionConfig connection;
+    UploadConfig upload;
+    BandwidthConfig bandwidth;
+    TrackerConfig tracker;
+    DhtConfig dht;
+    LsdConfig lsd;
+    IoConfig io;
+};
+} // namespace bt
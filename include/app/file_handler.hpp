@@ -4,6 +4,7 @@
 #include <fstream>
 #include <mutex>
 #include <span>
+#include <sys/types.h>
 #include <vector>
 
 namespace bt {
@@ -13,11 +14,17 @@ public:
     ~FileHandler();
 
     void writePiece(uint32_t index, std::span<const uint8_t> data);
+    void readData(uint64_t offset, std::span<uint8_t> out);
+    // Sends up to `length` bytes at `offset` straight from the file to `socketFd`, without
+    // copying them through user space. Returns the bytes sent, or -1 with errno set (EAGAIN
+    // when the socket is full, ENOSYS where there is no sendfile).
+    ssize_t sendData(int socketFd, uint64_t offset, size_t length);
     std::vector<uint8_t> loadResumeStatus();
 
 private:
     std::mutex _mtx;
     std::fstream _fileStream;
+    int _fd = -1; // Read-only, for sendData. Needs no lock, it never seeks
 
     size_t _pieceSize;
     size_t _lastPieceSize;
@@ -1,30 +1,123 @@
 #pragma once
+#include "app/client_config.hpp"
 #include "app/piece_manager.hpp"
+#include "core/bandwidth_channel.hpp"
+#include "core/choker.hpp"
 #include "core/peer_communicator.hpp"
+#include "core/peer_pool.hpp"
+#include "core/peer_stream.hpp"
 #include "core/torrent_metadata_loader.hpp"
+#include "core/utp.hpp"
 #include <array>
 #include <asio/detail/handler_work.hpp>
 #include <asio/io_context.hpp>
+#include <asio/ip/tcp.hpp>
+#include <atomic>
 #include <cstdint>
+#include <map>
+#include <memory>
+#include <optional>
+#include <set>
+#include <string>
+#include <thread>
 #include <vector>
 
 namespace bt {
+class PeerSession;
+
+// Keeps up to maxPeers connections to the best peers it knows. Connect attempts are limited to
+// maxHalfOpen at a time and get deadlines, failed and dropped peers are retried with backoff.
+// The peer pool is owned by a control strand, sessions report back to it by posting.
+// The control strand also runs the choker and tells every session about verified pieces.
+// Incoming connections count against the same limits as outgoing ones.
+// Peers learn from each other (ut_pex): every pexInterval the control strand hands each session
+// the peers we reached, and the peers sessions hear about go into the pool.
+// With uTP enabled, every shard has a UDP socket of its own that its sessions connect over.
+// Rate limits form a tree: every session has a channel of its own below the torrent's, which
+// sits below the client-wide channels passed in (see core::BandwidthChannel). Unlimited levels
+// are left out, so peers always share the nearest limit as siblings.
 class PeerManager {
 public:
     PeerManager(std::vector<std::array<uint8_t, 6>> peerBuffer, core::Sha1Hash& infoHash,
-                std::string_view peerId);
-    ~PeerManager() = default;
+                std::string_view peerId, const ClientConfig& config = {},
+                std::shared_ptr<core::BandwidthChannel> downloadLimit = nullptr,
+                std::shared_ptr<core::BandwidthChannel> uploadLimit = nullptr);
+    ~PeerManager();
 
     void start(std::shared_ptr<PieceManager> pieceManager);
+    // New candidates, e.g. from another tracker announce. `local` ones were found on the LAN and
+    // are tried first. Safe to call from any thread.
+    void addPeers(const std::vector<core::Peer>& peers, bool local = false);
+    // Connection accepted by the listener, whose handshake is still to be answered. Safe to call
+    // from any thread.
+    void addIncoming(core::PeerStream stream, core::Peer peer, core::HandshakeMsg handshake);
+    // Established connections, safe to call from any thread
+    inline size_t getConnectedCount() const {
+        return _connected;
+    }
+    // Sessions per io thread, from connect attempt to end. Safe to call from any thread
+    std::vector<size_t> getShardLoads() const;
+    // Stops all shards and joins their threads, sessions still running are dropped
     void stop();
 
 private:
-    asio::io_context _ctx;
-    std::vector<core::Peer> _peers;
+    // One io_context per thread. A session stays on the shard it was started on, it only
+    // shares the (locked) PieceManager with sessions on other shards.
+    struct Shard {
+        asio::io_context ctx{1};
+        asio::executor_work_guard<asio::io_context::executor_type> work{ctx.get_executor()};
+        std::atomic<size_t> sessions{0};
+        std::shared_ptr<core::UtpContext> utp; // Null if uTP is off or the socket failed
+    };
+
+    ClientConfig _config;
+    std::vector<std::unique_ptr<Shard>> _shards;
+    std::vector<std::thread> _threadPool;
     core::Sha1Hash& _infoHash;
     std::string_view _peerId;
-    std::vector<std::thread> _threadPool;
+    std::shared_ptr<PieceManager> _pieceManager;
+    std::shared_ptr<core::BandwidthChannel> _downloadChannel; // Torrent level, may be null
+    std::shared_ptr<core::BandwidthChannel> _uploadChannel;
+
+    // Only touched on the control strand
+    asio::strand<asio::io_context::executor_type> _control;
+    asio::steady_timer _wakeup; // Cancelled whenever a slot frees up or candidates arrive
+    core::PeerPool _pool;
+    std::vector<core::Peer> _peers; // From the constructor, added on start()
+    size_t _halfOpen = 0;
+    std::atomic<size_t> _connected{0}; // Only changed on the control strand
+    std::set<std::string> _connectedIds; // Remote peer ids, to drop duplicate connections
+    std::map<core::Peer, std::shared_ptr<PeerSession>> _sessions; // Admitted and running
+    core::Choker _choker;
+    asio::steady_timer _chokeTimer;
+    // Admitted peers we connected to. Incoming peers are left out of peer exchange, the port
+    // they connected from isn't the one they listen on.
+    std::set<core::Peer> _reachable;
+    asio::steady_timer _pexTimer;
+
+    struct Incoming {
+        core::PeerStream stream;
+        core::HandshakeMsg handshake;
+    };
+
+    Shard& _pickShard();
+    asio::awaitable<void> _connectLoop();
+    // Connects to `peer`, or answers the handshake of an incoming connection. Incoming peers
+    // connect from an ephemeral port, so they are kept out of the peer pool.
+    void _startSession(const core::Peer& peer, std::optional<Incoming> incoming = std::nullopt);
+    asio::awaitable<bool> _admit(std::shared_ptr<PeerSession> session, core::Peer peer,
+                                 std::string remoteId, bool inbound);
+    asio::awaitable<void> _chokeLoop();
+    asio::awaitable<void> _pexLoop();
+    void _broadcastHave(uint32_t index);
+    void _onSessionEnded(const core::Peer& peer, bool admitted, bool inbound,
+                         std::string remoteId, double rate);
 
+    static std::vector<std::unique_ptr<Shard>> _makeShards(uint32_t threads);
+    // Channel for `rate` below `parent`, or `parent` itself when `rate` is unlimited
+    static std::shared_ptr<core::BandwidthChannel>
+    _limit(uint64_t rate, std::shared_ptr<core::BandwidthChannel> parent,
+           const BandwidthConfig& config);
     static std::vector<core::Peer>
     _deserializePeerBuffer(const std::vector<std::array<uint8_t, 6>>& peerBuffer);
 };
@@ -1,11 +1,26 @@
 #pragma once
 
+#include "app/client_config.hpp"
 #include "app/piece_manager.hpp"
+#include "core/bandwidth_channel.hpp"
+#include "core/choker.hpp"
+#include "core/extension_protocol.hpp"
+#include "core/frame_decoder.hpp"
+#include "core/peer_stream.hpp"
+#include "core/request_pipeline.hpp"
 #include "core/torrent_metadata_loader.hpp"
+#include "core/utp.hpp"
 #include <core/peer_communicator.hpp>
 
 #include <asio.hpp>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
 #include <memory>
+#include <optional>
+#include <set>
+#include <string>
 #include <vector>
 
 namespace bt {
@@ -17,42 +32,163 @@ enum class PeerState {
     DISCONNECTED,
     ERROR
 };
-class PeerSession {
+// Reads and writes run as two coroutines on the session's strand: the reader handles incoming
+// messages and queues replies, the writer flushes the queue whenever it's not empty. Blocks the
+// peer requested are sent by the writer, a few at a time: straight from the file with sendfile
+// where possible, otherwise read into the send buffer.
+// With the Fast Extension (BEP 6) negotiated, requests are rejected explicitly instead of being
+// dropped, and pieces in an allowed fast set may be requested while choked.
+// With the Extension Protocol (BEP 10) negotiated, peers tell each other about the peers they
+// are connected to (ut_pex) and we serve the info dictionary to peers that started from a
+// magnet link (ut_metadata).
+// The connection is TCP or uTP (BEP 29), see core::PeerStream; sendfile and corking are TCP only.
+// Rate limits hold back the requests we send and the blocks we upload, never the reads, so the
+// peer's messages keep flowing while we're over the limit.
+class PeerSession : public std::enable_shared_from_this<PeerSession> {
 public:
-    explicit PeerSession(asio::io_context& io_context, std::shared_ptr<PieceManager> pieceManager);
+    PeerSession(asio::io_context& io_context, std::shared_ptr<PieceManager> pieceManager,
+                const PipelineConfig& pipelineConfig = {}, const UploadConfig& uploadConfig = {},
+                const ConnectionConfig& connectionConfig = {});
 
-    // inline PeerState getState() {
-    //     return _state;
-    // };
-    asio::awaitable<void> connect(const core::Peer& peer);
-
-    asio::awaitable<void> doHandshake(const core::Sha1Hash& infoHash, std::string_view peerId);
+    inline PeerState getState() const {
+        return _state;
+    };
+    // Both steps close the socket and end in PeerState::ERROR when they exceed `timeout`.
+    // With a uTP context, uTP is tried first for half of `timeout`, then TCP.
+    asio::awaitable<void> connect(const core::Peer& peer, std::chrono::milliseconds timeout,
+                                  std::shared_ptr<core::UtpContext> utp = nullptr);
+    asio::awaitable<void> doHandshake(const core::Sha1Hash& infoHash, std::string_view peerId,
+                                      std::chrono::milliseconds timeout);
+    // Incoming connections: takes over a stream accepted on another io_context, whose
+    // handshake was already read, and answers that handshake
+    void adopt(core::PeerStream stream, const core::Peer& peer);
+    asio::awaitable<void> answerHandshake(const core::Sha1Hash& infoHash, std::string_view peerId,
+                                          const core::HandshakeMsg& remoteHandshake,
+                                          std::chrono::milliseconds timeout);
     asio::awaitable<void> run();
 
-    // Helper to check connection status
-    // bool isOpen() const {
-    //     return _socket.is_open();
-    // }
+    inline asio::any_io_executor getExecutor() {
+        return _socket.get_executor();
+    }
+
+    // Peer id the remote side sent in its handshake
+    inline std::string_view getRemotePeerId() const {
+        return _remotePeerId;
+    }
+
+    // Average download rate since the connection was established, bytes/s
+    double getDownloadRate() const;
+    // Socket writes so far, each one carries everything queued since the last
+    inline uint64_t getWriteCount() const {
+        return _writes;
+    }
+
+    // The following run on the session's executor only
+    void setChoking(bool choke);
+    // Tells the peer about a piece we just verified
+    void sendHave(uint32_t index);
+    core::ChokeCandidate getChokeStats() const;
+    // Peer exchange: tells the peer which of `connected` are new and which are gone since the
+    // last message, at most once per pexInterval. Does nothing unless the peer supports ut_pex.
+    void sendPex(const std::set<core::Peer>& connected);
+    // Receives the peers this peer tells us about. Set before run().
+    inline void onPeersDiscovered(std::function<void(std::vector<core::Peer>)> callback) {
+        _onPeersDiscovered = std::move(callback);
+    }
+    // Channels block data is taken from, either may be null. Set before run().
+    inline void limitBandwidth(std::shared_ptr<core::BandwidthChannel> download,
+                               std::shared_ptr<core::BandwidthChannel> upload) {
+        _downloadChannel = std::move(download);
+        _uploadChannel = std::move(upload);
+    }
 
 private:
     bool _am_choking = true;       // We are choking the peer (default)
     bool _am_interested = false;   // We want data from the peer
     bool _peer_choking = true;     // Peer is choking us (default)
     bool _peer_interested = false; // Peer wants data from us
+    bool _fastExtension = false;   // Both sides support BEP 6
+    bool _extensionProtocol = false; // Both sides support BEP 10
     PeerState _state;
-    asio::ip::tcp::socket _socket;
+    core::Peer _peer{};
+    std::string _remotePeerId;
+    core::PeerStream _socket;
+    asio::steady_timer _deadline;
+    bool _deadlineArmed = false;
+    asio::steady_timer _watchdog; // Request timeouts and snub detection
+    core::FrameDecoder _decoder;
+    bool _batchReads = false; // Blocks are queued faster than we read them, see _readLoop
+    std::vector<uint8_t> _scratch; // Landing place for blocks without a piece buffer slot
+    std::vector<uint8_t> _sendBuffer; // Queued for the writer
+    asio::steady_timer _sendSignal;   // Never expires, cancelled to wake the writer
     std::shared_ptr<PieceManager> _pieceManager;
     std::vector<uint8_t> _peerBitfield;
-    std::set<Block> _pendingBlocks;
+    std::deque<Block> _peerRequests; // Blocks the peer asked us for, served by the writer
+    std::set<uint32_t> _allowedFast;    // Pieces the peer serves us while choking us
+    std::set<uint32_t> _allowedFastOut; // Pieces we serve the peer while choking it
+    UploadConfig _uploadConfig;
+    bool _zeroCopy = false; // Upload with sendfile, cleared when that fails
+    std::map<Block, std::chrono::steady_clock::time_point> _pendingBlocks; // Block -> sent at
+    PipelineConfig _config;
+    core::RequestPipeline _pipeline;
+    std::chrono::steady_clock::time_point _lastDataAt;
+    bool _snubbed = false; // No data for snubTimeout, only one request at a time
+
+    // Transfer statistics
+    uint64_t _bytesDownloaded = 0;
+    uint64_t _bytesUploaded = 0;
+    uint64_t _unsentUpload = 0; // Block data in _sendBuffer, counted once the write succeeds
+    uint64_t _writes = 0;
+    std::chrono::steady_clock::time_point _connectedAt;
+
+    // Extension protocol
+    ConnectionConfig _connectionConfig;
+    std::map<std::string, uint8_t> _remoteExtensions; // Ids the peer wants its extensions under
+    std::optional<core::PexState> _pexOut;            // Set once the peer supports ut_pex
+    std::optional<std::chrono::steady_clock::time_point> _lastPexIn;
+    std::function<void(std::vector<core::Peer>)> _onPeersDiscovered;
+
+    // Rate limits
+    std::shared_ptr<core::BandwidthChannel> _downloadChannel;
+    std::shared_ptr<core::BandwidthChannel> _uploadChannel;
+    asio::steady_timer _requestRetry; // Fills the pipeline again once the download limit allows
+    bool _requestRetryArmed = false;
+    std::optional<std::chrono::steady_clock::time_point> _uploadResume; // Upload limit hit
 
-    asio::awaitable<uint32_t> _readMsgLen();
     void _handleBitfield(std::span<uint8_t> payload);
     asio::awaitable<void> _handleMessage(core::msg::id msg_id, std::span<uint8_t> payload);
-    asio::awaitable<void> _requestBlock();
+    asio::awaitable<void> _receiveBlock(const core::PartialFrame& partial);
+    asio::awaitable<void> _onBlockDone(const Block& block);
+    // Closes the connection if the peer's IP got banned, true if it did
+    asio::awaitable<bool> _dropIfBanned();
+    void _requestBlock();
+    void _fillPipeline();
+    void _retryRequestsAfter(std::chrono::steady_clock::duration wait);
+    bool _uploadAllowed(const Block& block);
+    bool _uploadThrottled() const;
+    void _sendInterested();
+    void _sendBitfield();
+    void _sendAllowedFast();
+    void _sendReject(const Block& block);
+    void _sendExtended(uint8_t extensionId, std::span<const uint8_t> payload);
+    void _sendExtensionHandshake();
+    void _handleExtended(std::span<uint8_t> payload);
+    void _serveMetadata(std::span<const uint8_t> payload);
+    void _serveRequests();
+    asio::awaitable<bool> _uploadZeroCopy(std::vector<uint8_t>& writing);
+    asio::awaitable<bool> _sendFileRange(uint64_t offset, size_t length);
+    asio::awaitable<bool> _flush(std::vector<uint8_t>& writing);
+    void _setCork(bool cork);
+    void _queueMessage(std::span<const uint8_t> msg);
+    asio::awaitable<void> _readLoop();
+    asio::awaitable<void> _writeLoop();
+    asio::awaitable<void> _watchdogLoop();
     asio::awaitable<void> _returnBlocks();
     inline void _setState(PeerState s) {
         _state = s;
     }
+    void _armDeadline(std::chrono::milliseconds timeout);
+    void _disarmDeadline();
 
     asio::awaitable<std::tuple<std::error_code, unsigned long>, asio::any_io_executor>
     _asyncWrite(const std::span<const uint8_t> data);
@@ -1,13 +1,21 @@
 #pragma once
 
+#include "app/client_config.hpp"
 #include "app/file_handler.hpp"
 #include "app/progress_tracker.hpp"
+#include "core/peer_communicator.hpp"
+#include "core/piece_cache.hpp"
 #include "core/torrent_metadata_loader.hpp"
 
+#include <chrono>
+#include <atomic>
 #include <condition_variable>
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
+#include <functional>
+#include <map>
+#include <memory>
 #include <mutex>
 #include <openssl/sha.h>
 #include <optional>
@@ -20,15 +28,29 @@ namespace bt {
 constexpr uint32_t BLOCK_LEN = 16384;
 
 struct PendingPiece {
-    std::vector<uint8_t> data;
+    // Shared with blocks that are read straight into it, so dropping the piece can't leave a
+    // socket read with a dangling destination
+    std::shared_ptr<std::vector<uint8_t>> data;
     size_t blocksReceived = 0;
     size_t totalBlocksNeeded;
+    std::vector<bool> received; // One flag per block, so duplicate deliveries are ignored
+    std::vector<bool> leased;   // Blocks currently being read into data by a session
+    size_t blocksInFlight = 0;
+    std::optional<core::Peer> owner; // Peer downloading this piece on its own
+    bool exclusive = false;          // Owner may not be helped out (piece is on parole)
+    std::vector<std::optional<core::Peer>> sources; // Which peer supplied each block
 
     inline bool isFinished() {
         return blocksReceived == totalBlocksNeeded;
     }
 };
 
+/** Remains of a piece that failed its hash check, kept to find the culprit. */
+struct FailedPiece {
+    std::vector<core::Sha1Hash> blockHashes;
+    std::vector<std::optional<core::Peer>> sources;
+};
+
 struct Block {
     uint32_t pieceIndex;
     uint32_t offset;
@@ -38,32 +60,143 @@ struct Block {
     }
 };
 
+/** Destination of a block that is read from the socket directly into its piece buffer. */
+struct BlockLease {
+    Block block;
+    std::shared_ptr<std::vector<uint8_t>> buffer;
+    std::span<uint8_t> rest; // Part of the block still to be filled
+};
+
+/** What the picker knows about the peer asking for a block. */
+struct PeerContext {
+    core::Peer peer;
+    double downloadRate = 0.0; // bytes/s
+};
+
 class PieceManager {
 public:
+    using Clock = std::chrono::steady_clock;
+
     PieceManager(core::TorrentMetadata metadata, std::condition_variable& cv,
-                 std::unique_ptr<ProgressTracker> progressTracker);
+                 std::unique_ptr<ProgressTracker> progressTracker, PickerConfig config = {},
+                 const UploadConfig& uploadConfig = {});
     ~PieceManager() = default;
 
-    std::optional<Block> requestBlock(std::vector<uint8_t>& peer_bitfield);
-    bool deliverBlock(uint32_t idx, uint32_t offset, std::span<const uint8_t> data);
+    // Picks the next block for a peer. Pieces that are already open are finished first, new
+    // pieces are only opened while the open piece and buffered byte caps allow it. A peer faster
+    // than the average gets new pieces to itself and receives escalated requests for pieces past
+    // their streaming deadline.
+    std::optional<Block> requestBlock(std::vector<uint8_t>& peer_bitfield,
+                                      const PeerContext& context);
+    // Stores a block of an open piece. Blocks of pieces that aren't open are dropped, so
+    // unsolicited data never allocates a piece buffer. Returns false for blocks out of bounds
+    // and for a piece that failed its hash check.
+    bool deliverBlock(uint32_t idx, uint32_t offset, std::span<const uint8_t> data,
+                      const core::Peer& from);
+    // Zero-copy receive: hands out the slot of `block` inside its piece buffer, with `prefix`
+    // (payload bytes already buffered) copied in. Returns nullopt for duplicates, invalid blocks
+    // and pieces that aren't open, those have to be received into a scratch buffer and passed
+    // to deliverBlock.
+    // Every lease ends with finishBlock once `rest` is filled, or abortBlock.
+    std::optional<BlockLease> beginBlock(const Block& block, std::span<const uint8_t> prefix);
+    bool finishBlock(const BlockLease& lease, const core::Peer& from);
+    void abortBlock(const BlockLease& lease);
     bool returnBlock(const Block& block);
     bool isComplete();
+    bool hasPiece(uint32_t index);
+
+    // Streaming: move the read cursor to the piece covering `offset` and give the pieces in
+    // the streaming window deadlines relative to now.
+    void setReadCursor(uint64_t offset);
+    // Runs `callback` once piece `index` has been verified. Returns false without registering
+    // when the piece is already available. The callback runs with the manager locked and must
+    // not call back into it.
+    bool whenVerified(uint32_t index, std::function<void()> callback);
+    // Reads verified data from storage.
+    void readData(uint64_t offset, std::span<uint8_t> out);
+    // Reads a block of a verified piece for upload. Returns false if we don't have the piece or
+    // the block lies outside of it. A block that isn't cached brings its whole piece into the
+    // read cache, the other blocks of a piece are usually requested right after.
+    bool readBlock(const Block& block, std::span<uint8_t> out);
+    // Zero-copy uploads: checks the block like readBlock and returns where it lies in storage.
+    // The data then goes out through sendData.
+    std::optional<uint64_t> beginUpload(const Block& block);
+    // Sends stored data to a socket without copying it, see FileHandler::sendData
+    ssize_t sendData(int socketFd, uint64_t offset, size_t length);
+    // Counts block data a session got onto the wire. Reading a block doesn't count yet, the
+    // write can still fail.
+    inline void addUploaded(uint64_t bytes) {
+        _uploadedBytes += bytes;
+    }
+    // Our bitfield, as sent to peers
+    std::vector<uint8_t> getBitfield();
+    // Runs `listener` for every verified piece, with the manager locked like whenVerified
+    void setVerifiedListener(std::function<void(uint32_t)> listener);
 
     inline int getTotalNumOfPieces() const {
         return _metadata.info.pieceHashes.size();
     };
 
+    inline uint64_t getPieceLength() const {
+        return _metadata.info.pieceLength;
+    }
+
+    inline uint64_t getFileLength() const {
+        return _metadata.info.fileLength;
+    }
+
+    inline const core::Sha1Hash& getInfoHash() const {
+        return _metadata.infoHash;
+    }
+
+    // Bencoded info dictionary, served to peers that fetch it for a magnet link
+    inline const std::string& getRawInfo() const {
+        return _metadata.rawInfo;
+    }
+
+    size_t getOpenPieceCount();
+    size_t getBufferedBytes();
+    // Blocks handed out by requestBlock that were neither received nor returned yet
+    size_t getRequestedBlockCount();
+
+    // Peers proven to have sent corrupt data too often
+    bool isBanned(const core::IpAddr& ip);
+    // Bytes thrown away because their piece failed the hash check
+    inline uint64_t getWastedBytes() const {
+        return _wastedBytes;
+    }
+    // Block bytes stored so far and how many of them were memcpy'd rather than received in place
+    inline uint64_t getReceivedBytes() const {
+        return _receivedBytes;
+    }
+    inline uint64_t getCopiedBytes() const {
+        return _copiedBytes;
+    }
+    inline uint64_t getUploadedBytes() const {
+        return _uploadedBytes;
+    }
+    // Bytes of the pieces not verified yet
+    inline uint64_t getBytesLeft() const {
+        return _metadata.info.fileLength - _verifiedBytes;
+    }
+    inline core::PieceCache::Stats getReadCacheStats() const {
+        return _readCache.stats();
+    }
+
 private:
     std::condition_variable& _completionCV;
     std::unique_ptr<bt::ProgressTracker> _progressTracker;
 
     FileHandler _fileHandler;
+    core::PieceCache _readCache;
     core::TorrentMetadata _metadata;
+    PickerConfig _config;
     std::vector<uint8_t> _bitfield;
     std::mutex _mutex;
 
     // Different vectors for the piece states (index matching)
-    std::map<uint32_t, PendingPiece> _pendingPieces;
+    std::map<uint32_t, PendingPiece> _pendingPieces; // Open pieces
+    size_t _bufferedBytes = 0;
     std::vector<core::Sha1Hash> _verificationHashes;
     std::vector<bool> _finished;
     int _piecesFinished;
@@ -72,12 +205,49 @@ private:
     std::set<Block> _pendingBlocks;
     std::vector<uint32_t> _nextOffsets;
 
+    // Streaming
+    uint32_t _readCursor = 0;
+    std::map<uint32_t, Clock::time_point> _deadlines;
+    std::set<Block> _escalatedBlocks;
+    std::multimap<uint32_t, std::function<void()>> _verifyWaiters;
+    std::function<void(uint32_t)> _verifiedListener;
+    double _avgPeerRate = 0.0;
+
+    // Hash failure attribution
+    std::map<uint32_t, FailedPiece> _failedPieces;
+    std::set<core::Peer> _parole; // Suspects, only get whole pieces to themselves
+    std::map<core::IpAddr, uint32_t> _strikes;
+    std::set<core::IpAddr> _bannedIps;
+    std::atomic<uint64_t> _wastedBytes{0};
+    std::atomic<uint64_t> _receivedBytes{0};
+    std::atomic<uint64_t> _copiedBytes{0};
+    std::atomic<uint64_t> _uploadedBytes{0};
+    std::atomic<uint64_t> _verifiedBytes{0};
+
     // Helpers
+    std::optional<Block> _pickSequential(const std::vector<uint8_t>& peer_bitfield,
+                                         const PeerContext& context, bool fastPeer);
+    std::optional<Block> _pickOpenPiece(const std::vector<uint8_t>& peer_bitfield,
+                                        const PeerContext& context, bool steal);
+    std::optional<Block> _pickNewPiece(const std::vector<uint8_t>& peer_bitfield,
+                                       const PeerContext& context, bool ownPiece, uint32_t start);
+    bool _storeBlock(uint32_t idx, PendingPiece& pending, uint32_t offset,
+                     const core::Peer& from);
+    void _onHashFailure(uint32_t index, PendingPiece& piece);
+    void _onHashSuccess(uint32_t index, const PendingPiece& piece);
+    void _strike(const core::Peer& peer);
+    bool _canOpenPiece(uint32_t index) const;
+    PendingPiece& _openPiece(uint32_t index);
+    void _closePiece(uint32_t index);
+    std::optional<Block> _getEscalatedBlock(uint32_t index);
     std::optional<Block> _getNextBlockForPiece(uint32_t index);
     size_t _getPieceLength(uint32_t index) const;
     bool _verifyHash(uint32_t index, std::span<uint8_t> data) const;
+    bool _isBlockReceived(const Block& block) const;
+    void _advanceReadCursor();
 
     bool _hasPiece(uint32_t index) const;
     void _setPiece(uint32_t index);
+    static bool _peerHasPiece(const std::vector<uint8_t>& peer_bitfield, uint32_t index);
 };
-} // namespace bt
\ No newline at end of file
+} // namespace bt
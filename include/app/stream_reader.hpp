@@ -0,0 +1,32 @@
+#pragma once
+
+#include "app/piece_manager.hpp"
+
+#include <asio.hpp>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace bt {
+/**
+ * Read access to a torrent that is still downloading.
+ *
+ * readRange() moves the piece picker's read cursor to the requested range, so the covering
+ * pieces are fetched first and get deadlines, and completes as soon as all of them are
+ * verified. Pair it with PickerConfig::sequential for media playback.
+ *
+ * The awaiting coroutine must run on a strand or single threaded io_context, the wake-up is
+ * posted to its executor.
+ */
+class StreamReader {
+public:
+    explicit StreamReader(std::shared_ptr<PieceManager> pieceManager);
+
+    asio::awaitable<std::vector<uint8_t>> readRange(uint64_t offset, uint64_t length);
+
+private:
+    std::shared_ptr<PieceManager> _pieceManager;
+
+    asio::awaitable<void> _waitForPiece(uint32_t index);
+};
+} // namespace bt
@@ -1,27 +1,73 @@
 #pragma once
 
+#include "app/client_config.hpp"
 #include "app/peer_manager.hpp"
 #include "app/piece_manager.hpp"
+#include "core/dht.hpp"
+#include "core/local_discovery.hpp"
+#include "core/magnet_link.hpp"
+#include "core/peer_listener.hpp"
 #include "core/torrent_metadata_loader.hpp"
+#include "core/tracker_announcer.hpp"
+#include "core/udp_tracker.hpp"
+#include <asio/io_context.hpp>
 #include <condition_variable>
 #include <memory>
+#include <optional>
 #include <string>
+#include <thread>
+#include <vector>
 
 class TorrentOrchestrator {
 public:
-    explicit TorrentOrchestrator(std::string path, bool logging);
+    // `source` is the path of a .torrent file or a magnet link
+    explicit TorrentOrchestrator(std::string source, bool logging, bt::ClientConfig config = {});
+    ~TorrentOrchestrator();
     void download();
 
 private:
     bt::core::TorrentMetadata _metadata;
+    std::optional<bt::core::MagnetLink> _magnet; // Until its metadata is fetched
     bool _logging = false;
+    bt::ClientConfig _config;
 
+    std::unique_ptr<bt::core::PeerListener> _listener;
     std::unique_ptr<bt::PeerManager> _peerManager;
     std::shared_ptr<bt::PieceManager> _pieceManager;
 
     std::mutex _completionMutex;
     std::condition_variable cv;
 
+    // Tracker announces, the DHT and local discovery run here, on a thread of their own
+    asio::io_context _io{1};
+    asio::executor_work_guard<asio::io_context::executor_type> _work{_io.get_executor()};
+    std::thread _ioThread;
+    std::shared_ptr<bt::core::TrackerAnnouncer> _announcer; // Unless there are no trackers
+    std::shared_ptr<bt::core::UdpTrackerClient> _udpTracker; // For udp:// trackers only
+    std::shared_ptr<bt::core::DhtNode> _dht;
+    asio::steady_timer _dhtTimer{_io}; // Until the next DHT lookup
+    bool _dhtStopped = false;          // Only touched on _io
+    std::shared_ptr<bt::core::LocalDiscovery> _lsd;
+
+    // Guards what the peer sources' callbacks see of the download while it is set up
+    std::mutex _trackerMutex;
+    std::condition_variable _trackerAnswered;
+    bool _trackerAnswer = false;
+    std::optional<std::string> _trackerError; // Set when a round to every tracker failed
+    std::vector<bt::core::Peer> _trackerPeers; // Until the peer manager runs, from either
+    std::vector<bt::core::Peer> _localPeers;   // Likewise, found on the LAN
+
+    void _startAnnouncer(const std::string& peerId, uint16_t port);
+    void _startDht(uint16_t port);
+    asio::awaitable<void> _dhtLoop(bt::core::Sha1Hash infoHash, uint16_t port);
+    void _stopDht();
+    void _startLsd(uint16_t port);
+    bt::core::TrackerAnnouncer::Stats _announceStats();
+    void _onTrackerPeers(std::vector<bt::core::Peer> peers);
+    void _onTrackersFailed(const std::string& error);
+    void _onLocalPeer(const bt::core::Peer& peer);
+    void _fetchMetadata(std::string_view peerId, const std::vector<bt::core::Peer>& peers);
+
     // PiecesManager
     //...
 };
\ No newline at end of file
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+
+/**
+ * @file bandwidth_channel.hpp
+ * @brief Hierarchical token buckets for rate limits (whole client, torrent, peer).
+ *
+ * Every channel is a token bucket: `rate` bytes per second flow in and at most `burst` are
+ * saved up. A channel may have a parent, and bytes are only granted when every channel up to
+ * the root has tokens for them, so a peer is held to its own limit and to the limits it
+ * shares with others. A denied request takes nothing and tells how long to wait.
+ *
+ * A fair channel serves its children in turn: one that was denied queues up, and the ones
+ * behind it don't get tokens until it had its go. Without it, whoever asks first when tokens
+ * come in gets them. A child that stops asking leaves the queue once its retry is overdue.
+ *
+ * Channels are thread safe; locks are taken from the child up, never the other way.
+ */
+
+namespace bt::core {
+class BandwidthChannel {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // Rate 0 means unlimited. The bucket starts full.
+    BandwidthChannel(uint64_t rate, uint64_t burst,
+                     std::shared_ptr<BandwidthChannel> parent = nullptr, bool fair = false);
+    ~BandwidthChannel();
+
+    BandwidthChannel(const BandwidthChannel&) = delete;
+    BandwidthChannel& operator=(const BandwidthChannel&) = delete;
+
+    /**
+     * Takes `bytes` from this channel and all above it if each of them can spare them, and
+     * returns zero. Otherwise takes nothing and returns the time to wait before asking again.
+     * Requests larger than a burst pass once the bucket is full and leave it in debt.
+     */
+    Clock::duration request(size_t bytes, Clock::time_point now = Clock::now());
+
+    void setRate(uint64_t rate, uint64_t burst);
+    uint64_t getRate() const;
+
+    // Burst given as time at `rate`, at least `minBurst` bytes
+    static uint64_t burstBytes(uint64_t rate, Clock::duration burst, uint64_t minBurst);
+
+private:
+    // Retry slack before a queued child counts as gone
+    static constexpr Clock::duration QUEUE_GRACE = std::chrono::milliseconds(100);
+    // Shortest wait handed out, so denied requests don't spin
+    static constexpr Clock::duration MIN_WAIT = std::chrono::milliseconds(1);
+
+    struct Waiter {
+        const BandwidthChannel* child;
+        Clock::time_point expires;
+    };
+
+    mutable std::mutex _mutex;
+    uint64_t _rate;
+    uint64_t _burst;
+    double _tokens;
+    Clock::time_point _updated;
+    std::shared_ptr<BandwidthChannel> _parent;
+    bool _fair;
+    std::deque<Waiter> _queue; // Denied children, in the order they get their turn
+
+    // The following expect _mutex to be held
+    void _refill(Clock::time_point now);
+    Clock::duration _wait(const BandwidthChannel* child, size_t bytes, Clock::time_point now);
+    void _enqueue(const BandwidthChannel* child, Clock::time_point expires);
+    void _take(const BandwidthChannel* child, size_t bytes);
+    void _leave(const BandwidthChannel* child);
+};
+} // namespace bt::core
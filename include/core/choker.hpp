@@ -0,0 +1,65 @@
+#pragma once
+
+#include "core/peer_communicator.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <random>
+#include <set>
+#include <vector>
+
+/**
+ * @file choker.hpp
+ * @brief Decides which peers we upload to (tit-for-tat).
+ *
+ * Called once per choke interval with the byte counters of every connected peer. The interested
+ * peers that gave us the most data since the last round (while seeding: that took the most) get
+ * the regular upload slots. One more slot is the optimistic unchoke: a random choked, interested
+ * peer, rotated every few rounds so new peers get a chance to prove themselves. Peers seen for
+ * the first time are three times as likely to get it, they have nothing to offer yet.
+ */
+
+namespace bt::core {
+struct ChokeCandidate {
+    Peer peer;
+    bool interested = false; // Peer is interested in our data
+    uint64_t downloaded = 0; // Totals since the connection was established
+    uint64_t uploaded = 0;
+};
+
+class Choker {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // `uploadSlots` includes the optimistic one, which moves every `optimisticRounds` rounds
+    Choker(uint32_t uploadSlots, uint32_t optimisticRounds, uint32_t seed = std::random_device{}());
+
+    /** One choke round. Returns the peers to unchoke, all others are to be choked. */
+    std::set<Peer> rechoke(const std::vector<ChokeCandidate>& peers, bool seeding,
+                           Clock::time_point now);
+
+    inline std::optional<Peer> optimistic() const {
+        return _optimistic;
+    }
+
+private:
+    struct History {
+        uint64_t downloaded = 0;
+        uint64_t uploaded = 0;
+        Clock::time_point at;
+        uint32_t rounds = 0; // Rounds the peer has been part of
+    };
+
+    uint32_t _uploadSlots;
+    uint32_t _optimisticRounds;
+    uint32_t _round = 0;
+    std::mt19937 _random;
+    std::map<Peer, History> _history;
+    std::optional<Peer> _optimistic;
+
+    std::optional<Peer> _pickOptimistic(const std::vector<ChokeCandidate>& peers,
+                                        const std::set<Peer>& unchoked);
+};
+} // namespace bt::core
@@ -0,0 +1,321 @@
+#pragma once
+
+#include "core/bencode_parser.hpp"
+#include "core/peer_communicator.hpp"
+#include "core/torrent_metadata_loader.hpp"
+
+#include <array>
+#include <asio.hpp>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <future>
+#include <map>
+#include <memory>
+#include <optional>
+#include <random>
+#include <set>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * @file dht.hpp
+ * @brief Mainline DHT node (BEP 5): finds peers for an info hash without a tracker.
+ *
+ * Nodes and info hashes share one 160-bit id space, in which the distance of two ids is their
+ * XOR. Every node keeps a routing table of the nodes it knows, up to K per bucket, bucket i
+ * holding the nodes whose id shares exactly i leading bits with ours. That way we know many
+ * nodes close to us and few far away.
+ *
+ * Lookups are iterative: the K closest nodes we know of are asked, ALPHA at a time, for nodes
+ * closer still (find_node) or for peers of a torrent (get_peers), until the K closest nodes that
+ * answered have all been asked. announce_peer then stores our address with the closest of
+ * those, proving with the token each of them gave us that we own the address we send from.
+ *
+ * Messages are KRPC: bencoded dictionaries, one per UDP datagram. Only IPv4 is spoken. The
+ * routing table can be saved and loaded, so a restart doesn't need a bootstrap router.
+ * All state of a DhtNode lives on its strand.
+ */
+
+namespace bt::core {
+namespace dht {
+using NodeId = Sha1Hash;
+using Endpoint = asio::ip::udp::endpoint;
+using Clock = std::chrono::steady_clock;
+
+constexpr size_t ID_BITS = HASH_LENGTH * 8;
+// Nodes per bucket, also the nodes a lookup ends with and announces to
+constexpr size_t K = 8;
+// Queries a lookup has in flight at the same time
+constexpr size_t ALPHA = 3;
+// 20 bytes id, 4 bytes IPv4 address, 2 bytes port
+constexpr size_t COMPACT_NODE_LEN = 26;
+// Timeouts in a row after which a node is dropped from the routing table
+constexpr uint32_t MAX_FAILURES = 2;
+
+// KRPC error codes
+constexpr int64_t ERROR_GENERIC = 201;
+constexpr int64_t ERROR_SERVER = 202;
+constexpr int64_t ERROR_PROTOCOL = 203;
+constexpr int64_t ERROR_METHOD_UNKNOWN = 204;
+
+struct Node {
+    NodeId id;
+    Endpoint endpoint;
+
+    bool operator==(const Node&) const = default;
+};
+
+NodeId distance(const NodeId& a, const NodeId& b);
+// Leading bits `a` and `b` have in common, ID_BITS if they are equal
+size_t commonPrefix(const NodeId& a, const NodeId& b);
+NodeId randomId(std::mt19937& random);
+
+std::string encodeNodes(const std::vector<Node>& nodes);
+// Throws std::invalid_argument on a partial entry
+std::vector<Node> parseNodes(std::string_view blob);
+
+struct Message {
+    enum class Type { QUERY, RESPONSE, ERROR };
+
+    std::string transactionId;
+    Type type = Type::QUERY;
+    std::string method; // Queries only
+    bencode::Dict body; // "a" of a query, "r" of a response
+    int64_t errorCode = 0;
+    std::string errorMessage;
+};
+
+std::vector<uint8_t> encodeMessage(const Message& message);
+// Throws std::invalid_argument for datagrams that aren't KRPC messages
+Message parseMessage(std::span<const uint8_t> datagram);
+
+/** The nodes we know, by common prefix length with our own id. */
+class RoutingTable {
+public:
+    explicit RoutingTable(const NodeId& self, size_t bucketSize = K);
+
+    /**
+     * The node answered or queried us at `now`. A new node whose bucket is full takes the place
+     * of the one that failed most, if any did; otherwise it's dropped and false returned.
+     */
+    bool onSeen(const Node& node, Clock::time_point now);
+    // A query to the node timed out, it's removed after MAX_FAILURES in a row
+    void onFailed(const NodeId& id);
+
+    std::vector<Node> closest(const NodeId& target, size_t count) const;
+    // Nodes not heard from since `before`
+    std::vector<Node> questionable(Clock::time_point before) const;
+    // Buckets that didn't change since `before`, up to the deepest one in use
+    std::vector<size_t> staleBuckets(Clock::time_point before) const;
+    // A lookup into bucket `index` ran, it counts as fresh whether or not it found anything
+    void onRefreshed(size_t index, Clock::time_point now);
+    // Random id that falls into bucket `index`
+    NodeId randomIdIn(size_t index, std::mt19937& random) const;
+
+    std::vector<Node> nodes() const;
+    size_t size() const;
+    const NodeId& id() const { return _self; }
+
+private:
+    struct Entry {
+        Node node;
+        Clock::time_point lastSeen;
+        uint32_t failures = 0; // In a row
+    };
+    struct Bucket {
+        std::vector<Entry> entries;
+        Clock::time_point changed{};
+    };
+
+    NodeId _self;
+    size_t _bucketSize;
+    std::array<Bucket, ID_BITS> _buckets;
+
+    Bucket& _bucketFor(const NodeId& id);
+};
+
+/**
+ * Tokens handed out with get_peers answers, only good for announces from the same IP. They are
+ * derived from a secret that rotates, tokens of the previous secret are still accepted.
+ */
+class TokenStore {
+public:
+    explicit TokenStore(std::mt19937& random);
+
+    std::string make(const asio::ip::address& ip) const;
+    bool check(std::string_view token, const asio::ip::address& ip) const;
+    void rotate();
+
+private:
+    using Secret = std::array<uint8_t, 16>;
+
+    std::mt19937& _random;
+    Secret _secret;
+    Secret _previous;
+
+    static std::string _token(const Secret& secret, const asio::ip::address& ip);
+};
+
+/** Peers announced to us, by info hash. */
+class PeerStore {
+public:
+    // Per info hash, the oldest announce makes room for a new one
+    static constexpr size_t MAX_PEERS = 200;
+
+    explicit PeerStore(Clock::duration lifetime);
+
+    void add(const Sha1Hash& infoHash, const Peer& peer, Clock::time_point now);
+    // Up to `max` peers, the most recently announced first
+    std::vector<Peer> get(const Sha1Hash& infoHash, size_t max) const;
+    void expire(Clock::time_point now);
+
+private:
+    Clock::duration _lifetime;
+    std::map<Sha1Hash, std::map<Peer, Clock::time_point>> _peers; // -> announced at
+};
+
+/** What is kept across restarts. */
+struct State {
+    NodeId id;
+    std::vector<Node> nodes;
+};
+
+void saveState(const std::filesystem::path& path, const State& state);
+// Throws std::runtime_error if the file is missing or malformed
+State loadState(const std::filesystem::path& path);
+} // namespace dht
+
+class DhtNode : public std::enable_shared_from_this<DhtNode> {
+public:
+    using Node = dht::Node;
+    using NodeId = dht::NodeId;
+    using Endpoint = dht::Endpoint;
+    using Clock = dht::Clock;
+
+    struct Options {
+        uint16_t port = 0; // 0 picks a free port
+        // Saved routing table, loaded on construction and written by close(). Empty disables it.
+        std::filesystem::path stateFile;
+        // Random unless set here or saved in the state file
+        std::optional<NodeId> id;
+        std::chrono::milliseconds queryTimeout{2000};
+        std::chrono::seconds tokenRotation{300};
+        // Announces we hold on to
+        std::chrono::seconds peerLifetime{1800};
+        // Nodes and buckets unheard of for this long are pinged and refreshed
+        std::chrono::seconds refreshInterval{900};
+    };
+
+    DhtNode(asio::io_context& io, Options options);
+
+    /** Binds the UDP socket. Throws std::system_error if it can't. */
+    void start();
+    /**
+     * Saves the state file and closes the socket, operations in progress end. From any thread,
+     * the future is ready once the state is saved.
+     */
+    std::future<void> close();
+
+    // The awaitables may be awaited from any executor and resume on the caller's
+
+    /**
+     * Joins the DHT through `routers` and the nodes of the state file by looking up our own
+     * id. Returns the nodes in the routing table afterwards.
+     */
+    asio::awaitable<size_t> bootstrap(std::vector<Endpoint> routers);
+    asio::awaitable<bool> ping(Endpoint to);
+    // The K closest nodes to `target` that answered
+    asio::awaitable<std::vector<Node>> findNode(NodeId target);
+    asio::awaitable<std::vector<Peer>> getPeers(Sha1Hash infoHash);
+    /**
+     * Looks up the peers of `infoHash` and announces us to the closest nodes. `port` is the one
+     * we accept peers on, 0 tells the nodes to use the port we send from.
+     */
+    asio::awaitable<std::vector<Peer>> announce(Sha1Hash infoHash, uint16_t port);
+    asio::awaitable<size_t> getNodeCount();
+
+    const NodeId& getId() const { return _id; }
+    uint16_t getPort() const;
+
+private:
+    static constexpr auto MAINTENANCE_TICK = std::chrono::seconds(60);
+    // Values in one get_peers answer, keeps it well within a datagram
+    static constexpr size_t MAX_VALUES = 50;
+
+    struct Transaction {
+        explicit Transaction(const asio::any_io_executor& executor) : answered(executor) {}
+        Endpoint to;
+        asio::steady_timer answered; // Cancelled when the reply is in
+        std::optional<dht::Message> reply;
+    };
+
+    // One iterative lookup
+    struct Lookup {
+        enum class State { FRESH, QUERYING, ANSWERED, FAILED };
+        struct Candidate {
+            Node node;
+            State state = State::FRESH;
+            std::string token;
+        };
+
+        explicit Lookup(const asio::any_io_executor& executor) : wakeup(executor) {}
+        NodeId target;
+        bool getPeers = false;
+        std::map<NodeId, Candidate> candidates; // By distance to the target
+        std::set<Peer> peers;
+        size_t inFlight = 0;
+        asio::steady_timer wakeup; // Cancelled whenever a query ends
+    };
+
+    asio::any_io_executor _strand;
+    asio::ip::udp::socket _udp;
+    Options _options;
+    std::mt19937 _random;
+    NodeId _id;
+    dht::RoutingTable _table;
+    dht::TokenStore _tokens;
+    dht::PeerStore _peers;
+    std::map<std::string, std::shared_ptr<Transaction>> _transactions;
+    uint16_t _nextTransaction = 0;
+    asio::steady_timer _ticker;
+    Clock::time_point _rotated;
+
+    asio::awaitable<size_t> _bootstrap(std::vector<Endpoint> routers);
+    asio::awaitable<bool> _ping(Endpoint to);
+    asio::awaitable<std::vector<Node>> _findNode(NodeId target);
+    asio::awaitable<std::vector<Peer>> _getPeers(Sha1Hash infoHash);
+    asio::awaitable<std::vector<Peer>> _announce(Sha1Hash infoHash, uint16_t port);
+    asio::awaitable<size_t> _getNodeCount();
+
+    // Sends a query and waits for its answer, nullopt on timeouts and errors. A timeout counts
+    // against `node` in the routing table.
+    asio::awaitable<std::optional<bencode::Dict>> _query(Endpoint to, std::string method,
+                                                         bencode::Dict args,
+                                                         std::optional<NodeId> node);
+
+    // A lookup starting from the closest nodes in the routing table
+    std::shared_ptr<Lookup> _newLookup(const NodeId& target, bool getPeers);
+    void _addCandidate(Lookup& lookup, const Node& node);
+    // Takes the nodes and peers of an answer, returns its token
+    std::string _absorb(Lookup& lookup, const bencode::Dict& reply);
+    void _queryCandidate(const std::shared_ptr<Lookup>& lookup, const NodeId& key);
+    // Until the K closest candidates that didn't fail all answered
+    asio::awaitable<void> _iterate(std::shared_ptr<Lookup> lookup);
+    // Until no query of the lookup is in flight
+    asio::awaitable<void> _settle(std::shared_ptr<Lookup> lookup);
+    static std::vector<const Lookup::Candidate*> _closestAnswered(const Lookup& lookup);
+
+    void _handle(const dht::Message& message, const Endpoint& from);
+    // Throws std::invalid_argument for queries missing arguments
+    void _answerQuery(const dht::Message& query, const Endpoint& from);
+    void _send(const Endpoint& to, const dht::Message& message);
+
+    asio::awaitable<void> _receiveLoop();
+    asio::awaitable<void> _maintain();
+    void _saveState() const;
+    void _close();
+};
+} // namespace bt::core
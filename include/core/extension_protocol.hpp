@@ -0,0 +1,105 @@
+#pragma once
+
+#include "core/peer_communicator.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <set>
+#include <span>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * @file extension_protocol.hpp
+ * @brief Extension protocol (BEP 10) payloads, peer exchange (ut_pex, BEP 11) and metadata
+ * exchange (ut_metadata, BEP 9).
+ *
+ * Extended messages use message id 20. The first payload byte selects the extension: 0 is the
+ * extension handshake, a bencoded dictionary whose "m" entry maps extension names to the ids
+ * the sender wants to receive them under. Every other id is one of those extensions.
+ *
+ * ut_pex messages carry compact IPv4 peers (4 bytes address, 2 bytes port) the sender has
+ * connected to ("added") or disconnected from ("dropped") since its previous message.
+ *
+ * ut_metadata messages transfer the bencoded info dictionary in 16 KiB pieces. Each is a
+ * bencoded dictionary (msg_type, piece, total_size), data messages carry the piece right after.
+ */
+
+namespace bt::core {
+namespace ext {
+constexpr uint8_t HANDSHAKE_ID = 0;
+// Ids we receive our extensions under
+constexpr uint8_t UT_PEX_ID = 1;
+constexpr const char* UT_PEX = "ut_pex";
+constexpr uint8_t UT_METADATA_ID = 2;
+constexpr const char* UT_METADATA = "ut_metadata";
+constexpr size_t METADATA_PIECE_LEN = 16 * 1024;
+// Info dictionaries larger than this are refused, like .torrent files of that size
+constexpr size_t MAX_METADATA_SIZE = 10 * 1024 * 1024;
+// Peers per direction in one ut_pex message, more are left for the next one
+constexpr size_t MAX_PEX_PEERS = 50;
+} // namespace ext
+
+struct ExtensionHandshake {
+    std::map<std::string, uint8_t> extensions; // Name -> id, 0 means disabled
+    std::optional<uint16_t> listenPort;
+    std::string client;
+    std::optional<uint32_t> maxRequests; // reqq
+    std::optional<size_t> metadataSize;  // Size of the info dictionary, if the sender has it
+};
+
+struct PexMessage {
+    std::vector<Peer> added;
+    std::vector<Peer> dropped;
+};
+
+struct MetadataMessage {
+    enum class Type : uint8_t { REQUEST = 0, DATA = 1, REJECT = 2 };
+    Type type;
+    uint32_t piece;
+    size_t totalSize = 0; // Data messages only
+};
+
+// Both parsers throw std::invalid_argument / std::runtime_error on malformed payloads
+std::vector<uint8_t> encodeExtensionHandshake(const ExtensionHandshake& handshake);
+ExtensionHandshake parseExtensionHandshake(std::span<const uint8_t> payload);
+std::vector<uint8_t> encodePex(const PexMessage& message);
+// Keeps at most ext::MAX_PEX_PEERS peers per direction
+PexMessage parsePex(std::span<const uint8_t> payload);
+
+std::vector<uint8_t> encodeMetadataMessage(const MetadataMessage& message,
+                                           std::span<const uint8_t> data = {});
+// The message and, for data messages, the piece that follows it. Throws like the above.
+std::pair<MetadataMessage, std::span<const uint8_t>>
+parseMetadataMessage(std::span<const uint8_t> payload);
+// Number of ut_metadata pieces of an info dictionary
+inline uint32_t metadataPieceCount(size_t metadataSize) {
+    return static_cast<uint32_t>((metadataSize + ext::METADATA_PIECE_LEN - 1) /
+                                 ext::METADATA_PIECE_LEN);
+}
+
+std::string encodeCompactPeers(const std::vector<Peer>& peers);
+std::vector<Peer> parseCompactPeers(std::string_view blob);
+
+/** What one peer was told about our connections, so ut_pex only sends the changes. */
+class PexState {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit PexState(Clock::duration interval);
+
+    /**
+     * Changes in `connected` since the previous message, or nullopt if there are none or the
+     * last message is less than an interval ago.
+     */
+    std::optional<PexMessage> update(const std::set<Peer>& connected, Clock::time_point now);
+
+private:
+    Clock::duration _interval;
+    std::optional<Clock::time_point> _lastSent;
+    std::set<Peer> _known; // As far as the peer knows, our connections
+};
+} // namespace bt::core
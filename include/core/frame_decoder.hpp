@@ -0,0 +1,86 @@
+#pragma once
+
+#include "core/peer_communicator.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <vector>
+
+/**
+ * @file frame_decoder.hpp
+ * @brief Incremental decoder for length prefixed peer wire messages.
+ *
+ * The session reads as much as the socket has into prepare(), hands the byte count to
+ * commit() and then drains every complete message with next(). Messages are decoded in
+ * place, the payload span points into the receive buffer and stays valid until the next
+ * prepare(). Only messages that do not fit into the buffer (huge bitfields) get an
+ * allocation of their own.
+ *
+ * A large message that is still arriving can be detached with takePartial(), so the caller
+ * can read the rest of it straight into its final destination.
+ */
+
+namespace bt::core {
+constexpr size_t DEFAULT_RECEIVE_BUFFER = 256 * 1024;
+constexpr uint32_t MAX_MESSAGE_LEN = 16 * 1024 * 1024;
+
+struct Frame {
+    msg::id id;
+    std::span<uint8_t> payload;
+};
+
+/** Start of a message whose remaining `missing` bytes are still on the wire. */
+struct PartialFrame {
+    msg::id id;
+    std::span<uint8_t> header; // First payload bytes, as many as asked for
+    std::span<uint8_t> body;   // Buffered payload bytes after the header
+    size_t missing;
+};
+
+class FrameDecoder {
+public:
+    explicit FrameDecoder(size_t capacity = DEFAULT_RECEIVE_BUFFER);
+
+    /** Writable space for the next socket read, never empty. */
+    std::span<uint8_t> prepare();
+    /** Marks the first n bytes of the last prepare() as filled. */
+    void commit(size_t n);
+    /**
+     * Next complete message, or nullopt when more data is needed. Keep-alives are skipped.
+     * Throws std::runtime_error when a peer announces a message above MAX_MESSAGE_LEN.
+     */
+    std::optional<Frame> next();
+    /**
+     * Detaches the incomplete message at the front of the buffer if it has the given id and
+     * at least headerLen payload bytes arrived. The caller must read the missing bytes from
+     * the socket itself before it commits anything else, decoding continues after them. The
+     * spans point into the receive buffer, prepare() may reuse it.
+     */
+    std::optional<PartialFrame> takePartial(msg::id id, size_t headerLen);
+
+    /** Bytes received but not yet returned as a frame. */
+    inline size_t buffered() const {
+        return _end - _begin;
+    }
+    /**
+     * True while a message larger than the buffer is being filled. prepare() then returns the
+     * rest of that message, which can be shorter than any header.
+     */
+    inline bool assembling() const {
+        return _oversizedActive && !_oversizedDelivered;
+    }
+
+private:
+    std::vector<uint8_t> _buffer;
+    size_t _begin = 0; // First unconsumed byte
+    size_t _end = 0;   // One past the last received byte
+
+    // Message larger than the buffer, assembled separately
+    std::vector<uint8_t> _oversized;
+    size_t _oversizedFilled = 0;
+    bool _oversizedActive = false;
+    bool _oversizedDelivered = false;
+};
+} // namespace bt::core
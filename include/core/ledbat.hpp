@@ -0,0 +1,66 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
+/**
+ * @file ledbat.hpp
+ * @brief Delay based congestion window for uTP (LEDBAT, BEP 29).
+ *
+ * Every ack carries the one-way delay of our packets as the peer measured it. Its minimum
+ * over the last two minutes is the base delay, the rest is queuing we caused. The window grows
+ * while the queuing delay is below the 100 ms target and shrinks above it, by at most
+ * MAX_GAIN bytes per round trip, so uTP backs off before TCP on the same link notices anything.
+ * Until the delay first gets near the target the window grows like TCP slow start. Losses
+ * halve the window, timeouts drop it to a single packet.
+ */
+
+namespace bt::core {
+class Ledbat {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr uint32_t TARGET_DELAY_US = 100000;
+    static constexpr size_t MAX_GAIN = 3000; // Bytes per round trip
+
+    Ledbat(size_t minWindow, size_t initialWindow);
+
+    /**
+     * `acked` bytes left the network, `flightSize` were in flight before. `delay` is the
+     * one-way delay the peer measured for our packets in microseconds (any clock offset).
+     */
+    void onAck(size_t acked, size_t flightSize, uint32_t delay, Clock::time_point now);
+    // At most one decrease per round trip
+    void onLoss(Clock::duration roundTrip, Clock::time_point now);
+    void onTimeout();
+    // The smallest window is one packet, so it follows the packet size
+    void setMinWindow(size_t minWindow);
+
+    inline size_t window() const {
+        return _window;
+    }
+    inline uint32_t queuingDelay() const {
+        return _queuingDelay;
+    }
+    inline bool inSlowStart() const {
+        return _slowStart;
+    }
+
+private:
+    static constexpr Clock::duration BASE_BUCKET = std::chrono::minutes(1);
+
+    size_t _minWindow;
+    double _window;
+    bool _slowStart = true;
+    uint32_t _queuingDelay = 0;
+    // Base delay: minimum of the current and the previous minute
+    std::optional<uint32_t> _baseCurrent;
+    std::optional<uint32_t> _basePrevious;
+    std::optional<Clock::time_point> _bucketStart;
+    std::optional<Clock::time_point> _lastDecrease;
+
+    uint32_t _updateBaseDelay(uint32_t delay, Clock::time_point now);
+};
+} // namespace bt::core
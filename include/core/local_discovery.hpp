@@ -0,0 +1,103 @@
+#pragma once
+
+#include "core/peer_communicator.hpp"
+#include "core/torrent_metadata_loader.hpp"
+
+#include <asio.hpp>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <optional>
+#include <random>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+/**
+ * @file local_discovery.hpp
+ * @brief Local Service Discovery (BEP 14): finds peers of the same torrents on the LAN.
+ *
+ * Every client announces the info hashes it has and the port it accepts peers on to a multicast
+ * group, in an HTTP-like "BT-SEARCH" datagram, and listens to the group for the announces of
+ * others. An announce that names one of our torrents makes its sender a peer of it.
+ *
+ * Each torrent is announced when it's added and then every `interval`, never more often than
+ * every `minInterval`. Announces we hear from a host for a torrent are passed on at most once per
+ * `minInterval` too, so a chatty LAN doesn't flood the peer manager. Our own announces come back
+ * to us through the multicast loopback; the cookie they carry tells them apart.
+ */
+
+namespace bt::core {
+namespace lsd {
+constexpr const char* MULTICAST_ADDRESS = "239.192.152.143";
+constexpr uint16_t MULTICAST_PORT = 6771;
+
+struct Announce {
+    uint16_t port = 0; // Peers are accepted there
+    std::vector<Sha1Hash> infoHashes;
+    std::string cookie; // Tells our own announces apart, may be empty
+};
+
+// `host` is the multicast group the announce goes to
+std::string encodeAnnounce(const Announce& announce, const asio::ip::udp::endpoint& host);
+// Nullopt for anything but a BT-SEARCH with a port and at least one valid info hash
+std::optional<Announce> parseAnnounce(std::string_view datagram);
+} // namespace lsd
+
+class LocalDiscovery : public std::enable_shared_from_this<LocalDiscovery> {
+public:
+    using Clock = std::chrono::steady_clock;
+    // Runs on the discovery's strand
+    using PeerHandler = std::function<void(Peer peer)>;
+
+    struct Options {
+        asio::ip::address_v4 group = asio::ip::make_address_v4(lsd::MULTICAST_ADDRESS);
+        uint16_t port = lsd::MULTICAST_PORT;
+        // Interface to join the group on and send from, any leaves the choice to the system
+        asio::ip::address_v4 interface = asio::ip::address_v4::any();
+        std::chrono::seconds interval{300};
+        std::chrono::seconds minInterval{60};
+    };
+
+    LocalDiscovery(asio::io_context& io, Options options);
+
+    /** Joins the multicast group. Throws std::system_error if it can't. */
+    void start();
+    // Leaves the group and closes the socket. From any thread.
+    void close();
+
+    /**
+     * Announces `infoHash` with `port` from now on and hands every peer that announces it to
+     * `onPeer`. Port 0 only listens, for clients that accept no peers. From any thread.
+     */
+    void add(const Sha1Hash& infoHash, uint16_t port, PeerHandler onPeer);
+    void remove(const Sha1Hash& infoHash);
+
+private:
+    struct Torrent {
+        uint16_t port;
+        PeerHandler onPeer;
+        Clock::time_point next{};
+    };
+
+    asio::any_io_executor _strand;
+    asio::ip::udp::socket _udp;
+    asio::steady_timer _ticker; // Cancelled when a torrent is added
+    Options _options;
+    std::string _cookie;
+    std::map<Sha1Hash, Torrent> _torrents;
+    // Last announce sent, kept for minInterval even if the torrent is removed
+    std::map<Sha1Hash, Clock::time_point> _announced;
+    // Last announce passed on, by sender and torrent
+    std::map<std::pair<asio::ip::address_v4, Sha1Hash>, Clock::time_point> _heard;
+
+    asio::awaitable<void> _announceLoop();
+    asio::awaitable<void> _receiveLoop();
+    void _onAnnounce(const lsd::Announce& announce, const asio::ip::address_v4& from);
+    void _send(const Sha1Hash& infoHash, uint16_t port);
+    void _close();
+};
+} // namespace bt::core
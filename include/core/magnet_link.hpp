@@ -0,0 +1,28 @@
+#pragma once
+
+#include "core/torrent_metadata_loader.hpp"
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * @file magnet_link.hpp
+ * @brief Parses magnet URIs (BEP 9).
+ *
+ * A magnet link names a torrent by its info hash ("xt=urn:btih:", 40 hex or 32 base32
+ * characters) and may suggest a display name ("dn") and trackers ("tr"). Everything else
+ * about the torrent has to be fetched from peers, see MetadataFetcher.
+ */
+
+namespace bt::core {
+struct MagnetLink {
+    Sha1Hash infoHash;
+    std::string displayName;
+    std::vector<std::string> trackers; // In the order of the link
+};
+
+bool isMagnetLink(std::string_view uri);
+/** Throws std::invalid_argument if `uri` isn't a magnet link with a BitTorrent info hash. */
+MagnetLink parseMagnetLink(std::string_view uri);
+} // namespace bt::core
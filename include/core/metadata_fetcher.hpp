@@ -0,0 +1,98 @@
+#pragma once
+
+#include "core/extension_protocol.hpp"
+#include "core/peer_communicator.hpp"
+#include "core/torrent_metadata_loader.hpp"
+
+#include <asio.hpp>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <optional>
+#include <set>
+#include <span>
+#include <string>
+#include <vector>
+
+/**
+ * @file metadata_fetcher.hpp
+ * @brief Downloads the info dictionary of a magnet link from peers (ut_metadata, BEP 9).
+ *
+ * The fetcher connects to several peers at once and asks each of them for pieces of the info
+ * dictionary, missing pieces nobody was asked for first. Once every piece is in, the whole
+ * dictionary is checked against the info hash; a mismatch throws it away and starts over with
+ * the peers still connected. The first verified dictionary ends the fetch.
+ */
+
+namespace bt::core {
+/** Pieces of one info dictionary, collected from any number of peers. Not thread safe. */
+class MetadataAssembler {
+public:
+    explicit MetadataAssembler(const Sha1Hash& infoHash);
+
+    // The first size a peer announces is used. Returns false for sizes that don't match it,
+    // such a peer has different metadata or none at all.
+    bool setSize(size_t size);
+    inline std::optional<size_t> size() const {
+        return _size;
+    }
+    // Missing piece asked of the fewest peers so far, skipping those in `skip`. Counts as asked.
+    std::optional<uint32_t> nextPiece(const std::set<uint32_t>& skip = {});
+    // A peer won't deliver a piece it was asked for
+    void release(uint32_t piece);
+    // Stores a piece. Returns true once the dictionary is complete and matches the info hash.
+    // A mismatch drops everything, size included.
+    bool addPiece(uint32_t piece, std::span<const uint8_t> data);
+
+    inline bool isComplete() const {
+        return _complete;
+    }
+    // The verified info dictionary
+    inline const std::string& data() const {
+        return _data;
+    }
+
+private:
+    Sha1Hash _infoHash;
+    std::optional<size_t> _size;
+    std::string _data;
+    std::vector<bool> _received;
+    std::vector<uint32_t> _asked; // Peers asked for each piece, for as long as it's missing
+    size_t _missing = 0;
+    bool _complete = false;
+
+    void _reset();
+};
+
+class MetadataFetcher {
+public:
+    struct Options {
+        // Peers fetched from at the same time
+        size_t maxPeers = 8;
+        std::chrono::milliseconds connectTimeout{5000};
+        // Also how long a connected peer may stay silent
+        std::chrono::milliseconds handshakeTimeout{10000};
+    };
+
+    MetadataFetcher(const Sha1Hash& infoHash, std::string peerId, Options options);
+
+    /**
+     * Fetches from `peers` until the info dictionary is verified, the peers are used up or
+     * `timeout` runs out. Returns the bencoded dictionary on success. Call once.
+     */
+    std::optional<std::string> fetch(const std::vector<Peer>& peers,
+                                     std::chrono::milliseconds timeout);
+
+private:
+    asio::io_context _io{1};
+    Sha1Hash _infoHash;
+    std::string _peerId;
+    Options _options;
+    MetadataAssembler _assembler;
+    std::deque<Peer> _candidates;
+    size_t _active = 0;
+
+    asio::awaitable<void> _worker();
+    asio::awaitable<void> _fetchFrom(Peer peer);
+};
+} // namespace bt::core
@@ -8,9 +8,11 @@
 
 #include <asio.hpp>
 #include <format>
+#include <optional>
 #include <spdlog/spdlog.h>
 #include <string>
 #include <string_view>
+#include <vector>
 
 namespace bt::core {
 typedef std::array<uint8_t, 4> IpAddr;
@@ -19,8 +21,13 @@ typedef std::array<uint8_t, 68> HandshakeMsg;
 namespace msg {
 constexpr uint8_t LEN = 0x13;
 constexpr const char* PROTOCOL = "BitTorrent protocol";
-constexpr uint64_t RESERVED = 0;
+// Reserved handshake bits we set, big endian: Extension Protocol (BEP 10), Fast Extension (BEP 6)
+constexpr uint64_t RESERVED = 0x100004;
 constexpr size_t HANDSHAKE_LEN = 68;
+constexpr size_t FAST_EXTENSION_BYTE = 27; // Last reserved byte
+constexpr uint8_t FAST_EXTENSION_BIT = 0x04;
+constexpr size_t EXTENSION_PROTOCOL_BYTE = 25;
+constexpr uint8_t EXTENSION_PROTOCOL_BIT = 0x10;
 
 enum class id : uint8_t {
     CHOKE = 0,
@@ -31,7 +38,15 @@ enum class id : uint8_t {
     BITFIELD = 5,
     REQUEST = 6,
     PIECE = 7,
-    CANCEL = 8
+    CANCEL = 8,
+    // Fast Extension (BEP 6)
+    SUGGEST_PIECE = 0x0D,
+    HAVE_ALL = 0x0E,
+    HAVE_NONE = 0x0F,
+    REJECT_REQUEST = 0x10,
+    ALLOWED_FAST = 0x11,
+    // Extension Protocol (BEP 10)
+    EXTENDED = 0x14
 };
 } // namespace msg
 
@@ -55,10 +70,21 @@ struct Peer {
         auto res = std::format("{}.{}.{}.{}", f(0), f(1), f(2), f(3));
         return res;
     }
+
+    auto operator<=>(const Peer&) const = default;
 };
 
 HandshakeMsg serializeHandshake(const Sha1Hash& infoHash, std::string_view peerId);
 bool verifyHandshake(const HandshakeMsg& handshakeResponse, const Sha1Hash& expectedInfoHash);
+// Info hash of a handshake an incoming peer sent, nullopt if it isn't a BitTorrent handshake
+std::optional<Sha1Hash> handshakeInfoHash(const HandshakeMsg& handshake);
+// Whether the sender of `handshake` supports the Fast Extension, we always do
+bool supportsFastExtension(const HandshakeMsg& handshake);
+bool supportsExtensionProtocol(const HandshakeMsg& handshake);
+// BEP 6 canonical allowed fast set: `count` pieces derived from the peer's IPv4 /24 network and
+// the info hash, so every client computes the same set for the same peer
+std::vector<uint32_t> allowedFastSet(const Sha1Hash& infoHash, const IpAddr& ip,
+                                     uint32_t numPieces, uint32_t count);
 
 // void readMessage( std::span<typename Type, size_t Extent> )
 }; // namespace bt::core
\ No newline at end of file
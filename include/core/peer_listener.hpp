@@ -0,0 +1,70 @@
+#pragma once
+
+#include "core/peer_communicator.hpp"
+#include "core/peer_stream.hpp"
+#include "core/torrent_metadata_loader.hpp"
+#include "core/utp.hpp"
+
+#include <asio.hpp>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/**
+ * @file peer_listener.hpp
+ * @brief Accepts incoming peer connections on one port, for every torrent registered with it.
+ *
+ * The remote side speaks first: the listener reads its handshake, looks the torrent up by the
+ * info hash in it and passes the connection on to that torrent's handler, which answers the
+ * handshake. Connections for unknown torrents, broken handshakes and peers that don't finish
+ * the handshake within the timeout are closed. The listener runs on an io_context and thread
+ * of its own.
+ *
+ * With uTP enabled, connections over uTP (BEP 29) are accepted on the same port number over
+ * UDP and handed on the same way; the uTP connection keeps running on the listener's thread.
+ */
+
+namespace bt::core {
+class PeerListener {
+public:
+    // Gets a connection whose handshake was read, with the remote address and that handshake.
+    // Runs on the listener's thread.
+    using Handler =
+        std::function<void(PeerStream stream, Peer peer, const HandshakeMsg& handshake)>;
+
+    // Port 0 picks a free port, see getPort()
+    PeerListener(uint16_t port, std::chrono::milliseconds handshakeTimeout, bool utp = true);
+    ~PeerListener();
+
+    /** Binds the port and starts accepting. Throws std::system_error if it can't bind. */
+    void start();
+    void stop();
+
+    // Both are safe to call from any thread
+    void addTorrent(const Sha1Hash& infoHash, Handler handler);
+    void removeTorrent(const Sha1Hash& infoHash);
+
+    uint16_t getPort() const;
+
+private:
+    asio::io_context _io{1};
+    asio::ip::tcp::acceptor _acceptor;
+    uint16_t _port;
+    std::chrono::milliseconds _handshakeTimeout;
+    bool _utpEnabled;
+    std::shared_ptr<UtpContext> _utp;
+    std::thread _thread;
+
+    std::mutex _mutex;
+    std::map<Sha1Hash, Handler> _torrents;
+
+    asio::awaitable<void> _acceptLoop();
+    asio::awaitable<void> _acceptUtpLoop();
+    asio::awaitable<void> _receiveHandshake(PeerStream stream, Peer peer);
+};
+} // namespace bt::core
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "core/peer_communicator.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <optional>
+
+/**
+ * @file peer_pool.hpp
+ * @brief Book keeping for the peers we could connect to.
+ *
+ * Every address is known once. next() hands out the best idle candidate: peers on the local
+ * network come first, as they are the cheapest and fastest to download from. Among those and
+ * the rest, peers that already delivered data rank by their observed throughput, untried peers
+ * follow, peers that failed come last and only after their backoff (doubling per consecutive
+ * failure) ran out. A peer that failed too often in a row is forgotten.
+ */
+
+namespace bt::core {
+class PeerPool {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    PeerPool(Clock::duration retryBackoff, Clock::duration maxRetryBackoff,
+             uint32_t maxFailures);
+
+    /**
+     * Adds a new candidate, returns false if the address is already known. `local` peers were
+     * found on the LAN; a known address found there again is marked local, but still not new.
+     */
+    bool add(const Peer& peer, bool local = false);
+    /** Best candidate that may be connected at `now`, it is marked as connecting. */
+    std::optional<Peer> next(Clock::time_point now);
+
+    void onConnected(const Peer& peer);
+    /** Connect or handshake failed. */
+    void onFailed(const Peer& peer, Clock::time_point now);
+    /** An established connection ended after downloading at `rate` bytes/s. */
+    void onClosed(const Peer& peer, double rate, Clock::time_point now);
+    /** Never hand out this address again (ourselves, banned peers). */
+    void block(const Peer& peer);
+
+    /** Earliest time a waiting candidate becomes available. */
+    std::optional<Clock::time_point> nextRetry() const;
+    size_t size() const;
+
+private:
+    enum class State { IDLE, CONNECTING, CONNECTED, BLOCKED };
+
+    struct Candidate {
+        State state = State::IDLE;
+        uint32_t failures = 0; // In a row
+        Clock::time_point retryAt{};
+        double score = 0.0; // Bytes/s of the last connection
+        bool tried = false;
+        bool local = false; // Found by local service discovery
+    };
+
+    Clock::duration _retryBackoff;
+    Clock::duration _maxRetryBackoff;
+    uint32_t _maxFailures;
+    std::map<Peer, Candidate> _candidates;
+
+    static bool _betterThan(const Candidate& a, const Candidate& b);
+};
+} // namespace bt::core
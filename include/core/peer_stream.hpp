@@ -0,0 +1,110 @@
+#pragma once
+
+#include "core/utp.hpp"
+
+#include <asio.hpp>
+#include <memory>
+#include <utility>
+
+/**
+ * @file peer_stream.hpp
+ * @brief The byte stream a peer connection runs on: a TCP socket or a uTP connection.
+ *
+ * Both have the async_read_some / async_write_some interface, so asio::async_read and
+ * async_write work on either and the wire protocol doesn't know which one it talks over.
+ * The TCP socket is always there: its executor is the executor of the stream, and TCP only
+ * features (sendfile, corking) use it directly when isUtp() is false. A uTP connection is
+ * closed with the stream that owns it.
+ */
+
+namespace bt::core {
+class PeerStream {
+public:
+    using executor_type = asio::any_io_executor;
+
+    explicit PeerStream(const executor_type& executor) : _tcp(executor) {}
+    explicit PeerStream(asio::ip::tcp::socket socket) : _tcp(std::move(socket)) {}
+    explicit PeerStream(std::shared_ptr<UtpSocket> utp)
+        : _tcp(utp->get_executor()), _utp(std::move(utp)) {}
+
+    PeerStream(PeerStream&&) = default;
+    PeerStream& operator=(PeerStream&&) = delete;
+    ~PeerStream() {
+        close();
+    }
+
+    inline executor_type get_executor() {
+        return _tcp.get_executor();
+    }
+
+    template <typename Buffers, typename Token>
+    auto async_read_some(const Buffers& buffers, Token&& token) {
+        return asio::async_initiate<Token, void(asio::error_code, size_t)>(
+            [this](auto handler, const Buffers& buffers) {
+                if (_utp) {
+                    _utp->async_read_some(buffers, std::move(handler));
+                } else {
+                    _tcp.async_read_some(buffers, std::move(handler));
+                }
+            },
+            token, buffers);
+    }
+
+    template <typename Buffers, typename Token>
+    auto async_write_some(const Buffers& buffers, Token&& token) {
+        return asio::async_initiate<Token, void(asio::error_code, size_t)>(
+            [this](auto handler, const Buffers& buffers) {
+                if (_utp) {
+                    _utp->async_write_some(buffers, std::move(handler));
+                } else {
+                    _tcp.async_write_some(buffers, std::move(handler));
+                }
+            },
+            token, buffers);
+    }
+
+    inline bool is_open() const {
+        return _utp ? _utp->is_open() : _tcp.is_open();
+    }
+
+    // Never throws, pending operations complete with operation_aborted
+    inline void close() {
+        if (_utp) {
+            _utp->close();
+        }
+        asio::error_code ec;
+        _tcp.close(ec);
+    }
+
+    inline bool isUtp() const {
+        return _utp != nullptr;
+    }
+    // Runs the stream over `utp` from now on, instead of the TCP socket
+    inline void useUtp(std::shared_ptr<UtpSocket> utp) {
+        useTcp();
+        _utp = std::move(utp);
+    }
+    // Back to TCP, e.g. after a uTP connect failed. Closes the uTP connection.
+    inline void useTcp() {
+        if (_utp) {
+            _utp->close();
+            _utp.reset();
+        }
+    }
+
+    inline asio::ip::tcp::socket& tcp() {
+        return _tcp;
+    }
+    inline const std::shared_ptr<UtpSocket>& utp() const {
+        return _utp;
+    }
+    // Hands the uTP connection over without closing it
+    inline std::shared_ptr<UtpSocket> releaseUtp() {
+        return std::move(_utp);
+    }
+
+private:
+    asio::ip::tcp::socket _tcp;
+    std::shared_ptr<UtpSocket> _utp;
+};
+} // namespace bt::core
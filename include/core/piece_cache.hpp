@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <mutex>
+#include <span>
+#include <vector>
+
+/**
+ * @file piece_cache.hpp
+ * @brief Verified pieces kept in memory for buffered uploads.
+ *
+ * Popular pieces get requested by many peers at about the same time. The first request reads
+ * the whole piece from storage into the cache, the requests for its other blocks and those of
+ * other peers are answered from memory. Once the cached bytes exceed the budget, the least
+ * recently used pieces are evicted. Every member is safe to call from any thread.
+ */
+
+namespace bt::core {
+class PieceCache {
+public:
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+        size_t bytes = 0; // Currently cached
+    };
+
+    // A capacity of 0 disables the cache
+    explicit PieceCache(size_t capacity);
+
+    /** Copies `out.size()` bytes at `offset` of piece `index`. Returns false on a miss. */
+    bool read(uint32_t index, uint64_t offset, std::span<uint8_t> out);
+    /** Caches a whole piece. Pieces larger than the whole budget are not kept. */
+    void insert(uint32_t index, std::vector<uint8_t> data);
+    Stats stats() const;
+
+    inline size_t capacity() const {
+        return _capacity;
+    }
+
+private:
+    using Lru = std::list<uint32_t>; // Piece indices, most recently used first
+
+    struct Entry {
+        std::vector<uint8_t> data;
+        Lru::iterator use;
+    };
+
+    size_t _capacity;
+    mutable std::mutex _mutex;
+    std::map<uint32_t, Entry> _pieces;
+    Lru _lru;
+    Stats _stats;
+};
+} // namespace bt::core
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <optional>
+
+/**
+ * @file request_pipeline.hpp
+ * @brief Sizes a peer's queue of outstanding block requests.
+ *
+ * The session reports every block with its round trip time (request sent to block received).
+ * The pipeline keeps a throughput estimate and the smallest round trip seen, which is the
+ * one least inflated by requests queued at the peer, and asks for enough requests to cover
+ * the bandwidth-delay product with headroom to probe for more.
+ */
+
+namespace bt::core {
+class RequestPipeline {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // Throughput is sampled over windows of this length
+    static constexpr Clock::duration RATE_WINDOW = std::chrono::milliseconds(200);
+    // Depth relative to the bandwidth-delay product, > 1 so the estimate can grow
+    static constexpr double DEPTH_GAIN = 2.0;
+
+    RequestPipeline(uint32_t minDepth, uint32_t maxDepth, uint32_t initialDepth,
+                    uint32_t blockLen);
+
+    void onBlockReceived(uint32_t bytes, Clock::duration roundTrip, Clock::time_point now);
+    /** Upper bound announced by the peer ("reqq" in the extension handshake). */
+    void setPeerLimit(uint32_t reqq);
+
+    /** Number of requests that should be outstanding. */
+    uint32_t depth() const;
+
+    /** Bytes/s, 0 until the first window is complete. */
+    inline double rate() const {
+        return _rate;
+    }
+
+    inline std::optional<Clock::duration> minRoundTrip() const {
+        return _minRoundTrip;
+    }
+
+private:
+    uint32_t _minDepth;
+    uint32_t _maxDepth;
+    uint32_t _initialDepth;
+    uint32_t _blockLen;
+    std::optional<uint32_t> _peerLimit;
+
+    double _rate = 0.0;
+    std::optional<Clock::duration> _minRoundTrip;
+    std::optional<Clock::time_point> _windowStart;
+    uint64_t _windowBytes = 0;
+};
+} // namespace bt::core
@@ -25,6 +25,7 @@ using Sha1Hash = std::array<uint8_t, HASH_LENGTH>;
 struct DictKeys {
     static constexpr const char* COMMENT = "comment";
     static constexpr const char* ANNOUNCE = "announce";
+    static constexpr const char* ANNOUNCE_LIST = "announce-list";
     static constexpr const char* INFO = "info";
     static constexpr const char* PIECE_LENGTH = "piece length";
     static constexpr const char* LENGTH = "length";
@@ -36,6 +37,8 @@ struct DictKeys {
 /** Subset of the torrent's "info" dictionary (per-piece and file info). */
 struct TorrentMetadata {
     std::string announce;
+    // Tiers of tracker URLs (BEP 12), empty if the torrent has a single tracker
+    std::vector<std::vector<std::string>> announceList;
     std::string comment;
     uint64_t creationDate;
     Sha1Hash infoHash;
@@ -50,16 +53,26 @@ struct TorrentMetadata {
     };
 
     Info info;
+    std::string rawInfo; // Bencoded info dictionary, hashes to infoHash
 };
 
 /** Parse a .torrent file buffer into TorrentMetadata. */
 TorrentMetadata parseTorrentData(std::string_view path);
+/**
+ * Build TorrentMetadata from a bare bencoded info dictionary, as fetched for a magnet link.
+ * The info hash is the hash of `rawInfo` itself, announce and comment are left empty.
+ */
+TorrentMetadata parseInfoData(std::string_view rawInfo);
+/** Trackers to announce to by tier: the announce-list if there is one, else `announce` alone. */
+std::vector<std::vector<std::string>> trackerTiers(const TorrentMetadata& metadata);
 
 namespace detail {
 std::string loadTorrentFile(const std::filesystem::path& path);
 bencode::Dict parseRootDict(const std::string& torrentData);
 TorrentMetadata::Info parseInfoDict(const bencode::Dict& infoDict);
 TorrentMetadata parseRootMetadata(const bencode::Dict& rootDict);
+std::vector<std::vector<std::string>> parseAnnounceList(const bencode::Dict& rootDict);
+std::string encodeInfoDict(const TorrentMetadata::Info& infoDictData);
 Sha1Hash calculateInfoHash(const TorrentMetadata::Info& infoDictData);
 std::vector<Sha1Hash> parsePieceHashes(const std::string& piecesStr);
 
@@ -0,0 +1,153 @@
+#pragma once
+
+#include "core/peer_communicator.hpp"
+#include "core/torrent_metadata_loader.hpp"
+#include "core/tracker_communicator.hpp"
+#include "core/udp_tracker.hpp"
+
+#include <asio.hpp>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * @file tracker_announcer.hpp
+ * @brief Announces a torrent to its trackers for as long as it runs, on an asio executor.
+ *
+ * Trackers come in tiers (BEP 12), each shuffled once. Every round of announces goes to all
+ * trackers of the first tier that has one which isn't backing off from failures, at the same
+ * time; the first to answer moves to the front of its tier and its intervals set the time of
+ * the next round. A tier where every announce fails, or none answers within `timeout`, passes
+ * the round on to the next tier; trackers that didn't answer in time count as failed. Trackers
+ * answering late still count, and all of them hand their peers on.
+ *
+ * Every tracker gets `started` with its first announce and `completed` once we are done;
+ * stop() sends `stopped` to each tracker that knows us. Rounds go out every `interval`, or
+ * every `min interval` while we are short of peers or have news. A failed tracker is skipped
+ * until its backoff, doubled with every failure in a row, ran out. Every announce reports the
+ * transfer figures of the moment. A round in which every tier failed is reported to the
+ * FailureHandler, if there is one.
+ *
+ * udp:// trackers (BEP 15) need a UdpTrackerClient, which any number of announcers may share.
+ *
+ * stop() doesn't wait for announces in progress, which for a UDP tracker that doesn't answer
+ * may take long; they are left to end on their own and their answers are ignored.
+ */
+
+namespace bt::core {
+class TrackerAnnouncer : public std::enable_shared_from_this<TrackerAnnouncer> {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Stats {
+        uint64_t uploaded = 0;
+        uint64_t downloaded = 0;
+        uint64_t left = 0;
+        // Peers we are short of, 0 leaves the number to the tracker
+        uint32_t numWant = 0;
+    };
+    // Both run on the executor
+    using StatsProvider = std::function<Stats()>;
+    using PeerHandler = std::function<void(std::vector<Peer> peers)>;
+    // A round where every tier failed, with the last error
+    using FailureHandler = std::function<void(const std::string& error)>;
+
+    struct Options {
+        // Until a tracker sends intervals of its own
+        std::chrono::seconds interval{1800};
+        std::chrono::seconds minInterval{300};
+        // Wait before a tracker is asked again after a failed announce, doubled with every
+        // failure in a row
+        std::chrono::milliseconds retryBackoff{15000};
+        std::chrono::milliseconds maxRetryBackoff{30 * 60 * 1000};
+        // Time an announce may take, connecting included
+        std::chrono::milliseconds timeout{15000};
+    };
+
+    // `tiers` lists the announce URLs by priority, see trackerTiers()
+    TrackerAnnouncer(asio::any_io_executor executor, std::vector<std::vector<std::string>> tiers,
+                     const Sha1Hash& infoHash, std::string peerId, uint16_t port,
+                     StatsProvider stats, PeerHandler onPeers, Options options,
+                     std::shared_ptr<UdpTrackerClient> udp = nullptr,
+                     FailureHandler onFailure = nullptr);
+
+    // All of these are safe to call from any thread
+    void start();
+    // The download is complete, tells the trackers that know about us
+    void completed();
+    /**
+     * Stops re-announcing and sends `stopped` to the trackers that know about us. The future is
+     * ready once those announces are done, failed or timed out.
+     */
+    std::future<void> stop();
+
+private:
+    struct Tracker {
+        std::string url;
+        uint32_t failures = 0;       // In a row
+        Clock::time_point retryAt{}; // Skipped until then
+        bool busy = false;           // Announce in progress
+        bool started = false;        // Answered our `started`
+        bool completed = false;      // Knows we are complete
+        bool timedOut = false;       // Counted as failed while its announce still runs
+    };
+    // Announces sent at the same time
+    struct Round {
+        size_t pending = 0;
+        std::shared_ptr<Tracker> winner; // First to answer
+        TrackerResponse response;
+    };
+
+    asio::strand<asio::any_io_executor> _strand;
+    std::vector<std::vector<std::shared_ptr<Tracker>>> _tiers;
+    Sha1Hash _infoHash;
+    std::string _peerId;
+    uint16_t _port;
+    StatsProvider _stats;
+    PeerHandler _onPeers;
+    FailureHandler _onRoundFailed;
+    Options _options;
+    std::shared_ptr<UdpTrackerClient> _udp;
+    asio::thread_pool _blocking{4}; // http(s) announces, cpr blocks until they are done
+
+    // Only touched on the strand
+    asio::steady_timer _wakeup; // Cancelled to reschedule, stop or when an announce ends
+    Clock::time_point _next;
+    Clock::time_point _last; // Last answered round
+    std::string _lastError;  // Of the latest failed announce
+    std::chrono::seconds _interval;
+    std::chrono::seconds _minInterval;
+    bool _completed = false;
+    bool _running = false;
+    std::shared_ptr<std::promise<void>> _stopped; // Set once stop() was called
+
+    asio::awaitable<void> _run();
+    // Announces to the first tier with trackers to ask, then to the next if they all fail.
+    // Returns the winning round, if any tracker answered before stop().
+    asio::awaitable<std::shared_ptr<Round>> _announceRound(Stats stats);
+    // Starts announces to `trackers`, `stopped` or whatever each of them is due
+    std::shared_ptr<Round> _startRound(const std::vector<std::shared_ptr<Tracker>>& trackers,
+                                       const Stats& stats, bool stopping);
+    // Until the first answer, or with `all` until every announce ended. Gives up at the
+    // deadline, and at stop() unless `all`.
+    asio::awaitable<void> _await(std::shared_ptr<Round> round, bool all,
+                                 Clock::time_point deadline);
+    void _onAnswer(Tracker& tracker, AnnounceEvent event, const Stats& stats,
+                   const TrackerResponse& response);
+    void _onFailure(Tracker& tracker, AnnounceEvent event, const std::string& error);
+    AnnounceEvent _eventFor(const Tracker& tracker) const;
+    void _promote(const std::shared_ptr<Tracker>& tracker);
+
+    asio::awaitable<TrackerResponse> _announce(std::string url, AnnounceEvent event,
+                                               Stats stats);
+    asio::awaitable<std::string> _httpGet(std::string url);
+    // Moves the next round forward to `when`, never back
+    void _schedule(Clock::time_point when);
+
+    static std::vector<Peer> _toPeers(const std::vector<std::array<uint8_t, 6>>& peersBlob);
+};
+} // namespace bt::core
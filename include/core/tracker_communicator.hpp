@@ -3,6 +3,9 @@
 #include <ada.h>
 #include <cpr/cpr.h>
 #include <cpr/response.h>
+#include <chrono>
+#include <cstdint>
+#include <optional>
 #include <string>
 #include <string_view>
 
@@ -19,8 +22,22 @@
  *
  * Represents a tracker reply.
  *
- * @var interval   Number of seconds the client should wait before re-announcing.
- * @var peersBlob  Vector of 6-byte peer entries (IPv4: 4 bytes address + 2 bytes port).
+ * @var interval     Number of seconds the client should wait before re-announcing.
+ * @var minInterval  Seconds the client must wait at least between announces, if the tracker
+ *                   sets a limit.
+ * @var peersBlob    Vector of 6-byte peer entries (IPv4: 4 bytes address + 2 bytes port).
+ */
+
+/**
+ * AnnounceRequest
+ *
+ * Everything an announce tells the tracker about us and the torrent.
+ *
+ * @var uploaded    Payload bytes sent to peers since the `started` event.
+ * @var downloaded  Payload bytes received from peers since the `started` event.
+ * @var left        Bytes still missing until the torrent is complete.
+ * @var event       started, completed or stopped, or none for a regular re-announce.
+ * @var numWant     Number of peers we'd like, the tracker picks when it is unset.
  */
 
 /**
@@ -29,6 +46,8 @@
  * Perform an announce for the given torrent metadata and return the parsed tracker response.
  *
  * @param metadata  Torrent metadata used to construct the announce.
+ * @param peerId    Our peer id.
+ * @param port      Port we accept peer connections on.
  * @return          Parsed TrackerResponse containing interval and peer list.
  */
 
@@ -49,6 +68,20 @@
  *
  * @param metadata  Torrent metadata containing announce URL and parameters.
  * @param peerId    Peer id to include in the announce.
+ * @param port      Port we accept peer connections on.
+ * @return          Fully formed tracker URL.
+ */
+
+/**
+ * buildAnnounceUrl
+ *
+ * Construct the tracker announce URL for the given announce request.
+ *
+ * @param announce  Announce URL of the tracker.
+ * @param infoHash  Info hash of the torrent.
+ * @param peerId    Peer id to include in the announce.
+ * @param port      Port we accept peer connections on.
+ * @param request   Transfer figures, event and number of peers wanted.
  * @return          Fully formed tracker URL.
  */
 
@@ -57,8 +90,9 @@
  *
  * Perform the HTTP request to the tracker.
  *
- * @param url  Tracker announce URL.
- * @return     HTTP response object from the request.
+ * @param url      Tracker announce URL.
+ * @param timeout  Time the whole request may take, 0 for no limit.
+ * @return         HTTP response object from the request.
  */
 
 /**
@@ -66,6 +100,8 @@
  *
  * Parse the tracker's response payload into a TrackerResponse structure.
  *
+ * Throws std::runtime_error with the tracker's `failure reason` if it refused the announce.
+ *
  * @param response  Raw response body from the tracker.
  * @return          Parsed TrackerResponse.
  */
@@ -90,15 +126,32 @@ namespace bt::core {
 
 struct TrackerResponse {
     int interval;
+    std::optional<int> minInterval;
     std::vector<std::array<uint8_t, 6>> peersBlob;
 };
 
-TrackerResponse announceAndGetPeers(const TorrentMetadata& metadata, std::string_view peerId);
+enum class AnnounceEvent { None, Started, Completed, Stopped };
+
+struct AnnounceRequest {
+    uint64_t uploaded = 0;
+    uint64_t downloaded = 0;
+    uint64_t left = 0;
+    AnnounceEvent event = AnnounceEvent::None;
+    std::optional<uint32_t> numWant;
+};
+
+TrackerResponse announceAndGetPeers(const TorrentMetadata& metadata, std::string_view peerId,
+                                    uint16_t port);
 std::string generateId(int length);
 
 namespace detail {
-std::string buildTrackerUrl(const TorrentMetadata& metadata, std::string_view peerId);
-cpr::Response announceToTracker(std::string_view url);
+std::string buildTrackerUrl(const TorrentMetadata& metadata, std::string_view peerId,
+                            uint16_t port);
+std::string buildAnnounceUrl(std::string_view announce, const Sha1Hash& infoHash,
+                             std::string_view peerId, uint16_t port,
+                             const AnnounceRequest& request);
+cpr::Response announceToTracker(std::string_view url,
+                                std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
 TrackerResponse parseTrackerResponse(const std::string_view response);
 std::vector<std::array<uint8_t, 6>> toSixByteArrays(std::string_view blob);
 void debugLogTrackerResponse(const TrackerResponse& r);
@@ -0,0 +1,125 @@
+#pragma once
+
+#include "core/torrent_metadata_loader.hpp"
+#include "core/tracker_communicator.hpp"
+
+#include <asio.hpp>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <optional>
+#include <random>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * @file udp_tracker.hpp
+ * @brief Announces to udp:// trackers (BEP 15).
+ *
+ * An announce takes two round trips of one datagram each: `connect` gets a connection id,
+ * which proves we own our address, and `announce` uses it. Connection ids are kept for a
+ * minute per tracker, so re-announces within that time need a single round trip. A request
+ * that gets no answer is sent again after 15 * 2^n seconds, n counting from 0 up to 8, before
+ * the announce fails, unless the caller's deadline ends it sooner.
+ *
+ * One UdpTrackerClient owns one UDP socket and serves any number of torrents and trackers;
+ * answers are told apart by their transaction id. All state lives on the client's strand.
+ */
+
+namespace bt::core {
+namespace udp_tracker {
+constexpr uint64_t PROTOCOL_ID = 0x41727101980;
+constexpr size_t CONNECT_LEN = 16;
+constexpr size_t ANNOUNCE_LEN = 98;
+// Action, transaction id, interval, leechers, seeders
+constexpr size_t ANNOUNCE_REPLY_HEADER_LEN = 20;
+
+enum class Action : uint32_t { CONNECT = 0, ANNOUNCE = 1, SCRAPE = 2, ERROR = 3 };
+
+struct Reply {
+    Action action;
+    uint32_t transactionId;
+    std::span<const uint8_t> body; // Past action and transaction id
+};
+
+std::vector<uint8_t> encodeConnect(uint32_t transactionId);
+std::vector<uint8_t> encodeAnnounce(uint64_t connectionId, uint32_t transactionId,
+                                    const Sha1Hash& infoHash, std::string_view peerId,
+                                    uint16_t port, uint32_t key, const AnnounceRequest& request);
+// Nullopt for datagrams too short to be a reply
+std::optional<Reply> parseReply(std::span<const uint8_t> datagram);
+// Body of an ANNOUNCE reply
+TrackerResponse parseAnnounceReply(std::span<const uint8_t> body);
+} // namespace udp_tracker
+
+class UdpTrackerClient : public std::enable_shared_from_this<UdpTrackerClient> {
+public:
+    using Endpoint = asio::ip::udp::endpoint;
+
+    struct Options {
+        uint16_t port = 0; // 0 picks a free port
+        // Wait for the first answer, doubled with every retransmission
+        std::chrono::milliseconds baseTimeout{15000};
+        uint32_t maxRetransmits = 8;
+    };
+
+    UdpTrackerClient(asio::io_context& io, Options options);
+
+    /** Binds the UDP socket. Throws std::system_error if it can't. */
+    void start();
+    // Closes the socket, announces in progress fail. From any thread.
+    void close();
+
+    /**
+     * Announces to `url` (udp://host:port) and returns the tracker's answer. Throws
+     * std::runtime_error if the tracker refuses, doesn't answer by `deadline` or within the
+     * retransmissions, or the client is closed.
+     * May be awaited from any executor and resumes on the caller's.
+     */
+    asio::awaitable<TrackerResponse>
+    announce(std::string url, Sha1Hash infoHash, std::string peerId, uint16_t port,
+             AnnounceRequest request,
+             std::chrono::steady_clock::time_point deadline =
+                 std::chrono::steady_clock::time_point::max());
+
+    uint16_t getPort() const;
+
+private:
+    // Connection ids are good for a minute (BEP 15)
+    static constexpr auto CONNECTION_ID_LIFETIME = std::chrono::seconds(60);
+
+    struct Connection {
+        uint64_t id;
+        std::chrono::steady_clock::time_point expires;
+    };
+    struct Transaction {
+        explicit Transaction(const asio::any_io_executor& executor) : answered(executor) {}
+        Endpoint to;
+        asio::steady_timer answered; // Cancelled when the reply is in
+        std::optional<std::vector<uint8_t>> reply;
+    };
+
+    asio::any_io_executor _strand;
+    asio::ip::udp::socket _udp;
+    Options _options;
+    std::mt19937 _random;
+    uint32_t _key; // Tells the tracker it's still us if our address changes
+    std::map<Endpoint, Connection> _connections;
+    std::map<uint32_t, std::shared_ptr<Transaction>> _transactions;
+
+    asio::awaitable<TrackerResponse> _announce(std::string url, Sha1Hash infoHash,
+                                               std::string peerId, uint16_t port,
+                                               AnnounceRequest request,
+                                               std::chrono::steady_clock::time_point deadline);
+    asio::awaitable<Endpoint> _resolve(std::string url);
+    // Sends `datagram` and waits up to `timeout` for the reply to `transactionId`
+    asio::awaitable<std::optional<std::vector<uint8_t>>>
+    _exchange(const Endpoint& to, uint32_t transactionId, std::vector<uint8_t> datagram,
+              std::chrono::milliseconds timeout);
+    asio::awaitable<void> _receiveLoop();
+    void _close();
+};
+} // namespace bt::core
@@ -1,4 +1,6 @@
 #pragma once
+#include <array>
+#include <cstdint>
 #include <cstring>
 #include <netinet/in.h>
 #include <span>
@@ -15,6 +17,23 @@ private:
     std::vector<uint8_t> _data;
 };
 
+/**
+ * ByteWriter for message headers: writes into a fixed size buffer on the stack instead of
+ * growing a vector. The largest fixed header is REQUEST/CANCEL with 17 bytes.
+ */
+class HeaderWriter {
+public:
+    static constexpr size_t CAPACITY = 17;
+
+    void write_u32(uint32_t val);
+    void write_u8(uint8_t val);
+    std::span<const uint8_t> data() const;
+
+private:
+    std::array<uint8_t, CAPACITY> _data;
+    size_t _size = 0;
+};
+
 class ByteReader {
 public:
     explicit ByteReader(std::span<const uint8_t> buffer);
@@ -0,0 +1,336 @@
+#pragma once
+
+#include "core/ledbat.hpp"
+
+#include <asio.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <optional>
+#include <random>
+#include <span>
+#include <utility>
+#include <vector>
+
+/**
+ * @file utp.hpp
+ * @brief uTP (BEP 29): reliable byte streams over UDP with delay based congestion control.
+ *
+ * A UtpContext owns one UDP socket and runs every connection on it. Each UtpSocket is an
+ * ordered, reliable stream like a TCP socket and has the same async_read_some /
+ * async_write_some interface, so asio::async_read/async_write and PeerStream work with it.
+ *
+ * Sending is paced by LEDBAT (see Ledbat) and the receiver's window. Acks carry a selective
+ * ack bitmask for packets past a gap; a packet the peer skipped three times is sent again
+ * without waiting for the timeout. Packets start at a size that fits any IPv4 path, larger
+ * sizes are probed with the don't-fragment bit set (Linux only) and kept once acked.
+ *
+ * All state lives on the context's strand; operations may be started from any thread and
+ * complete on the executor of their handler.
+ */
+
+namespace bt::core {
+namespace utp {
+enum class PacketType : uint8_t { DATA = 0, FIN = 1, STATE = 2, RESET = 3, SYN = 4 };
+
+constexpr uint8_t VERSION = 1;
+constexpr size_t HEADER_LEN = 20;
+constexpr uint8_t EXTENSION_SELECTIVE_ACK = 1;
+// Bits in a selective ack, the first one stands for ack_nr + 2
+constexpr size_t SELECTIVE_ACK_BITS = 32;
+
+struct PacketHeader {
+    PacketType type;
+    uint16_t connectionId;
+    uint32_t timestamp;     // Sender's clock, microseconds
+    uint32_t timestampDiff; // Sender's clock minus the timestamp of its last received packet
+    uint32_t windowSize;    // Receive window of the sender, bytes
+    uint16_t seqNr;
+    uint16_t ackNr;
+};
+
+struct Packet {
+    PacketHeader header;
+    std::vector<uint8_t> selectiveAck; // Bitmask, empty if the packet has none
+    std::span<const uint8_t> payload;
+};
+
+std::vector<uint8_t> encodePacket(const PacketHeader& header, std::span<const uint8_t> selectiveAck,
+                                  std::span<const uint8_t> payload);
+// Nullopt for anything that isn't a uTP version 1 packet
+std::optional<Packet> parsePacket(std::span<const uint8_t> datagram);
+} // namespace utp
+
+class UtpSocket;
+
+class UtpContext : public std::enable_shared_from_this<UtpContext> {
+public:
+    using Endpoint = asio::ip::udp::endpoint;
+
+    struct Options {
+        uint16_t port = 0; // 0 picks a free port
+        // Connections the peer opens are accepted, otherwise they are reset
+        bool acceptIncoming = false;
+        // Test hooks: every outgoing datagram is delayed, and dropped with this probability
+        std::chrono::milliseconds sendDelay{0};
+        double lossRate = 0.0;
+    };
+
+    UtpContext(asio::io_context& io, Options options);
+
+    /** Binds the UDP socket. Throws std::system_error if it can't. */
+    void start();
+    // Resets every connection and closes the UDP socket, from any thread
+    void close();
+
+    // New, unconnected socket, see UtpSocket::async_connect
+    std::shared_ptr<UtpSocket> createSocket();
+
+    // Next connection a peer opened, once it's established
+    template <typename Token> auto async_accept(Token&& token);
+
+    uint16_t getPort() const;
+    inline asio::any_io_executor getExecutor() const {
+        return _strand;
+    }
+
+private:
+    friend class UtpSocket;
+    using AcceptHandler = std::function<void(asio::error_code, std::shared_ptr<UtpSocket>)>;
+    using Key = std::pair<Endpoint, uint16_t>; // Remote endpoint, connection id we receive on
+
+    asio::any_io_executor _strand;
+    asio::ip::udp::socket _udp;
+    asio::steady_timer _tick;
+    Options _options;
+    std::mt19937 _random;
+    std::map<Key, std::shared_ptr<UtpSocket>> _sockets;
+    std::deque<std::shared_ptr<UtpSocket>> _accepted;
+    std::deque<AcceptHandler> _acceptWaiters;
+    bool _dontFragment = false;
+
+    asio::awaitable<void> _receiveLoop();
+    asio::awaitable<void> _tickLoop();
+    void _close();
+    void _onDatagram(const Endpoint& from, std::span<const uint8_t> datagram);
+    void _startAccept(AcceptHandler handler);
+    void _accept(std::shared_ptr<UtpSocket> socket);
+    void _register(const Key& key, std::shared_ptr<UtpSocket> socket);
+    void _unregister(const Key& key);
+    // Sends now, or after the test delay. Probes go out with the don't-fragment bit.
+    asio::error_code _send(const Endpoint& to, std::vector<uint8_t> datagram, bool probe);
+    asio::error_code _sendNow(const Endpoint& to, std::span<const uint8_t> datagram, bool probe);
+    void _sendReset(const Endpoint& to, uint16_t connectionId, uint16_t ackNr);
+};
+
+class UtpSocket : public std::enable_shared_from_this<UtpSocket> {
+public:
+    using Clock = std::chrono::steady_clock;
+    using Endpoint = asio::ip::udp::endpoint;
+    using executor_type = asio::any_io_executor;
+
+    struct Stats {
+        size_t window;         // Congestion window, bytes
+        uint32_t queuingDelay; // Microseconds
+        size_t packetSize;     // Largest datagram known to get through
+        uint64_t retransmits;
+        Clock::duration roundTrip;
+    };
+
+    explicit UtpSocket(std::shared_ptr<UtpContext> context);
+
+    inline executor_type get_executor() const {
+        return _strand;
+    }
+
+    template <typename Token> auto async_connect(const Endpoint& remote, Token&& token);
+    template <typename Buffers, typename Token>
+    auto async_read_some(const Buffers& buffers, Token&& token);
+    template <typename Buffers, typename Token>
+    auto async_write_some(const Buffers& buffers, Token&& token);
+
+    // Pending operations complete with operation_aborted. Data already written still goes
+    // out, followed by a FIN.
+    void close();
+    inline bool is_open() const {
+        return _open.load();
+    }
+    inline Endpoint remote_endpoint() const {
+        return _remote;
+    }
+    // Call on the context's strand, or once the context stopped
+    Stats stats() const;
+
+private:
+    friend class UtpContext;
+    enum class State { IDLE, SYN_SENT, CONNECTED, CLOSED };
+    using Handler = std::function<void(asio::error_code, size_t)>;
+    using ConnectHandler = std::function<void(asio::error_code)>;
+
+    struct OutPacket {
+        utp::PacketType type;
+        uint16_t seq;
+        std::vector<uint8_t> payload;
+        Clock::time_point sentAt;
+        uint32_t transmissions = 0;
+        bool acked = false; // Selectively acked
+        bool probe = false; // Larger than the path is known to take
+    };
+
+    std::weak_ptr<UtpContext> _context;
+    asio::any_io_executor _strand;
+    std::atomic<bool> _open{true};
+    State _state = State::IDLE;
+    Endpoint _remote;
+    uint16_t _recvId = 0;
+    uint16_t _sendId = 0;
+    asio::error_code _error; // Why the connection ended, if it did
+    bool _registered = false;
+
+    // Sending
+    uint16_t _seqNr = 1;            // Next sequence number to use
+    std::vector<uint8_t> _sendQueue; // Written, not yet packetized
+    size_t _sendHead = 0;
+    std::deque<OutPacket> _inFlight; // In sequence order
+    size_t _bytesInFlight = 0;
+    uint32_t _peerWindow;
+    uint16_t _lastAckNr = 0;
+    uint32_t _duplicateAcks = 0;
+    bool _finQueued = false;
+    bool _finSent = false;
+    Ledbat _ledbat;
+
+    // Receiving
+    uint16_t _ackNr = 0; // Last sequence number received in order
+    std::vector<uint8_t> _recvBuffer;
+    size_t _recvHead = 0;
+    std::map<uint16_t, std::vector<uint8_t>> _outOfOrder; // Seq -> payload, empty for FIN
+    size_t _outOfOrderBytes = 0;
+    bool _eof = false;
+    uint32_t _replyMicro = 0; // Delay of the peer's last packet, sent back as timestampDiff
+
+    // Timers
+    Clock::duration _roundTrip{};
+    Clock::duration _roundTripVar{};
+    bool _haveRoundTrip = false;
+    Clock::duration _timeout;
+    Clock::time_point _timeoutAt;
+    uint32_t _timeouts = 0; // In a row
+    Clock::time_point _lastSend;
+    uint64_t _retransmits = 0;
+
+    // Path MTU: datagrams up to _mtuFloor get through, above _mtuCeiling they don't
+    size_t _mtuFloor;
+    size_t _mtuCeiling;
+    std::optional<uint16_t> _probeSeq; // At most one probe in flight
+
+    // Pending operations
+    ConnectHandler _connectHandler;
+    Handler _readHandler;
+    std::vector<asio::mutable_buffer> _readBuffers;
+    Handler _writeHandler;
+    std::vector<asio::const_buffer> _writeBuffers;
+
+    template <typename Completion, typename... Args>
+    std::function<void(Args...)> _wrap(Completion&& handler);
+
+    void _startConnect(const Endpoint& remote, ConnectHandler handler);
+    void _startRead(std::vector<asio::mutable_buffer> buffers, Handler handler);
+    void _startWrite(std::vector<asio::const_buffer> buffers, Handler handler);
+    void _close();
+    void _acceptSyn(const Endpoint& remote, const utp::Packet& syn, uint16_t seqNr);
+
+    void _onPacket(const utp::Packet& packet, Clock::time_point now);
+    void _onAck(const utp::Packet& packet, Clock::time_point now);
+    void _onData(const utp::Packet& packet);
+    void _onTick(Clock::time_point now);
+    bool _flush(); // True if anything was sent
+    void _sendPacket(OutPacket& packet, Clock::time_point now);
+    void _sendState();
+    std::vector<uint8_t> _encode(utp::PacketType type, uint16_t seq,
+                                 std::span<const uint8_t> payload);
+    void _acknowledge(OutPacket& packet, Clock::time_point now, size_t& ackedBytes);
+    void _resend(OutPacket& packet, Clock::time_point now);
+    void _fail(asio::error_code ec);
+    void _finish();
+    void _completeRead();
+    void _completeWrite();
+    uint32_t _receiveWindow() const;
+    size_t _maxPayload(size_t datagramSize) const;
+    void _armTimeout(Clock::time_point now);
+};
+
+// -- Templates -------------------------------------------------------------------------------
+
+template <typename Completion, typename... Args>
+std::function<void(Args...)> UtpSocket::_wrap(Completion&& handler) {
+    // std::function needs a copyable target, completion handlers are move-only
+    auto shared =
+        std::make_shared<std::decay_t<Completion>>(std::forward<Completion>(handler));
+    auto executor = asio::get_associated_executor(*shared, _strand);
+    return [shared, executor](Args... args) {
+        asio::post(executor, [shared, args...]() mutable { std::move(*shared)(args...); });
+    };
+}
+
+template <typename Token> auto UtpSocket::async_connect(const Endpoint& remote, Token&& token) {
+    return asio::async_initiate<Token, void(asio::error_code)>(
+        [self = shared_from_this(), remote](auto handler) {
+            auto wrapped = self->template _wrap<decltype(handler), asio::error_code>(
+                std::move(handler));
+            asio::post(self->_strand,
+                       [self, remote, wrapped] { self->_startConnect(remote, wrapped); });
+        },
+        token);
+}
+
+template <typename Buffers, typename Token>
+auto UtpSocket::async_read_some(const Buffers& buffers, Token&& token) {
+    return asio::async_initiate<Token, void(asio::error_code, size_t)>(
+        [self = shared_from_this()](auto handler, const Buffers& buffers) {
+            auto wrapped = self->template _wrap<decltype(handler), asio::error_code, size_t>(
+                std::move(handler));
+            std::vector<asio::mutable_buffer> sequence(asio::buffer_sequence_begin(buffers),
+                                                       asio::buffer_sequence_end(buffers));
+            asio::post(self->_strand, [self, sequence, wrapped] {
+                self->_startRead(sequence, wrapped);
+            });
+        },
+        token, buffers);
+}
+
+template <typename Buffers, typename Token>
+auto UtpSocket::async_write_some(const Buffers& buffers, Token&& token) {
+    return asio::async_initiate<Token, void(asio::error_code, size_t)>(
+        [self = shared_from_this()](auto handler, const Buffers& buffers) {
+            auto wrapped = self->template _wrap<decltype(handler), asio::error_code, size_t>(
+                std::move(handler));
+            std::vector<asio::const_buffer> sequence(asio::buffer_sequence_begin(buffers),
+                                                     asio::buffer_sequence_end(buffers));
+            asio::post(self->_strand, [self, sequence, wrapped] {
+                self->_startWrite(sequence, wrapped);
+            });
+        },
+        token, buffers);
+}
+
+template <typename Token> auto UtpContext::async_accept(Token&& token) {
+    return asio::async_initiate<Token, void(asio::error_code, std::shared_ptr<UtpSocket>)>(
+        [self = shared_from_this()](auto handler) {
+            auto shared = std::make_shared<decltype(handler)>(std::move(handler));
+            auto executor = asio::get_associated_executor(*shared, self->_strand);
+            AcceptHandler wrapped = [shared, executor](asio::error_code ec,
+                                                       std::shared_ptr<UtpSocket> socket) {
+                asio::post(executor, [shared, ec, socket]() mutable {
+                    std::move(*shared)(ec, std::move(socket));
+                });
+            };
+            asio::post(self->_strand, [self, wrapped] { self->_startAccept(wrapped); });
+        },
+        token);
+}
+} // namespace bt::core
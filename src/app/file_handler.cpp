@@ -1,7 +1,13 @@
 #include "app/file_handler.hpp"
 #include <cassert>
+#include <cerrno>
+#include <fcntl.h>
 #include <mutex>
 #include <stdexcept>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 namespace bt {
 FileHandler::FileHandler(std::filesystem::path path, size_t pieceSize, size_t lastPieceSize)
@@ -11,9 +17,14 @@ FileHandler::FileHandler(std::filesystem::path path, size_t pieceSize, size_t la
         _fileStream.close();
         _fileStream.open(std::string(path), std::ios::in | std::ios::out | std::ios::binary);
     }
+    // Written pieces are flushed, so this descriptor sees them through the page cache
+    _fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
 }
 
 FileHandler::~FileHandler() {
+    if (_fd >= 0) {
+        ::close(_fd);
+    }
     _fileStream.close();
 }
 
@@ -29,4 +40,33 @@ void FileHandler::writePiece(uint32_t index, std::span<const uint8_t> data) {
     _fileStream.write(reinterpret_cast<const char*>(data.data()), data.size());
     _fileStream.flush();
 }
+
+void FileHandler::readData(uint64_t offset, std::span<uint8_t> out) {
+    std::lock_guard<std::mutex> lock(_mtx);
+
+    if (!_fileStream.is_open()) {
+        throw std::runtime_error{"Failed to read from file!"};
+    }
+
+    _fileStream.seekg(offset);
+    _fileStream.read(reinterpret_cast<char*>(out.data()), out.size());
+    if (_fileStream.gcount() != static_cast<std::streamsize>(out.size())) {
+        _fileStream.clear();
+        throw std::runtime_error{"Short read from file!"};
+    }
+}
+
+ssize_t FileHandler::sendData(int socketFd, uint64_t offset, size_t length) {
+#ifdef __linux__
+    if (_fd < 0) {
+        errno = EBADF;
+        return -1;
+    }
+    off_t fileOffset = static_cast<off_t>(offset);
+    return ::sendfile(socketFd, _fd, &fileOffset, length);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
 } // namespace bt
@@ -6,6 +6,7 @@
 #include <asio/detail/handler_work.hpp>
 #include <asio/error_code.hpp>
 #include <asio/read.hpp>
+#include <asio/use_future.hpp>
 #include <asio/write.hpp>
 #include <cstdint>
 #include <spdlog/spdlog.h>
@@ -13,43 +14,343 @@
 
 namespace bt {
 PeerManager::PeerManager(std::vector<std::array<uint8_t, 6>> peerBuffer, core::Sha1Hash& infoHash,
-                         std::string_view peerId)
-    : _ctx(), _peers{_deserializePeerBuffer(peerBuffer)}, _infoHash(infoHash), _peerId(peerId),
-      _threadPool(4) {}
+                         std::string_view peerId, const ClientConfig& config,
+                         std::shared_ptr<core::BandwidthChannel> downloadLimit,
+                         std::shared_ptr<core::BandwidthChannel> uploadLimit)
+    : _config(config), _shards(_makeShards(config.io.threads)), _infoHash(infoHash),
+      _peerId(peerId),
+      _downloadChannel(_limit(config.bandwidth.torrentDownloadRate, downloadLimit, config.bandwidth)),
+      _uploadChannel(_limit(config.bandwidth.torrentUploadRate, uploadLimit, config.bandwidth)),
+      _control(asio::make_strand(_shards.front()->ctx)), _wakeup(_control),
+      _pool(config.connection.retryBackoff, config.connection.maxRetryBackoff,
+            config.connection.maxFailures),
+      _peers{_deserializePeerBuffer(peerBuffer)},
+      _choker(config.upload.uploadSlots, config.upload.optimisticRounds), _chokeTimer(_control),
+      _pexTimer(_control) {
+    spdlog::debug("Running peer sessions on {} io thread(s)", _shards.size());
+}
+
+PeerManager::~PeerManager() {
+    stop();
+}
 
 void PeerManager::start(std::shared_ptr<PieceManager> pieceManager) {
     spdlog::debug("Starting the peer manager...");
-    for (const auto& peer : _peers) {
-        spdlog::debug("Found Peer: {}:{}", peer.getIpStr(), peer.port);
+    _pieceManager = pieceManager;
+    _pieceManager->setVerifiedListener(
+        [this](uint32_t index) { asio::post(_control, [this, index] { _broadcastHave(index); }); });
+    addPeers(_peers);
+    asio::co_spawn(_control, _connectLoop(), asio::detached);
+    asio::co_spawn(_control, _chokeLoop(), asio::detached);
+    if (_config.connection.peerExchange) {
+        asio::co_spawn(_control, _pexLoop(), asio::detached);
     }
 
-    for (const auto& peer : _peers) {
-        auto session = std::make_shared<PeerSession>(_ctx, pieceManager);
-
-        asio::co_spawn(
-            _ctx,
-            [session, peer, this]() -> asio::awaitable<void> {
-                try {
-                    co_await session->connect(peer);
-                    co_await session->doHandshake(_infoHash, _peerId);
-                    co_await session->run();
-                } catch (const std::exception& e) {
-                    spdlog::warn("Peer session error: {}", e.what());
-                }
-            },
-            asio::detached);
+    for (auto& shard : _shards) {
+        if (_config.connection.utp) {
+            shard->utp = std::make_shared<core::UtpContext>(shard->ctx, core::UtpContext::Options{});
+            try {
+                shard->utp->start();
+            } catch (const std::system_error& e) {
+                spdlog::warn("No uTP, opening a UDP socket failed: {}", e.what());
+                shard->utp.reset();
+            }
+        }
+        _threadPool.emplace_back([&ctx = shard->ctx] { ctx.run(); });
     }
+}
 
-    for (int i = 0; i < 4; ++i) {
-        _threadPool.emplace_back(std::thread{[this] { _ctx.run(); }});
-    };
+void PeerManager::addPeers(const std::vector<core::Peer>& peers, bool local) {
+    asio::post(_control, [this, peers, local] {
+        size_t added = 0;
+        for (const auto& peer : peers) {
+            if (_pool.add(peer, local)) {
+                spdlog::debug("Found Peer: {}:{}", peer.getIpStr(), peer.port);
+                ++added;
+            }
+        }
+        // Known peers found on the LAN moved up the queue
+        if (added > 0 || (local && !peers.empty())) {
+            _wakeup.cancel();
+        }
+    });
+}
+
+void PeerManager::addIncoming(core::PeerStream stream, core::Peer peer,
+                              core::HandshakeMsg handshake) {
+    asio::post(_control, [this, stream = std::move(stream), peer, handshake]() mutable {
+        const auto& limits = _config.connection;
+        if (_halfOpen + _connected >= limits.maxPeers) {
+            spdlog::debug("Turning away {}:{}, connection limit reached", peer.getIpStr(),
+                          peer.port);
+            return;
+        }
+        if (_pieceManager->isBanned(peer.ip)) {
+            spdlog::debug("Turning away banned peer {}:{}", peer.getIpStr(), peer.port);
+            return;
+        }
+        _startSession(peer, Incoming{std::move(stream), handshake});
+    });
 }
 
 void PeerManager::stop() {
+    if (_threadPool.empty()) {
+        return;
+    }
     spdlog::info("Stopping peermanager...");
+    _pieceManager->setVerifiedListener(nullptr);
+    // uTP closes on its strand, so the shard's thread has to run that before it stops. The
+    // strand runs handlers in order: once the empty one posted after close() ran, so did close().
+    for (auto& shard : _shards) {
+        if (shard->utp) {
+            shard->utp->close();
+            asio::post(shard->utp->getExecutor(), asio::use_future).wait();
+        }
+    }
+    for (auto& shard : _shards) {
+        shard->work.reset();
+        shard->ctx.stop();
+    }
     for (auto& thread : _threadPool) {
         thread.join();
     }
+    _threadPool.clear();
+}
+
+asio::awaitable<void> PeerManager::_connectLoop() {
+    constexpr auto IDLE_TICK = std::chrono::seconds(1);
+    const auto& limits = _config.connection;
+
+    while (true) {
+        auto now = core::PeerPool::Clock::now();
+        while (_halfOpen < limits.maxHalfOpen && _halfOpen + _connected < limits.maxPeers) {
+            auto peer = _pool.next(now);
+            if (!peer) {
+                break;
+            }
+            if (_pieceManager->isBanned(peer->ip)) {
+                _pool.block(*peer);
+                continue;
+            }
+            _startSession(*peer);
+        }
+
+        auto wake = std::min(_pool.nextRetry().value_or(now + IDLE_TICK), now + IDLE_TICK);
+        _wakeup.expires_at(wake);
+        co_await _wakeup.async_wait(asio::as_tuple(asio::use_awaitable));
+    }
+}
+
+void PeerManager::_startSession(const core::Peer& peer, std::optional<Incoming> incoming) {
+    Shard& shard = _pickShard();
+    auto session = std::make_shared<PeerSession>(shard.ctx, _pieceManager, _config.pipeline,
+                                                 _config.upload, _config.connection);
+    session->onPeersDiscovered([this](std::vector<core::Peer> peers) { addPeers(peers); });
+    // Sessions get a channel of their own even without a per-peer limit, the fair queue of the
+    // channel above tells them apart by it
+    auto channel = [this](uint64_t rate, const std::shared_ptr<core::BandwidthChannel>& parent)
+        -> std::shared_ptr<core::BandwidthChannel> {
+        if (rate == 0 && !parent) {
+            return nullptr;
+        }
+        return std::make_shared<core::BandwidthChannel>(
+            rate, core::BandwidthChannel::burstBytes(rate, _config.bandwidth.burst, BLOCK_LEN),
+            parent);
+    };
+    session->limitBandwidth(channel(_config.bandwidth.peerDownloadRate, _downloadChannel),
+                            channel(_config.bandwidth.peerUploadRate, _uploadChannel));
+    ++shard.sessions;
+    ++_halfOpen;
+
+    bool inbound = incoming.has_value();
+    core::HandshakeMsg remoteHandshake{};
+    if (incoming) {
+        session->adopt(std::move(incoming->stream), peer);
+        remoteHandshake = incoming->handshake;
+    }
+
+    asio::co_spawn(
+        session->getExecutor(),
+        [session, peer, &shard, this, inbound, remoteHandshake]() -> asio::awaitable<void> {
+            bool admitted = false;
+            try {
+                if (inbound) {
+                    if (session->getState() != PeerState::ERROR) {
+                        co_await session->answerHandshake(_infoHash, _peerId, remoteHandshake,
+                                                          _config.connection.handshakeTimeout);
+                    }
+                } else {
+                    co_await session->connect(peer, _config.connection.connectTimeout, shard.utp);
+                    if (session->getState() != PeerState::ERROR) {
+                        co_await session->doHandshake(_infoHash, _peerId,
+                                                      _config.connection.handshakeTimeout);
+                    }
+                }
+                if (session->getState() != PeerState::ERROR) {
+                    // Ask the control strand whether this connection is wanted
+                    admitted = co_await asio::co_spawn(
+                        _control,
+                        _admit(session, peer, std::string(session->getRemotePeerId()), inbound),
+                        asio::use_awaitable);
+                }
+                if (admitted) {
+                    co_await session->run();
+                }
+            } catch (const std::exception& e) {
+                spdlog::warn("Peer session error: {}", e.what());
+            }
+
+            --shard.sessions;
+            asio::post(_control, [this, peer, admitted, inbound,
+                                  remoteId = std::string(session->getRemotePeerId()),
+                                  rate = session->getDownloadRate()] {
+                _onSessionEnded(peer, admitted, inbound, remoteId, rate);
+            });
+        },
+        asio::detached);
+}
+
+asio::awaitable<bool> PeerManager::_admit(std::shared_ptr<PeerSession> session, core::Peer peer,
+                                          std::string remoteId, bool inbound) {
+    if (remoteId == _peerId) {
+        spdlog::debug("{}:{} is ourselves", peer.getIpStr(), peer.port);
+        if (!inbound) {
+            _pool.block(peer);
+        }
+        co_return false;
+    }
+    if (!_connectedIds.insert(remoteId).second) {
+        spdlog::debug("Already connected to the peer at {}:{}", peer.getIpStr(), peer.port);
+        if (!inbound) {
+            _pool.block(peer);
+        }
+        co_return false;
+    }
+
+    --_halfOpen;
+    ++_connected;
+    _sessions[peer] = session;
+    if (!inbound) {
+        _pool.onConnected(peer);
+        _reachable.insert(peer);
+    }
+    _wakeup.cancel(); // A half-open slot is free again
+    co_return true;
+}
+
+void PeerManager::_onSessionEnded(const core::Peer& peer, bool admitted, bool inbound,
+                                  std::string remoteId, double rate) {
+    auto now = core::PeerPool::Clock::now();
+    if (admitted) {
+        --_connected;
+        _sessions.erase(peer);
+        _connectedIds.erase(remoteId);
+        _reachable.erase(peer);
+        if (!inbound) {
+            _pool.onClosed(peer, rate, now);
+        }
+    } else {
+        --_halfOpen;
+        if (!inbound) {
+            _pool.onFailed(peer, now);
+        }
+    }
+    _wakeup.cancel();
+}
+
+asio::awaitable<void> PeerManager::_chokeLoop() {
+    while (true) {
+        _chokeTimer.expires_after(_config.upload.chokeInterval);
+        auto [ec] = co_await _chokeTimer.async_wait(asio::as_tuple(asio::use_awaitable));
+        if (ec) {
+            co_return;
+        }
+
+        // Sessions may end while we collect, so work on a snapshot
+        std::vector<std::shared_ptr<PeerSession>> sessions;
+        for (const auto& [peer, session] : _sessions) {
+            sessions.push_back(session);
+        }
+
+        std::vector<core::ChokeCandidate> candidates;
+        for (const auto& session : sessions) {
+            candidates.push_back(co_await asio::co_spawn(
+                session->getExecutor(),
+                [session]() -> asio::awaitable<core::ChokeCandidate> {
+                    co_return session->getChokeStats();
+                },
+                asio::use_awaitable));
+        }
+
+        auto unchoked = _choker.rechoke(candidates, _pieceManager->isComplete(),
+                                        std::chrono::steady_clock::now());
+        for (size_t i = 0; i < sessions.size(); ++i) {
+            bool choke = !unchoked.contains(candidates[i].peer);
+            asio::post(sessions[i]->getExecutor(),
+                       [session = sessions[i], choke] { session->setChoking(choke); });
+        }
+        spdlog::debug("Uploading to {} of {} peer(s)", unchoked.size(), sessions.size());
+    }
+}
+
+asio::awaitable<void> PeerManager::_pexLoop() {
+    while (true) {
+        // Sessions keep track of their own interval, a tick per interval is enough
+        _pexTimer.expires_after(_config.connection.pexInterval);
+        auto [ec] = co_await _pexTimer.async_wait(asio::as_tuple(asio::use_awaitable));
+        if (ec) {
+            co_return;
+        }
+        auto reachable = std::make_shared<const std::set<core::Peer>>(_reachable);
+        for (const auto& [peer, session] : _sessions) {
+            asio::post(session->getExecutor(),
+                       [session, reachable] { session->sendPex(*reachable); });
+        }
+    }
+}
+
+void PeerManager::_broadcastHave(uint32_t index) {
+    for (const auto& [peer, session] : _sessions) {
+        asio::post(session->getExecutor(), [session, index] { session->sendHave(index); });
+    }
+}
+
+std::vector<size_t> PeerManager::getShardLoads() const {
+    std::vector<size_t> loads;
+    for (const auto& shard : _shards) {
+        loads.push_back(shard->sessions.load(std::memory_order_relaxed));
+    }
+    return loads;
+}
+
+PeerManager::Shard& PeerManager::_pickShard() {
+    // Least loaded first; the counts are only a hint, so relaxed reads are fine
+    return **std::min_element(_shards.begin(), _shards.end(), [](const auto& a, const auto& b) {
+        return a->sessions.load(std::memory_order_relaxed) <
+               b->sessions.load(std::memory_order_relaxed);
+    });
+}
+
+std::vector<std::unique_ptr<PeerManager::Shard>> PeerManager::_makeShards(uint32_t threads) {
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    std::vector<std::unique_ptr<Shard>> shards;
+    for (uint32_t i = 0; i < threads; ++i) {
+        shards.push_back(std::make_unique<Shard>());
+    }
+    return shards;
+}
+
+std::shared_ptr<core::BandwidthChannel>
+PeerManager::_limit(uint64_t rate, std::shared_ptr<core::BandwidthChannel> parent,
+                    const BandwidthConfig& config) {
+    if (rate == 0) {
+        return parent;
+    }
+    return std::make_shared<core::BandwidthChannel>(
+        rate, core::BandwidthChannel::burstBytes(rate, config.burst, BLOCK_LEN), std::move(parent),
+        config.fairQueueing);
 }
 
 std::vector<core::Peer>
@@ -3,33 +3,42 @@
 #include "core/peer_communicator.hpp"
 #include "core/utils.hpp"
 
+#include <algorithm>
+#include <array>
 #include <asio/awaitable.hpp>
+#include <cerrno>
 #include <cstdint>
+#include <cstring>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <optional>
 #include <spdlog/spdlog.h>
 #include <stdexcept>
+#include <utility>
 
 namespace bt {
-constexpr int MAX_PIPELINE_SIZE = 32;
+constexpr size_t PIECE_HEADER_LEN = 8; // Index and offset in front of the block data
+// Length prefix, id and header of a PIECE message
+constexpr size_t PIECE_PREFIX_LEN = sizeof(uint32_t) + 1 + PIECE_HEADER_LEN;
+constexpr auto WATCHDOG_INTERVAL = std::chrono::seconds(1);
+// Uploads per writer round; buffered blocks are read into the send buffer until it holds this much
+constexpr size_t UPLOAD_BATCH = 4 * BLOCK_LEN;
+// Size of the allowed fast set we give peers, as suggested by BEP 6
+constexpr uint32_t ALLOWED_FAST_COUNT = 10;
+constexpr const char* CLIENT_NAME = "bit-torrent-client";
 
-PeerSession::PeerSession(asio::io_context& io_context, std::shared_ptr<PieceManager> pieceManager)
-    : _socket(io_context), _pieceManager(pieceManager), _state(PeerState::CONNECTING) {}
-
-asio::awaitable<uint32_t> PeerSession::_readMsgLen() {
-    uint32_t network_len = 0;
-    auto [ec, _] =
-        co_await asio::async_read(_socket, asio::buffer(&network_len, sizeof(network_len)),
-                                  asio::as_tuple(asio::use_awaitable));
-
-    if (ec) {
-        _setState(PeerState::ERROR);
-        co_await _returnBlocks();
-        throw std::runtime_error{ec.message()};
-    }
-
-    uint32_t len = ntohl(network_len);
-    co_return len;
+PeerSession::PeerSession(asio::io_context& io_context, std::shared_ptr<PieceManager> pieceManager,
+                         const PipelineConfig& pipelineConfig, const UploadConfig& uploadConfig,
+                         const ConnectionConfig& connectionConfig)
+    : _socket(asio::make_strand(io_context)), _deadline(_socket.get_executor()),
+      _watchdog(_socket.get_executor()), _sendSignal(_socket.get_executor()),
+      _pieceManager(pieceManager), _uploadConfig(uploadConfig), _zeroCopy(uploadConfig.zeroCopy),
+      _state(PeerState::CONNECTING),
+      _config(pipelineConfig),
+      _pipeline(pipelineConfig.minDepth, pipelineConfig.maxDepth, pipelineConfig.initialDepth,
+                BLOCK_LEN),
+      _connectionConfig(connectionConfig), _requestRetry(_socket.get_executor()) {
+    _sendSignal.expires_at(asio::steady_timer::time_point::max());
 }
 
 void PeerSession::_handleBitfield(std::span<uint8_t> payload) {
@@ -49,37 +58,508 @@ void PeerSession::_handleBitfield(std::span<uint8_t> payload) {
 }
 
 asio::awaitable<void> PeerSession::_returnBlocks() {
-    for (const auto& block : _pendingBlocks) {
+    for (const auto& [block, sentAt] : _pendingBlocks) {
         if (!_pieceManager->returnBlock(block)) {
             spdlog::debug("Failed to return block");
         }
     }
+    _pendingBlocks.clear();
     co_return;
 }
 
-asio::awaitable<void> PeerSession::_requestBlock() {
-    std::optional<Block> block = _pieceManager->requestBlock(_peerBitfield);
+void PeerSession::_requestBlock() {
+    // While choked, only pieces of the peer's allowed fast set may be requested
+    std::vector<uint8_t> allowed;
+    if (_peer_choking) {
+        allowed.resize(_peerBitfield.size(), 0);
+        for (uint32_t index : _allowedFast) {
+            if (index / 8 < allowed.size()) {
+                allowed[index / 8] |= _peerBitfield[index / 8] & (0x80 >> (index % 8));
+            }
+        }
+    }
+    std::optional<Block> block = _pieceManager->requestBlock(
+        _peer_choking ? allowed : _peerBitfield,
+        PeerContext{.peer = _peer, .downloadRate = getDownloadRate()});
     if (!block) {
-        co_return;
+        return;
+    }
+    if (_downloadChannel) {
+        auto wait = _downloadChannel->request(block->length);
+        if (wait > std::chrono::steady_clock::duration::zero()) {
+            // Over the limit: the block goes back, so other peers may take it meanwhile
+            _pieceManager->returnBlock(*block);
+            _retryRequestsAfter(wait);
+            return;
+        }
     }
-    utils::ByteWriter msg;
+    utils::HeaderWriter msg;
     msg.write_u32(13);
     msg.write_u8(static_cast<uint8_t>(core::msg::id::REQUEST));
     msg.write_u32(block->pieceIndex);
     msg.write_u32(block->offset);
     msg.write_u32(block->length);
+    _queueMessage(msg.data());
 
-    auto [ec1, len] = co_await _asyncWrite(msg.data());
-    if (ec1) {
-        co_await _returnBlocks();
-        co_return;
+    auto now = std::chrono::steady_clock::now();
+    if (_pendingBlocks.empty()) {
+        _lastDataAt = now; // The snub clock starts with the first outstanding request
     }
-
-    _pendingBlocks.insert(block.value());
+    _pendingBlocks.emplace(block.value(), now);
     spdlog::debug("Requesting block: pieceidx:{}, offset:{}, len{}", block->pieceIndex,
                   block->offset, block->length);
 }
 
+void PeerSession::_sendInterested() {
+    if (_am_interested) {
+        return;
+    }
+    utils::HeaderWriter msg;
+    msg.write_u32(1);
+    msg.write_u8(static_cast<uint8_t>(core::msg::id::INTERESTED));
+    _queueMessage(msg.data());
+    _am_interested = true;
+}
+
+void PeerSession::_sendBitfield() {
+    auto bitfield = _pieceManager->getBitfield();
+    bool none = std::all_of(bitfield.begin(), bitfield.end(), [](uint8_t b) { return b == 0; });
+    if (_fastExtension && (none || _pieceManager->isComplete())) {
+        // A single byte instead of the whole bitfield
+        utils::HeaderWriter msg;
+        msg.write_u32(1);
+        msg.write_u8(static_cast<uint8_t>(none ? core::msg::id::HAVE_NONE
+                                               : core::msg::id::HAVE_ALL));
+        _queueMessage(msg.data());
+        return;
+    }
+    if (none) {
+        return; // The bitfield is optional when we have nothing
+    }
+    utils::HeaderWriter msg;
+    msg.write_u32(static_cast<uint32_t>(1 + bitfield.size()));
+    msg.write_u8(static_cast<uint8_t>(core::msg::id::BITFIELD));
+    _queueMessage(msg.data());
+    _queueMessage(bitfield);
+}
+
+void PeerSession::_sendAllowedFast() {
+    if (!_fastExtension) {
+        return;
+    }
+    auto pieces = core::allowedFastSet(_pieceManager->getInfoHash(), _peer.ip,
+                                       _pieceManager->getTotalNumOfPieces(), ALLOWED_FAST_COUNT);
+    for (uint32_t index : pieces) {
+        if (!_pieceManager->hasPiece(index)) {
+            continue;
+        }
+        _allowedFastOut.insert(index);
+        utils::HeaderWriter msg;
+        msg.write_u32(5);
+        msg.write_u8(static_cast<uint8_t>(core::msg::id::ALLOWED_FAST));
+        msg.write_u32(index);
+        _queueMessage(msg.data());
+    }
+}
+
+void PeerSession::_sendReject(const Block& block) {
+    utils::HeaderWriter msg;
+    msg.write_u32(13);
+    msg.write_u8(static_cast<uint8_t>(core::msg::id::REJECT_REQUEST));
+    msg.write_u32(block.pieceIndex);
+    msg.write_u32(block.offset);
+    msg.write_u32(block.length);
+    _queueMessage(msg.data());
+}
+
+void PeerSession::_sendExtended(uint8_t extensionId, std::span<const uint8_t> payload) {
+    utils::HeaderWriter msg;
+    msg.write_u32(static_cast<uint32_t>(2 + payload.size()));
+    msg.write_u8(static_cast<uint8_t>(core::msg::id::EXTENDED));
+    msg.write_u8(extensionId);
+    _queueMessage(msg.data());
+    _queueMessage(payload);
+}
+
+void PeerSession::_sendExtensionHandshake() {
+    if (!_extensionProtocol) {
+        return;
+    }
+    core::ExtensionHandshake handshake{.client = CLIENT_NAME,
+                                       .maxRequests = _uploadConfig.maxPeerRequests};
+    if (_connectionConfig.peerExchange) {
+        handshake.extensions[core::ext::UT_PEX] = core::ext::UT_PEX_ID;
+    }
+    if (const auto& info = _pieceManager->getRawInfo(); !info.empty()) {
+        handshake.extensions[core::ext::UT_METADATA] = core::ext::UT_METADATA_ID;
+        handshake.metadataSize = info.size();
+    }
+    if (_connectionConfig.listenPort != 0) {
+        handshake.listenPort = _connectionConfig.listenPort;
+    }
+    _sendExtended(core::ext::HANDSHAKE_ID, core::encodeExtensionHandshake(handshake));
+}
+
+void PeerSession::_handleExtended(std::span<uint8_t> payload) {
+    if (!_extensionProtocol) {
+        spdlog::debug("Peer sent an extended message without supporting the protocol");
+        _setState(PeerState::ERROR);
+        return;
+    }
+    utils::ByteReader reader{payload};
+    uint8_t extensionId = reader.readU8();
+    auto body = reader.readRemaining();
+
+    if (extensionId == core::ext::HANDSHAKE_ID) {
+        // May be sent again later to update the ids, the latest one counts
+        auto handshake = core::parseExtensionHandshake(body);
+        std::erase_if(handshake.extensions, [](const auto& entry) { return entry.second == 0; });
+        _remoteExtensions = std::move(handshake.extensions);
+        if (handshake.maxRequests) {
+            _pipeline.setPeerLimit(*handshake.maxRequests);
+        }
+        if (_connectionConfig.peerExchange && _remoteExtensions.contains(core::ext::UT_PEX)) {
+            if (!_pexOut) {
+                _pexOut.emplace(_connectionConfig.pexInterval);
+            }
+        } else {
+            _pexOut.reset();
+        }
+        spdlog::debug("{}:{} runs '{}' with {} extension(s)", _peer.getIpStr(), _peer.port,
+                      handshake.client, _remoteExtensions.size());
+        return;
+    }
+
+    if (extensionId == core::ext::UT_PEX_ID && _connectionConfig.peerExchange) {
+        // Peers flooding us with ut_pex are ignored rather than trusted, BEP 11 asks for at
+        // most one message a minute
+        auto now = std::chrono::steady_clock::now();
+        if (_lastPexIn && now - *_lastPexIn < _connectionConfig.pexInterval / 2) {
+            spdlog::debug("Ignoring early ut_pex message from {}:{}", _peer.getIpStr(),
+                          _peer.port);
+            return;
+        }
+        _lastPexIn = now;
+        auto message = core::parsePex(body);
+        if (!message.added.empty() && _onPeersDiscovered) {
+            _onPeersDiscovered(std::move(message.added));
+        }
+        return;
+    }
+    if (extensionId == core::ext::UT_METADATA_ID) {
+        _serveMetadata(body);
+        return;
+    }
+    spdlog::debug("Received unknown extended message ID: {}", extensionId);
+}
+
+void PeerSession::_serveMetadata(std::span<const uint8_t> payload) {
+    using Type = core::MetadataMessage::Type;
+    auto [message, data] = core::parseMetadataMessage(payload);
+    auto id = _remoteExtensions.find(core::ext::UT_METADATA);
+    if (message.type != Type::REQUEST || id == _remoteExtensions.end()) {
+        return; // We only serve, our own metadata is complete
+    }
+
+    const auto& info = _pieceManager->getRawInfo();
+    if (info.empty() || message.piece >= core::metadataPieceCount(info.size())) {
+        _sendExtended(id->second,
+                      core::encodeMetadataMessage({.type = Type::REJECT, .piece = message.piece}));
+        return;
+    }
+    size_t offset = static_cast<size_t>(message.piece) * core::ext::METADATA_PIECE_LEN;
+    size_t length = std::min(core::ext::METADATA_PIECE_LEN, info.size() - offset);
+    auto piece = std::span(reinterpret_cast<const uint8_t*>(info.data()) + offset, length);
+    _sendExtended(id->second, core::encodeMetadataMessage({.type = Type::DATA,
+                                                           .piece = message.piece,
+                                                           .totalSize = info.size()},
+                                                          piece));
+}
+
+void PeerSession::setChoking(bool choke) {
+    bool running = _state == PeerState::BITFIELD_WAIT || _state == PeerState::READY;
+    if (!running || choke == _am_choking) {
+        return;
+    }
+    _am_choking = choke;
+    utils::HeaderWriter msg;
+    msg.write_u32(1);
+    msg.write_u8(static_cast<uint8_t>(choke ? core::msg::id::CHOKE : core::msg::id::UNCHOKE));
+    _queueMessage(msg.data());
+    if (!choke) {
+        return;
+    }
+    if (!_fastExtension) {
+        _peerRequests.clear(); // Choking discards what the peer asked for so far
+        return;
+    }
+    // Requests for allowed fast pieces are still served, the rest are rejected explicitly
+    std::erase_if(_peerRequests, [this](const Block& block) {
+        if (_allowedFastOut.contains(block.pieceIndex)) {
+            return false;
+        }
+        _sendReject(block);
+        return true;
+    });
+}
+
+void PeerSession::sendHave(uint32_t index) {
+    bool running = _state == PeerState::BITFIELD_WAIT || _state == PeerState::READY;
+    if (!running || !_socket.is_open()) {
+        return;
+    }
+    if (index / 8 < _peerBitfield.size() && (_peerBitfield[index / 8] & (0x80 >> (index % 8)))) {
+        return; // Nothing new for the peer
+    }
+    utils::HeaderWriter msg;
+    msg.write_u32(5);
+    msg.write_u8(static_cast<uint8_t>(core::msg::id::HAVE));
+    msg.write_u32(index);
+    _queueMessage(msg.data());
+}
+
+void PeerSession::sendPex(const std::set<core::Peer>& connected) {
+    bool running = _state == PeerState::BITFIELD_WAIT || _state == PeerState::READY;
+    auto id = _remoteExtensions.find(core::ext::UT_PEX);
+    if (!running || !_pexOut || id == _remoteExtensions.end() || !_socket.is_open()) {
+        return;
+    }
+    auto others = connected;
+    others.erase(_peer); // The peer knows it's connected to us
+    if (auto message = _pexOut->update(others, std::chrono::steady_clock::now())) {
+        spdlog::debug("Telling {}:{} about {} new and {} dropped peer(s)", _peer.getIpStr(),
+                      _peer.port, message->added.size(), message->dropped.size());
+        _sendExtended(id->second, core::encodePex(*message));
+    }
+}
+
+core::ChokeCandidate PeerSession::getChokeStats() const {
+    return {.peer = _peer,
+            .interested = _peer_interested,
+            .downloaded = _bytesDownloaded,
+            .uploaded = _bytesUploaded};
+}
+
+void PeerSession::_serveRequests() {
+    while (!_peerRequests.empty() && _sendBuffer.size() < UPLOAD_BATCH &&
+           _uploadAllowed(_peerRequests.front())) {
+        Block block = _peerRequests.front();
+        _peerRequests.pop_front();
+
+        utils::HeaderWriter header;
+        header.write_u32(9 + block.length);
+        header.write_u8(static_cast<uint8_t>(core::msg::id::PIECE));
+        header.write_u32(block.pieceIndex);
+        header.write_u32(block.offset);
+
+        // The block is read straight behind its header in the send buffer
+        size_t start = _sendBuffer.size();
+        _sendBuffer.insert(_sendBuffer.end(), header.data().begin(), header.data().end());
+        _sendBuffer.resize(_sendBuffer.size() + block.length);
+        auto out = std::span<uint8_t>(_sendBuffer).subspan(start + header.data().size());
+
+        bool served = false;
+        try {
+            served = _pieceManager->readBlock(block, out);
+        } catch (const std::exception& e) {
+            spdlog::warn("Reading block for upload failed: {}", e.what());
+        }
+        if (!served) {
+            spdlog::debug("Not serving piece {} offset {} to {}:{}", block.pieceIndex,
+                          block.offset, _peer.getIpStr(), _peer.port);
+            _sendBuffer.resize(start);
+            continue;
+        }
+        _unsentUpload += block.length;
+    }
+}
+
+asio::awaitable<bool> PeerSession::_uploadZeroCopy(std::vector<uint8_t>& writing) {
+    // Corked, the small headers leave in the same segments as the file data behind them
+    _setCork(true);
+    bool ok = true;
+    size_t batch = 0;
+    while (ok && _zeroCopy && !_peerRequests.empty() && batch < UPLOAD_BATCH &&
+           _uploadAllowed(_peerRequests.front())) {
+        Block block = _peerRequests.front();
+        _peerRequests.pop_front();
+
+        auto offset = _pieceManager->beginUpload(block);
+        if (!offset) {
+            spdlog::debug("Not serving piece {} offset {} to {}:{}", block.pieceIndex,
+                          block.offset, _peer.getIpStr(), _peer.port);
+            continue;
+        }
+        utils::HeaderWriter header;
+        header.write_u32(9 + block.length);
+        header.write_u8(static_cast<uint8_t>(core::msg::id::PIECE));
+        header.write_u32(block.pieceIndex);
+        header.write_u32(block.offset);
+        _sendBuffer.insert(_sendBuffer.end(), header.data().begin(), header.data().end());
+
+        // Queued messages and the header go out first, then the data from the file
+        ok = co_await _flush(writing);
+        if (ok) {
+            ok = co_await _sendFileRange(*offset, block.length);
+        }
+        if (ok) {
+            _bytesUploaded += block.length;
+            _pieceManager->addUploaded(block.length);
+            batch += block.length;
+        }
+    }
+    _setCork(false);
+    co_return ok;
+}
+
+asio::awaitable<bool> PeerSession::_sendFileRange(uint64_t offset, size_t length) {
+    size_t sent = 0;
+    while (sent < length) {
+        ssize_t n = _pieceManager->sendData(_socket.tcp().native_handle(), offset + sent, length - sent);
+        int err = errno;
+        if (n > 0) {
+            sent += n;
+            continue;
+        }
+        if (n < 0 && err == EINTR) {
+            continue;
+        }
+        if (n < 0 && (err == EAGAIN || err == EWOULDBLOCK)) {
+            auto [ec] = co_await _socket.tcp().async_wait(asio::ip::tcp::socket::wait_write,
+                                                          asio::as_tuple(asio::use_awaitable));
+            if (!ec) {
+                continue;
+            }
+            spdlog::debug("Sending to peer failed: {}", ec.message());
+        } else if (n < 0 && (err == EINVAL || err == ENOSYS || err == EOPNOTSUPP)) {
+            // The header is already out, so the rest of this block follows through a buffer
+            spdlog::debug("sendfile not usable ({}), uploading through buffers",
+                          std::strerror(err));
+            _zeroCopy = false;
+            std::vector<uint8_t> rest(length - sent);
+            try {
+                _pieceManager->readData(offset + sent, rest);
+                auto [ec, len] = co_await _asyncWrite(rest);
+                if (!ec) {
+                    co_return true;
+                }
+                spdlog::debug("Sending to peer failed: {}", ec.message());
+            } catch (const std::exception& e) {
+                spdlog::warn("Reading block for upload failed: {}", e.what());
+            }
+        } else {
+            spdlog::debug("Uploading to {}:{} failed: {}", _peer.getIpStr(), _peer.port,
+                          n == 0 ? "file is too short" : std::strerror(err));
+        }
+        // The peer got a header without all of its data, the connection can't be used anymore
+        _setState(PeerState::ERROR);
+        _socket.close();
+        co_return false;
+    }
+    co_return true;
+}
+
+void PeerSession::_setCork(bool cork) {
+#ifdef TCP_CORK
+    if (_socket.isUtp()) {
+        return;
+    }
+    int value = cork ? 1 : 0;
+    ::setsockopt(_socket.tcp().native_handle(), IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
+#endif
+}
+
+void PeerSession::_fillPipeline() {
+    if (_peer_choking && _allowedFast.empty()) {
+        return;
+    }
+    // A snubbed peer gets a single request until it sends data again
+    size_t depth = _snubbed ? 1 : _pipeline.depth();
+    while (_pendingBlocks.size() < depth) {
+        size_t outstanding = _pendingBlocks.size();
+        _requestBlock();
+        if (_pendingBlocks.size() == outstanding) {
+            break; // Nothing left to ask this peer for
+        }
+    }
+}
+
+void PeerSession::_retryRequestsAfter(std::chrono::steady_clock::duration wait) {
+    if (_requestRetryArmed) {
+        return;
+    }
+    _requestRetryArmed = true;
+    _requestRetry.expires_after(wait);
+    _requestRetry.async_wait([self = shared_from_this()](const asio::error_code& ec) {
+        self->_requestRetryArmed = false;
+        if (!ec && self->_socket.is_open() && self->_state != PeerState::ERROR) {
+            self->_fillPipeline();
+        }
+    });
+}
+
+bool PeerSession::_uploadAllowed(const Block& block) {
+    if (!_uploadChannel) {
+        return true;
+    }
+    auto now = std::chrono::steady_clock::now();
+    auto wait = _uploadChannel->request(block.length, now);
+    if (wait > std::chrono::steady_clock::duration::zero()) {
+        _uploadResume = now + wait;
+        return false;
+    }
+    return true;
+}
+
+bool PeerSession::_uploadThrottled() const {
+    return _uploadResume && std::chrono::steady_clock::now() < *_uploadResume;
+}
+
+void PeerSession::_queueMessage(std::span<const uint8_t> msg) {
+    _sendBuffer.insert(_sendBuffer.end(), msg.begin(), msg.end());
+    _sendSignal.cancel(); // Wake the writer
+}
+
+asio::awaitable<void> PeerSession::_writeLoop() {
+    std::vector<uint8_t> writing;
+    while (_socket.is_open() && _state != PeerState::ERROR) {
+        bool throttled = _uploadThrottled();
+        if (_zeroCopy && !_peerRequests.empty() && !throttled) {
+            co_await _uploadZeroCopy(writing);
+            continue;
+        }
+        if (!throttled) {
+            _serveRequests();
+        }
+        if (_sendBuffer.empty()) {
+            // Over the upload limit the writer also wakes up when it may send again
+            bool waiting = !_peerRequests.empty() && _uploadThrottled();
+            _sendSignal.expires_at(waiting ? *_uploadResume
+                                           : asio::steady_timer::time_point::max());
+            co_await _sendSignal.async_wait(asio::as_tuple(asio::use_awaitable));
+            continue;
+        }
+        co_await _flush(writing);
+    }
+}
+
+asio::awaitable<bool> PeerSession::_flush(std::vector<uint8_t>& writing) {
+    // Everything queued so far goes out in one write, the reader keeps queueing meanwhile
+    std::swap(writing, _sendBuffer);
+    uint64_t blockData = std::exchange(_unsentUpload, 0);
+    auto [ec, len] = co_await _asyncWrite(writing);
+    writing.clear(); // Keeps the capacity for the next batch
+    if (ec) {
+        spdlog::debug("Sending to peer failed: {}", ec.message());
+        _setState(PeerState::ERROR);
+        _socket.close(); // The reader hands back the blocks
+        co_return false;
+    }
+    _bytesUploaded += blockData;
+    _pieceManager->addUploaded(blockData);
+    co_return true;
+}
+
 asio::awaitable<void> PeerSession::_handleMessage(core::msg::id msg_id,
                                                   std::span<uint8_t> payload) {
     using namespace core::msg;
@@ -87,27 +567,131 @@ asio::awaitable<void> PeerSession::_handleMessage(core::msg::id msg_id,
     case id::CHOKE:
         spdlog::debug("Peer choked us");
         _peer_choking = true;
+        if (!_fastExtension) {
+            // A choking peer drops our requests, let other peers pick the blocks up. With the
+            // Fast Extension, it rejects the ones it won't serve.
+            co_await _returnBlocks();
+        }
         break;
     case id::UNCHOKE: {
         spdlog::debug("Peer unchoked us! We can request now.");
         _peer_choking = false;
-        int needed = MAX_PIPELINE_SIZE - _pendingBlocks.size();
-        for (int i = 0; i < needed; ++i) {
-            co_await _requestBlock();
-        }
+        _fillPipeline();
     }; break;
-    case id::HAVE:
-        // Parse payload (4 bytes index) and update bitfield
+    case id::INTERESTED:
+        _peer_interested = true;
+        break;
+    case id::NOT_INTERESTED:
+        _peer_interested = false;
+        break;
+    case id::REQUEST: {
+        utils::ByteReader reader{payload};
+        Block block{.pieceIndex = reader.readU32(),
+                    .offset = reader.readU32(),
+                    .length = reader.readU32()};
+        if (block.length == 0 || block.length > BLOCK_LEN) {
+            spdlog::debug("Peer requested a block of {} bytes", block.length);
+            _setState(PeerState::ERROR);
+            break;
+        }
+        bool allowed = !_am_choking || _allowedFastOut.contains(block.pieceIndex);
+        bool full = _peerRequests.size() >= _uploadConfig.maxPeerRequests;
+        if (full) {
+            spdlog::debug("Request queue of {}:{} is full", _peer.getIpStr(), _peer.port);
+        }
+        if (!allowed || full) {
+            // Without the Fast Extension the peer learns from the CHOKE, or the request times out
+            if (_fastExtension) {
+                _sendReject(block);
+            }
+            break;
+        }
+        _peerRequests.push_back(block);
+        _sendSignal.cancel(); // Wake the writer
+    } break;
+    case id::CANCEL: {
+        utils::ByteReader reader{payload};
+        Block block{.pieceIndex = reader.readU32(),
+                    .offset = reader.readU32(),
+                    .length = reader.readU32()};
+        std::erase_if(_peerRequests, [&](const Block& queued) {
+            return queued.pieceIndex == block.pieceIndex && queued.offset == block.offset &&
+                   queued.length == block.length;
+        });
+    } break;
+    case id::HAVE: {
+        utils::ByteReader reader{payload};
+        uint32_t index = reader.readU32();
+        if (index >= static_cast<uint32_t>(_pieceManager->getTotalNumOfPieces())) {
+            spdlog::debug("Peer announced unknown piece {}", index);
+            _setState(PeerState::ERROR);
+            break;
+        }
+        // Peers that have nothing may skip the bitfield
+        _peerBitfield.resize((_pieceManager->getTotalNumOfPieces() + 7) / 8, 0);
+        _peerBitfield[index / 8] |= 0x80 >> (index % 8);
+
+        _sendInterested();
+        _fillPipeline();
+    } break;
+    case id::HAVE_ALL:
+    case id::HAVE_NONE: {
+        if (!_fastExtension) {
+            spdlog::debug("Peer sent a Fast Extension message without supporting it");
+            _setState(PeerState::ERROR);
+            break;
+        }
+        int pieces = _pieceManager->getTotalNumOfPieces();
+        _peerBitfield.assign((pieces + 7) / 8, 0);
+        if (msg_id == id::HAVE_ALL) {
+            for (int index = 0; index < pieces; ++index) {
+                _peerBitfield[index / 8] |= 0x80 >> (index % 8);
+            }
+            _sendInterested();
+        }
+        _setState(PeerState::READY);
+    } break;
+    case id::REJECT_REQUEST: {
+        if (!_fastExtension) {
+            spdlog::debug("Peer sent a Fast Extension message without supporting it");
+            _setState(PeerState::ERROR);
+            break;
+        }
+        utils::ByteReader reader{payload};
+        Block block{.pieceIndex = reader.readU32(),
+                    .offset = reader.readU32(),
+                    .length = reader.readU32()};
+        // Back to the picker right away instead of after the request timeout, and the freed
+        // slot is refilled like after a PIECE
+        if (_pendingBlocks.erase(block) > 0) {
+            _pieceManager->returnBlock(block);
+            _fillPipeline();
+        }
+    } break;
+    case id::ALLOWED_FAST: {
+        if (!_fastExtension) {
+            spdlog::debug("Peer sent a Fast Extension message without supporting it");
+            _setState(PeerState::ERROR);
+            break;
+        }
+        utils::ByteReader reader{payload};
+        uint32_t index = reader.readU32();
+        if (index < static_cast<uint32_t>(_pieceManager->getTotalNumOfPieces())) {
+            _allowedFast.insert(index);
+            _fillPipeline();
+        }
+    } break;
+    case id::SUGGEST_PIECE:
+        break; // Only a hint, the picker knows better what we need
+    case id::EXTENDED:
+        _handleExtended(payload);
         break;
     case id::BITFIELD: {
         spdlog::debug("Received Bitfield of size {}", payload.size());
         _handleBitfield(payload);
 
         // TODO: Only send when really interested, for now we just wantn everything
-        utils::ByteWriter msg;
-        msg.write_u32(1);
-        msg.write_u8(static_cast<uint8_t>(id::INTERESTED));
-        auto [ec1, len] = co_await _asyncWrite(msg.data());
+        _sendInterested();
 
         _setState(PeerState::READY);
         break;
@@ -117,20 +701,12 @@ asio::awaitable<void> PeerSession::_handleMessage(core::msg::id msg_id,
         uint32_t index = reader.readU32();
         uint32_t offset = reader.readU32();
         spdlog::debug("Block incoming: len:{}, idx:{}, offset:{}", payload.size(), index, offset);
+        _bytesDownloaded += payload.size() - 8;
 
-        if (!_pieceManager->deliverBlock(index, offset, reader.readRemaining())) {
-            co_return;
-        }
-
-        _pendingBlocks.erase(Block{.pieceIndex = index,
-                                   .offset = offset,
-                                   .length = static_cast<uint32_t>(payload.size() - 8)});
-
-        // Pipline request a new block
-        int needed = MAX_PIPELINE_SIZE - _pendingBlocks.size();
-        for (int i = 0; i < needed; ++i) {
-            co_await _requestBlock();
-        }
+        _pieceManager->deliverBlock(index, offset, reader.readRemaining(), _peer);
+        co_await _onBlockDone(Block{.pieceIndex = index,
+                                    .offset = offset,
+                                    .length = static_cast<uint32_t>(payload.size() - 8)});
     } break;
     default:
         spdlog::debug("Received unknown or unhandled message ID: {}", static_cast<uint8_t>(msg_id));
@@ -138,49 +714,262 @@ asio::awaitable<void> PeerSession::_handleMessage(core::msg::id msg_id,
     }
 }
 
+asio::awaitable<void> PeerSession::_receiveBlock(const core::PartialFrame& partial) {
+    utils::ByteReader reader{partial.header};
+    Block block{.pieceIndex = reader.readU32(), .offset = reader.readU32()};
+    block.length = static_cast<uint32_t>(partial.body.size() + partial.missing);
+    spdlog::debug("Block incoming: len:{}, idx:{}, offset:{}", block.length, block.pieceIndex,
+                  block.offset);
+
+    // Read the rest of the payload into its piece buffer. Blocks the piece manager doesn't
+    // want there (duplicates, garbage) go through the scratch buffer and deliverBlock.
+    auto lease = _pieceManager->beginBlock(block, partial.body);
+    std::span<uint8_t> rest;
+    if (lease) {
+        rest = lease->rest;
+    } else {
+        _scratch.resize(block.length);
+        std::copy(partial.body.begin(), partial.body.end(), _scratch.begin());
+        rest = std::span<uint8_t>(_scratch).subspan(partial.body.size());
+    }
+
+    // Whatever follows the block lands in the receive buffer with the same read, so the next
+    // PIECE header doesn't cost a read of its own. The buffered payload was copied out above,
+    // prepare() may reuse its space.
+    auto spare = _decoder.prepare();
+    size_t spilled = 0;
+    asio::error_code ec;
+    while (!rest.empty()) {
+        std::array<asio::mutable_buffer, 2> buffers{asio::buffer(rest), asio::buffer(spare)};
+        auto [readEc, len] = co_await _socket.async_read_some(
+            buffers, asio::as_tuple(asio::use_awaitable));
+        if (readEc) {
+            ec = readEc;
+            break;
+        }
+        size_t intoBlock = std::min(len, rest.size());
+        rest = rest.subspan(intoBlock);
+        spilled = len - intoBlock;
+    }
+    if (ec) {
+        if (lease) {
+            _pieceManager->abortBlock(*lease);
+        }
+        spdlog::error("Connection lost: {}", ec.message());
+        _state = PeerState::ERROR;
+        co_await _returnBlocks();
+        co_return;
+    }
+    _decoder.commit(spilled);
+    _bytesDownloaded += block.length;
+    // More than the next header already waiting means the peer sends faster than we read
+    _batchReads = spilled > PIECE_PREFIX_LEN;
+
+    if (lease) {
+        _pieceManager->finishBlock(*lease, _peer);
+    } else {
+        _pieceManager->deliverBlock(block.pieceIndex, block.offset, _scratch, _peer);
+    }
+    co_await _onBlockDone(block);
+}
+
+asio::awaitable<void> PeerSession::_onBlockDone(const Block& block) {
+    _lastDataAt = std::chrono::steady_clock::now();
+    if (_snubbed) {
+        spdlog::debug("Peer {}:{} is sending again", _peer.getIpStr(), _peer.port);
+        _snubbed = false;
+    }
+    if (auto it = _pendingBlocks.find(block); it != _pendingBlocks.end()) {
+        auto now = std::chrono::steady_clock::now();
+        _pipeline.onBlockReceived(block.length, now - it->second, now);
+        _pendingBlocks.erase(it);
+    }
+
+    // Checked on every block: a peer can be banned over a block it sent earlier, once another
+    // peer's clean copy of that piece shows what it corrupted
+    if (co_await _dropIfBanned()) {
+        co_return;
+    }
+
+    // Pipline request a new block
+    _fillPipeline();
+}
+
+asio::awaitable<bool> PeerSession::_dropIfBanned() {
+    if (!_pieceManager->isBanned(_peer.ip)) {
+        co_return false;
+    }
+    spdlog::warn("Disconnecting banned peer {}:{}", _peer.getIpStr(), _peer.port);
+    _setState(PeerState::ERROR);
+    co_await _returnBlocks();
+    _socket.close();
+    co_return true;
+}
+
 asio::awaitable<void> PeerSession::run() {
     _setState(PeerState::BITFIELD_WAIT);
+    _sendBitfield(); // Has to be the first message after the handshake
+    _sendAllowedFast();
+    _sendExtensionHandshake();
+    _zeroCopy = _zeroCopy && !_socket.isUtp();
+    if (_zeroCopy) {
+        // sendfile on a blocking socket would stall the whole io thread
+        asio::error_code ec;
+        _socket.tcp().native_non_blocking(true, ec);
+        _zeroCopy = !ec;
+    }
+
+    // Reader, writer and watchdog share the session's strand, so they never run at the same time
+    asio::co_spawn(
+        _socket.get_executor(), [self = shared_from_this()] { return self->_writeLoop(); },
+        asio::detached);
+    asio::co_spawn(
+        _socket.get_executor(), [self = shared_from_this()] { return self->_watchdogLoop(); },
+        asio::detached);
+    co_await _readLoop();
+    co_await _returnBlocks();
+
+    if (_state != PeerState::ERROR) {
+        _setState(PeerState::DISCONNECTED);
+    }
+    _socket.close();
+    _sendSignal.cancel();
+    _watchdog.cancel();
+    _requestRetry.cancel();
+}
+
+asio::awaitable<void> PeerSession::_watchdogLoop() {
     while (_socket.is_open() && _state != PeerState::ERROR) {
-        uint32_t len = 0;
+        _watchdog.expires_after(WATCHDOG_INTERVAL);
+        co_await _watchdog.async_wait(asio::as_tuple(asio::use_awaitable));
+        if (!_socket.is_open()) {
+            break;
+        }
+        // Banned peers that send nothing more still have to go
+        if (co_await _dropIfBanned()) {
+            break;
+        }
 
-        try {
-            len = co_await _readMsgLen();
-        } catch (std::runtime_error& e) {
-            spdlog::error("Connection lost reading length: {}", e.what());
-            co_return;
+        auto now = std::chrono::steady_clock::now();
+        if (!_pendingBlocks.empty() && !_snubbed && now - _lastDataAt > _config.snubTimeout) {
+            spdlog::debug("Peer {}:{} snubbed us, returning {} block(s)", _peer.getIpStr(),
+                          _peer.port, _pendingBlocks.size());
+            _snubbed = true;
+            co_await _returnBlocks();
+            // Refill on the next tick, the other sessions get the first go at the blocks
+            continue;
+        }
+
+        // Hand blocks the peer sits on back to the picker, so faster peers can fetch them
+        size_t expired = std::erase_if(_pendingBlocks, [&](const auto& entry) {
+            if (now - entry.second < _config.requestTimeout) {
+                return false;
+            }
+            _pieceManager->returnBlock(entry.first);
+            return true;
+        });
+        if (expired > 0) {
+            spdlog::debug("{} request(s) to {}:{} timed out", expired, _peer.getIpStr(),
+                          _peer.port);
+            _snubbed = true;
+            continue;
         }
 
-        if (len == 0) {
-            spdlog::debug("Received Keep-Alive");
-            continue; // Go back to start of loop
+        // Idle sessions only learn about blocks other peers gave back here
+        _fillPipeline();
+    }
+}
+
+asio::awaitable<void> PeerSession::_readLoop() {
+    while (_socket.is_open() && _state != PeerState::ERROR) {
+        // Take whatever the socket has, then handle every complete message in it
+        auto space = _decoder.prepare();
+        bool headerOnly = !_batchReads && !_decoder.assembling() && _decoder.buffered() == 0 &&
+                          !_pendingBlocks.empty();
+        if (headerOnly) {
+            // Blocks are due and trickle in, stop after the next PIECE header so its payload
+            // can be read into the piece buffer instead of being copied out of the receive
+            // buffer. While they trickle, the payload takes reads of its own anyway.
+            space = space.first(std::min(space.size(), PIECE_PREFIX_LEN));
         }
-        std::vector<uint8_t> message_buffer(len);
-        auto [ec2, bytes_read] = co_await asio::async_read(_socket, asio::buffer(message_buffer),
-                                                           asio::as_tuple(asio::use_awaitable));
+        auto [ec, bytes_read] = co_await _socket.async_read_some(
+            asio::buffer(space), asio::as_tuple(asio::use_awaitable));
 
-        if (ec2) {
-            spdlog::error("Connection lost reading payload: {}", ec2.message());
+        if (ec) {
+            spdlog::error("Connection lost: {}", ec.message());
             _state = PeerState::ERROR;
             co_await _returnBlocks();
             co_return;
         }
-
-        core::msg::id msg_id = static_cast<core::msg::id>(message_buffer[0]);
-        std::span<uint8_t> payload = {};
-        if (len > 1) {
-            payload = std::span<uint8_t>(message_buffer.data() + 1, len - 1);
+        _decoder.commit(bytes_read);
+        if (!headerOnly && !_decoder.assembling()) {
+            // Less than a block per read: back to reading blocks into their piece buffers
+            _batchReads = bytes_read >= PIECE_PREFIX_LEN + BLOCK_LEN;
         }
 
-        co_await _handleMessage(msg_id, payload);
+        // A block that is still arriving is read straight into the piece buffer, along with
+        // what follows it, which is decoded before the socket is read again
+        bool more = true;
+        while (more && _state != PeerState::ERROR && _socket.is_open()) {
+            bool malformed = false;
+            try {
+                while (auto frame = _decoder.next()) {
+                    co_await _handleMessage(frame->id, frame->payload);
+                    if (_state == PeerState::ERROR || !_socket.is_open()) {
+                        break;
+                    }
+                }
+            } catch (const std::exception& e) {
+                spdlog::debug("Dropping peer after malformed message: {}", e.what());
+                malformed = true;
+            }
+
+            if (malformed) {
+                _state = PeerState::ERROR;
+                co_await _returnBlocks();
+                co_return;
+            }
+
+            more = false;
+            if (_state != PeerState::ERROR && _socket.is_open()) {
+                if (auto partial = _decoder.takePartial(core::msg::id::PIECE, PIECE_HEADER_LEN)) {
+                    co_await _receiveBlock(*partial);
+                    more = true;
+                }
+            }
+        }
     }
-};
+}
 
-asio::awaitable<void> PeerSession::connect(const core::Peer& peer) {
+asio::awaitable<void> PeerSession::connect(const core::Peer& peer,
+                                           std::chrono::milliseconds timeout,
+                                           std::shared_ptr<core::UtpContext> utp) {
     _setState(PeerState::CONNECTING);
-    asio::ip::tcp::endpoint endpoint(asio::ip::address::from_string(peer.getIpStr()), peer.port);
+    _peer = peer;
+    auto address = asio::ip::address::from_string(peer.getIpStr());
     spdlog::debug("Connecting to peer at {}:{}", peer.getIpStr(), peer.port);
 
-    auto [ec] = co_await _socket.async_connect(endpoint, asio::as_tuple(asio::use_awaitable));
+    if (utp) {
+        auto socket = utp->createSocket();
+        _socket.useUtp(socket);
+        _armDeadline(timeout / 2);
+        auto [ec] = co_await socket->async_connect({address, peer.port},
+                                                   asio::as_tuple(asio::use_awaitable));
+        _disarmDeadline();
+        if (!ec && socket->is_open()) {
+            _connectedAt = std::chrono::steady_clock::now();
+            spdlog::debug("Connected to peer at {}:{} over uTP", peer.getIpStr(), peer.port);
+            co_return;
+        }
+        spdlog::debug("No uTP from {}:{}, trying TCP", peer.getIpStr(), peer.port);
+        _socket.useTcp();
+        timeout -= timeout / 2;
+    }
+
+    asio::ip::tcp::endpoint endpoint(address, peer.port);
+    _armDeadline(timeout);
+    auto [ec] = co_await _socket.tcp().async_connect(endpoint, asio::as_tuple(asio::use_awaitable));
+    _disarmDeadline();
 
     if (ec) {
         spdlog::debug("Failed to connect to peer at {}:{} - {}", peer.getIpStr(), peer.port,
@@ -188,23 +977,28 @@ asio::awaitable<void> PeerSession::connect(const core::Peer& peer) {
         _state = PeerState::ERROR;
         co_return;
     }
+    _connectedAt = std::chrono::steady_clock::now();
     spdlog::debug("Successfully connected to peer at {}:{}", peer.getIpStr(), peer.port);
 }
 
 asio::awaitable<void> PeerSession::doHandshake(const core::Sha1Hash& infoHash,
-                                               std::string_view peerId) {
+                                               std::string_view peerId,
+                                               std::chrono::milliseconds timeout) {
     _setState(PeerState::HANDSHAKING);
+    _armDeadline(timeout);
     spdlog::debug("Performing handshake...");
     core::HandshakeMsg handshake = core::serializeHandshake(infoHash, peerId);
 
     spdlog::debug("Sending buffer to peer.");
     auto [ec1, len] = co_await _asyncWrite(handshake);
     if (ec1) {
+        _disarmDeadline();
         spdlog::error("Sending handshake failed: {}", ec1.message());
         _state = PeerState::ERROR;
         co_return;
     }
     if (len != handshake.size()) {
+        _disarmDeadline();
         spdlog::error("Failed to send whole handshake buffer to peer");
         _state = PeerState::ERROR;
         co_return;
@@ -215,6 +1009,7 @@ asio::awaitable<void> PeerSession::doHandshake(const core::Sha1Hash& infoHash,
 
     auto [ec2, bytes_transferred] = co_await asio::async_read(
         _socket, asio::buffer(handshakeResponse), asio::as_tuple(asio::use_awaitable));
+    _disarmDeadline();
 
     spdlog::debug("Read {} bytes from peer", bytes_transferred);
     if (ec2) {
@@ -230,12 +1025,90 @@ asio::awaitable<void> PeerSession::doHandshake(const core::Sha1Hash& infoHash,
         co_return;
     }
 
-    spdlog::info("Handshake successfully completed with {}:{}.",
-                 _socket.remote_endpoint().address().to_string(), _socket.remote_endpoint().port());
+    _remotePeerId.assign(handshakeResponse.begin() + 48, handshakeResponse.end());
+    _fastExtension = core::supportsFastExtension(handshakeResponse);
+    _extensionProtocol = core::supportsExtensionProtocol(handshakeResponse);
+    spdlog::info("Handshake successfully completed with {}:{}{}.", _peer.getIpStr(), _peer.port,
+                 _socket.isUtp() ? " (uTP)" : "");
+}
+
+void PeerSession::adopt(core::PeerStream stream, const core::Peer& peer) {
+    _peer = peer;
+    if (stream.isUtp()) {
+        // uTP connections stay on the context that accepted them, completions come back here
+        _socket.useUtp(stream.releaseUtp());
+        _connectedAt = std::chrono::steady_clock::now();
+        return;
+    }
+    auto& socket = stream.tcp();
+    asio::error_code ec;
+    auto protocol = socket.local_endpoint(ec).protocol();
+    if (!ec) {
+        // Move the descriptor over, so the connection runs on this session's strand
+        auto handle = socket.release(ec);
+        if (!ec) {
+            _socket.tcp().assign(protocol, handle, ec);
+        }
+    }
+    if (ec) {
+        spdlog::debug("Taking over the connection of {}:{} failed: {}", peer.getIpStr(),
+                      peer.port, ec.message());
+        _state = PeerState::ERROR;
+        return;
+    }
+    _connectedAt = std::chrono::steady_clock::now();
+}
+
+asio::awaitable<void> PeerSession::answerHandshake(const core::Sha1Hash& infoHash,
+                                                   std::string_view peerId,
+                                                   const core::HandshakeMsg& remoteHandshake,
+                                                   std::chrono::milliseconds timeout) {
+    _setState(PeerState::HANDSHAKING);
+    _remotePeerId.assign(remoteHandshake.begin() + 48, remoteHandshake.end());
+    _fastExtension = core::supportsFastExtension(remoteHandshake);
+    _extensionProtocol = core::supportsExtensionProtocol(remoteHandshake);
+    core::HandshakeMsg handshake = core::serializeHandshake(infoHash, peerId);
+
+    _armDeadline(timeout);
+    auto [ec, len] = co_await _asyncWrite(handshake);
+    _disarmDeadline();
+    if (ec) {
+        spdlog::debug("Answering the handshake of {}:{} failed: {}", _peer.getIpStr(), _peer.port,
+                      ec.message());
+        _state = PeerState::ERROR;
+        co_return;
+    }
+    spdlog::info("Accepted incoming peer {}:{}.", _peer.getIpStr(), _peer.port);
+}
+
+double PeerSession::getDownloadRate() const {
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - _connectedAt;
+    if (elapsed.count() <= 0.0) {
+        return 0.0;
+    }
+    return _bytesDownloaded / elapsed.count();
+}
+
+void PeerSession::_armDeadline(std::chrono::milliseconds timeout) {
+    _deadlineArmed = true;
+    _deadline.expires_after(timeout);
+    _deadline.async_wait([self = shared_from_this()](const asio::error_code& ec) {
+        // The flag catches a timeout that fired right before it was disarmed
+        if (!ec && self->_deadlineArmed) {
+            spdlog::debug("Peer {}:{} timed out", self->_peer.getIpStr(), self->_peer.port);
+            self->_socket.close();
+        }
+    });
+}
+
+void PeerSession::_disarmDeadline() {
+    _deadlineArmed = false;
+    _deadline.cancel();
 }
 
 asio::awaitable<std::tuple<std::error_code, unsigned long>, asio::any_io_executor>
 PeerSession::_asyncWrite(const std::span<const uint8_t> data) {
+    ++_writes;
     return asio::async_write(_socket, asio::buffer(data), asio::as_tuple(asio::use_awaitable));
 }
 } // namespace bt
\ No newline at end of file
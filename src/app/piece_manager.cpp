@@ -11,100 +11,319 @@
 
 namespace bt {
 PieceManager::PieceManager(core::TorrentMetadata metadata, std::condition_variable& cv,
-                           std::unique_ptr<bt::ProgressTracker> progressTracker)
-    : _metadata(metadata), _verificationHashes(_metadata.info.pieceHashes),
+                           std::unique_ptr<bt::ProgressTracker> progressTracker,
+                           PickerConfig config, const UploadConfig& uploadConfig)
+    : _metadata(metadata), _config(config), _verificationHashes(_metadata.info.pieceHashes),
       _nextOffsets(_metadata.info.pieceHashes.size(), 0),
       _finished(_metadata.info.pieceHashes.size(), false),
       _bitfield((_metadata.info.pieceHashes.size() + 7) / 8, 0),
       _fileHandler("debian.iso", metadata.info.pieceLength, metadata.info.pieceLength),
+      _readCache(uploadConfig.readCacheBytes),
       _completionCV(cv), _piecesFinished(0), _progressTracker(std::move(progressTracker)) {
     spdlog::debug("PieceManager initialized for {} pieces ({} bytes bitfield)",
                   _metadata.info.pieceHashes.size(), _bitfield.size());
 }
 
-std::optional<Block> PieceManager::requestBlock(std::vector<uint8_t>& peer_bitfield) {
+std::optional<Block> PieceManager::requestBlock(std::vector<uint8_t>& peer_bitfield,
+                                                const PeerContext& context) {
     std::lock_guard<std::mutex> lock(_mutex);
-    for (size_t i = 0; i < _bitfield.size(); ++i) {
-        uint8_t my_byte = _bitfield[i];
-        uint8_t peer_byte = peer_bitfield[i];
-        uint8_t needed = peer_byte & ~my_byte;
-
-        if (needed > 0) {
-            for (int bit = 7; bit >= 0; --bit) {
-                if ((needed >> bit) & 1) {
-                    uint32_t piece_index = (i * 8) + (7 - bit);
-                    auto block = _getNextBlockForPiece(piece_index);
-                    if (block) {
-                        return block;
-                    }
-                }
+    if (peer_bitfield.size() != _bitfield.size()) {
+        // No (valid) bitfield from this peer yet
+        return std::nullopt;
+    }
+    if (_bannedIps.contains(context.peer.ip)) {
+        return std::nullopt; // Its session is on the way out
+    }
+
+    // Keep a moving average of the requesting peers, a peer above it counts as fast
+    const double rate = context.downloadRate;
+    if (rate > 0.0) {
+        _avgPeerRate = _avgPeerRate == 0.0 ? rate : 0.9 * _avgPeerRate + 0.1 * rate;
+    }
+    bool fastPeer = rate > 0.0 && rate >= _avgPeerRate;
+    // Suspects of a hash failure only work on pieces of their own, so that a failure can be
+    // pinned on them
+    bool onParole = _parole.contains(context.peer);
+
+    bool streaming = _config.sequential || !_deadlines.empty();
+    if (streaming && !onParole) {
+        if (auto block = _pickSequential(peer_bitfield, context, fastPeer)) {
+            return block;
+        }
+    }
+
+    // Finish what is already in progress before starting something new
+    if (auto block = _pickOpenPiece(peer_bitfield, context, false)) {
+        return block;
+    }
+
+    if (auto block = _pickNewPiece(peer_bitfield, context, fastPeer || onParole,
+                                   streaming ? _readCursor : 0)) {
+        return block;
+    }
+
+    if (onParole) {
+        return std::nullopt;
+    }
+
+    // At the caps, help out on pieces other peers own instead of idling
+    return _pickOpenPiece(peer_bitfield, context, true);
+}
+
+std::optional<Block> PieceManager::_pickSequential(const std::vector<uint8_t>& peer_bitfield,
+                                                   const PeerContext& context, bool fastPeer) {
+    const uint32_t total = _finished.size();
+    const uint32_t windowEnd = std::min<uint64_t>(total, _readCursor + _config.streamingWindow);
+    const auto now = Clock::now();
+
+    for (uint32_t index = _readCursor; index < windowEnd; ++index) {
+        if (_finished[index] || !_peerHasPiece(peer_bitfield, index)) {
+            continue;
+        }
+        auto open = _pendingPieces.find(index);
+        if (open == _pendingPieces.end()) {
+            // Pieces that failed before are handed out whole by _pickNewPiece
+            if (!_canOpenPiece(index) || _failedPieces.contains(index)) {
+                continue;
+            }
+        } else if (open->second.exclusive && open->second.owner != context.peer) {
+            continue;
+        }
+
+        if (auto block = _getNextBlockForPiece(index)) {
+            return block;
+        }
+
+        // Everything of this piece is already requested. If it is overdue, hand a duplicate of
+        // an outstanding block to a fast peer so a slow one can't stall the reader.
+        auto deadline = _deadlines.find(index);
+        if (fastPeer && deadline != _deadlines.end() && deadline->second <= now) {
+            if (auto block = _getEscalatedBlock(index)) {
+                spdlog::debug("Escalating block {}:{} of overdue piece to {}:{}",
+                              block->pieceIndex, block->offset, context.peer.getIpStr(),
+                              context.peer.port);
+                return block;
             }
         }
     }
 
+    return std::nullopt;
+}
+
+std::optional<Block> PieceManager::_pickOpenPiece(const std::vector<uint8_t>& peer_bitfield,
+                                                  const PeerContext& context, bool steal) {
+    std::optional<uint32_t> best;
+    size_t bestScore = 0;
+
+    for (const auto& [index, piece] : _pendingPieces) {
+        if (!_peerHasPiece(peer_bitfield, index)) {
+            continue;
+        }
+        if (piece.blocksReceived + piece.blocksInFlight >= piece.totalBlocksNeeded) {
+            continue; // Nothing left to request
+        }
+
+        bool ownPiece = piece.owner && *piece.owner == context.peer;
+        if (piece.owner && !ownPiece && (!steal || piece.exclusive)) {
+            continue;
+        }
+        if (!ownPiece && _parole.contains(context.peer)) {
+            continue;
+        }
+
+        // The peer's own pieces first, then the one closest to completion
+        size_t score = piece.blocksReceived + piece.blocksInFlight;
+        if (ownPiece) {
+            score += piece.totalBlocksNeeded;
+        }
+        if (!best || score > bestScore) {
+            best = index;
+            bestScore = score;
+        }
+    }
+
+    if (!best) {
+        return std::nullopt;
+    }
+    return _getNextBlockForPiece(*best);
+}
+
+std::optional<Block> PieceManager::_pickNewPiece(const std::vector<uint8_t>& peer_bitfield,
+                                                 const PeerContext& context, bool ownPiece,
+                                                 uint32_t start) {
+    const uint32_t total = _finished.size();
+    for (uint32_t i = 0; i < total; ++i) {
+        uint32_t index = (start + i) % total;
+        if (_finished[index] || _pendingPieces.contains(index) ||
+            !_peerHasPiece(peer_bitfield, index)) {
+            continue;
+        }
+
+        if (!_canOpenPiece(index)) {
+            spdlog::debug("Open piece limit reached ({} pieces, {} bytes)", _pendingPieces.size(),
+                          _bufferedBytes);
+            return std::nullopt;
+        }
+
+        auto& piece = _openPiece(index);
+        // A piece that failed before is downloaded again from a single peer
+        bool retry = _failedPieces.contains(index);
+        if (ownPiece || retry) {
+            piece.owner = context.peer;
+            piece.exclusive = retry || _parole.contains(context.peer);
+        }
+        return _getNextBlockForPiece(index);
+    }
+
     // Peer has nothing we want
     return std::nullopt;
 }
 
-bool PieceManager::deliverBlock(uint32_t idx, uint32_t offset, std::span<const uint8_t> data) {
+bool PieceManager::deliverBlock(uint32_t idx, uint32_t offset, std::span<const uint8_t> data,
+                                const core::Peer& from) {
     std::lock_guard<std::mutex> lock(_mutex);
 
-    if (_finished[idx]) {
+    if (idx >= _finished.size()) {
+        spdlog::debug("Received block for unknown piece {}", idx);
+        return false;
+    }
+
+    // Only pieces the picker opened take blocks, anything else (unsolicited, or for a piece
+    // closed since the request) would allocate a piece buffer past the caps
+    auto it = _pendingPieces.find(idx);
+    if (it == _pendingPieces.end()) {
         return true;
     }
+    auto& pending = it->second;
 
-    if (!_pendingPieces.contains(idx)) {
-        size_t len = _getPieceLength(idx);
-        size_t totalBlocks = (len + BLOCK_LEN - 1) / BLOCK_LEN;
+    if (offset % BLOCK_LEN != 0 || offset + data.size() > pending.data->size()) {
+        spdlog::debug("Received block out of bounds for piece {}", idx);
+        return false;
+    }
 
-        _pendingPieces[idx] = PendingPiece{.data = std::vector<uint8_t>(len),
-                                           .blocksReceived = 0,
-                                           .totalBlocksNeeded = totalBlocks};
+    size_t block = offset / BLOCK_LEN;
+    if (pending.received[block] || pending.leased[block]) {
+        // Second copy of an escalated block
+        return true;
     }
 
-    auto& pending = _pendingPieces[idx];
+    std::copy_n(data.data(), data.size(), pending.data->data() + offset);
+    _copiedBytes += data.size();
+    return _storeBlock(idx, pending, offset, from);
+}
 
-    if (offset + data.size() > pending.data.size()) {
-        spdlog::debug("Received block out of bounds for piece {}", idx);
-        return false;
+std::optional<BlockLease> PieceManager::beginBlock(const Block& block,
+                                                   std::span<const uint8_t> prefix) {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    if (block.pieceIndex >= _finished.size() || prefix.size() > block.length) {
+        return std::nullopt;
+    }
+    auto it = _pendingPieces.find(block.pieceIndex);
+    if (it == _pendingPieces.end()) {
+        return std::nullopt; // Not open, deliverBlock drops it
     }
 
-    std::copy_n(data.data(), data.size(), pending.data.data() + offset);
-    pending.blocksReceived++;
+    auto& pending = it->second;
+    if (block.offset % BLOCK_LEN != 0 || block.offset >= pending.data->size() ||
+        block.length != std::min<size_t>(BLOCK_LEN, pending.data->size() - block.offset)) {
+        spdlog::debug("Received block out of bounds for piece {}", block.pieceIndex);
+        return std::nullopt;
+    }
+
+    size_t index = block.offset / BLOCK_LEN;
+    if (pending.received[index] || pending.leased[index]) {
+        return std::nullopt;
+    }
+    pending.leased[index] = true;
+
+    auto dest = std::span<uint8_t>(*pending.data).subspan(block.offset, block.length);
+    std::copy(prefix.begin(), prefix.end(), dest.begin());
+    _copiedBytes += prefix.size();
+    return BlockLease{.block = block, .buffer = pending.data, .rest = dest.subspan(prefix.size())};
+}
+
+bool PieceManager::finishBlock(const BlockLease& lease, const core::Peer& from) {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    auto it = _pendingPieces.find(lease.block.pieceIndex);
+    if (it == _pendingPieces.end() || it->second.data != lease.buffer) {
+        return true; // Piece was thrown away while the block was on its way
+    }
+
+    it->second.leased[lease.block.offset / BLOCK_LEN] = false;
+    return _storeBlock(lease.block.pieceIndex, it->second, lease.block.offset, from);
+}
+
+void PieceManager::abortBlock(const BlockLease& lease) {
+    std::lock_guard<std::mutex> lock(_mutex);
 
+    auto it = _pendingPieces.find(lease.block.pieceIndex);
+    if (it != _pendingPieces.end() && it->second.data == lease.buffer) {
+        it->second.leased[lease.block.offset / BLOCK_LEN] = false;
+    }
+}
+
+bool PieceManager::_storeBlock(uint32_t idx, PendingPiece& pending, uint32_t offset,
+                               const core::Peer& from) {
     Block finishedBlock{
         .pieceIndex = idx,
         .offset = offset,
-        .length = std::min(BLOCK_LEN, static_cast<uint32_t>(pending.data.size()) - offset)};
-    _pendingBlocks.erase(finishedBlock);
-
-    if (pending.isFinished()) {
-        if (_verifyHash(idx, pending.data)) {
-            _fileHandler.writePiece(idx, data);
-            _finished[idx] = true;
-            _pendingPieces.erase(idx);
-            _setPiece(idx);
-            ++_piecesFinished;
-
-            if (_progressTracker) {
-                _progressTracker->notifyProgress();
-            }
+        .length = std::min(BLOCK_LEN, static_cast<uint32_t>(pending.data->size()) - offset)};
 
-            spdlog::info("Piece {} downloaded and verified.", idx);
+    pending.received[offset / BLOCK_LEN] = true;
+    pending.sources[offset / BLOCK_LEN] = from;
+    pending.blocksReceived++;
+    _receivedBytes += finishedBlock.length;
 
-            if (isComplete()) {
-                // Wake up torren orchestrator
-                _completionCV.notify_one();
-            }
-            return true;
-        } else {
-            spdlog::warn("Piece {} Hash Mismatch! Discarding.", idx);
-            _pendingPieces.erase(idx); // Throw it away
-            _nextOffsets[idx] = 0;
-            return false;
-        }
+    if (_pendingBlocks.erase(finishedBlock) > 0) {
+        pending.blocksInFlight--;
+    }
+    _escalatedBlocks.erase(finishedBlock);
+
+    if (!pending.isFinished()) {
+        return true;
+    }
+
+    if (!_verifyHash(idx, *pending.data)) {
+        spdlog::warn("Piece {} Hash Mismatch! Discarding.", idx);
+        _onHashFailure(idx, pending);
+        _closePiece(idx); // Throw it away
+        return false;
     }
 
+    _onHashSuccess(idx, pending);
+    _fileHandler.writePiece(idx, *pending.data);
+    _finished[idx] = true;
+    _closePiece(idx);
+    _setPiece(idx);
+    _deadlines.erase(idx);
+    ++_piecesFinished;
+    _verifiedBytes += _getPieceLength(idx);
+
+    if (idx == _readCursor) {
+        _advanceReadCursor();
+    }
+
+    auto [first, last] = _verifyWaiters.equal_range(idx);
+    for (auto it = first; it != last; ++it) {
+        it->second();
+    }
+    _verifyWaiters.erase(first, last);
+    if (_verifiedListener) {
+        _verifiedListener(idx);
+    }
+
+    if (_progressTracker) {
+        _progressTracker->notifyProgress();
+    }
+
+    spdlog::info("Piece {} downloaded and verified.", idx);
+
+    if (isComplete()) {
+        // Wake up torren orchestrator
+        _completionCV.notify_one();
+    }
     return true;
 }
 
@@ -115,12 +334,136 @@ bool PieceManager::returnBlock(const Block& block) {
             _nextOffsets[block.pieceIndex] = block.offset;
         }
         _pendingBlocks.erase(block);
+        _escalatedBlocks.erase(block);
+
+        auto piece = _pendingPieces.find(block.pieceIndex);
+        if (piece != _pendingPieces.end()) {
+            auto& pending = piece->second;
+            pending.blocksInFlight--;
+            if (pending.exclusive) {
+                // Mixing in other peers would spoil the attribution, start over once the owner
+                // has nothing outstanding anymore
+                if (pending.blocksInFlight == 0) {
+                    _closePiece(block.pieceIndex);
+                }
+            } else {
+                pending.owner.reset(); // The owner gave up on it, let others finish it
+                if (pending.blocksReceived == 0 && pending.blocksInFlight == 0) {
+                    _closePiece(block.pieceIndex);
+                }
+            }
+        }
         return true;
     } else {
         return false;
     }
 }
 
+bool PieceManager::hasPiece(uint32_t index) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return index < _finished.size() && _finished[index];
+}
+
+void PieceManager::setReadCursor(uint64_t offset) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    const uint32_t total = _finished.size();
+    _readCursor = std::min<uint64_t>(offset / _metadata.info.pieceLength, total - 1);
+    _advanceReadCursor();
+
+    // A seek invalidates the old window
+    _deadlines.clear();
+    const auto now = Clock::now();
+    for (uint32_t k = 0; k < _config.streamingWindow && _readCursor + k < total; ++k) {
+        uint32_t index = _readCursor + k;
+        if (!_finished[index]) {
+            _deadlines[index] = now + _config.deadlineStep * (k + 1);
+        }
+    }
+}
+
+bool PieceManager::whenVerified(uint32_t index, std::function<void()> callback) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_finished[index]) {
+        return false;
+    }
+    _verifyWaiters.emplace(index, std::move(callback));
+    return true;
+}
+
+bool PieceManager::isBanned(const core::IpAddr& ip) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _bannedIps.contains(ip);
+}
+
+size_t PieceManager::getOpenPieceCount() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _pendingPieces.size();
+}
+
+size_t PieceManager::getBufferedBytes() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _bufferedBytes;
+}
+
+size_t PieceManager::getRequestedBlockCount() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _pendingBlocks.size();
+}
+
+void PieceManager::readData(uint64_t offset, std::span<uint8_t> out) {
+    _fileHandler.readData(offset, out);
+}
+
+bool PieceManager::readBlock(const Block& block, std::span<uint8_t> out) {
+    if (out.size() != block.length) {
+        return false;
+    }
+    auto offset = beginUpload(block);
+    if (!offset) {
+        return false;
+    }
+    size_t pieceLength = _getPieceLength(block.pieceIndex);
+    if (_readCache.capacity() < pieceLength) {
+        // Verified pieces never change, the file handler serializes the read itself
+        _fileHandler.readData(*offset, out);
+        return true;
+    }
+    if (_readCache.read(block.pieceIndex, block.offset, out)) {
+        return true;
+    }
+
+    std::vector<uint8_t> piece(pieceLength);
+    _fileHandler.readData(uint64_t(block.pieceIndex) * _metadata.info.pieceLength, piece);
+    std::copy_n(piece.begin() + block.offset, block.length, out.begin());
+    _readCache.insert(block.pieceIndex, std::move(piece));
+    return true;
+}
+
+std::optional<uint64_t> PieceManager::beginUpload(const Block& block) {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (block.pieceIndex >= _finished.size() || !_finished[block.pieceIndex] ||
+            uint64_t(block.offset) + block.length > _getPieceLength(block.pieceIndex)) {
+            return std::nullopt;
+        }
+    }
+    return uint64_t(block.pieceIndex) * _metadata.info.pieceLength + block.offset;
+}
+
+ssize_t PieceManager::sendData(int socketFd, uint64_t offset, size_t length) {
+    return _fileHandler.sendData(socketFd, offset, length);
+}
+
+std::vector<uint8_t> PieceManager::getBitfield() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _bitfield;
+}
+
+void PieceManager::setVerifiedListener(std::function<void(uint32_t)> listener) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _verifiedListener = std::move(listener);
+}
+
 bool PieceManager::_verifyHash(uint32_t index, std::span<uint8_t> data) const {
     auto expectedHash = _verificationHashes[index];
     core::Sha1Hash calculatedHash;
@@ -132,7 +475,118 @@ bool PieceManager::isComplete() {
     return _piecesFinished >= _metadata.info.pieceHashes.size();
 }
 
+void PieceManager::_onHashFailure(uint32_t index, PendingPiece& piece) {
+    _wastedBytes += piece.data->size();
+
+    std::set<core::Peer> contributors;
+    for (const auto& source : piece.sources) {
+        if (source) {
+            contributors.insert(*source);
+        }
+    }
+    spdlog::warn("Piece {} came from {} peer(s), {} bytes wasted on bad data so far", index,
+                 contributors.size(), _wastedBytes.load());
+
+    if (contributors.size() == 1) {
+        _strike(*contributors.begin());
+        return;
+    }
+
+    // Keep a hash per block; once the piece passes, the blocks that differ name the culprit
+    FailedPiece failed{.sources = piece.sources};
+    for (size_t offset = 0; offset < piece.data->size(); offset += BLOCK_LEN) {
+        size_t len = std::min<size_t>(BLOCK_LEN, piece.data->size() - offset);
+        core::Sha1Hash hash;
+        SHA1(piece.data->data() + offset, len, hash.data());
+        failed.blockHashes.push_back(hash);
+    }
+    _failedPieces[index] = std::move(failed);
+
+    for (const auto& peer : contributors) {
+        _parole.insert(peer);
+    }
+}
+
+void PieceManager::_onHashSuccess(uint32_t index, const PendingPiece& piece) {
+    // A clean piece of its own clears a suspect
+    if (piece.exclusive && piece.owner) {
+        _parole.erase(*piece.owner);
+    }
+
+    auto failed = _failedPieces.find(index);
+    if (failed == _failedPieces.end()) {
+        return;
+    }
+
+    std::set<core::Peer> culprits;
+    for (size_t block = 0; block < failed->second.blockHashes.size(); ++block) {
+        size_t offset = block * BLOCK_LEN;
+        size_t len = std::min<size_t>(BLOCK_LEN, piece.data->size() - offset);
+        core::Sha1Hash hash;
+        SHA1(piece.data->data() + offset, len, hash.data());
+
+        const auto& source = failed->second.sources[block];
+        if (source && hash != failed->second.blockHashes[block]) {
+            culprits.insert(*source);
+        }
+    }
+    _failedPieces.erase(failed);
+
+    for (const auto& peer : culprits) {
+        _strike(peer);
+    }
+}
+
+void PieceManager::_strike(const core::Peer& peer) {
+    uint32_t strikes = ++_strikes[peer.ip];
+    spdlog::warn("Peer {}:{} sent corrupt data ({} strike(s))", peer.getIpStr(), peer.port,
+                 strikes);
+
+    if (strikes >= _config.hashFailuresBeforeBan && !_bannedIps.contains(peer.ip)) {
+        spdlog::warn("Banning {}", peer.getIpStr());
+        _bannedIps.insert(peer.ip);
+    }
+}
+
+bool PieceManager::_canOpenPiece(uint32_t index) const {
+    if (_pendingPieces.empty()) {
+        return true; // Always allow one, even if a single piece exceeds the byte cap
+    }
+    return _pendingPieces.size() < _config.maxOpenPieces &&
+           _bufferedBytes + _getPieceLength(index) <= _config.maxBufferedBytes;
+}
+
+PendingPiece& PieceManager::_openPiece(uint32_t index) {
+    auto it = _pendingPieces.find(index);
+    if (it != _pendingPieces.end()) {
+        return it->second;
+    }
+
+    size_t len = _getPieceLength(index);
+    size_t totalBlocks = (len + BLOCK_LEN - 1) / BLOCK_LEN;
+    _bufferedBytes += len;
+
+    PendingPiece piece{.data = std::make_shared<std::vector<uint8_t>>(len),
+                       .blocksReceived = 0,
+                       .totalBlocksNeeded = totalBlocks,
+                       .received = std::vector<bool>(totalBlocks, false),
+                       .leased = std::vector<bool>(totalBlocks, false),
+                       .sources = std::vector<std::optional<core::Peer>>(totalBlocks)};
+    return _pendingPieces[index] = std::move(piece);
+}
+
+void PieceManager::_closePiece(uint32_t index) {
+    auto it = _pendingPieces.find(index);
+    if (it == _pendingPieces.end()) {
+        return;
+    }
+    _bufferedBytes -= it->second.data->size();
+    _pendingPieces.erase(it);
+    _nextOffsets[index] = 0;
+}
+
 std::optional<Block> PieceManager::_getNextBlockForPiece(uint32_t index) {
+    auto& piece = _openPiece(index);
     uint32_t pieceLength = _getPieceLength(index);
     uint32_t currentOffset = _nextOffsets[index];
 
@@ -144,9 +598,10 @@ std::optional<Block> PieceManager::_getNextBlockForPiece(uint32_t index) {
             .length = std::min(BLOCK_LEN, pieceLength - currentOffset) // Clamp last block
         };
 
-        if (!_pendingBlocks.contains(block)) {
+        if (!_pendingBlocks.contains(block) && !piece.received[currentOffset / BLOCK_LEN]) {
             _pendingBlocks.insert(block);
             _nextOffsets[index] = currentOffset + block.length;
+            piece.blocksInFlight++;
 
             return block;
         }
@@ -157,12 +612,34 @@ std::optional<Block> PieceManager::_getNextBlockForPiece(uint32_t index) {
     return std::nullopt;
 }
 
+std::optional<Block> PieceManager::_getEscalatedBlock(uint32_t index) {
+    for (auto it = _pendingBlocks.lower_bound(Block{.pieceIndex = index, .offset = 0});
+         it != _pendingBlocks.end() && it->pieceIndex == index; ++it) {
+        if (!_escalatedBlocks.contains(*it) && !_isBlockReceived(*it)) {
+            _escalatedBlocks.insert(*it);
+            return *it;
+        }
+    }
+    return std::nullopt;
+}
+
+bool PieceManager::_isBlockReceived(const Block& block) const {
+    auto it = _pendingPieces.find(block.pieceIndex);
+    return it != _pendingPieces.end() && it->second.received[block.offset / BLOCK_LEN];
+}
+
+void PieceManager::_advanceReadCursor() {
+    while (_readCursor + 1 < _finished.size() && _finished[_readCursor]) {
+        ++_readCursor;
+    }
+}
+
 size_t PieceManager::_getPieceLength(uint32_t index) const {
     uint32_t pieceLength = _metadata.info.pieceLength;
 
     // Handle the very last piece
     if (index == _metadata.info.pieceHashes.size() - 1) {
-        uint32_t totalSize = _metadata.info.fileLength;
+        uint64_t totalSize = _metadata.info.fileLength;
         uint32_t remainder = totalSize % pieceLength;
         if (remainder != 0)
             pieceLength = remainder;
@@ -183,4 +660,8 @@ void PieceManager::_setPiece(uint32_t index) {
     _bitfield[byteIndex] |= 1 << (7 - offset);
 }
 
-} // namespace bt
\ No newline at end of file
+bool PieceManager::_peerHasPiece(const std::vector<uint8_t>& peer_bitfield, uint32_t index) {
+    return (peer_bitfield[index / 8] >> (7 - index % 8) & 1) != 0;
+}
+
+} // namespace bt
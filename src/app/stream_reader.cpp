@@ -0,0 +1,50 @@
+#include "app/stream_reader.hpp"
+
+#include <algorithm>
+#include <asio/steady_timer.hpp>
+#include <spdlog/spdlog.h>
+#include <stdexcept>
+
+namespace bt {
+StreamReader::StreamReader(std::shared_ptr<PieceManager> pieceManager)
+    : _pieceManager(std::move(pieceManager)) {}
+
+asio::awaitable<std::vector<uint8_t>> StreamReader::readRange(uint64_t offset, uint64_t length) {
+    if (length == 0) {
+        co_return std::vector<uint8_t>{};
+    }
+    if (offset + length > _pieceManager->getFileLength()) {
+        throw std::out_of_range{"Read range exceeds file length"};
+    }
+
+    const uint64_t pieceLength = _pieceManager->getPieceLength();
+    const auto firstPiece = static_cast<uint32_t>(offset / pieceLength);
+    const auto lastPiece = static_cast<uint32_t>((offset + length - 1) / pieceLength);
+
+    _pieceManager->setReadCursor(offset);
+    for (uint32_t index = firstPiece; index <= lastPiece; ++index) {
+        co_await _waitForPiece(index);
+    }
+
+    std::vector<uint8_t> out(length);
+    _pieceManager->readData(offset, out);
+    co_return out;
+}
+
+asio::awaitable<void> StreamReader::_waitForPiece(uint32_t index) {
+    auto timer = std::make_shared<asio::steady_timer>(co_await asio::this_coro::executor,
+                                                      asio::steady_timer::time_point::max());
+
+    // Pulling the expiry into the past also wakes a wait that has not started yet
+    bool registered = _pieceManager->whenVerified(index, [timer] {
+        asio::post(timer->get_executor(),
+                   [timer] { timer->expires_at(asio::steady_timer::time_point::min()); });
+    });
+    if (!registered) {
+        co_return;
+    }
+
+    spdlog::debug("Stream reader waiting for piece {}", index);
+    co_await timer->async_wait(asio::as_tuple(asio::use_awaitable));
+}
+} // namespace bt
@@ -1,22 +1,95 @@
 #include "app/torrent_orchestrator.hpp"
 #include "app/progress_tracker.hpp"
+#include "core/metadata_fetcher.hpp"
 #include "core/torrent_metadata_loader.hpp"
 #include "core/tracker_communicator.hpp"
+#include <algorithm>
+#include <asio/io_context.hpp>
+#include <asio/signal_set.hpp>
+#include <csignal>
+#include <future>
 #include <memory>
 #include <spdlog/spdlog.h>
+#include <system_error>
 #include <unistd.h>
 
 using namespace bt;
 
-TorrentOrchestrator::TorrentOrchestrator(std::string path, bool logging)
-    : _logging(logging), _metadata(core::parseTorrentData(path)) {};
+TorrentOrchestrator::TorrentOrchestrator(std::string source, bool logging, ClientConfig config)
+    : _logging(logging), _config(config) {
+    if (!core::isMagnetLink(source)) {
+        _metadata = core::parseTorrentData(source);
+        return;
+    }
+    _magnet = core::parseMagnetLink(source);
+    if (_magnet->trackers.empty() && !_config.dht.enabled && !_config.lsd.enabled) {
+        throw std::runtime_error("Magnet link has no tracker to find peers with");
+    }
+    // Enough to announce with, the rest comes from the peers
+    _metadata.infoHash = _magnet->infoHash;
+    _metadata.announceList = {_magnet->trackers}; // One tier, tried all at once
+};
+
+TorrentOrchestrator::~TorrentOrchestrator() {
+    _io.stop();
+    if (_ioThread.joinable()) {
+        _ioThread.join();
+    }
+}
 
 void TorrentOrchestrator::download() {
     // TODO: Move to peer manager
     const auto peerId = core::generateId(20);
     spdlog::debug("Generated peer id: %s", peerId);
-    const auto trackerResponse = core::announceAndGetPeers(_metadata, peerId);
-    auto peers = trackerResponse.peersBlob;
+
+    uint16_t port = _config.connection.listenPort;
+    if (port != 0) {
+        _listener = std::make_unique<core::PeerListener>(port, _config.connection.handshakeTimeout,
+                                                         _config.connection.utp);
+        try {
+            _listener->start();
+        } catch (const std::system_error& e) {
+            spdlog::warn("Can't listen on port {}: {}", port, e.what());
+            _listener.reset();
+        }
+    }
+
+    // Without a listener there is no port to tell anyone about
+    const uint16_t reachablePort = _listener ? port : 0;
+    _startAnnouncer(peerId, reachablePort);
+    if (_config.dht.enabled) {
+        _startDht(reachablePort);
+    }
+    if (_config.lsd.enabled) {
+        _startLsd(reachablePort);
+    }
+    if (!_announcer && !_dht && !_lsd) {
+        throw std::runtime_error("No tracker, DHT or local discovery to find peers with");
+    }
+    _ioThread = std::thread([this] { _io.run(); });
+    std::vector<core::Peer> peers;
+    std::vector<core::Peer> localPeers;
+    {
+        std::unique_lock<std::mutex> lock(_trackerMutex);
+        // Trackers alone give up on their first failed round, the DHT and LSD keep looking
+        _trackerAnswered.wait_for(lock, _config.connection.peerSearchTimeout, [this] {
+            return _trackerAnswer || (_trackerError && !_dht && !_lsd);
+        });
+        if (!_trackerAnswer) {
+            std::string reason = _trackerError ? ", trackers failed: " + *_trackerError : "";
+            throw std::runtime_error("No tracker, DHT or local discovery found peers" + reason);
+        }
+        peers = std::move(_trackerPeers);
+        _trackerPeers.clear();
+        localPeers = std::move(_localPeers);
+        _localPeers.clear();
+    }
+    if (_magnet) {
+        // LAN peers first, they are the quickest to answer
+        auto candidates = localPeers;
+        candidates.insert(candidates.end(), peers.begin(), peers.end());
+        _fetchMetadata(peerId, candidates);
+    }
 
     std::unique_ptr<bt::ProgressTracker> p = nullptr;
 
@@ -24,13 +97,266 @@ void TorrentOrchestrator::download() {
         p = std::make_unique<bt::ProgressTracker>(_metadata.info.pieceHashes.size(), 100);
     }
 
-    _pieceManager = std::make_shared<PieceManager>(_metadata, cv, std::move(p));
-    _peerManager = std::make_unique<PeerManager>(peers, _metadata.infoHash, peerId);
-
-    _peerManager->start(_pieceManager);
+    _pieceManager = std::make_shared<PieceManager>(_metadata, cv, std::move(p), _config.picker,
+                                                   _config.upload);
+    // Client-wide limits, the peer manager puts the torrent's channels below them
+    auto clientLimit = [this](uint64_t rate) -> std::shared_ptr<core::BandwidthChannel> {
+        if (rate == 0) {
+            return nullptr;
+        }
+        return std::make_shared<core::BandwidthChannel>(
+            rate, core::BandwidthChannel::burstBytes(rate, _config.bandwidth.burst, BLOCK_LEN),
+            nullptr, _config.bandwidth.fairQueueing);
+    };
+    {
+        std::lock_guard<std::mutex> lock(_trackerMutex);
+        _peerManager = std::make_unique<PeerManager>(
+            std::vector<std::array<uint8_t, 6>>{}, _metadata.infoHash, peerId, _config,
+            clientLimit(_config.bandwidth.downloadRate), clientLimit(_config.bandwidth.uploadRate));
+        _peerManager->start(_pieceManager);
+        // From now on the announcer hands new peers straight over
+        peers.insert(peers.end(), _trackerPeers.begin(), _trackerPeers.end());
+        _trackerPeers.clear();
+        localPeers.insert(localPeers.end(), _localPeers.begin(), _localPeers.end());
+        _localPeers.clear();
+        _peerManager->addPeers(peers);
+        _peerManager->addPeers(localPeers, true);
+    }
+    if (_listener) {
+        _listener->addTorrent(_metadata.infoHash,
+                              [this](core::PeerStream stream, core::Peer peer,
+                                     const core::HandshakeMsg& handshake) {
+                                  _peerManager->addIncoming(std::move(stream), peer, handshake);
+                              });
+    }
 
     std::unique_lock<std::mutex> lock(_completionMutex);
     cv.wait(lock, [&] { return _pieceManager->isComplete(); });
+    if (_announcer) {
+        _announcer->completed();
+    }
+
+    if (_config.upload.seedAfterDownload) {
+        spdlog::info("Download finished, seeding until interrupted");
+        asio::io_context signals;
+        asio::signal_set interrupt(signals, SIGINT, SIGTERM);
+        interrupt.async_wait([](const asio::error_code&, int) {});
+        signals.run();
+    }
 
+    if (_listener) {
+        _listener->stop();
+    }
+    if (_announcer) {
+        _announcer->stop().wait();
+    }
+    if (_udpTracker) {
+        _udpTracker->close();
+    }
+    _stopDht();
+    if (_lsd) {
+        _lsd->close();
+    }
     _peerManager->stop();
-}
\ No newline at end of file
+    spdlog::info("Download finished, {} bytes wasted on corrupt pieces",
+                 _pieceManager->getWastedBytes());
+
+    spdlog::debug("{} of {} block bytes were copied after the socket read",
+                  _pieceManager->getCopiedBytes(), _pieceManager->getReceivedBytes());
+    spdlog::info("Uploaded {} bytes", _pieceManager->getUploadedBytes());
+    auto cache = _pieceManager->getReadCacheStats();
+    spdlog::debug("Read cache: {} hits, {} misses, {} evictions, {} bytes held", cache.hits,
+                  cache.misses, cache.evictions, cache.bytes);
+}
+
+void TorrentOrchestrator::_startAnnouncer(const std::string& peerId, uint16_t port) {
+    const auto& tracker = _config.tracker;
+    auto tiers = core::trackerTiers(_metadata);
+    if (tiers.empty()) {
+        return;
+    }
+    bool udp = std::ranges::any_of(tiers, [](const auto& tier) {
+        return std::ranges::any_of(tier, [](const auto& url) { return url.starts_with("udp://"); });
+    });
+    if (udp) {
+        _udpTracker = std::make_shared<core::UdpTrackerClient>(_io,
+                                                               core::UdpTrackerClient::Options{});
+        _udpTracker->start();
+    }
+    _announcer = std::make_shared<core::TrackerAnnouncer>(
+        _io.get_executor(), std::move(tiers), _metadata.infoHash, peerId, port,
+        [this] { return _announceStats(); },
+        [this](std::vector<core::Peer> peers) { _onTrackerPeers(std::move(peers)); },
+        core::TrackerAnnouncer::Options{.interval = tracker.announceInterval,
+                                        .minInterval = tracker.minAnnounceInterval,
+                                        .retryBackoff = tracker.retryBackoff,
+                                        .maxRetryBackoff = tracker.maxRetryBackoff,
+                                        .timeout = tracker.announceTimeout},
+        _udpTracker, [this](const std::string& error) { _onTrackersFailed(error); });
+    _announcer->start();
+}
+
+void TorrentOrchestrator::_startDht(uint16_t port) {
+    const auto& config = _config.dht;
+    _dht = std::make_shared<core::DhtNode>(
+        _io, core::DhtNode::Options{.port = config.port, .stateFile = config.stateFile});
+    try {
+        _dht->start();
+    } catch (const std::system_error& e) {
+        spdlog::warn("Can't start the DHT node on port {}: {}", config.port, e.what());
+        _dht.reset();
+        return;
+    }
+    asio::co_spawn(_io, _dhtLoop(_metadata.infoHash, port), [](std::exception_ptr error) {
+        if (error) {
+            try {
+                std::rethrow_exception(error);
+            } catch (const std::exception& e) {
+                spdlog::warn("DHT lookups ended: {}", e.what());
+            }
+        }
+    });
+}
+
+asio::awaitable<void> TorrentOrchestrator::_dhtLoop(core::Sha1Hash infoHash, uint16_t port) {
+    const auto& config = _config.dht;
+    std::vector<core::DhtNode::Endpoint> routers;
+    asio::ip::udp::resolver resolver(_io);
+    for (const auto& router : config.routers) {
+        auto colon = router.rfind(':');
+        if (colon == std::string::npos) {
+            continue;
+        }
+        auto [ec, endpoints] = co_await resolver.async_resolve(
+            asio::ip::udp::v4(), router.substr(0, colon), router.substr(colon + 1),
+            asio::as_tuple(asio::use_awaitable));
+        if (ec || endpoints.empty()) {
+            spdlog::debug("Can't resolve DHT router {}: {}", router, ec.message());
+            continue;
+        }
+        routers.push_back(endpoints.begin()->endpoint());
+    }
+    if (_dhtStopped) {
+        co_return;
+    }
+    co_await _dht->bootstrap(routers);
+
+    while (!_dhtStopped) {
+        std::vector<core::Peer> peers;
+        if (port != 0) {
+            peers = co_await _dht->announce(infoHash, port);
+        } else {
+            peers = co_await _dht->getPeers(infoHash); // Nothing to announce without a listener
+        }
+        spdlog::info("DHT found {} peers", peers.size());
+        bool found = !peers.empty();
+        if (found) {
+            _onTrackerPeers(std::move(peers));
+        }
+        if (_dhtStopped) {
+            break;
+        }
+        _dhtTimer.expires_after(found ? config.announceInterval : config.retryInterval);
+        co_await _dhtTimer.async_wait(asio::as_tuple(asio::use_awaitable));
+    }
+}
+
+void TorrentOrchestrator::_stopDht() {
+    if (!_dht) {
+        return;
+    }
+    std::promise<std::future<void>> closing;
+    asio::post(_io, [this, &closing] {
+        _dhtStopped = true;
+        _dhtTimer.cancel();
+        closing.set_value(_dht->close());
+    });
+    closing.get_future().get().wait();
+}
+
+void TorrentOrchestrator::_startLsd(uint16_t port) {
+    const auto& config = _config.lsd;
+    _lsd = std::make_shared<core::LocalDiscovery>(
+        _io, core::LocalDiscovery::Options{.interval = config.announceInterval,
+                                           .minInterval = config.minAnnounceInterval});
+    try {
+        _lsd->start();
+    } catch (const std::system_error& e) {
+        spdlog::warn("No local service discovery: {}", e.what());
+        _lsd.reset();
+        return;
+    }
+    // Without a listener we only listen, nobody could connect to what we'd announce
+    _lsd->add(_metadata.infoHash, port, [this](core::Peer peer) { _onLocalPeer(peer); });
+}
+
+core::TrackerAnnouncer::Stats TorrentOrchestrator::_announceStats() {
+    std::lock_guard<std::mutex> lock(_trackerMutex);
+    uint32_t maxPeers = _config.connection.maxPeers;
+    if (!_peerManager) { // Set after the piece manager
+        // The size of a magnet link's torrent is unknown, anything but 0 keeps us a leecher
+        uint64_t left = _magnet ? BLOCK_LEN : _metadata.info.fileLength;
+        return {.left = left, .numWant = maxPeers};
+    }
+    auto connected = static_cast<uint32_t>(_peerManager->getConnectedCount());
+    return {.uploaded = _pieceManager->getUploadedBytes(),
+            .downloaded = _pieceManager->getReceivedBytes(),
+            .left = _pieceManager->getBytesLeft(),
+            .numWant = connected < maxPeers ? maxPeers - connected : 0};
+}
+
+void TorrentOrchestrator::_onTrackerPeers(std::vector<core::Peer> peers) {
+    std::lock_guard<std::mutex> lock(_trackerMutex);
+    if (_peerManager) {
+        _peerManager->addPeers(peers);
+    } else {
+        // Trackers of a tier tend to know the same peers
+        for (const auto& peer : peers) {
+            if (std::ranges::find(_trackerPeers, peer) == _trackerPeers.end()) {
+                _trackerPeers.push_back(peer);
+            }
+        }
+    }
+    _trackerAnswer = true;
+    _trackerAnswered.notify_all();
+}
+
+void TorrentOrchestrator::_onTrackersFailed(const std::string& error) {
+    std::lock_guard<std::mutex> lock(_trackerMutex);
+    _trackerError = error;
+    _trackerAnswered.notify_all();
+}
+
+void TorrentOrchestrator::_onLocalPeer(const core::Peer& peer) {
+    spdlog::info("Found a peer on the local network: {}:{}", peer.getIpStr(), peer.port);
+    std::lock_guard<std::mutex> lock(_trackerMutex);
+    if (_peerManager) {
+        _peerManager->addPeers({peer}, true);
+    } else if (std::ranges::find(_localPeers, peer) == _localPeers.end()) {
+        _localPeers.push_back(peer);
+    }
+    _trackerAnswer = true;
+    _trackerAnswered.notify_all();
+}
+
+void TorrentOrchestrator::_fetchMetadata(std::string_view peerId,
+                                         const std::vector<core::Peer>& peers) {
+    spdlog::info("Fetching the metadata of '{}' from {} peer(s)", _magnet->displayName,
+                 peers.size());
+
+    const auto& limits = _config.connection;
+    core::MetadataFetcher fetcher(_metadata.infoHash, std::string(peerId),
+                                  {.maxPeers = limits.maxHalfOpen,
+                                   .connectTimeout = limits.connectTimeout,
+                                   .handshakeTimeout = limits.handshakeTimeout});
+    auto rawInfo = fetcher.fetch(peers, limits.metadataTimeout);
+    if (!rawInfo) {
+        throw std::runtime_error("Couldn't fetch the metadata of the magnet link");
+    }
+
+    auto metadata = core::parseInfoData(*rawInfo);
+    metadata.announceList = _metadata.announceList;
+    std::lock_guard<std::mutex> lock(_trackerMutex);
+    _metadata = std::move(metadata);
+    _magnet.reset();
+}
@@ -0,0 +1,129 @@
+#include "core/bandwidth_channel.hpp"
+
+#include <algorithm>
+#include <vector>
+
+namespace bt::core {
+BandwidthChannel::BandwidthChannel(uint64_t rate, uint64_t burst,
+                                   std::shared_ptr<BandwidthChannel> parent, bool fair)
+    : _rate(rate), _burst(burst), _tokens(static_cast<double>(burst)), _updated(Clock::now()),
+      _parent(std::move(parent)), _fair(fair) {}
+
+BandwidthChannel::~BandwidthChannel() {
+    if (_parent) {
+        std::lock_guard<std::mutex> lock(_parent->_mutex);
+        _parent->_leave(this);
+    }
+}
+
+BandwidthChannel::Clock::duration BandwidthChannel::request(size_t bytes, Clock::time_point now) {
+    std::vector<BandwidthChannel*> chain;
+    for (auto* channel = this; channel; channel = channel->_parent.get()) {
+        chain.push_back(channel);
+    }
+    std::vector<std::unique_lock<std::mutex>> locks;
+    locks.reserve(chain.size());
+
+    // Every level judges the request on behalf of the child right below it
+    std::vector<Clock::duration> waits(chain.size());
+    Clock::duration wait{0};
+    for (size_t i = 0; i < chain.size(); ++i) {
+        locks.emplace_back(chain[i]->_mutex);
+        chain[i]->_refill(now);
+        waits[i] = chain[i]->_wait(i > 0 ? chain[i - 1] : nullptr, bytes, now);
+        wait = std::max(wait, waits[i]);
+    }
+
+    if (wait > Clock::duration::zero()) {
+        // The child queues where it waits longest; elsewhere it would hold up its siblings
+        // for tokens it can't use yet
+        for (size_t i = 1; i < chain.size(); ++i) {
+            if (waits[i] == wait) {
+                chain[i]->_enqueue(chain[i - 1], now + wait + QUEUE_GRACE);
+            } else {
+                chain[i]->_leave(chain[i - 1]);
+            }
+        }
+        return wait;
+    }
+    for (size_t i = 0; i < chain.size(); ++i) {
+        chain[i]->_take(i > 0 ? chain[i - 1] : nullptr, bytes);
+    }
+    return Clock::duration::zero();
+}
+
+void BandwidthChannel::setRate(uint64_t rate, uint64_t burst) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _refill(Clock::now());
+    _rate = rate;
+    _burst = burst;
+    _tokens = std::min(_tokens, static_cast<double>(burst));
+}
+
+uint64_t BandwidthChannel::getRate() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _rate;
+}
+
+uint64_t BandwidthChannel::burstBytes(uint64_t rate, Clock::duration burst, uint64_t minBurst) {
+    std::chrono::duration<double> seconds = burst;
+    return std::max(static_cast<uint64_t>(seconds.count() * static_cast<double>(rate)), minBurst);
+}
+
+void BandwidthChannel::_refill(Clock::time_point now) {
+    if (now <= _updated) {
+        return; // Callers on other threads may pass slightly older times
+    }
+    std::chrono::duration<double> elapsed = now - _updated;
+    _tokens = std::min(_tokens + elapsed.count() * _rate, static_cast<double>(_burst));
+    _updated = now;
+}
+
+BandwidthChannel::Clock::duration BandwidthChannel::_wait(const BandwidthChannel* child,
+                                                          size_t bytes, Clock::time_point now) {
+    if (_rate == 0) {
+        return Clock::duration::zero();
+    }
+    size_t ahead = 0;
+    if (_fair) {
+        std::erase_if(_queue, [&](const Waiter& waiter) { return waiter.expires < now; });
+        auto it = std::find_if(_queue.begin(), _queue.end(),
+                               [&](const Waiter& waiter) { return waiter.child == child; });
+        ahead = static_cast<size_t>(it - _queue.begin());
+    }
+    // Children ahead in the queue get their share first
+    double needed = std::min(static_cast<double>(bytes), static_cast<double>(_burst));
+    double shortfall = needed * static_cast<double>(ahead + 1) - _tokens;
+    if (shortfall <= 0) {
+        return Clock::duration::zero();
+    }
+    auto wait = std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(shortfall / static_cast<double>(_rate)));
+    return std::max(wait, MIN_WAIT);
+}
+
+void BandwidthChannel::_enqueue(const BandwidthChannel* child, Clock::time_point expires) {
+    if (!_fair) {
+        return;
+    }
+    auto it = std::find_if(_queue.begin(), _queue.end(),
+                           [&](const Waiter& waiter) { return waiter.child == child; });
+    if (it != _queue.end()) {
+        it->expires = expires;
+    } else {
+        _queue.push_back({child, expires});
+    }
+}
+
+void BandwidthChannel::_take(const BandwidthChannel* child, size_t bytes) {
+    if (_rate == 0) {
+        return;
+    }
+    _tokens -= static_cast<double>(bytes);
+    _leave(child);
+}
+
+void BandwidthChannel::_leave(const BandwidthChannel* child) {
+    std::erase_if(_queue, [&](const Waiter& waiter) { return waiter.child == child; });
+}
+} // namespace bt::core
@@ -0,0 +1,97 @@
+#include "core/choker.hpp"
+
+#include <algorithm>
+#include <tuple>
+
+namespace bt::core {
+constexpr uint32_t NEW_PEER_WEIGHT = 3;
+
+Choker::Choker(uint32_t uploadSlots, uint32_t optimisticRounds, uint32_t seed)
+    : _uploadSlots(uploadSlots), _optimisticRounds(std::max<uint32_t>(optimisticRounds, 1)),
+      _random(seed) {}
+
+std::set<Peer> Choker::rechoke(const std::vector<ChokeCandidate>& peers, bool seeding,
+                               Clock::time_point now) {
+    struct Ranked {
+        Peer peer;
+        double rate;  // What we rank by
+        double other; // Tie breaker
+    };
+    std::vector<Ranked> ranked;
+    std::map<Peer, History> history;
+
+    for (const auto& candidate : peers) {
+        double downRate = 0.0;
+        double upRate = 0.0;
+        uint32_t rounds = 1;
+
+        auto it = _history.find(candidate.peer);
+        // Lower totals mean a new connection from the same address
+        if (it != _history.end() && candidate.downloaded >= it->second.downloaded &&
+            candidate.uploaded >= it->second.uploaded) {
+            std::chrono::duration<double> elapsed = now - it->second.at;
+            if (elapsed.count() > 0.0) {
+                downRate = (candidate.downloaded - it->second.downloaded) / elapsed.count();
+                upRate = (candidate.uploaded - it->second.uploaded) / elapsed.count();
+            }
+            rounds = it->second.rounds + 1;
+        }
+        history[candidate.peer] = {candidate.downloaded, candidate.uploaded, now, rounds};
+
+        if (candidate.interested) {
+            ranked.push_back(seeding ? Ranked{candidate.peer, upRate, downRate}
+                                     : Ranked{candidate.peer, downRate, upRate});
+        }
+    }
+    _history = std::move(history);
+
+    std::stable_sort(ranked.begin(), ranked.end(), [](const Ranked& a, const Ranked& b) {
+        return std::tie(a.rate, a.other) > std::tie(b.rate, b.other);
+    });
+
+    // With a single slot there is no room for an optimistic unchoke
+    bool withOptimistic = _uploadSlots > 1;
+    size_t regularSlots = withOptimistic ? _uploadSlots - 1 : _uploadSlots;
+
+    std::set<Peer> unchoked;
+    for (size_t i = 0; i < ranked.size() && i < regularSlots; ++i) {
+        unchoked.insert(ranked[i].peer);
+    }
+
+    if (!withOptimistic) {
+        _optimistic.reset();
+        return unchoked;
+    }
+
+    bool rotate = _round % _optimisticRounds == 0;
+    ++_round;
+    bool valid = _optimistic && !unchoked.contains(*_optimistic) &&
+                 std::any_of(ranked.begin(), ranked.end(),
+                             [&](const Ranked& r) { return r.peer == *_optimistic; });
+    if (rotate || !valid) {
+        _optimistic = _pickOptimistic(peers, unchoked);
+    }
+    if (_optimistic) {
+        unchoked.insert(*_optimistic);
+    }
+    return unchoked;
+}
+
+std::optional<Peer> Choker::_pickOptimistic(const std::vector<ChokeCandidate>& peers,
+                                            const std::set<Peer>& unchoked) {
+    std::vector<Peer> draw;
+    for (const auto& candidate : peers) {
+        if (!candidate.interested || unchoked.contains(candidate.peer)) {
+            continue;
+        }
+        uint32_t weight = _history[candidate.peer].rounds == 1 ? NEW_PEER_WEIGHT : 1;
+        draw.insert(draw.end(), weight, candidate.peer);
+    }
+
+    if (draw.empty()) {
+        return std::nullopt;
+    }
+    std::uniform_int_distribution<size_t> pick(0, draw.size() - 1);
+    return draw[pick(_random)];
+}
+} // namespace bt::core
@@ -0,0 +1,897 @@
+#include "core/dht.hpp"
+#include "core/extension_protocol.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <fstream>
+#include <iterator>
+#include <openssl/sha.h>
+#include <spdlog/spdlog.h>
+#include <stdexcept>
+
+namespace bt::core {
+namespace dht {
+namespace {
+const bencode::Value* find(const bencode::Dict& dict, const std::string& key) {
+    auto it = dict.values.find(key);
+    return it == dict.values.end() ? nullptr : &it->second;
+}
+
+const std::string* findString(const bencode::Dict& dict, const std::string& key) {
+    auto value = find(dict, key);
+    return value && std::holds_alternative<std::string>(*value) ? &std::get<std::string>(*value)
+                                                                : nullptr;
+}
+
+std::optional<Sha1Hash> findHash(const bencode::Dict& dict, const std::string& key) {
+    auto value = findString(dict, key);
+    if (!value || value->size() != HASH_LENGTH) {
+        return std::nullopt;
+    }
+    Sha1Hash hash{};
+    std::copy_n(value->begin(), HASH_LENGTH, hash.begin());
+    return hash;
+}
+
+// Like findHash, for arguments a query can't do without
+Sha1Hash requireHash(const bencode::Dict& dict, const std::string& key) {
+    auto hash = findHash(dict, key);
+    if (!hash) {
+        throw std::invalid_argument("Missing or malformed '" + key + "'");
+    }
+    return *hash;
+}
+
+std::string toString(const Sha1Hash& hash) {
+    return std::string(reinterpret_cast<const char*>(hash.data()), hash.size());
+}
+} // namespace
+
+NodeId distance(const NodeId& a, const NodeId& b) {
+    NodeId result{};
+    for (size_t i = 0; i < result.size(); ++i) {
+        result[i] = a[i] ^ b[i];
+    }
+    return result;
+}
+
+size_t commonPrefix(const NodeId& a, const NodeId& b) {
+    for (size_t i = 0; i < a.size(); ++i) {
+        if (uint8_t x = a[i] ^ b[i]; x != 0) {
+            return i * 8 + static_cast<size_t>(std::countl_zero(x));
+        }
+    }
+    return ID_BITS;
+}
+
+NodeId randomId(std::mt19937& random) {
+    NodeId id{};
+    for (auto& byte : id) {
+        byte = static_cast<uint8_t>(random());
+    }
+    return id;
+}
+
+std::string encodeNodes(const std::vector<Node>& nodes) {
+    std::string blob;
+    blob.reserve(nodes.size() * COMPACT_NODE_LEN);
+    for (const auto& node : nodes) {
+        if (!node.endpoint.address().is_v4()) {
+            continue;
+        }
+        auto ip = node.endpoint.address().to_v4().to_bytes();
+        blob += toString(node.id);
+        blob.append(reinterpret_cast<const char*>(ip.data()), ip.size());
+        blob.push_back(static_cast<char>(node.endpoint.port() >> 8));
+        blob.push_back(static_cast<char>(node.endpoint.port() & 0xFF));
+    }
+    return blob;
+}
+
+std::vector<Node> parseNodes(std::string_view blob) {
+    if (blob.size() % COMPACT_NODE_LEN != 0) {
+        throw std::invalid_argument("Compact node list has a partial entry");
+    }
+    std::vector<Node> nodes;
+    for (size_t pos = 0; pos < blob.size(); pos += COMPACT_NODE_LEN) {
+        Node node{};
+        std::copy_n(blob.begin() + pos, HASH_LENGTH, node.id.begin());
+        asio::ip::address_v4::bytes_type ip{};
+        std::copy_n(blob.begin() + pos + HASH_LENGTH, ip.size(), ip.begin());
+        auto port = static_cast<uint16_t>((static_cast<uint8_t>(blob[pos + 24]) << 8) |
+                                          static_cast<uint8_t>(blob[pos + 25]));
+        node.endpoint = Endpoint(asio::ip::address_v4(ip), port);
+        nodes.push_back(node);
+    }
+    return nodes;
+}
+
+std::vector<uint8_t> encodeMessage(const Message& message) {
+    bencode::Dict dict;
+    dict.values["t"] = message.transactionId;
+    switch (message.type) {
+    case Message::Type::QUERY:
+        dict.values["y"] = std::string("q");
+        dict.values["q"] = message.method;
+        dict.values["a"] = message.body;
+        break;
+    case Message::Type::RESPONSE:
+        dict.values["y"] = std::string("r");
+        dict.values["r"] = message.body;
+        break;
+    case Message::Type::ERROR:
+        dict.values["y"] = std::string("e");
+        dict.values["e"] = bencode::List{{message.errorCode, message.errorMessage}};
+        break;
+    }
+    return bencode::encode(dict);
+}
+
+Message parseMessage(std::span<const uint8_t> datagram) {
+    auto value = bencode::parse(
+        std::string_view(reinterpret_cast<const char*>(datagram.data()), datagram.size()));
+    if (!std::holds_alternative<bencode::Dict>(value)) {
+        throw std::invalid_argument("KRPC message is not a dictionary");
+    }
+    auto& dict = std::get<bencode::Dict>(value);
+    auto transactionId = findString(dict, "t");
+    auto type = findString(dict, "y");
+    if (!transactionId || !type) {
+        throw std::invalid_argument("KRPC message without transaction id or type");
+    }
+
+    Message message;
+    message.transactionId = *transactionId;
+    auto body = [&](const std::string& key) {
+        auto value = find(dict, key);
+        if (!value || !std::holds_alternative<bencode::Dict>(*value)) {
+            throw std::invalid_argument("KRPC message without '" + key + "' dictionary");
+        }
+        return std::get<bencode::Dict>(std::move(*value));
+    };
+    if (*type == "q") {
+        auto method = findString(dict, "q");
+        if (!method) {
+            throw std::invalid_argument("KRPC query without method");
+        }
+        message.type = Message::Type::QUERY;
+        message.method = *method;
+        message.body = body("a");
+    } else if (*type == "r") {
+        message.type = Message::Type::RESPONSE;
+        message.body = body("r");
+    } else if (*type == "e") {
+        message.type = Message::Type::ERROR;
+        // [code, message], nodes get this wrong often enough to not insist on it
+        if (auto error = find(dict, "e"); error && std::holds_alternative<bencode::List>(*error)) {
+            const auto& items = std::get<bencode::List>(*error).values;
+            if (!items.empty() && std::holds_alternative<int64_t>(items[0])) {
+                message.errorCode = std::get<int64_t>(items[0]);
+            }
+            if (items.size() > 1 && std::holds_alternative<std::string>(items[1])) {
+                message.errorMessage = std::get<std::string>(items[1]);
+            }
+        }
+    } else {
+        throw std::invalid_argument("Unknown KRPC message type '" + *type + "'");
+    }
+    return message;
+}
+
+RoutingTable::RoutingTable(const NodeId& self, size_t bucketSize)
+    : _self(self), _bucketSize(bucketSize) {}
+
+bool RoutingTable::onSeen(const Node& node, Clock::time_point now) {
+    if (node.id == _self) {
+        return false;
+    }
+    auto& bucket = _bucketFor(node.id);
+    auto it = std::find_if(bucket.entries.begin(), bucket.entries.end(),
+                           [&](const Entry& entry) { return entry.node.id == node.id; });
+    if (it != bucket.entries.end()) {
+        it->node.endpoint = node.endpoint;
+        it->lastSeen = std::max(it->lastSeen, now);
+        it->failures = 0;
+        bucket.changed = std::max(bucket.changed, now);
+        return true;
+    }
+    if (bucket.entries.size() < _bucketSize) {
+        bucket.entries.push_back({node, now, 0});
+        bucket.changed = std::max(bucket.changed, now);
+        return true;
+    }
+    // Nodes that keep answering are never pushed out, that's what makes the DHT hard to flood
+    auto worst = std::max_element(
+        bucket.entries.begin(), bucket.entries.end(),
+        [](const Entry& a, const Entry& b) { return a.failures < b.failures; });
+    if (worst->failures == 0) {
+        return false;
+    }
+    *worst = {node, now, 0};
+    bucket.changed = std::max(bucket.changed, now);
+    return true;
+}
+
+void RoutingTable::onFailed(const NodeId& id) {
+    auto& bucket = _bucketFor(id);
+    auto it = std::find_if(bucket.entries.begin(), bucket.entries.end(),
+                           [&](const Entry& entry) { return entry.node.id == id; });
+    if (it != bucket.entries.end() && ++it->failures >= MAX_FAILURES) {
+        bucket.entries.erase(it);
+    }
+}
+
+std::vector<Node> RoutingTable::closest(const NodeId& target, size_t count) const {
+    auto all = nodes();
+    count = std::min(count, all.size());
+    std::partial_sort(all.begin(), all.begin() + static_cast<ptrdiff_t>(count), all.end(),
+                      [&](const Node& a, const Node& b) {
+                          return distance(a.id, target) < distance(b.id, target);
+                      });
+    all.resize(count);
+    return all;
+}
+
+std::vector<Node> RoutingTable::questionable(Clock::time_point before) const {
+    std::vector<Node> result;
+    for (const auto& bucket : _buckets) {
+        for (const auto& entry : bucket.entries) {
+            if (entry.lastSeen < before) {
+                result.push_back(entry.node);
+            }
+        }
+    }
+    return result;
+}
+
+std::vector<size_t> RoutingTable::staleBuckets(Clock::time_point before) const {
+    size_t deepest = 0;
+    for (size_t i = 0; i < _buckets.size(); ++i) {
+        if (!_buckets[i].entries.empty()) {
+            deepest = i;
+        }
+    }
+    // Deeper buckets are empty because there is nobody that close to us
+    std::vector<size_t> result;
+    for (size_t i = 0; i <= std::min(deepest + 1, ID_BITS - 1); ++i) {
+        if (_buckets[i].changed < before) {
+            result.push_back(i);
+        }
+    }
+    return result;
+}
+
+void RoutingTable::onRefreshed(size_t index, Clock::time_point now) {
+    _buckets.at(index).changed = std::max(_buckets.at(index).changed, now);
+}
+
+NodeId RoutingTable::randomIdIn(size_t index, std::mt19937& random) const {
+    auto id = randomId(random);
+    // Our first `index` bits, then the one that differs
+    for (size_t bit = 0; bit <= index && bit < ID_BITS; ++bit) {
+        uint8_t mask = static_cast<uint8_t>(0x80 >> (bit % 8));
+        bool set = (_self[bit / 8] & mask) != 0;
+        if (bit == index) {
+            set = !set;
+        }
+        id[bit / 8] = set ? (id[bit / 8] | mask) : (id[bit / 8] & ~mask);
+    }
+    return id;
+}
+
+std::vector<Node> RoutingTable::nodes() const {
+    std::vector<Node> result;
+    for (const auto& bucket : _buckets) {
+        for (const auto& entry : bucket.entries) {
+            result.push_back(entry.node);
+        }
+    }
+    return result;
+}
+
+size_t RoutingTable::size() const {
+    size_t count = 0;
+    for (const auto& bucket : _buckets) {
+        count += bucket.entries.size();
+    }
+    return count;
+}
+
+RoutingTable::Bucket& RoutingTable::_bucketFor(const NodeId& id) {
+    return _buckets[std::min(commonPrefix(_self, id), ID_BITS - 1)];
+}
+
+TokenStore::TokenStore(std::mt19937& random) : _random(random) {
+    rotate();
+    rotate();
+}
+
+std::string TokenStore::make(const asio::ip::address& ip) const {
+    return _token(_secret, ip);
+}
+
+bool TokenStore::check(std::string_view token, const asio::ip::address& ip) const {
+    return token == _token(_secret, ip) || token == _token(_previous, ip);
+}
+
+void TokenStore::rotate() {
+    _previous = _secret;
+    for (auto& byte : _secret) {
+        byte = static_cast<uint8_t>(_random());
+    }
+}
+
+std::string TokenStore::_token(const Secret& secret, const asio::ip::address& ip) {
+    constexpr size_t TOKEN_LEN = 8;
+    std::vector<uint8_t> input(secret.begin(), secret.end());
+    if (ip.is_v4()) {
+        auto bytes = ip.to_v4().to_bytes();
+        input.insert(input.end(), bytes.begin(), bytes.end());
+    } else {
+        auto bytes = ip.to_v6().to_bytes();
+        input.insert(input.end(), bytes.begin(), bytes.end());
+    }
+    Sha1Hash hash{};
+    SHA1(input.data(), input.size(), hash.data());
+    return std::string(reinterpret_cast<const char*>(hash.data()), TOKEN_LEN);
+}
+
+PeerStore::PeerStore(Clock::duration lifetime) : _lifetime(lifetime) {}
+
+void PeerStore::add(const Sha1Hash& infoHash, const Peer& peer, Clock::time_point now) {
+    auto& peers = _peers[infoHash];
+    peers[peer] = now;
+    if (peers.size() > MAX_PEERS) {
+        peers.erase(std::min_element(peers.begin(), peers.end(), [](const auto& a, const auto& b) {
+            return a.second < b.second;
+        }));
+    }
+}
+
+std::vector<Peer> PeerStore::get(const Sha1Hash& infoHash, size_t max) const {
+    auto it = _peers.find(infoHash);
+    if (it == _peers.end()) {
+        return {};
+    }
+    std::vector<std::pair<Peer, Clock::time_point>> entries(it->second.begin(), it->second.end());
+    std::sort(entries.begin(), entries.end(),
+              [](const auto& a, const auto& b) { return a.second > b.second; });
+    std::vector<Peer> peers;
+    for (size_t i = 0; i < std::min(max, entries.size()); ++i) {
+        peers.push_back(entries[i].first);
+    }
+    return peers;
+}
+
+void PeerStore::expire(Clock::time_point now) {
+    for (auto it = _peers.begin(); it != _peers.end();) {
+        std::erase_if(it->second, [&](const auto& entry) { return entry.second + _lifetime < now; });
+        it = it->second.empty() ? _peers.erase(it) : std::next(it);
+    }
+}
+
+void saveState(const std::filesystem::path& path, const State& state) {
+    bencode::Dict dict;
+    dict.values["id"] = toString(state.id);
+    dict.values["nodes"] = encodeNodes(state.nodes);
+    auto data = bencode::encode(dict);
+
+    // Written aside first, so a crash can't leave half a file behind
+    auto temporary = path;
+    temporary += ".tmp";
+    {
+        std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+        file.write(reinterpret_cast<const char*>(data.data()),
+                   static_cast<std::streamsize>(data.size()));
+        if (!file) {
+            throw std::runtime_error("Can't write DHT state to " + temporary.string());
+        }
+    }
+    std::filesystem::rename(temporary, path);
+}
+
+State loadState(const std::filesystem::path& path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        throw std::runtime_error("Can't read DHT state from " + path.string());
+    }
+    std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    auto value = bencode::parse(data);
+    if (!std::holds_alternative<bencode::Dict>(value)) {
+        throw std::runtime_error("DHT state is not a dictionary");
+    }
+    const auto& dict = std::get<bencode::Dict>(value);
+    auto id = findHash(dict, "id");
+    auto nodes = findString(dict, "nodes");
+    if (!id || !nodes || nodes->size() % COMPACT_NODE_LEN != 0) {
+        throw std::runtime_error("Malformed DHT state in " + path.string());
+    }
+    return {*id, parseNodes(*nodes)};
+}
+} // namespace dht
+
+DhtNode::DhtNode(asio::io_context& io, Options options)
+    : _strand(asio::make_strand(io)), _udp(_strand), _options(std::move(options)),
+      _random(std::random_device{}()), _id{}, _table(_id), _tokens(_random),
+      _peers(_options.peerLifetime), _ticker(_strand), _rotated(Clock::now()) {
+    std::optional<dht::State> saved;
+    if (!_options.stateFile.empty() && std::filesystem::exists(_options.stateFile)) {
+        try {
+            saved = dht::loadState(_options.stateFile);
+        } catch (const std::exception& e) {
+            spdlog::warn("Ignoring the saved DHT state: {}", e.what());
+        }
+    }
+    _id = _options.id ? *_options.id : saved ? saved->id : dht::randomId(_random);
+    _table = dht::RoutingTable(_id);
+    if (saved) {
+        // Never heard from in this run, so they are the first to be pinged
+        for (const auto& node : saved->nodes) {
+            _table.onSeen(node, Clock::time_point{});
+        }
+        spdlog::debug("Loaded {} DHT nodes from {}", _table.size(), _options.stateFile.string());
+    }
+    _nextTransaction = static_cast<uint16_t>(_random());
+}
+
+void DhtNode::start() {
+    Endpoint endpoint(asio::ip::udp::v4(), _options.port);
+    _udp.open(endpoint.protocol());
+    _udp.bind(endpoint);
+    _udp.non_blocking(true);
+    spdlog::debug("DHT node on port {}", getPort());
+
+    asio::co_spawn(
+        _strand, [self = shared_from_this()] { return self->_receiveLoop(); }, asio::detached);
+    asio::co_spawn(
+        _strand, [self = shared_from_this()] { return self->_maintain(); }, asio::detached);
+}
+
+std::future<void> DhtNode::close() {
+    auto done = std::make_shared<std::promise<void>>();
+    auto future = done->get_future();
+    asio::dispatch(_strand, [self = shared_from_this(), done] {
+        self->_close();
+        done->set_value();
+    });
+    return future;
+}
+
+uint16_t DhtNode::getPort() const {
+    asio::error_code ec;
+    auto endpoint = _udp.local_endpoint(ec);
+    return ec ? 0 : endpoint.port();
+}
+
+asio::awaitable<size_t> DhtNode::bootstrap(std::vector<Endpoint> routers) {
+    auto bootstrap = [self = shared_from_this(), routers = std::move(routers)]() mutable {
+        return self->_bootstrap(std::move(routers));
+    };
+    auto nodes = co_await asio::co_spawn(_strand, std::move(bootstrap), asio::use_awaitable);
+    co_return nodes;
+}
+
+asio::awaitable<bool> DhtNode::ping(Endpoint to) {
+    auto ping = [self = shared_from_this(), to] { return self->_ping(to); };
+    auto answered = co_await asio::co_spawn(_strand, std::move(ping), asio::use_awaitable);
+    co_return answered;
+}
+
+asio::awaitable<std::vector<DhtNode::Node>> DhtNode::findNode(NodeId target) {
+    auto findNode = [self = shared_from_this(), target] { return self->_findNode(target); };
+    auto nodes = co_await asio::co_spawn(_strand, std::move(findNode), asio::use_awaitable);
+    co_return nodes;
+}
+
+asio::awaitable<std::vector<Peer>> DhtNode::getPeers(Sha1Hash infoHash) {
+    auto getPeers = [self = shared_from_this(), infoHash] { return self->_getPeers(infoHash); };
+    auto peers = co_await asio::co_spawn(_strand, std::move(getPeers), asio::use_awaitable);
+    co_return peers;
+}
+
+asio::awaitable<std::vector<Peer>> DhtNode::announce(Sha1Hash infoHash, uint16_t port) {
+    auto announce = [self = shared_from_this(), infoHash, port] {
+        return self->_announce(infoHash, port);
+    };
+    auto peers = co_await asio::co_spawn(_strand, std::move(announce), asio::use_awaitable);
+    co_return peers;
+}
+
+asio::awaitable<size_t> DhtNode::getNodeCount() {
+    auto count = [self = shared_from_this()] { return self->_getNodeCount(); };
+    auto nodes = co_await asio::co_spawn(_strand, std::move(count), asio::use_awaitable);
+    co_return nodes;
+}
+
+asio::awaitable<size_t> DhtNode::_bootstrap(std::vector<Endpoint> routers) {
+    auto lookup = _newLookup(_id, false);
+    // Routers' ids are unknown until they answer, so they are asked before the lookup proper
+    for (const auto& router : routers) {
+        bencode::Dict args;
+        args.values["target"] = dht::toString(_id);
+        ++lookup->inFlight;
+        asio::co_spawn(_strand, _query(router, "find_node", std::move(args), std::nullopt),
+                       [this, self = shared_from_this(),
+                        lookup](std::exception_ptr, std::optional<bencode::Dict> reply) {
+                           --lookup->inFlight;
+                           if (reply) {
+                               _absorb(*lookup, *reply);
+                           }
+                           lookup->wakeup.cancel();
+                       });
+    }
+    co_await _settle(lookup);
+    co_await _iterate(lookup);
+    spdlog::info("DHT bootstrapped with {} nodes", _table.size());
+    co_return _table.size();
+}
+
+asio::awaitable<bool> DhtNode::_ping(Endpoint to) {
+    auto reply = co_await _query(to, "ping", {}, std::nullopt);
+    co_return reply.has_value();
+}
+
+asio::awaitable<std::vector<DhtNode::Node>> DhtNode::_findNode(NodeId target) {
+    auto lookup = _newLookup(target, false);
+    co_await _iterate(lookup);
+    std::vector<Node> nodes;
+    for (const auto* candidate : _closestAnswered(*lookup)) {
+        nodes.push_back(candidate->node);
+    }
+    co_return nodes;
+}
+
+asio::awaitable<std::vector<Peer>> DhtNode::_getPeers(Sha1Hash infoHash) {
+    auto lookup = _newLookup(infoHash, true);
+    co_await _iterate(lookup);
+    co_return std::vector<Peer>(lookup->peers.begin(), lookup->peers.end());
+}
+
+asio::awaitable<std::vector<Peer>> DhtNode::_announce(Sha1Hash infoHash, uint16_t port) {
+    auto lookup = _newLookup(infoHash, true);
+    co_await _iterate(lookup);
+
+    auto stored = std::make_shared<size_t>(0);
+    auto closest = _closestAnswered(*lookup);
+    for (const auto* candidate : closest) {
+        if (candidate->token.empty()) {
+            continue;
+        }
+        bencode::Dict args;
+        args.values["info_hash"] = dht::toString(infoHash);
+        args.values["port"] = int64_t{port};
+        args.values["token"] = candidate->token;
+        if (port == 0) {
+            args.values["implied_port"] = int64_t{1};
+        }
+        ++lookup->inFlight;
+        asio::co_spawn(
+            _strand,
+            _query(candidate->node.endpoint, "announce_peer", std::move(args), candidate->node.id),
+            [lookup, stored](std::exception_ptr error, std::optional<bencode::Dict> reply) {
+                --lookup->inFlight;
+                if (!error && reply) {
+                    ++*stored;
+                }
+                lookup->wakeup.cancel();
+            });
+    }
+    co_await _settle(lookup);
+    spdlog::debug("Announced to {} of {} DHT nodes, {} peers found", *stored, closest.size(),
+                  lookup->peers.size());
+    co_return std::vector<Peer>(lookup->peers.begin(), lookup->peers.end());
+}
+
+asio::awaitable<size_t> DhtNode::_getNodeCount() {
+    co_return _table.size();
+}
+
+asio::awaitable<std::optional<bencode::Dict>>
+DhtNode::_query(Endpoint to, std::string method, bencode::Dict args, std::optional<NodeId> node) {
+    if (!_udp.is_open()) {
+        co_return std::nullopt;
+    }
+    uint16_t number = _nextTransaction++;
+    std::string transactionId{static_cast<char>(number >> 8), static_cast<char>(number & 0xFF)};
+    args.values["id"] = dht::toString(_id);
+
+    auto transaction = std::make_shared<Transaction>(_strand);
+    transaction->to = to;
+    _transactions[transactionId] = transaction;
+    _send(to, dht::Message{.transactionId = transactionId,
+                           .type = dht::Message::Type::QUERY,
+                           .method = method,
+                           .body = std::move(args)});
+    transaction->answered.expires_after(_options.queryTimeout);
+    co_await transaction->answered.async_wait(asio::as_tuple(asio::use_awaitable));
+    _transactions.erase(transactionId);
+
+    auto& reply = transaction->reply;
+    if (!reply) {
+        if (node && _udp.is_open()) {
+            _table.onFailed(*node);
+        }
+        co_return std::nullopt;
+    }
+    if (reply->type == dht::Message::Type::ERROR) {
+        spdlog::debug("DHT node {} refused {}: {} {}", to.address().to_string(), method,
+                      reply->errorCode, reply->errorMessage);
+        co_return std::nullopt;
+    }
+    if (auto id = dht::findHash(reply->body, "id")) {
+        _table.onSeen({*id, to}, Clock::now());
+    }
+    co_return std::move(reply->body);
+}
+
+std::shared_ptr<DhtNode::Lookup> DhtNode::_newLookup(const NodeId& target, bool getPeers) {
+    auto lookup = std::make_shared<Lookup>(_strand);
+    lookup->target = target;
+    lookup->getPeers = getPeers;
+    lookup->wakeup.expires_at(Clock::time_point::max());
+    for (const auto& node : _table.closest(target, dht::K)) {
+        _addCandidate(*lookup, node);
+    }
+    return lookup;
+}
+
+void DhtNode::_addCandidate(Lookup& lookup, const Node& node) {
+    if (node.id != _id && node.endpoint.port() != 0) {
+        lookup.candidates.try_emplace(dht::distance(node.id, lookup.target),
+                                      Lookup::Candidate{.node = node});
+    }
+}
+
+std::string DhtNode::_absorb(Lookup& lookup, const bencode::Dict& reply) {
+    try {
+        if (auto nodes = dht::findString(reply, "nodes")) {
+            for (const auto& node : dht::parseNodes(*nodes)) {
+                _addCandidate(lookup, node);
+            }
+        }
+        auto values = dht::find(reply, "values");
+        if (lookup.getPeers && values && std::holds_alternative<bencode::List>(*values)) {
+            for (const auto& value : std::get<bencode::List>(*values).values) {
+                if (std::holds_alternative<std::string>(value)) {
+                    auto peers = parseCompactPeers(std::get<std::string>(value));
+                    lookup.peers.insert(peers.begin(), peers.end());
+                }
+            }
+        }
+    } catch (const std::invalid_argument& e) {
+        spdlog::debug("Malformed DHT answer: {}", e.what());
+    }
+    auto token = dht::findString(reply, "token");
+    return token ? *token : std::string();
+}
+
+void DhtNode::_queryCandidate(const std::shared_ptr<Lookup>& lookup, const NodeId& key) {
+    auto& candidate = lookup->candidates.at(key);
+    candidate.state = Lookup::State::QUERYING;
+    bencode::Dict args;
+    if (lookup->getPeers) {
+        args.values["info_hash"] = dht::toString(lookup->target);
+    } else {
+        args.values["target"] = dht::toString(lookup->target);
+    }
+    ++lookup->inFlight;
+    asio::co_spawn(_strand,
+                   _query(candidate.node.endpoint, lookup->getPeers ? "get_peers" : "find_node",
+                          std::move(args), candidate.node.id),
+                   [this, self = shared_from_this(), lookup,
+                    key](std::exception_ptr error, std::optional<bencode::Dict> reply) {
+                       --lookup->inFlight;
+                       auto& candidate = lookup->candidates.at(key);
+                       if (error || !reply) {
+                           candidate.state = Lookup::State::FAILED;
+                       } else {
+                           candidate.state = Lookup::State::ANSWERED;
+                           candidate.token = _absorb(*lookup, *reply);
+                       }
+                       lookup->wakeup.cancel();
+                   });
+}
+
+asio::awaitable<void> DhtNode::_iterate(std::shared_ptr<Lookup> lookup) {
+    for (;;) {
+        size_t considered = 0;
+        for (const auto& [key, candidate] : lookup->candidates) {
+            if (candidate.state == Lookup::State::FAILED) {
+                continue;
+            }
+            if (++considered > dht::K) {
+                break;
+            }
+            if (candidate.state == Lookup::State::FRESH && lookup->inFlight < dht::ALPHA) {
+                _queryCandidate(lookup, key);
+            }
+        }
+        if (lookup->inFlight == 0) {
+            break; // The K closest all answered, or there is nobody left to ask
+        }
+        co_await lookup->wakeup.async_wait(asio::as_tuple(asio::use_awaitable));
+        lookup->wakeup.expires_at(Clock::time_point::max());
+    }
+}
+
+asio::awaitable<void> DhtNode::_settle(std::shared_ptr<Lookup> lookup) {
+    while (lookup->inFlight > 0) {
+        co_await lookup->wakeup.async_wait(asio::as_tuple(asio::use_awaitable));
+        lookup->wakeup.expires_at(Clock::time_point::max());
+    }
+}
+
+std::vector<const DhtNode::Lookup::Candidate*> DhtNode::_closestAnswered(const Lookup& lookup) {
+    std::vector<const Lookup::Candidate*> answered;
+    for (const auto& [key, candidate] : lookup.candidates) {
+        if (candidate.state == Lookup::State::ANSWERED) {
+            answered.push_back(&candidate);
+            if (answered.size() == dht::K) {
+                break;
+            }
+        }
+    }
+    return answered;
+}
+
+void DhtNode::_handle(const dht::Message& message, const Endpoint& from) {
+    if (message.type == dht::Message::Type::QUERY) {
+        try {
+            _answerQuery(message, from);
+        } catch (const std::invalid_argument& e) {
+            _send(from, dht::Message{.transactionId = message.transactionId,
+                                     .type = dht::Message::Type::ERROR,
+                                     .errorCode = dht::ERROR_PROTOCOL,
+                                     .errorMessage = e.what()});
+        }
+        return;
+    }
+    auto it = _transactions.find(message.transactionId);
+    if (it == _transactions.end() || it->second->to != from || it->second->reply) {
+        return; // Late, forged or a duplicate
+    }
+    it->second->reply = message;
+    it->second->answered.cancel();
+}
+
+void DhtNode::_answerQuery(const dht::Message& query, const Endpoint& from) {
+    const auto& args = query.body;
+    auto id = dht::requireHash(args, "id");
+
+    dht::Message response{.transactionId = query.transactionId,
+                          .type = dht::Message::Type::RESPONSE};
+    response.body.values["id"] = dht::toString(_id);
+    if (query.method == "ping") {
+        // Just the id
+    } else if (query.method == "find_node") {
+        auto target = dht::requireHash(args, "target");
+        response.body.values["nodes"] = dht::encodeNodes(_table.closest(target, dht::K));
+    } else if (query.method == "get_peers") {
+        auto infoHash = dht::requireHash(args, "info_hash");
+        response.body.values["token"] = _tokens.make(from.address());
+        auto peers = _peers.get(infoHash, MAX_VALUES);
+        if (peers.empty()) {
+            response.body.values["nodes"] = dht::encodeNodes(_table.closest(infoHash, dht::K));
+        } else {
+            bencode::List values;
+            for (const auto& peer : peers) {
+                values.values.emplace_back(encodeCompactPeers({peer}));
+            }
+            response.body.values["values"] = std::move(values);
+        }
+    } else if (query.method == "announce_peer") {
+        auto infoHash = dht::requireHash(args, "info_hash");
+        auto token = dht::findString(args, "token");
+        if (!token || !_tokens.check(*token, from.address())) {
+            throw std::invalid_argument("Bad token");
+        }
+        auto port = dht::find(args, "port");
+        auto implied = dht::find(args, "implied_port");
+        Peer peer{.port = from.port(), .ip = from.address().to_v4().to_bytes()};
+        if (!implied || !std::holds_alternative<int64_t>(*implied) ||
+            std::get<int64_t>(*implied) == 0) {
+            if (!port || !std::holds_alternative<int64_t>(*port) || std::get<int64_t>(*port) <= 0 ||
+                std::get<int64_t>(*port) > UINT16_MAX) {
+                throw std::invalid_argument("Missing or malformed 'port'");
+            }
+            peer.port = static_cast<uint16_t>(std::get<int64_t>(*port));
+        }
+        _peers.add(infoHash, peer, Clock::now());
+        spdlog::debug("DHT peer {}:{} announced", peer.getIpStr(), peer.port);
+    } else {
+        _send(from, dht::Message{.transactionId = query.transactionId,
+                                 .type = dht::Message::Type::ERROR,
+                                 .errorCode = dht::ERROR_METHOD_UNKNOWN,
+                                 .errorMessage = "Method Unknown"});
+        return;
+    }
+    _send(from, response);
+    // Nodes that query us are alive as well
+    _table.onSeen({id, from}, Clock::now());
+}
+
+void DhtNode::_send(const Endpoint& to, const dht::Message& message) {
+    auto datagram = dht::encodeMessage(message);
+    asio::error_code ec;
+    _udp.send_to(asio::buffer(datagram), to, 0, ec);
+    if (ec) {
+        // Counts as unanswered for queries
+        spdlog::debug("Can't send to DHT node {}: {}", to.address().to_string(), ec.message());
+    }
+}
+
+asio::awaitable<void> DhtNode::_receiveLoop() {
+    std::vector<uint8_t> buffer(64 * 1024);
+    Endpoint from;
+    while (_udp.is_open()) {
+        auto [ec, n] = co_await _udp.async_receive_from(asio::buffer(buffer), from,
+                                                        asio::as_tuple(asio::use_awaitable));
+        if (ec == asio::error::operation_aborted || !_udp.is_open()) {
+            co_return;
+        }
+        if (ec || !from.address().is_v4()) {
+            continue; // ICMP errors of earlier sends show up here
+        }
+        dht::Message message;
+        try {
+            message = dht::parseMessage(std::span<const uint8_t>(buffer.data(), n));
+        } catch (const std::exception&) {
+            continue; // Without a transaction id there's nobody to answer to
+        }
+        _handle(message, from);
+    }
+}
+
+asio::awaitable<void> DhtNode::_maintain() {
+    while (_udp.is_open()) {
+        _ticker.expires_after(MAINTENANCE_TICK);
+        co_await _ticker.async_wait(asio::as_tuple(asio::use_awaitable));
+        if (!_udp.is_open()) {
+            co_return;
+        }
+        auto now = Clock::now();
+        if (now - _rotated >= _options.tokenRotation) {
+            _tokens.rotate();
+            _rotated = now;
+        }
+        _peers.expire(now);
+
+        auto before = now - _options.refreshInterval;
+        for (const auto& node : _table.questionable(before)) {
+            asio::co_spawn(_strand, _query(node.endpoint, "ping", {}, node.id),
+                           [self = shared_from_this()](std::exception_ptr,
+                                                       std::optional<bencode::Dict>) {});
+        }
+        for (size_t index : _table.staleBuckets(before)) {
+            _table.onRefreshed(index, now);
+            asio::co_spawn(_strand, _iterate(_newLookup(_table.randomIdIn(index, _random), false)),
+                           [self = shared_from_this()](std::exception_ptr) {});
+        }
+        _saveState();
+    }
+}
+
+void DhtNode::_saveState() const {
+    if (_options.stateFile.empty()) {
+        return;
+    }
+    try {
+        dht::saveState(_options.stateFile, {_id, _table.nodes()});
+    } catch (const std::exception& e) {
+        spdlog::warn("Can't save the DHT state: {}", e.what());
+    }
+}
+
+void DhtNode::_close() {
+    if (!_udp.is_open()) {
+        return;
+    }
+    _saveState();
+    asio::error_code ec;
+    _udp.close(ec);
+    _ticker.cancel();
+    for (auto& [id, transaction] : _transactions) {
+        transaction->answered.cancel();
+    }
+}
+} // namespace bt::core
@@ -0,0 +1,211 @@
+#include "core/extension_protocol.hpp"
+#include "core/bencode_parser.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace bt::core {
+namespace {
+constexpr size_t COMPACT_PEER_LEN = 6;
+
+bencode::Dict parseDictPayload(std::span<const uint8_t> payload) {
+    auto value = bencode::parse(
+        std::string_view(reinterpret_cast<const char*>(payload.data()), payload.size()));
+    if (!std::holds_alternative<bencode::Dict>(value)) {
+        throw std::invalid_argument("Extension payload is not a dictionary");
+    }
+    return std::get<bencode::Dict>(std::move(value));
+}
+
+const bencode::Value* find(const bencode::Dict& dict, const std::string& key) {
+    auto it = dict.values.find(key);
+    return it == dict.values.end() ? nullptr : &it->second;
+}
+} // namespace
+
+std::vector<uint8_t> encodeExtensionHandshake(const ExtensionHandshake& handshake) {
+    bencode::Dict m;
+    for (const auto& [name, id] : handshake.extensions) {
+        m.values[name] = int64_t{id};
+    }
+    bencode::Dict dict;
+    dict.values["m"] = std::move(m);
+    if (handshake.listenPort) {
+        dict.values["p"] = int64_t{*handshake.listenPort};
+    }
+    if (!handshake.client.empty()) {
+        dict.values["v"] = handshake.client;
+    }
+    if (handshake.maxRequests) {
+        dict.values["reqq"] = int64_t{*handshake.maxRequests};
+    }
+    if (handshake.metadataSize) {
+        dict.values["metadata_size"] = static_cast<int64_t>(*handshake.metadataSize);
+    }
+    return bencode::encode(dict);
+}
+
+ExtensionHandshake parseExtensionHandshake(std::span<const uint8_t> payload) {
+    auto dict = parseDictPayload(payload);
+    ExtensionHandshake handshake;
+
+    // Unknown keys and values of unexpected types are ignored, clients differ a lot here
+    if (auto m = find(dict, "m"); m && std::holds_alternative<bencode::Dict>(*m)) {
+        for (const auto& [name, id] : std::get<bencode::Dict>(*m).values) {
+            if (std::holds_alternative<int64_t>(id)) {
+                int64_t value = std::get<int64_t>(id);
+                if (value >= 0 && value <= 255) {
+                    handshake.extensions[name] = static_cast<uint8_t>(value);
+                }
+            }
+        }
+    }
+    if (auto p = find(dict, "p"); p && std::holds_alternative<int64_t>(*p)) {
+        int64_t port = std::get<int64_t>(*p);
+        if (port > 0 && port <= 65535) {
+            handshake.listenPort = static_cast<uint16_t>(port);
+        }
+    }
+    if (auto v = find(dict, "v"); v && std::holds_alternative<std::string>(*v)) {
+        handshake.client = std::get<std::string>(*v);
+    }
+    if (auto reqq = find(dict, "reqq"); reqq && std::holds_alternative<int64_t>(*reqq)) {
+        int64_t value = std::get<int64_t>(*reqq);
+        if (value > 0 && value <= UINT32_MAX) {
+            handshake.maxRequests = static_cast<uint32_t>(value);
+        }
+    }
+    if (auto size = find(dict, "metadata_size"); size && std::holds_alternative<int64_t>(*size)) {
+        int64_t value = std::get<int64_t>(*size);
+        if (value > 0 && static_cast<uint64_t>(value) <= ext::MAX_METADATA_SIZE) {
+            handshake.metadataSize = static_cast<size_t>(value);
+        }
+    }
+    return handshake;
+}
+
+std::vector<uint8_t> encodePex(const PexMessage& message) {
+    bencode::Dict dict;
+    dict.values["added"] = encodeCompactPeers(message.added);
+    // One flags byte per added peer, we know nothing about them worth telling
+    dict.values["added.f"] = std::string(message.added.size(), '\0');
+    dict.values["dropped"] = encodeCompactPeers(message.dropped);
+    return bencode::encode(dict);
+}
+
+PexMessage parsePex(std::span<const uint8_t> payload) {
+    auto dict = parseDictPayload(payload);
+    PexMessage message;
+    auto read = [&](const std::string& key) {
+        std::vector<Peer> peers;
+        if (auto value = find(dict, key); value && std::holds_alternative<std::string>(*value)) {
+            peers = parseCompactPeers(std::get<std::string>(*value));
+        }
+        if (peers.size() > ext::MAX_PEX_PEERS) {
+            peers.resize(ext::MAX_PEX_PEERS);
+        }
+        return peers;
+    };
+    message.added = read("added");
+    message.dropped = read("dropped");
+    return message;
+}
+
+std::vector<uint8_t> encodeMetadataMessage(const MetadataMessage& message,
+                                           std::span<const uint8_t> data) {
+    bencode::Dict dict;
+    dict.values["msg_type"] = int64_t{static_cast<uint8_t>(message.type)};
+    dict.values["piece"] = int64_t{message.piece};
+    if (message.type == MetadataMessage::Type::DATA) {
+        dict.values["total_size"] = static_cast<int64_t>(message.totalSize);
+    }
+    auto encoded = bencode::encode(dict);
+    encoded.insert(encoded.end(), data.begin(), data.end());
+    return encoded;
+}
+
+std::pair<MetadataMessage, std::span<const uint8_t>>
+parseMetadataMessage(std::span<const uint8_t> payload) {
+    // Only the dictionary is bencoded, the piece data after it is raw
+    std::string_view text(reinterpret_cast<const char*>(payload.data()), payload.size());
+    size_t pos = 0;
+    auto value = bencode::detail::parse(text, pos, 0);
+    if (!std::holds_alternative<bencode::Dict>(value)) {
+        throw std::invalid_argument("ut_metadata message is not a dictionary");
+    }
+    const auto& dict = std::get<bencode::Dict>(value);
+
+    auto type = bencode::extractValueFromDict<int64_t>(dict, "msg_type");
+    auto piece = bencode::extractValueFromDict<int64_t>(dict, "piece");
+    if (type < 0 || type > 2 || piece < 0 || piece > UINT32_MAX) {
+        throw std::invalid_argument("Bad ut_metadata message");
+    }
+    MetadataMessage message{.type = static_cast<MetadataMessage::Type>(type),
+                            .piece = static_cast<uint32_t>(piece)};
+    if (message.type == MetadataMessage::Type::DATA) {
+        auto totalSize = bencode::extractValueFromDict<int64_t>(dict, "total_size");
+        if (totalSize <= 0 || static_cast<uint64_t>(totalSize) > ext::MAX_METADATA_SIZE) {
+            throw std::invalid_argument("Bad ut_metadata total size");
+        }
+        message.totalSize = static_cast<size_t>(totalSize);
+    }
+    return {message, payload.subspan(pos)};
+}
+
+std::string encodeCompactPeers(const std::vector<Peer>& peers) {
+    std::string blob;
+    blob.reserve(peers.size() * COMPACT_PEER_LEN);
+    for (const auto& peer : peers) {
+        blob.append(reinterpret_cast<const char*>(peer.ip.data()), peer.ip.size());
+        blob.push_back(static_cast<char>(peer.port >> 8));
+        blob.push_back(static_cast<char>(peer.port & 0xFF));
+    }
+    return blob;
+}
+
+std::vector<Peer> parseCompactPeers(std::string_view blob) {
+    if (blob.size() % COMPACT_PEER_LEN != 0) {
+        throw std::invalid_argument("Compact peer list has a partial entry");
+    }
+    std::vector<Peer> peers;
+    for (size_t pos = 0; pos < blob.size(); pos += COMPACT_PEER_LEN) {
+        Peer peer{};
+        std::copy_n(blob.begin() + pos, 4, peer.ip.begin());
+        peer.port = static_cast<uint16_t>((static_cast<uint8_t>(blob[pos + 4]) << 8) |
+                                          static_cast<uint8_t>(blob[pos + 5]));
+        peers.push_back(peer);
+    }
+    return peers;
+}
+
+PexState::PexState(Clock::duration interval) : _interval(interval) {}
+
+std::optional<PexMessage> PexState::update(const std::set<Peer>& connected,
+                                           Clock::time_point now) {
+    if (_lastSent && now - *_lastSent < _interval) {
+        return std::nullopt;
+    }
+
+    PexMessage message;
+    for (const auto& peer : connected) {
+        if (message.added.size() < ext::MAX_PEX_PEERS && !_known.contains(peer)) {
+            message.added.push_back(peer);
+        }
+    }
+    for (const auto& peer : _known) {
+        if (message.dropped.size() < ext::MAX_PEX_PEERS && !connected.contains(peer)) {
+            message.dropped.push_back(peer);
+        }
+    }
+    if (message.added.empty() && message.dropped.empty()) {
+        return std::nullopt;
+    }
+
+    _known.insert(message.added.begin(), message.added.end());
+    for (const auto& peer : message.dropped) {
+        _known.erase(peer);
+    }
+    _lastSent = now;
+    return message;
+}
+} // namespace bt::core
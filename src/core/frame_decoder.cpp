@@ -0,0 +1,122 @@
+#include "core/frame_decoder.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <netinet/in.h>
+#include <stdexcept>
+
+namespace bt::core {
+FrameDecoder::FrameDecoder(size_t capacity) : _buffer(capacity) {}
+
+std::span<uint8_t> FrameDecoder::prepare() {
+    if (_oversizedActive) {
+        if (!_oversizedDelivered) {
+            return std::span<uint8_t>(_oversized).subspan(_oversizedFilled);
+        }
+        // The caller is done with the large frame, release it
+        _oversizedActive = false;
+        _oversizedDelivered = false;
+        _oversized = std::vector<uint8_t>{};
+    }
+
+    if (_begin == _end) {
+        _begin = _end = 0;
+    } else if (_begin > 0) {
+        size_t frameEnd = _begin + sizeof(uint32_t);
+        if (_end - _begin >= sizeof(uint32_t)) {
+            uint32_t networkLen;
+            std::memcpy(&networkLen, _buffer.data() + _begin, sizeof(networkLen));
+            frameEnd += ntohl(networkLen);
+        }
+
+        // Move the partial frame to the front once it can't grow contiguously anymore or the
+        // space left makes for short reads
+        if (frameEnd > _buffer.size() || _buffer.size() - _end < _buffer.size() / 4) {
+            std::memmove(_buffer.data(), _buffer.data() + _begin, _end - _begin);
+            _end -= _begin;
+            _begin = 0;
+        }
+    }
+
+    return std::span<uint8_t>(_buffer).subspan(_end);
+}
+
+void FrameDecoder::commit(size_t n) {
+    if (_oversizedActive) {
+        _oversizedFilled += n;
+    } else {
+        _end += n;
+    }
+}
+
+std::optional<Frame> FrameDecoder::next() {
+    if (_oversizedActive) {
+        if (_oversizedDelivered || _oversizedFilled != _oversized.size()) {
+            return std::nullopt;
+        }
+        _oversizedDelivered = true;
+        return Frame{.id = static_cast<msg::id>(_oversized[0]),
+                     .payload = std::span<uint8_t>(_oversized).subspan(1)};
+    }
+
+    while (_end - _begin >= sizeof(uint32_t)) {
+        uint32_t networkLen;
+        std::memcpy(&networkLen, _buffer.data() + _begin, sizeof(networkLen));
+        uint32_t len = ntohl(networkLen);
+
+        if (len == 0) {
+            _begin += sizeof(uint32_t); // Keep-alive
+            continue;
+        }
+        if (len > MAX_MESSAGE_LEN) {
+            throw std::runtime_error{"Peer message exceeds maximum length"};
+        }
+
+        if (sizeof(uint32_t) + len > _buffer.size()) {
+            // Too large for the receive buffer, continue in a dedicated allocation
+            _begin += sizeof(uint32_t);
+            _oversized.resize(len);
+            _oversizedFilled = std::min<size_t>(len, _end - _begin);
+            std::copy_n(_buffer.data() + _begin, _oversizedFilled, _oversized.data());
+            _begin += _oversizedFilled;
+            _oversizedActive = true;
+            return next();
+        }
+
+        if (_end - _begin < sizeof(uint32_t) + len) {
+            return std::nullopt;
+        }
+
+        uint8_t* body = _buffer.data() + _begin + sizeof(uint32_t);
+        _begin += sizeof(uint32_t) + len;
+        return Frame{.id = static_cast<msg::id>(body[0]),
+                     .payload = std::span<uint8_t>(body + 1, len - 1)};
+    }
+
+    return std::nullopt;
+}
+
+std::optional<PartialFrame> FrameDecoder::takePartial(msg::id id, size_t headerLen) {
+    size_t available = _end - _begin;
+    if (_oversizedActive || available < sizeof(uint32_t) + 1 + headerLen) {
+        return std::nullopt;
+    }
+
+    uint32_t networkLen;
+    std::memcpy(&networkLen, _buffer.data() + _begin, sizeof(networkLen));
+    uint32_t len = ntohl(networkLen);
+    uint8_t* body = _buffer.data() + _begin + sizeof(uint32_t);
+    if (static_cast<msg::id>(body[0]) != id || len < 1 + headerLen ||
+        available >= sizeof(uint32_t) + len) {
+        return std::nullopt;
+    }
+
+    size_t bufferedPayload = available - sizeof(uint32_t) - 1;
+    _begin = _end; // Everything buffered belongs to this message
+    return PartialFrame{.id = id,
+                        .header = std::span<uint8_t>(body + 1, headerLen),
+                        .body = std::span<uint8_t>(body + 1 + headerLen,
+                                                   bufferedPayload - headerLen),
+                        .missing = len - 1 - bufferedPayload};
+}
+} // namespace bt::core
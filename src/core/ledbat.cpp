@@ -0,0 +1,74 @@
+#include "core/ledbat.hpp"
+
+#include <algorithm>
+
+namespace bt::core {
+namespace {
+// Delays are timestamps of two unsynchronized clocks that wrap, compare them by difference
+bool earlier(uint32_t a, uint32_t b) {
+    return static_cast<int32_t>(a - b) < 0;
+}
+} // namespace
+
+Ledbat::Ledbat(size_t minWindow, size_t initialWindow)
+    : _minWindow(minWindow), _window(std::max(initialWindow, minWindow)) {}
+
+void Ledbat::onAck(size_t acked, size_t flightSize, uint32_t delay, Clock::time_point now) {
+    if (acked == 0) {
+        return;
+    }
+    uint32_t base = _updateBaseDelay(delay, now);
+    _queuingDelay = delay - base;
+
+    double offTarget = (static_cast<double>(TARGET_DELAY_US) - _queuingDelay) / TARGET_DELAY_US;
+    double windowFactor = static_cast<double>(std::min(acked, flightSize)) /
+                          std::max<double>(std::max(_window, static_cast<double>(acked)), 1.0);
+    double ledbatWindow = _window + MAX_GAIN * offTarget * windowFactor;
+
+    if (_slowStart) {
+        if (_queuingDelay > TARGET_DELAY_US * 9 / 10) {
+            _slowStart = false;
+        } else {
+            ledbatWindow = std::max(ledbatWindow, _window + static_cast<double>(acked));
+        }
+    }
+    // Only an application limited sender grows past what it keeps in flight; that would
+    // just build up credit it never tested
+    double cap = std::max(static_cast<double>(flightSize + acked) * 2, _window);
+    _window = std::clamp(ledbatWindow, static_cast<double>(_minWindow), cap);
+}
+
+void Ledbat::onLoss(Clock::duration roundTrip, Clock::time_point now) {
+    if (_lastDecrease && now - *_lastDecrease < roundTrip) {
+        return; // Same loss event
+    }
+    _lastDecrease = now;
+    _slowStart = false;
+    _window = std::max(_window / 2, static_cast<double>(_minWindow));
+}
+
+void Ledbat::onTimeout() {
+    _slowStart = false;
+    _window = _minWindow;
+}
+
+void Ledbat::setMinWindow(size_t minWindow) {
+    _minWindow = minWindow;
+    _window = std::max(_window, static_cast<double>(_minWindow));
+}
+
+uint32_t Ledbat::_updateBaseDelay(uint32_t delay, Clock::time_point now) {
+    if (!_bucketStart || now - *_bucketStart >= BASE_BUCKET) {
+        _basePrevious = _baseCurrent;
+        _baseCurrent.reset();
+        _bucketStart = now;
+    }
+    if (!_baseCurrent || earlier(delay, *_baseCurrent)) {
+        _baseCurrent = delay;
+    }
+    if (_basePrevious && earlier(*_basePrevious, *_baseCurrent)) {
+        return *_basePrevious;
+    }
+    return *_baseCurrent;
+}
+} // namespace bt::core
@@ -0,0 +1,244 @@
+#include "core/local_discovery.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <spdlog/spdlog.h>
+
+namespace bt::core {
+namespace lsd {
+namespace {
+constexpr std::string_view REQUEST_LINE = "BT-SEARCH * HTTP/1.1";
+
+std::string toHex(const Sha1Hash& hash) {
+    static constexpr char DIGITS[] = "0123456789abcdef";
+    std::string hex;
+    for (uint8_t byte : hash) {
+        hex.push_back(DIGITS[byte >> 4]);
+        hex.push_back(DIGITS[byte & 0x0F]);
+    }
+    return hex;
+}
+
+std::optional<Sha1Hash> fromHex(std::string_view hex) {
+    if (hex.size() != HASH_LENGTH * 2) {
+        return std::nullopt;
+    }
+    Sha1Hash hash{};
+    for (size_t i = 0; i < hash.size(); ++i) {
+        auto [end, ec] = std::from_chars(hex.data() + 2 * i, hex.data() + 2 * i + 2, hash[i], 16);
+        if (ec != std::errc{} || end != hex.data() + 2 * i + 2) {
+            return std::nullopt;
+        }
+    }
+    return hash;
+}
+
+std::string_view trim(std::string_view text) {
+    while (!text.empty() && std::isspace(static_cast<unsigned char>(text.front()))) {
+        text.remove_prefix(1);
+    }
+    while (!text.empty() && std::isspace(static_cast<unsigned char>(text.back()))) {
+        text.remove_suffix(1);
+    }
+    return text;
+}
+
+bool equalsIgnoringCase(std::string_view a, std::string_view b) {
+    return std::ranges::equal(a, b, [](char x, char y) {
+        return std::tolower(static_cast<unsigned char>(x)) ==
+               std::tolower(static_cast<unsigned char>(y));
+    });
+}
+} // namespace
+
+std::string encodeAnnounce(const Announce& announce, const asio::ip::udp::endpoint& host) {
+    std::string message(REQUEST_LINE);
+    message += "\r\nHost: " + host.address().to_string() + ":" + std::to_string(host.port());
+    message += "\r\nPort: " + std::to_string(announce.port);
+    for (const auto& infoHash : announce.infoHashes) {
+        message += "\r\nInfohash: " + toHex(infoHash);
+    }
+    if (!announce.cookie.empty()) {
+        message += "\r\ncookie: " + announce.cookie;
+    }
+    message += "\r\n\r\n\r\n";
+    return message;
+}
+
+std::optional<Announce> parseAnnounce(std::string_view datagram) {
+    auto lineEnd = datagram.find("\r\n");
+    if (lineEnd == std::string_view::npos || datagram.substr(0, lineEnd) != REQUEST_LINE) {
+        return std::nullopt;
+    }
+    Announce announce;
+    size_t pos = lineEnd + 2;
+    while (pos < datagram.size()) {
+        lineEnd = datagram.find("\r\n", pos);
+        auto line = datagram.substr(pos, lineEnd == std::string_view::npos ? std::string_view::npos
+                                                                           : lineEnd - pos);
+        pos = lineEnd == std::string_view::npos ? datagram.size() : lineEnd + 2;
+        if (line.empty()) {
+            break; // End of the headers
+        }
+        auto colon = line.find(':');
+        if (colon == std::string_view::npos) {
+            continue;
+        }
+        auto name = trim(line.substr(0, colon));
+        auto value = trim(line.substr(colon + 1));
+        if (equalsIgnoringCase(name, "port")) {
+            uint16_t port = 0;
+            auto [end, ec] = std::from_chars(value.data(), value.data() + value.size(), port);
+            if (ec == std::errc{} && end == value.data() + value.size()) {
+                announce.port = port;
+            }
+        } else if (equalsIgnoringCase(name, "infohash")) {
+            if (auto infoHash = fromHex(value)) {
+                announce.infoHashes.push_back(*infoHash);
+            }
+        } else if (equalsIgnoringCase(name, "cookie")) {
+            announce.cookie = value;
+        }
+    }
+    if (announce.port == 0 || announce.infoHashes.empty()) {
+        return std::nullopt;
+    }
+    return announce;
+}
+} // namespace lsd
+
+LocalDiscovery::LocalDiscovery(asio::io_context& io, Options options)
+    : _strand(asio::make_strand(io)), _udp(_strand), _ticker(_strand), _options(options) {
+    std::mt19937 random(std::random_device{}());
+    _cookie = std::to_string(random());
+}
+
+void LocalDiscovery::start() {
+    asio::ip::udp::endpoint endpoint(asio::ip::address_v4::any(), _options.port);
+    _udp.open(endpoint.protocol());
+    // Other clients on this host listen to the group as well
+    _udp.set_option(asio::ip::udp::socket::reuse_address(true));
+    _udp.bind(endpoint);
+    _udp.set_option(asio::ip::multicast::join_group(_options.group, _options.interface));
+    if (!_options.interface.is_unspecified()) {
+        _udp.set_option(asio::ip::multicast::outbound_interface(_options.interface));
+    }
+    _udp.set_option(asio::ip::multicast::enable_loopback(true));
+    _udp.non_blocking(true);
+    spdlog::debug("Local service discovery on {}:{}", _options.group.to_string(), _options.port);
+
+    asio::co_spawn(
+        _strand, [self = shared_from_this()] { return self->_receiveLoop(); }, asio::detached);
+    asio::co_spawn(
+        _strand, [self = shared_from_this()] { return self->_announceLoop(); }, asio::detached);
+}
+
+void LocalDiscovery::close() {
+    asio::dispatch(_strand, [self = shared_from_this()] { self->_close(); });
+}
+
+void LocalDiscovery::add(const Sha1Hash& infoHash, uint16_t port, PeerHandler onPeer) {
+    asio::post(_strand, [self = shared_from_this(), infoHash, port,
+                         onPeer = std::move(onPeer)]() mutable {
+        auto& torrent = self->_torrents[infoHash];
+        torrent.port = port;
+        torrent.onPeer = std::move(onPeer);
+        torrent.next = Clock::now();
+        // Adding it again doesn't get around the rate limit
+        if (auto announced = self->_announced.find(infoHash);
+            announced != self->_announced.end()) {
+            torrent.next = std::max(torrent.next, announced->second + self->_options.minInterval);
+        }
+        self->_ticker.cancel();
+    });
+}
+
+void LocalDiscovery::remove(const Sha1Hash& infoHash) {
+    asio::post(_strand, [self = shared_from_this(), infoHash] {
+        self->_torrents.erase(infoHash);
+    });
+}
+
+asio::awaitable<void> LocalDiscovery::_announceLoop() {
+    while (_udp.is_open()) {
+        auto now = Clock::now();
+        auto next = Clock::time_point::max();
+        for (auto& [infoHash, torrent] : _torrents) {
+            if (torrent.next <= now) {
+                if (torrent.port != 0) {
+                    _send(infoHash, torrent.port);
+                    _announced[infoHash] = now;
+                }
+                torrent.next = now + _options.interval;
+            }
+            next = std::min(next, torrent.next);
+        }
+        auto expired = [&](const auto& entry) {
+            return entry.second + _options.minInterval <= now;
+        };
+        std::erase_if(_announced, expired);
+        std::erase_if(_heard, expired);
+
+        _ticker.expires_at(next);
+        co_await _ticker.async_wait(asio::as_tuple(asio::use_awaitable));
+    }
+}
+
+asio::awaitable<void> LocalDiscovery::_receiveLoop() {
+    std::vector<char> buffer(1500);
+    asio::ip::udp::endpoint from;
+    while (_udp.is_open()) {
+        auto [ec, n] = co_await _udp.async_receive_from(asio::buffer(buffer), from,
+                                                        asio::as_tuple(asio::use_awaitable));
+        if (ec == asio::error::operation_aborted || !_udp.is_open()) {
+            co_return;
+        }
+        if (ec || !from.address().is_v4()) {
+            continue;
+        }
+        auto announce = lsd::parseAnnounce(std::string_view(buffer.data(), n));
+        if (announce && announce->cookie != _cookie) {
+            _onAnnounce(*announce, from.address().to_v4());
+        }
+    }
+}
+
+void LocalDiscovery::_onAnnounce(const lsd::Announce& announce, const asio::ip::address_v4& from) {
+    auto now = Clock::now();
+    for (const auto& infoHash : announce.infoHashes) {
+        auto torrent = _torrents.find(infoHash);
+        if (torrent == _torrents.end()) {
+            continue;
+        }
+        auto [heard, first] = _heard.try_emplace({from, infoHash}, now);
+        if (!first) {
+            if (heard->second + _options.minInterval > now) {
+                continue;
+            }
+            heard->second = now;
+        }
+        Peer peer{.port = announce.port, .ip = from.to_bytes()};
+        spdlog::debug("Local peer {}:{}", peer.getIpStr(), peer.port);
+        torrent->second.onPeer(peer);
+    }
+}
+
+void LocalDiscovery::_send(const Sha1Hash& infoHash, uint16_t port) {
+    asio::ip::udp::endpoint group(_options.group, _options.port);
+    auto message = lsd::encodeAnnounce({.port = port, .infoHashes = {infoHash}, .cookie = _cookie},
+                                       group);
+    asio::error_code ec;
+    _udp.send_to(asio::buffer(message), group, 0, ec);
+    if (ec) {
+        spdlog::debug("Can't send the local announce: {}", ec.message());
+    }
+}
+
+void LocalDiscovery::_close() {
+    asio::error_code ec;
+    _udp.set_option(asio::ip::multicast::leave_group(_options.group, _options.interface), ec);
+    _udp.close(ec);
+    _ticker.cancel();
+}
+} // namespace bt::core
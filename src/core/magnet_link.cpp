@@ -0,0 +1,124 @@
+#include "core/magnet_link.hpp"
+
+#include <optional>
+#include <stdexcept>
+
+namespace bt::core {
+namespace {
+constexpr std::string_view SCHEME = "magnet:?";
+constexpr std::string_view BTIH = "urn:btih:";
+
+std::optional<uint8_t> hexValue(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return 10 + c - 'a';
+    }
+    if (c >= 'A' && c <= 'F') {
+        return 10 + c - 'A';
+    }
+    return std::nullopt;
+}
+
+std::string percentDecode(std::string_view text) {
+    std::string out;
+    out.reserve(text.size());
+    for (size_t i = 0; i < text.size(); ++i) {
+        if (text[i] == '+') {
+            out.push_back(' ');
+        } else if (text[i] == '%') {
+            auto high = i + 2 < text.size() ? hexValue(text[i + 1]) : std::nullopt;
+            auto low = i + 2 < text.size() ? hexValue(text[i + 2]) : std::nullopt;
+            if (!high || !low) {
+                throw std::invalid_argument("Bad percent escape in magnet link");
+            }
+            out.push_back(static_cast<char>(*high << 4 | *low));
+            i += 2;
+        } else {
+            out.push_back(text[i]);
+        }
+    }
+    return out;
+}
+
+Sha1Hash parseInfoHash(std::string_view text) {
+    Sha1Hash hash{};
+    if (text.size() == 2 * HASH_LENGTH) {
+        for (size_t i = 0; i < hash.size(); ++i) {
+            auto high = hexValue(text[2 * i]);
+            auto low = hexValue(text[2 * i + 1]);
+            if (!high || !low) {
+                throw std::invalid_argument("Info hash isn't hex");
+            }
+            hash[i] = static_cast<uint8_t>(*high << 4 | *low);
+        }
+        return hash;
+    }
+    if (text.size() == 32) {
+        // Base32 (RFC 4648), 32 characters of 5 bits each
+        uint64_t bits = 0;
+        int count = 0;
+        size_t out = 0;
+        for (char c : text) {
+            uint8_t value;
+            if (c >= 'A' && c <= 'Z') {
+                value = c - 'A';
+            } else if (c >= 'a' && c <= 'z') {
+                value = c - 'a';
+            } else if (c >= '2' && c <= '7') {
+                value = 26 + c - '2';
+            } else {
+                throw std::invalid_argument("Info hash isn't base32");
+            }
+            bits = bits << 5 | value;
+            count += 5;
+            if (count >= 8) {
+                count -= 8;
+                hash[out++] = static_cast<uint8_t>(bits >> count);
+            }
+        }
+        return hash;
+    }
+    throw std::invalid_argument("Info hash has an unexpected length");
+}
+} // namespace
+
+bool isMagnetLink(std::string_view uri) {
+    return uri.starts_with(SCHEME);
+}
+
+MagnetLink parseMagnetLink(std::string_view uri) {
+    if (!isMagnetLink(uri)) {
+        throw std::invalid_argument("Not a magnet link");
+    }
+    MagnetLink link{};
+    bool haveHash = false;
+
+    std::string_view query = uri.substr(SCHEME.size());
+    while (!query.empty()) {
+        auto end = query.find('&');
+        auto param = query.substr(0, end);
+        query = end == std::string_view::npos ? std::string_view{} : query.substr(end + 1);
+
+        auto eq = param.find('=');
+        if (eq == std::string_view::npos) {
+            continue;
+        }
+        auto key = param.substr(0, eq);
+        auto value = param.substr(eq + 1);
+        if (key == "xt" && value.starts_with(BTIH)) {
+            link.infoHash = parseInfoHash(value.substr(BTIH.size()));
+            haveHash = true;
+        } else if (key == "dn") {
+            link.displayName = percentDecode(value);
+        } else if (key == "tr" || key.starts_with("tr.")) {
+            link.trackers.push_back(percentDecode(value));
+        }
+    }
+    if (!haveHash) {
+        throw std::invalid_argument("Magnet link has no BitTorrent info hash");
+    }
+    return link;
+}
+} // namespace bt::core
@@ -0,0 +1,274 @@
+#include "core/metadata_fetcher.hpp"
+#include "core/frame_decoder.hpp"
+#include "core/utils.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <openssl/sha.h>
+#include <spdlog/spdlog.h>
+
+namespace bt::core {
+namespace {
+// Pieces asked of one peer at a time
+constexpr size_t REQUESTS_PER_PEER = 4;
+constexpr size_t RECEIVE_BUFFER = 64 * 1024;
+
+std::vector<uint8_t> extendedMessage(uint8_t extensionId, std::span<const uint8_t> payload) {
+    utils::HeaderWriter header;
+    header.write_u32(static_cast<uint32_t>(2 + payload.size()));
+    header.write_u8(static_cast<uint8_t>(msg::id::EXTENDED));
+    header.write_u8(extensionId);
+    std::vector<uint8_t> message(header.data().begin(), header.data().end());
+    message.insert(message.end(), payload.begin(), payload.end());
+    return message;
+}
+} // namespace
+
+MetadataAssembler::MetadataAssembler(const Sha1Hash& infoHash) : _infoHash(infoHash) {}
+
+bool MetadataAssembler::setSize(size_t size) {
+    if (_size) {
+        return *_size == size;
+    }
+    if (size == 0 || size > ext::MAX_METADATA_SIZE) {
+        return false;
+    }
+    _size = size;
+    _data.assign(size, '\0');
+    _missing = metadataPieceCount(size);
+    _received.assign(_missing, false);
+    _asked.assign(_missing, 0);
+    return true;
+}
+
+std::optional<uint32_t> MetadataAssembler::nextPiece(const std::set<uint32_t>& skip) {
+    if (!_size || _complete) {
+        return std::nullopt;
+    }
+    std::optional<uint32_t> best;
+    for (uint32_t piece = 0; piece < _received.size(); ++piece) {
+        if (_received[piece] || skip.contains(piece)) {
+            continue;
+        }
+        if (!best || _asked[piece] < _asked[*best]) {
+            best = piece;
+        }
+    }
+    if (best) {
+        ++_asked[*best];
+    }
+    return best;
+}
+
+void MetadataAssembler::release(uint32_t piece) {
+    if (piece < _asked.size() && _asked[piece] > 0) {
+        --_asked[piece];
+    }
+}
+
+bool MetadataAssembler::addPiece(uint32_t piece, std::span<const uint8_t> data) {
+    if (!_size || _complete || piece >= _received.size() || _received[piece]) {
+        return _complete;
+    }
+    size_t offset = static_cast<size_t>(piece) * ext::METADATA_PIECE_LEN;
+    size_t expected = std::min(ext::METADATA_PIECE_LEN, *_size - offset);
+    if (data.size() != expected) {
+        release(piece);
+        return false;
+    }
+    std::copy(data.begin(), data.end(), _data.begin() + offset);
+    _received[piece] = true;
+    if (--_missing > 0) {
+        return false;
+    }
+
+    Sha1Hash hash;
+    SHA1(reinterpret_cast<const unsigned char*>(_data.data()), _data.size(), hash.data());
+    if (hash != _infoHash) {
+        spdlog::warn("Fetched metadata doesn't match the info hash, starting over");
+        _reset();
+        return false;
+    }
+    _complete = true;
+    return true;
+}
+
+void MetadataAssembler::_reset() {
+    _size.reset();
+    _data.clear();
+    _received.clear();
+    _asked.clear();
+    _missing = 0;
+}
+
+MetadataFetcher::MetadataFetcher(const Sha1Hash& infoHash, std::string peerId, Options options)
+    : _infoHash(infoHash), _peerId(std::move(peerId)), _options(options),
+      _assembler(infoHash) {}
+
+std::optional<std::string> MetadataFetcher::fetch(const std::vector<Peer>& peers,
+                                                  std::chrono::milliseconds timeout) {
+    _candidates.assign(peers.begin(), peers.end());
+    _active = std::min(_options.maxPeers, _candidates.size());
+    for (size_t i = 0; i < _active; ++i) {
+        asio::co_spawn(_io, _worker(), asio::detached);
+    }
+    if (_active > 0) {
+        _io.run_for(timeout);
+    }
+    if (!_assembler.isComplete()) {
+        return std::nullopt;
+    }
+    return _assembler.data();
+}
+
+asio::awaitable<void> MetadataFetcher::_worker() {
+    while (!_candidates.empty() && !_assembler.isComplete()) {
+        Peer peer = _candidates.front();
+        _candidates.pop_front();
+        co_await _fetchFrom(peer);
+    }
+    if (--_active == 0 || _assembler.isComplete()) {
+        _io.stop();
+    }
+}
+
+asio::awaitable<void> MetadataFetcher::_fetchFrom(Peer peer) {
+    // The timer may fire after this frame is gone, so it shares the socket
+    auto socket = std::make_shared<asio::ip::tcp::socket>(_io);
+    asio::steady_timer deadline(_io);
+    auto arm = [&](std::chrono::milliseconds timeout) {
+        deadline.expires_after(timeout);
+        deadline.async_wait([socket](const asio::error_code& ec) {
+            if (!ec) {
+                socket->close();
+            }
+        });
+    };
+
+    arm(_options.connectTimeout);
+    asio::ip::tcp::endpoint endpoint(asio::ip::make_address_v4(peer.ip), peer.port);
+    auto [connectEc] =
+        co_await socket->async_connect(endpoint, asio::as_tuple(asio::use_awaitable));
+    if (connectEc) {
+        spdlog::debug("Metadata: can't connect to {}:{}", peer.getIpStr(), peer.port);
+        co_return;
+    }
+
+    arm(_options.handshakeTimeout);
+    auto handshake = serializeHandshake(_infoHash, _peerId);
+    auto [writeEc, written] = co_await asio::async_write(*socket, asio::buffer(handshake),
+                                                         asio::as_tuple(asio::use_awaitable));
+    HandshakeMsg response{};
+    auto [readEc, len] = co_await asio::async_read(*socket, asio::buffer(response),
+                                                   asio::as_tuple(asio::use_awaitable));
+    if (writeEc || readEc || !verifyHandshake(response, _infoHash) ||
+        !supportsExtensionProtocol(response)) {
+        spdlog::debug("Metadata: no usable handshake from {}:{}", peer.getIpStr(), peer.port);
+        co_return;
+    }
+
+    ExtensionHandshake ours{.extensions = {{ext::UT_METADATA, ext::UT_METADATA_ID}}};
+    auto message = extendedMessage(ext::HANDSHAKE_ID, encodeExtensionHandshake(ours));
+    co_await asio::async_write(*socket, asio::buffer(message), asio::as_tuple(asio::use_awaitable));
+
+    FrameDecoder decoder(RECEIVE_BUFFER);
+    std::optional<uint8_t> remoteId; // The peer's id for ut_metadata
+    size_t peerSize = 0;
+    std::set<uint32_t> outstanding;
+    bool done = false;
+
+    try {
+        while (!done && socket->is_open() && !_assembler.isComplete()) {
+            arm(_options.handshakeTimeout);
+            auto [ec, n] = co_await socket->async_read_some(asio::buffer(decoder.prepare()),
+                                                            asio::as_tuple(asio::use_awaitable));
+            if (ec) {
+                break;
+            }
+            decoder.commit(n);
+
+            while (auto frame = decoder.next()) {
+                if (frame->id != msg::id::EXTENDED) {
+                    continue; // Bitfields and the like, we have nothing to do with them yet
+                }
+                utils::ByteReader reader{frame->payload};
+                uint8_t extensionId = reader.readU8();
+                auto body = reader.readRemaining();
+
+                if (extensionId == ext::HANDSHAKE_ID) {
+                    auto theirs = parseExtensionHandshake(body);
+                    auto id = theirs.extensions.find(ext::UT_METADATA);
+                    if (id == theirs.extensions.end() || id->second == 0 ||
+                        !theirs.metadataSize) {
+                        done = true; // Can't help us
+                        break;
+                    }
+                    remoteId = id->second;
+                    peerSize = *theirs.metadataSize;
+                } else if (extensionId == ext::UT_METADATA_ID && remoteId) {
+                    auto [metadata, data] = parseMetadataMessage(body);
+                    if (metadata.type == MetadataMessage::Type::REQUEST) {
+                        // We have nothing to share yet
+                        auto reject = extendedMessage(
+                            *remoteId,
+                            encodeMetadataMessage({.type = MetadataMessage::Type::REJECT,
+                                                   .piece = metadata.piece}));
+                        co_await asio::async_write(*socket, asio::buffer(reject),
+                                                   asio::as_tuple(asio::use_awaitable));
+                        continue;
+                    }
+                    if (!outstanding.erase(metadata.piece)) {
+                        continue; // Not asked for, or from before a restart
+                    }
+                    if (metadata.type == MetadataMessage::Type::REJECT) {
+                        _assembler.release(metadata.piece);
+                        done = true; // The peer doesn't have it after all
+                        break;
+                    }
+                    if (_assembler.addPiece(metadata.piece, data)) {
+                        spdlog::info("Fetched metadata ({} bytes), last piece from {}:{}",
+                                     _assembler.data().size(), peer.getIpStr(), peer.port);
+                        _io.stop();
+                        co_return;
+                    }
+                }
+            }
+
+            // Keep a few pieces in flight. After a failed hash check the size is set again.
+            if (!done && remoteId) {
+                if (!_assembler.setSize(peerSize)) {
+                    spdlog::debug("Metadata: {}:{} has a different size", peer.getIpStr(),
+                                  peer.port);
+                    break;
+                }
+                std::vector<uint8_t> requests;
+                while (outstanding.size() < REQUESTS_PER_PEER) {
+                    auto piece = _assembler.nextPiece(outstanding);
+                    if (!piece) {
+                        break;
+                    }
+                    outstanding.insert(*piece);
+                    auto request = extendedMessage(
+                        *remoteId, encodeMetadataMessage(
+                                       {.type = MetadataMessage::Type::REQUEST, .piece = *piece}));
+                    requests.insert(requests.end(), request.begin(), request.end());
+                }
+                if (!requests.empty()) {
+                    co_await asio::async_write(*socket, asio::buffer(requests),
+                                               asio::as_tuple(asio::use_awaitable));
+                }
+            }
+        }
+    } catch (const std::exception& e) {
+        spdlog::debug("Metadata: dropping {}:{} after a bad message: {}", peer.getIpStr(),
+                      peer.port, e.what());
+    }
+
+    for (uint32_t piece : outstanding) {
+        _assembler.release(piece);
+    }
+    deadline.cancel();
+    socket->close();
+}
+} // namespace bt::core
@@ -2,10 +2,12 @@
 #include "core/torrent_metadata_loader.hpp"
 
 #include <algorithm>
+#include <array>
 #include <asio/io_context.hpp>
 #include <asio/ip/tcp.hpp>
 #include <cstddef>
 #include <cstdint>
+#include <openssl/sha.h>
 #include <spdlog/spdlog.h>
 
 using namespace asio::ip;
@@ -22,6 +24,10 @@ HandshakeMsg serializeHandshake(const core::Sha1Hash& infoHash, std::string_view
     size_t copy_len = std::min(sizeof(pkg.pstr), std::strlen(msg::PROTOCOL));
     std::copy_n(msg::PROTOCOL, copy_len, pkg.pstr);
 
+    for (size_t i = 0; i < sizeof(pkg.reserved); ++i) {
+        size_t shift = 8 * (sizeof(pkg.reserved) - 1 - i);
+        pkg.reserved[i] = static_cast<uint8_t>(msg::RESERVED >> shift);
+    }
     std::copy_n(infoHash.data(), 20, pkg.info_hash);
     std::copy_n(peerId.data(), 20, pkg.peer_id);
 
@@ -34,29 +40,68 @@ HandshakeMsg serializeHandshake(const core::Sha1Hash& infoHash, std::string_view
 }
 
 bool verifyHandshake(const HandshakeMsg& handshakeResponse, const Sha1Hash& expectedInfoHash) {
+    // Compare received hash against the one we expect
+    auto infoHash = handshakeInfoHash(handshakeResponse);
+    return infoHash && *infoHash == expectedInfoHash;
+}
+
+std::optional<Sha1Hash> handshakeInfoHash(const HandshakeMsg& handshake) {
     // 1. Check Protocol Length
-    if (handshakeResponse[0] != msg::LEN) {
-        return false;
+    if (handshake[0] != msg::LEN) {
+        return std::nullopt;
     }
 
     // 2. Check Protocol String
-    auto proto_start = handshakeResponse.begin() + 1;
+    auto proto_start = handshake.begin() + 1;
     auto proto_end = proto_start + msg::LEN;
 
     if (!std::equal(proto_start, proto_end, msg::PROTOCOL)) {
-        return false;
+        return std::nullopt;
     };
 
-    // 3. Check Info Hash
+    // 3. Extract Info Hash
     // Offset: 1 (len) + 19 (proto) + 8 (reserved) = 28
     const size_t info_hash_offset = 28;
-    auto hash_start = handshakeResponse.begin() + info_hash_offset;
+    Sha1Hash infoHash;
+    std::copy_n(handshake.begin() + info_hash_offset, infoHash.size(), infoHash.begin());
+    return infoHash;
+}
 
-    // Compare received hash against the one we expect
-    if (!std::equal(hash_start, hash_start + 20, expectedInfoHash.data())) {
-        return false;
-    }
+bool supportsFastExtension(const HandshakeMsg& handshake) {
+    return handshake[msg::FAST_EXTENSION_BYTE] & msg::FAST_EXTENSION_BIT;
+}
+
+bool supportsExtensionProtocol(const HandshakeMsg& handshake) {
+    return handshake[msg::EXTENSION_PROTOCOL_BYTE] & msg::EXTENSION_PROTOCOL_BIT;
+}
 
-    return true;
+std::vector<uint32_t> allowedFastSet(const Sha1Hash& infoHash, const IpAddr& ip,
+                                     uint32_t numPieces, uint32_t count) {
+    std::vector<uint32_t> pieces;
+    count = std::min(count, numPieces);
+
+    // x = (ip & 0xFFFFFF00) + info hash, then hashed over and over
+    std::array<uint8_t, 4 + 20> seed{};
+    std::copy_n(ip.begin(), 3, seed.begin());
+    std::copy(infoHash.begin(), infoHash.end(), seed.begin() + 4);
+    Sha1Hash x;
+    SHA1(seed.data(), seed.size(), x.data());
+
+    while (pieces.size() < count) {
+        for (size_t i = 0; i < 5 && pieces.size() < count; ++i) {
+            uint32_t y = (uint32_t(x[4 * i]) << 24) | (uint32_t(x[4 * i + 1]) << 16) |
+                         (uint32_t(x[4 * i + 2]) << 8) | uint32_t(x[4 * i + 3]);
+            uint32_t index = y % numPieces;
+            if (std::find(pieces.begin(), pieces.end(), index) == pieces.end()) {
+                pieces.push_back(index);
+            }
+        }
+        if (pieces.size() < count) {
+            Sha1Hash next;
+            SHA1(x.data(), x.size(), next.data());
+            x = next;
+        }
+    }
+    return pieces;
 }
 } // namespace bt::core
\ No newline at end of file
@@ -0,0 +1,142 @@
+#include "core/peer_listener.hpp"
+
+#include <memory>
+#include <spdlog/spdlog.h>
+
+namespace bt::core {
+PeerListener::PeerListener(uint16_t port, std::chrono::milliseconds handshakeTimeout, bool utp)
+    : _acceptor(_io), _port(port), _handshakeTimeout(handshakeTimeout), _utpEnabled(utp) {}
+
+PeerListener::~PeerListener() {
+    stop();
+}
+
+void PeerListener::start() {
+    asio::ip::tcp::endpoint endpoint(asio::ip::tcp::v4(), _port);
+    _acceptor.open(endpoint.protocol());
+    _acceptor.set_option(asio::ip::tcp::acceptor::reuse_address(true));
+    _acceptor.bind(endpoint);
+    _acceptor.listen();
+    spdlog::info("Listening for peers on port {}", getPort());
+
+    if (_utpEnabled) {
+        _utp = std::make_shared<UtpContext>(
+            _io, UtpContext::Options{.port = getPort(), .acceptIncoming = true});
+        try {
+            _utp->start();
+            asio::co_spawn(_io, _acceptUtpLoop(), asio::detached);
+        } catch (const std::system_error& e) {
+            spdlog::warn("Can't take uTP connections on port {}: {}", getPort(), e.what());
+            _utp.reset();
+        }
+    }
+    asio::co_spawn(_io, _acceptLoop(), asio::detached);
+    _thread = std::thread([this] { _io.run(); });
+}
+
+void PeerListener::stop() {
+    if (!_thread.joinable()) {
+        return;
+    }
+    if (_utp) {
+        // Closes on the strand, which needs the thread still running; see PeerManager::stop
+        _utp->close();
+        asio::post(_utp->getExecutor(), asio::use_future).wait();
+    }
+    _io.stop();
+    _thread.join();
+    _acceptor.close();
+}
+
+void PeerListener::addTorrent(const Sha1Hash& infoHash, Handler handler) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _torrents[infoHash] = std::move(handler);
+}
+
+void PeerListener::removeTorrent(const Sha1Hash& infoHash) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _torrents.erase(infoHash);
+}
+
+uint16_t PeerListener::getPort() const {
+    asio::error_code ec;
+    auto endpoint = _acceptor.local_endpoint(ec);
+    return ec ? _port : endpoint.port();
+}
+
+asio::awaitable<void> PeerListener::_acceptLoop() {
+    while (_acceptor.is_open()) {
+        auto [ec, socket] = co_await _acceptor.async_accept(asio::as_tuple(asio::use_awaitable));
+        if (ec == asio::error::operation_aborted) {
+            co_return;
+        }
+        if (ec) {
+            spdlog::debug("Accepting a peer failed: {}", ec.message());
+            continue;
+        }
+        asio::error_code remoteEc;
+        auto remote = socket.remote_endpoint(remoteEc);
+        if (remoteEc || !remote.address().is_v4()) {
+            continue; // Peers are IPv4 only for now
+        }
+        Peer peer{.port = remote.port(), .ip = remote.address().to_v4().to_bytes()};
+        asio::co_spawn(_io, _receiveHandshake(PeerStream(std::move(socket)), peer),
+                       asio::detached);
+    }
+}
+
+asio::awaitable<void> PeerListener::_acceptUtpLoop() {
+    while (true) {
+        auto [ec, socket] = co_await _utp->async_accept(asio::as_tuple(asio::use_awaitable));
+        if (ec) {
+            co_return; // Only fails once the context is closed
+        }
+        auto remote = socket->remote_endpoint();
+        if (!remote.address().is_v4()) {
+            socket->close();
+            continue;
+        }
+        Peer peer{.port = remote.port(), .ip = remote.address().to_v4().to_bytes()};
+        asio::co_spawn(_io, _receiveHandshake(PeerStream(std::move(socket)), peer),
+                       asio::detached);
+    }
+}
+
+asio::awaitable<void> PeerListener::_receiveHandshake(PeerStream stream, Peer peer) {
+    // The timer may fire after this frame is gone, so it shares the stream
+    auto shared = std::make_shared<PeerStream>(std::move(stream));
+    asio::steady_timer deadline(_io);
+    deadline.expires_after(_handshakeTimeout);
+    deadline.async_wait([shared](const asio::error_code& ec) {
+        if (!ec) {
+            shared->close();
+        }
+    });
+
+    HandshakeMsg handshake{};
+    auto [readEc, len] = co_await asio::async_read(*shared, asio::buffer(handshake),
+                                                   asio::as_tuple(asio::use_awaitable));
+    deadline.cancel();
+    if (readEc || !shared->is_open()) {
+        spdlog::debug("No handshake from incoming peer {}:{}", peer.getIpStr(), peer.port);
+        shared->close();
+        co_return;
+    }
+
+    auto infoHash = handshakeInfoHash(handshake);
+    Handler handler;
+    if (infoHash) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (auto it = _torrents.find(*infoHash); it != _torrents.end()) {
+            handler = it->second;
+        }
+    }
+    if (!handler) {
+        spdlog::debug("Incoming peer {}:{} wants a torrent we don't have", peer.getIpStr(),
+                      peer.port);
+        shared->close();
+        co_return;
+    }
+    handler(std::move(*shared), peer, handshake);
+}
+} // namespace bt::core
@@ -0,0 +1,106 @@
+#include "core/peer_pool.hpp"
+
+#include <algorithm>
+
+namespace bt::core {
+PeerPool::PeerPool(Clock::duration retryBackoff, Clock::duration maxRetryBackoff,
+                   uint32_t maxFailures)
+    : _retryBackoff(retryBackoff), _maxRetryBackoff(maxRetryBackoff),
+      _maxFailures(std::max<uint32_t>(maxFailures, 1)) {}
+
+bool PeerPool::add(const Peer& peer, bool local) {
+    auto [it, added] = _candidates.try_emplace(peer);
+    it->second.local = it->second.local || local;
+    return added;
+}
+
+std::optional<Peer> PeerPool::next(Clock::time_point now) {
+    auto best = _candidates.end();
+    for (auto it = _candidates.begin(); it != _candidates.end(); ++it) {
+        if (it->second.state != State::IDLE || it->second.retryAt > now) {
+            continue;
+        }
+        if (best == _candidates.end() || _betterThan(it->second, best->second)) {
+            best = it;
+        }
+    }
+
+    if (best == _candidates.end()) {
+        return std::nullopt;
+    }
+    best->second.state = State::CONNECTING;
+    best->second.tried = true;
+    return best->first;
+}
+
+void PeerPool::onConnected(const Peer& peer) {
+    auto it = _candidates.find(peer);
+    if (it != _candidates.end() && it->second.state != State::BLOCKED) {
+        it->second.state = State::CONNECTED;
+        it->second.failures = 0;
+    }
+}
+
+void PeerPool::onFailed(const Peer& peer, Clock::time_point now) {
+    auto it = _candidates.find(peer);
+    if (it == _candidates.end() || it->second.state == State::BLOCKED) {
+        return;
+    }
+
+    auto& candidate = it->second;
+    if (++candidate.failures >= _maxFailures) {
+        _candidates.erase(it);
+        return;
+    }
+
+    auto backoff = _retryBackoff;
+    for (uint32_t i = 1; i < candidate.failures && backoff < _maxRetryBackoff; ++i) {
+        backoff *= 2;
+    }
+    candidate.state = State::IDLE;
+    candidate.retryAt = now + std::min(backoff, _maxRetryBackoff);
+}
+
+void PeerPool::onClosed(const Peer& peer, double rate, Clock::time_point now) {
+    auto it = _candidates.find(peer);
+    if (it == _candidates.end() || it->second.state == State::BLOCKED) {
+        return;
+    }
+    it->second.state = State::IDLE;
+    it->second.score = rate;
+    it->second.retryAt = now + _retryBackoff;
+}
+
+void PeerPool::block(const Peer& peer) {
+    _candidates[peer].state = State::BLOCKED;
+}
+
+std::optional<PeerPool::Clock::time_point> PeerPool::nextRetry() const {
+    std::optional<Clock::time_point> earliest;
+    for (const auto& [peer, candidate] : _candidates) {
+        if (candidate.state == State::IDLE && (!earliest || candidate.retryAt < *earliest)) {
+            earliest = candidate.retryAt;
+        }
+    }
+    return earliest;
+}
+
+size_t PeerPool::size() const {
+    return _candidates.size();
+}
+
+bool PeerPool::_betterThan(const Candidate& a, const Candidate& b) {
+    // LAN peers first. Within both groups proven peers by throughput, then untried ones, then
+    // those that failed the least.
+    if (a.local != b.local) {
+        return a.local;
+    }
+    if (a.score != b.score) {
+        return a.score > b.score;
+    }
+    if (a.tried != b.tried) {
+        return !a.tried;
+    }
+    return a.failures < b.failures;
+}
+} // namespace bt::core
@@ -0,0 +1,48 @@
+#include "core/piece_cache.hpp"
+
+#include <algorithm>
+
+namespace bt::core {
+PieceCache::PieceCache(size_t capacity) : _capacity(capacity) {}
+
+bool PieceCache::read(uint32_t index, uint64_t offset, std::span<uint8_t> out) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto it = _pieces.find(index);
+    if (it == _pieces.end() || offset + out.size() > it->second.data.size()) {
+        ++_stats.misses;
+        return false;
+    }
+    ++_stats.hits;
+    _lru.splice(_lru.begin(), _lru, it->second.use);
+    std::copy_n(it->second.data.begin() + offset, out.size(), out.begin());
+    return true;
+}
+
+void PieceCache::insert(uint32_t index, std::vector<uint8_t> data) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (data.size() > _capacity) {
+        return;
+    }
+    if (auto it = _pieces.find(index); it != _pieces.end()) {
+        // Another thread read the same piece in the meantime, keep the copy we have
+        _lru.splice(_lru.begin(), _lru, it->second.use);
+        return;
+    }
+
+    while (_stats.bytes + data.size() > _capacity) {
+        auto victim = _pieces.find(_lru.back());
+        _stats.bytes -= victim->second.data.size();
+        _pieces.erase(victim);
+        _lru.pop_back();
+        ++_stats.evictions;
+    }
+    _lru.push_front(index);
+    _stats.bytes += data.size();
+    _pieces.emplace(index, Entry{.data = std::move(data), .use = _lru.begin()});
+}
+
+PieceCache::Stats PieceCache::stats() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _stats;
+}
+} // namespace bt::core
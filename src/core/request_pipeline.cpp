@@ -0,0 +1,50 @@
+#include "core/request_pipeline.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+namespace bt::core {
+RequestPipeline::RequestPipeline(uint32_t minDepth, uint32_t maxDepth, uint32_t initialDepth,
+                                 uint32_t blockLen)
+    : _minDepth(std::max<uint32_t>(minDepth, 1)), _maxDepth(std::max(maxDepth, _minDepth)),
+      _initialDepth(std::clamp(initialDepth, _minDepth, _maxDepth)), _blockLen(blockLen) {}
+
+void RequestPipeline::onBlockReceived(uint32_t bytes, Clock::duration roundTrip,
+                                      Clock::time_point now) {
+    if (!_minRoundTrip || roundTrip < *_minRoundTrip) {
+        _minRoundTrip = roundTrip;
+    }
+
+    if (!_windowStart) {
+        // The first block only marks the start, its bytes were in flight before
+        _windowStart = now;
+        return;
+    }
+
+    _windowBytes += bytes;
+    std::chrono::duration<double> elapsed = now - *_windowStart;
+    if (now - *_windowStart < RATE_WINDOW) {
+        return;
+    }
+
+    double sample = _windowBytes / elapsed.count();
+    _rate = _rate == 0.0 ? sample : 0.5 * _rate + 0.5 * sample;
+    _windowStart = now;
+    _windowBytes = 0;
+}
+
+void RequestPipeline::setPeerLimit(uint32_t reqq) {
+    _peerLimit = std::max<uint32_t>(reqq, 1);
+}
+
+uint32_t RequestPipeline::depth() const {
+    uint32_t depth = _initialDepth;
+    if (_rate > 0.0 && _minRoundTrip) {
+        double rtt = std::chrono::duration<double>(*_minRoundTrip).count();
+        double bdp = _rate * rtt / _blockLen;
+        depth = static_cast<uint32_t>(
+            std::clamp(std::ceil(DEPTH_GAIN * bdp), double(_minDepth), double(_maxDepth)));
+    }
+    return _peerLimit ? std::min(depth, *_peerLimit) : depth;
+}
+} // namespace bt::core
@@ -30,6 +30,31 @@ TorrentMetadata parseTorrentData(std::string_view path) {
     return metadata;
 }
 
+TorrentMetadata parseInfoData(std::string_view rawInfo) {
+    const auto infoDict = detail::parseRootDict(std::string(rawInfo));
+
+    TorrentMetadata metadata{};
+    metadata.info = detail::parseInfoDict(infoDict);
+    metadata.rawInfo = rawInfo;
+
+    unsigned char hash[HASH_LENGTH];
+    SHA1(reinterpret_cast<const unsigned char*>(rawInfo.data()), rawInfo.size(), hash);
+    std::copy_n(hash, HASH_LENGTH, metadata.infoHash.begin());
+
+    detail::debugLogTorrentMetadata(metadata);
+    return metadata;
+}
+
+std::vector<std::vector<std::string>> trackerTiers(const TorrentMetadata& metadata) {
+    if (!metadata.announceList.empty()) {
+        return metadata.announceList;
+    }
+    if (metadata.announce.empty()) {
+        return {};
+    }
+    return {{metadata.announce}};
+}
+
 namespace detail {
 // Parse the raw torrent data and return the root dictionary
 bencode::Dict parseRootDict(const std::string& torrentData) {
@@ -77,7 +102,12 @@ TorrentMetadata::Info parseInfoDict(const bencode::Dict& infoDict) {
 TorrentMetadata parseRootMetadata(const bencode::Dict& rootDict) {
     TorrentMetadata metadata;
     metadata.comment = bencode::extractValueFromDict<std::string>(rootDict, DictKeys::COMMENT);
-    metadata.announce = bencode::extractValueFromDict<std::string>(rootDict, DictKeys::ANNOUNCE);
+    metadata.announceList = parseAnnounceList(rootDict);
+    // Clients that know announce-list ignore announce, so it may be left out (BEP 12)
+    if (metadata.announceList.empty() || rootDict.values.contains(DictKeys::ANNOUNCE)) {
+        metadata.announce =
+            bencode::extractValueFromDict<std::string>(rootDict, DictKeys::ANNOUNCE);
+    }
     metadata.creationDate =
         bencode::extractValueFromDict<int64_t>(rootDict, DictKeys::CREATION_DATE);
 
@@ -86,10 +116,35 @@ TorrentMetadata parseRootMetadata(const bencode::Dict& rootDict) {
     metadata.info = infoDictData;
 
     metadata.infoHash = calculateInfoHash(infoDictData);
+    metadata.rawInfo = encodeInfoDict(infoDictData);
 
     return metadata;
 }
 
+// Malformed entries and tiers left empty by them are skipped
+std::vector<std::vector<std::string>> parseAnnounceList(const bencode::Dict& rootDict) {
+    std::vector<std::vector<std::string>> tiers;
+    auto it = rootDict.values.find(DictKeys::ANNOUNCE_LIST);
+    if (it == rootDict.values.end() || !std::holds_alternative<bencode::List>(it->second)) {
+        return tiers;
+    }
+    for (const auto& tierValue : std::get<bencode::List>(it->second).values) {
+        if (!std::holds_alternative<bencode::List>(tierValue)) {
+            continue;
+        }
+        std::vector<std::string> tier;
+        for (const auto& url : std::get<bencode::List>(tierValue).values) {
+            if (std::holds_alternative<std::string>(url) && !std::get<std::string>(url).empty()) {
+                tier.push_back(std::get<std::string>(url));
+            }
+        }
+        if (!tier.empty()) {
+            tiers.push_back(std::move(tier));
+        }
+    }
+    return tiers;
+}
+
 std::vector<Sha1Hash> parsePieceHashes(const std::string& piecesStr) {
     static_assert(sizeof(Sha1Hash) == HASH_LENGTH, "Sha1Hash size mismatch");
 
@@ -111,7 +166,7 @@ std::vector<Sha1Hash> parsePieceHashes(const std::string& piecesStr) {
     return pieceHashes;
 }
 
-Sha1Hash calculateInfoHash(const TorrentMetadata::Info& infoDictData) {
+std::string encodeInfoDict(const TorrentMetadata::Info& infoDictData) {
     bencode::Dict infoDict;
     infoDict.values[DictKeys::PIECE_LENGTH] = static_cast<int64_t>(infoDictData.pieceLength);
     infoDict.values[DictKeys::LENGTH] = static_cast<int64_t>(infoDictData.fileLength);
@@ -119,9 +174,14 @@ Sha1Hash calculateInfoHash(const TorrentMetadata::Info& infoDictData) {
     infoDict.values[DictKeys::PIECES] = infoDictData.rawPieces;
 
     const auto& encodedInfo = bencode::encode(infoDict);
+    return std::string(encodedInfo.begin(), encodedInfo.end());
+}
+
+Sha1Hash calculateInfoHash(const TorrentMetadata::Info& infoDictData) {
+    const auto encodedInfo = encodeInfoDict(infoDictData);
 
     unsigned char hash[HASH_LENGTH];
-    SHA1(encodedInfo.data(), encodedInfo.size(), hash);
+    SHA1(reinterpret_cast<const unsigned char*>(encodedInfo.data()), encodedInfo.size(), hash);
 
     Sha1Hash infoHash;
     std::copy_n(hash, 20, infoHash.begin());
@@ -164,6 +224,7 @@ std::string loadTorrentFile(const std::filesystem::path& path) {
 void debugLogTorrentMetadata(const TorrentMetadata& metadata) {
     spdlog::debug("Torrent Metadata:");
     spdlog::debug("  Announce URL: {}", metadata.announce);
+    spdlog::debug("  Announce tiers: {}", metadata.announceList.size());
     spdlog::debug("  Comment: {}", metadata.comment);
     spdlog::debug("  Creation Date: {}", metadata.creationDate);
     spdlog::debug("  Info Hash: {:spn}", spdlog::to_hex(metadata.infoHash));
@@ -0,0 +1,323 @@
+#include "core/tracker_announcer.hpp"
+
+#include <algorithm>
+#include <iterator>
+#include <random>
+#include <spdlog/spdlog.h>
+#include <stdexcept>
+#include <utility>
+
+namespace bt::core {
+namespace {
+// Failures in a row after which the backoff stops doubling (before maxRetryBackoff caps it)
+constexpr uint32_t MAX_BACKOFF_DOUBLINGS = 16;
+} // namespace
+
+TrackerAnnouncer::TrackerAnnouncer(asio::any_io_executor executor,
+                                   std::vector<std::vector<std::string>> tiers,
+                                   const Sha1Hash& infoHash, std::string peerId, uint16_t port,
+                                   StatsProvider stats, PeerHandler onPeers, Options options,
+                                   std::shared_ptr<UdpTrackerClient> udp, FailureHandler onFailure)
+    : _strand(asio::make_strand(executor)), _infoHash(infoHash), _peerId(std::move(peerId)),
+      _port(port), _stats(std::move(stats)), _onPeers(std::move(onPeers)),
+      _onRoundFailed(std::move(onFailure)), _options(options), _udp(std::move(udp)), _wakeup(_strand), _interval(options.interval),
+      _minInterval(std::min(options.minInterval, options.interval)) {
+    std::mt19937 random(std::random_device{}());
+    for (auto& urls : tiers) {
+        std::vector<std::shared_ptr<Tracker>> tier;
+        for (auto& url : urls) {
+            tier.push_back(std::make_shared<Tracker>(Tracker{.url = std::move(url)}));
+        }
+        if (!tier.empty()) {
+            std::shuffle(tier.begin(), tier.end(), random);
+            _tiers.push_back(std::move(tier));
+        }
+    }
+}
+
+void TrackerAnnouncer::start() {
+    asio::post(_strand, [this, self = shared_from_this()] {
+        if (_running || _stopped) {
+            return;
+        }
+        _running = true;
+        _next = Clock::now();
+        asio::co_spawn(_strand, _run(), asio::detached);
+    });
+}
+
+void TrackerAnnouncer::completed() {
+    asio::post(_strand, [this, self = shared_from_this()] {
+        _completed = true;
+        if (_last != Clock::time_point{}) {
+            _schedule(_last + _minInterval);
+        }
+    });
+}
+
+std::future<void> TrackerAnnouncer::stop() {
+    auto done = std::make_shared<std::promise<void>>();
+    auto future = done->get_future();
+    asio::post(_strand, [this, self = shared_from_this(), done] {
+        if (_stopped) {
+            done->set_value();
+            return;
+        }
+        _stopped = done;
+        if (!_running) {
+            done->set_value();
+            return;
+        }
+        _wakeup.cancel();
+    });
+    return future;
+}
+
+asio::awaitable<void> TrackerAnnouncer::_run() {
+    auto self = shared_from_this();
+    while (!_stopped) {
+        _wakeup.expires_at(_next);
+        co_await _wakeup.async_wait(asio::as_tuple(asio::use_awaitable));
+        if (_stopped) {
+            break;
+        }
+        if (Clock::now() < _next) {
+            continue; // Rescheduled while we slept
+        }
+
+        auto stats = _stats();
+        auto round = co_await _announceRound(stats);
+        if (_stopped) {
+            break;
+        }
+        if (!round) {
+            if (_onRoundFailed) {
+                _onRoundFailed(_lastError);
+            }
+            // Every tracker failed, try again once the first one's backoff ran out
+            auto next = Clock::time_point::max();
+            for (const auto& tier : _tiers) {
+                for (const auto& tracker : tier) {
+                    if (!tracker->busy) {
+                        next = std::min(next, tracker->retryAt);
+                    }
+                }
+            }
+            _next = next != Clock::time_point::max() ? next : Clock::now() + _options.retryBackoff;
+            continue;
+        }
+
+        const auto& response = round->response;
+        _last = Clock::now();
+        if (response.interval > 0) {
+            _interval = std::chrono::seconds(response.interval);
+        }
+        _minInterval = response.minInterval ? std::chrono::seconds(*response.minInterval)
+                                            : _options.minInterval;
+        _minInterval = std::clamp(_minInterval, std::chrono::seconds(1), _interval);
+        // Short of peers or with news, ask again as early as the tracker lets us
+        bool early = stats.numWant > 0 || (_completed && !round->winner->completed);
+        _next = _last + (early ? _minInterval : _interval);
+        spdlog::info("{} answered, next announce in {}s", round->winner->url,
+                     std::chrono::duration_cast<std::chrono::seconds>(_next - _last).count());
+    }
+
+    std::vector<std::shared_ptr<Tracker>> known;
+    for (const auto& tier : _tiers) {
+        std::copy_if(tier.begin(), tier.end(), std::back_inserter(known),
+                     [](const auto& tracker) { return tracker->started; });
+    }
+    if (!known.empty()) {
+        co_await _await(_startRound(known, _stats(), true), true, Clock::now() + _options.timeout);
+    }
+    _running = false;
+    _stopped->set_value();
+}
+
+asio::awaitable<std::shared_ptr<TrackerAnnouncer::Round>>
+TrackerAnnouncer::_announceRound(Stats stats) {
+    for (const auto& tier : _tiers) {
+        auto now = Clock::now();
+        std::vector<std::shared_ptr<Tracker>> candidates;
+        std::copy_if(tier.begin(), tier.end(), std::back_inserter(candidates),
+                     [&](const auto& tracker) { return !tracker->busy && tracker->retryAt <= now; });
+        if (candidates.empty()) {
+            continue; // All backing off, fail over to the next tier
+        }
+        auto round = _startRound(candidates, stats, false);
+        co_await _await(round, false, Clock::now() + _options.timeout);
+        if (round->winner) {
+            _promote(round->winner);
+            co_return round;
+        }
+        if (_stopped) {
+            break;
+        }
+        // A tracker that doesn't answer in time mustn't hold up the next tier
+        for (const auto& tracker : candidates) {
+            if (tracker->busy && !tracker->timedOut) {
+                tracker->timedOut = true;
+                _onFailure(*tracker, AnnounceEvent::None, "Tracker didn't answer in time");
+            }
+        }
+    }
+    co_return nullptr;
+}
+
+std::shared_ptr<TrackerAnnouncer::Round>
+TrackerAnnouncer::_startRound(const std::vector<std::shared_ptr<Tracker>>& trackers,
+                              const Stats& stats, bool stopping) {
+    auto round = std::make_shared<Round>();
+    round->pending = trackers.size();
+    for (const auto& tracker : trackers) {
+        auto event = stopping ? AnnounceEvent::Stopped : _eventFor(*tracker);
+        tracker->busy = true;
+        asio::co_spawn(_strand, _announce(tracker->url, event, stats),
+                       [this, self = shared_from_this(), tracker, round, event,
+                        stats](std::exception_ptr error, TrackerResponse response) {
+                           tracker->busy = false;
+                           bool counted = std::exchange(tracker->timedOut, false);
+                           --round->pending;
+                           if (error) {
+                               std::string what = "unknown error";
+                               try {
+                                   std::rethrow_exception(error);
+                               } catch (const std::exception& e) {
+                                   what = e.what();
+                               } catch (...) {
+                               }
+                               if (counted) {
+                                   spdlog::debug("Announce to {} failed: {}", tracker->url, what);
+                               } else {
+                                   _onFailure(*tracker, event, what);
+                               }
+                           } else {
+                               _onAnswer(*tracker, event, stats, response);
+                               if (!round->winner) {
+                                   round->winner = tracker;
+                                   round->response = std::move(response);
+                               }
+                           }
+                           _wakeup.cancel();
+                       });
+    }
+    return round;
+}
+
+asio::awaitable<void> TrackerAnnouncer::_await(std::shared_ptr<Round> round, bool all,
+                                               Clock::time_point deadline) {
+    while (round->pending > 0 && (all || !round->winner) && (all || !_stopped) &&
+           Clock::now() < deadline) {
+        _wakeup.expires_at(deadline);
+        co_await _wakeup.async_wait(asio::as_tuple(asio::use_awaitable));
+    }
+}
+
+void TrackerAnnouncer::_onAnswer(Tracker& tracker, AnnounceEvent event, const Stats& stats,
+                                 const TrackerResponse& response) {
+    tracker.failures = 0;
+    tracker.retryAt = {};
+    if (event == AnnounceEvent::Started) {
+        tracker.started = true;
+        tracker.completed = stats.left == 0; // Complete from the start isn't news
+    } else if (event == AnnounceEvent::Completed) {
+        tracker.completed = true;
+    } else if (event == AnnounceEvent::Stopped) {
+        tracker.started = false;
+        return;
+    }
+    auto peers = _toPeers(response.peersBlob);
+    spdlog::debug("{} sent {} peers", tracker.url, peers.size());
+    if (!_stopped) {
+        _onPeers(std::move(peers));
+    }
+}
+
+void TrackerAnnouncer::_onFailure(Tracker& tracker, AnnounceEvent event,
+                                  const std::string& error) {
+    if (event == AnnounceEvent::Stopped || _stopped) {
+        spdlog::debug("Announce to {} failed: {}", tracker.url, error);
+        return;
+    }
+    auto backoff =
+        std::min(_options.retryBackoff * (1u << std::min(tracker.failures, MAX_BACKOFF_DOUBLINGS)),
+                 _options.maxRetryBackoff);
+    ++tracker.failures;
+    tracker.retryAt = Clock::now() + backoff;
+    _lastError = error;
+    spdlog::warn("Announce to {} failed: {}, next try in {:.1f}s", tracker.url, error,
+                 std::chrono::duration<double>(backoff).count());
+}
+
+AnnounceEvent TrackerAnnouncer::_eventFor(const Tracker& tracker) const {
+    if (!tracker.started) {
+        return AnnounceEvent::Started;
+    }
+    if (_completed && !tracker.completed) {
+        return AnnounceEvent::Completed;
+    }
+    return AnnounceEvent::None;
+}
+
+void TrackerAnnouncer::_promote(const std::shared_ptr<Tracker>& tracker) {
+    for (auto& tier : _tiers) {
+        auto it = std::find(tier.begin(), tier.end(), tracker);
+        if (it != tier.end()) {
+            std::rotate(tier.begin(), it, it + 1);
+            return;
+        }
+    }
+}
+
+asio::awaitable<TrackerResponse> TrackerAnnouncer::_announce(std::string url, AnnounceEvent event,
+                                                             Stats stats) {
+    AnnounceRequest request{.uploaded = stats.uploaded,
+                            .downloaded = stats.downloaded,
+                            .left = stats.left,
+                            .event = event};
+    if (stats.numWant > 0) {
+        request.numWant = stats.numWant;
+    }
+    if (url.starts_with("udp://")) {
+        if (!_udp) {
+            throw std::runtime_error("UDP trackers aren't enabled");
+        }
+        auto response = co_await _udp->announce(url, _infoHash, _peerId, _port, request,
+                                                Clock::now() + _options.timeout);
+        co_return response;
+    }
+    auto announceUrl = detail::buildAnnounceUrl(url, _infoHash, _peerId, _port, request);
+    spdlog::debug("Announcing to tracker: {}", announceUrl);
+
+    auto body = co_await _httpGet(std::move(announceUrl));
+    co_return detail::parseTrackerResponse(body);
+}
+
+asio::awaitable<std::string> TrackerAnnouncer::_httpGet(std::string url) {
+    // cpr blocks until the tracker answered, following redirects on the way
+    auto get = [url = std::move(url),
+                timeout = _options.timeout]() -> asio::awaitable<std::string> {
+        co_return detail::announceToTracker(url, timeout).text;
+    };
+    auto body = co_await asio::co_spawn(_blocking, std::move(get), asio::use_awaitable);
+    co_return body;
+}
+
+void TrackerAnnouncer::_schedule(Clock::time_point when) {
+    if (when < _next) {
+        _next = when;
+        _wakeup.cancel();
+    }
+}
+
+std::vector<Peer> TrackerAnnouncer::_toPeers(const std::vector<std::array<uint8_t, 6>>& peersBlob) {
+    std::vector<Peer> peers;
+    peers.reserve(peersBlob.size());
+    for (const auto& entry : peersBlob) {
+        Peer peer{.port = static_cast<uint16_t>(entry[4] << 8 | entry[5])};
+        std::copy_n(entry.begin(), 4, peer.ip.begin());
+        peers.push_back(peer);
+    }
+    return peers;
+}
+} // namespace bt::core
@@ -15,11 +15,12 @@
 
 namespace bt::core {
 
-TrackerResponse announceAndGetPeers(const TorrentMetadata& metadata, std::string_view peerId) {
+TrackerResponse announceAndGetPeers(const TorrentMetadata& metadata, std::string_view peerId,
+                                    uint16_t port) {
     spdlog::debug("Announcing to tracker: {}", metadata.announce);
 
     spdlog::debug("Successfully generated a random id: {}", peerId);
-    const auto url = detail::buildTrackerUrl(metadata, peerId);
+    const auto url = detail::buildTrackerUrl(metadata, peerId, port);
     spdlog::debug("Built the tracker url: {}", url);
 
     const auto resp = detail::announceToTracker(url);
@@ -44,34 +45,59 @@ std::string generateId(int length) {
 }
 
 namespace detail {
-std::string buildTrackerUrl(const TorrentMetadata& metadata, std::string_view peerId) {
+std::string buildTrackerUrl(const TorrentMetadata& metadata, std::string_view peerId,
+                            uint16_t port) {
+    return buildAnnounceUrl(metadata.announce, metadata.infoHash, peerId, port,
+                            {.left = metadata.info.fileLength});
+}
+
+std::string buildAnnounceUrl(std::string_view announce, const Sha1Hash& infoHash,
+                             std::string_view peerId, uint16_t port,
+                             const AnnounceRequest& request) {
 
-    std::string_view infoHashView(reinterpret_cast<const char*>(metadata.infoHash.data()),
-                                  metadata.infoHash.size());
-    auto finalUrl = ada::parse(metadata.announce);
+    std::string_view infoHashView(reinterpret_cast<const char*>(infoHash.data()),
+                                  infoHash.size());
+    auto finalUrl = ada::parse(announce);
+    if (!finalUrl.has_value()) {
+        throw std::runtime_error{"Failed to build tracker URL"};
+    }
 
     ada::url_search_params params;
 
     params.append("info_hash", infoHashView);
     params.append("peer_id", peerId);
-    params.append("uploaded", "0");
-    params.append("downloaded", "0");
+    params.append("port", std::to_string(port));
+    params.append("uploaded", std::to_string(request.uploaded));
+    params.append("downloaded", std::to_string(request.downloaded));
     params.append("compact", "1");
-    params.append("left", std::to_string(metadata.info.fileLength));
+    params.append("left", std::to_string(request.left));
+    switch (request.event) {
+    case AnnounceEvent::Started:
+        params.append("event", "started");
+        break;
+    case AnnounceEvent::Completed:
+        params.append("event", "completed");
+        break;
+    case AnnounceEvent::Stopped:
+        params.append("event", "stopped");
+        break;
+    case AnnounceEvent::None:
+        break;
+    }
+    if (request.numWant) {
+        params.append("numwant", std::to_string(*request.numWant));
+    }
 
     finalUrl->set_search(params.to_string());
-    if (finalUrl.has_value()) {
-        return std::string{finalUrl.value().get_href()};
-    } else {
-        throw std::runtime_error{"Failed to build tracker URL"};
-    }
+    return std::string{finalUrl.value().get_href()};
 }
 
-cpr::Response announceToTracker(std::string_view url) {
-    const auto r = cpr::Get(cpr::Url{url});
+cpr::Response announceToTracker(std::string_view url, std::chrono::milliseconds timeout) {
+    const auto r = cpr::Get(cpr::Url{url}, cpr::Timeout{timeout});
     if (r.status_code != 200) {
-        std::string msg = "Announcing failed: " + r.error.message;
-        throw std::runtime_error(msg);
+        std::string reason =
+            r.error ? r.error.message : "HTTP status " + std::to_string(r.status_code);
+        throw std::runtime_error("Announcing failed: " + reason);
     }
 
     spdlog::debug("Announce response status code: {}", r.status_code);
@@ -88,11 +114,21 @@ TrackerResponse parseTrackerResponse(const std::string_view response) {
     }
     const auto& dict = std::get<bencode::Dict>(parsedResponse);
 
+    if (auto it = dict.values.find("failure reason");
+        it != dict.values.end() && std::holds_alternative<std::string>(it->second)) {
+        throw std::runtime_error("Tracker refused the announce: " +
+                                 std::get<std::string>(it->second));
+    }
+
     const auto interval = bencode::extractValueFromDict<int64_t>(dict, "interval");
     const auto& peerBlob = bencode::extractValueFromDict<std::string>(dict, "peers");
 
     TrackerResponse result;
     result.interval = static_cast<int>(interval);
+    if (auto it = dict.values.find("min interval");
+        it != dict.values.end() && std::holds_alternative<int64_t>(it->second)) {
+        result.minInterval = static_cast<int>(std::get<int64_t>(it->second));
+    }
     result.peersBlob = toSixByteArrays(peerBlob);
     return result;
 }
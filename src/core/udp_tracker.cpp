@@ -0,0 +1,278 @@
+#include "core/udp_tracker.hpp"
+#include "core/utils.hpp"
+
+#include <ada.h>
+#include <spdlog/spdlog.h>
+#include <stdexcept>
+
+namespace bt::core {
+namespace udp_tracker {
+namespace {
+void writeU64(utils::ByteWriter& writer, uint64_t value) {
+    writer.write_u32(static_cast<uint32_t>(value >> 32));
+    writer.write_u32(static_cast<uint32_t>(value));
+}
+
+uint64_t readU64(utils::ByteReader& reader) {
+    uint64_t high = reader.readU32();
+    return high << 32 | reader.readU32();
+}
+
+uint32_t eventCode(AnnounceEvent event) {
+    switch (event) {
+    case AnnounceEvent::Completed:
+        return 1;
+    case AnnounceEvent::Started:
+        return 2;
+    case AnnounceEvent::Stopped:
+        return 3;
+    case AnnounceEvent::None:
+        break;
+    }
+    return 0;
+}
+} // namespace
+
+std::vector<uint8_t> encodeConnect(uint32_t transactionId) {
+    utils::ByteWriter writer;
+    writeU64(writer, PROTOCOL_ID);
+    writer.write_u32(static_cast<uint32_t>(Action::CONNECT));
+    writer.write_u32(transactionId);
+    return writer.data();
+}
+
+std::vector<uint8_t> encodeAnnounce(uint64_t connectionId, uint32_t transactionId,
+                                    const Sha1Hash& infoHash, std::string_view peerId,
+                                    uint16_t port, uint32_t key, const AnnounceRequest& request) {
+    if (peerId.size() != HASH_LENGTH) {
+        throw std::invalid_argument("Peer id must be 20 bytes");
+    }
+    utils::ByteWriter writer;
+    writeU64(writer, connectionId);
+    writer.write_u32(static_cast<uint32_t>(Action::ANNOUNCE));
+    writer.write_u32(transactionId);
+    for (uint8_t byte : infoHash) {
+        writer.write_u8(byte);
+    }
+    for (char c : peerId) {
+        writer.write_u8(static_cast<uint8_t>(c));
+    }
+    writeU64(writer, request.downloaded);
+    writeU64(writer, request.left);
+    writeU64(writer, request.uploaded);
+    writer.write_u32(eventCode(request.event));
+    writer.write_u32(0); // Our IP address, the tracker uses the sender's
+    writer.write_u32(key);
+    writer.write_u32(request.numWant ? *request.numWant : static_cast<uint32_t>(-1));
+    writer.write_u8(static_cast<uint8_t>(port >> 8));
+    writer.write_u8(static_cast<uint8_t>(port & 0xFF));
+    return writer.data();
+}
+
+std::optional<Reply> parseReply(std::span<const uint8_t> datagram) {
+    if (datagram.size() < 8) {
+        return std::nullopt;
+    }
+    utils::ByteReader reader(datagram);
+    Reply reply{};
+    reply.action = static_cast<Action>(reader.readU32());
+    reply.transactionId = reader.readU32();
+    reply.body = reader.readRemaining();
+    return reply;
+}
+
+TrackerResponse parseAnnounceReply(std::span<const uint8_t> body) {
+    if (body.size() < ANNOUNCE_REPLY_HEADER_LEN - 8) {
+        throw std::runtime_error("UDP tracker sent a short announce reply");
+    }
+    utils::ByteReader reader(body);
+    TrackerResponse response{};
+    response.interval = static_cast<int>(reader.readU32());
+    reader.readU32(); // Leechers
+    reader.readU32(); // Seeders
+    auto peers = reader.readRemaining();
+    for (size_t pos = 0; pos + 6 <= peers.size(); pos += 6) {
+        std::array<uint8_t, 6> peer{};
+        std::copy_n(peers.begin() + pos, 6, peer.begin());
+        response.peersBlob.push_back(peer);
+    }
+    return response;
+}
+} // namespace udp_tracker
+
+UdpTrackerClient::UdpTrackerClient(asio::io_context& io, Options options)
+    : _strand(asio::make_strand(io)), _udp(_strand), _options(options),
+      _random(std::random_device{}()), _key(_random()) {}
+
+void UdpTrackerClient::start() {
+    asio::ip::udp::endpoint endpoint(asio::ip::udp::v4(), _options.port);
+    _udp.open(endpoint.protocol());
+    _udp.bind(endpoint);
+    _udp.non_blocking(true);
+    spdlog::debug("UDP tracker client on port {}", getPort());
+
+    asio::co_spawn(
+        _strand, [self = shared_from_this()] { return self->_receiveLoop(); }, asio::detached);
+}
+
+void UdpTrackerClient::close() {
+    asio::dispatch(_strand, [self = shared_from_this()] { self->_close(); });
+}
+
+uint16_t UdpTrackerClient::getPort() const {
+    asio::error_code ec;
+    auto endpoint = _udp.local_endpoint(ec);
+    return ec ? 0 : endpoint.port();
+}
+
+asio::awaitable<TrackerResponse>
+UdpTrackerClient::announce(std::string url, Sha1Hash infoHash, std::string peerId, uint16_t port,
+                           AnnounceRequest request,
+                           std::chrono::steady_clock::time_point deadline) {
+    auto announce = [self = shared_from_this(), url = std::move(url), infoHash,
+                     peerId = std::move(peerId), port, request, deadline]() mutable {
+        return self->_announce(std::move(url), infoHash, std::move(peerId), port, request,
+                               deadline);
+    };
+    auto response = co_await asio::co_spawn(_strand, std::move(announce), asio::use_awaitable);
+    co_return response;
+}
+
+asio::awaitable<TrackerResponse>
+UdpTrackerClient::_announce(std::string url, Sha1Hash infoHash, std::string peerId,
+                            uint16_t port, AnnounceRequest request,
+                            std::chrono::steady_clock::time_point deadline) {
+    auto to = co_await _resolve(url);
+    for (uint32_t attempt = 0; attempt <= _options.maxRetransmits; ++attempt) {
+        auto now = std::chrono::steady_clock::now();
+        if (now >= deadline) {
+            throw std::runtime_error("UDP tracker didn't answer in time");
+        }
+        // The last wait is cut short by the deadline
+        auto timeout = std::min<std::chrono::milliseconds>(
+            _options.baseTimeout * (1u << attempt),
+            std::chrono::ceil<std::chrono::milliseconds>(deadline - now));
+
+        auto connection = _connections.find(to);
+        if (connection == _connections.end() || connection->second.expires <= now) {
+            uint32_t transactionId = _random();
+            auto datagram =
+                co_await _exchange(to, transactionId, udp_tracker::encodeConnect(transactionId),
+                                   timeout);
+            if (!datagram) {
+                continue;
+            }
+            auto reply = udp_tracker::parseReply(*datagram);
+            if (reply->action == udp_tracker::Action::ERROR) {
+                throw std::runtime_error(
+                    "Tracker refused to connect: " +
+                    std::string(reply->body.begin(), reply->body.end()));
+            }
+            if (reply->action != udp_tracker::Action::CONNECT || reply->body.size() < 8) {
+                throw std::runtime_error("UDP tracker sent a malformed connect reply");
+            }
+            utils::ByteReader reader(reply->body);
+            connection = _connections.insert_or_assign(
+                to, Connection{udp_tracker::readU64(reader), now + CONNECTION_ID_LIFETIME}).first;
+        }
+
+        // The entry may be gone once we resume
+        uint64_t connectionId = connection->second.id;
+        uint32_t transactionId = _random();
+        auto datagram = co_await _exchange(
+            to, transactionId,
+            udp_tracker::encodeAnnounce(connectionId, transactionId, infoHash, peerId, port, _key,
+                                        request),
+            timeout);
+        if (!datagram) {
+            continue;
+        }
+        auto reply = udp_tracker::parseReply(*datagram);
+        if (reply->action == udp_tracker::Action::ERROR) {
+            _connections.erase(to); // Maybe the tracker forgot our connection id
+            throw std::runtime_error("Tracker refused the announce: " +
+                                     std::string(reply->body.begin(), reply->body.end()));
+        }
+        if (reply->action != udp_tracker::Action::ANNOUNCE) {
+            throw std::runtime_error("UDP tracker sent a malformed announce reply");
+        }
+        co_return udp_tracker::parseAnnounceReply(reply->body);
+    }
+    throw std::runtime_error("UDP tracker didn't answer");
+}
+
+asio::awaitable<UdpTrackerClient::Endpoint> UdpTrackerClient::_resolve(std::string url) {
+    auto parsed = ada::parse(url);
+    if (!parsed || parsed->get_protocol() != "udp:" || parsed->get_port().empty()) {
+        throw std::runtime_error("Invalid UDP tracker URL: " + url);
+    }
+    asio::ip::udp::resolver resolver(_strand);
+    auto [ec, endpoints] = co_await resolver.async_resolve(
+        asio::ip::udp::v4(), std::string(parsed->get_hostname()),
+        std::string(parsed->get_port()), asio::as_tuple(asio::use_awaitable));
+    if (ec || endpoints.empty()) {
+        throw std::runtime_error("Can't resolve " + std::string(parsed->get_hostname()) + ": " +
+                                 ec.message());
+    }
+    co_return endpoints.begin()->endpoint();
+}
+
+asio::awaitable<std::optional<std::vector<uint8_t>>>
+UdpTrackerClient::_exchange(const Endpoint& to, uint32_t transactionId,
+                            std::vector<uint8_t> datagram, std::chrono::milliseconds timeout) {
+    if (!_udp.is_open()) {
+        throw std::runtime_error("UDP tracker client is closed");
+    }
+    auto transaction = std::make_shared<Transaction>(_strand);
+    transaction->to = to;
+    _transactions[transactionId] = transaction;
+
+    asio::error_code ec;
+    _udp.send_to(asio::buffer(datagram), to, 0, ec);
+    if (ec) {
+        // Counts as unanswered, so a dead route doesn't use up the retransmissions at once
+        spdlog::debug("Can't send to UDP tracker {}: {}", to.address().to_string(), ec.message());
+    }
+    transaction->answered.expires_after(timeout);
+    co_await transaction->answered.async_wait(asio::as_tuple(asio::use_awaitable));
+    _transactions.erase(transactionId);
+
+    if (!_udp.is_open()) {
+        throw std::runtime_error("UDP tracker client is closed");
+    }
+    co_return std::move(transaction->reply);
+}
+
+asio::awaitable<void> UdpTrackerClient::_receiveLoop() {
+    std::vector<uint8_t> buffer(64 * 1024);
+    Endpoint from;
+    while (_udp.is_open()) {
+        auto [ec, n] = co_await _udp.async_receive_from(asio::buffer(buffer), from,
+                                                        asio::as_tuple(asio::use_awaitable));
+        if (ec == asio::error::operation_aborted || !_udp.is_open()) {
+            co_return;
+        }
+        if (ec) {
+            continue; // ICMP errors of earlier sends show up here
+        }
+        auto reply = udp_tracker::parseReply(std::span<const uint8_t>(buffer.data(), n));
+        if (!reply) {
+            continue;
+        }
+        auto it = _transactions.find(reply->transactionId);
+        if (it == _transactions.end() || it->second->to != from || it->second->reply) {
+            continue; // Late, forged or a duplicate
+        }
+        it->second->reply.emplace(buffer.begin(), buffer.begin() + n);
+        it->second->answered.cancel();
+    }
+}
+
+void UdpTrackerClient::_close() {
+    asio::error_code ec;
+    _udp.close(ec);
+    for (auto& [id, transaction] : _transactions) {
+        transaction->answered.cancel();
+    }
+}
+} // namespace bt::core
@@ -18,6 +18,25 @@ const std::vector<uint8_t>& ByteWriter::data() const {
     return _data;
 }
 
+void HeaderWriter::write_u32(uint32_t val) {
+    if (_size + 4 > CAPACITY)
+        throw std::length_error("Header too long");
+
+    uint32_t net = htonl(val);
+    std::memcpy(_data.data() + _size, &net, 4);
+    _size += 4;
+}
+
+void HeaderWriter::write_u8(uint8_t val) {
+    if (_size + 1 > CAPACITY)
+        throw std::length_error("Header too long");
+    _data[_size++] = val;
+}
+
+std::span<const uint8_t> HeaderWriter::data() const {
+    return {_data.data(), _size};
+}
+
 ByteReader::ByteReader(std::span<const uint8_t> buffer) : _buffer(buffer) {}
 
 uint32_t ByteReader::readU32() {
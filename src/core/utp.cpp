@@ -0,0 +1,900 @@
+#include "core/utp.hpp"
+
+#include <algorithm>
+#include <spdlog/spdlog.h>
+#include <system_error>
+
+#ifdef __linux__
+#include <netinet/in.h>
+#include <sys/socket.h>
+#endif
+
+namespace bt::core {
+namespace {
+using Clock = std::chrono::steady_clock;
+using namespace std::chrono_literals;
+
+// Datagram sizes (uTP header included): any IPv4 path takes 576 byte packets, Ethernet 1500
+constexpr size_t MIN_DATAGRAM = 576 - 28;
+constexpr size_t MAX_DATAGRAM = 1500 - 28;
+// Probing stops once floor and ceiling are this close
+constexpr size_t MTU_PRECISION = 16;
+// Header plus room for a selective ack
+constexpr size_t PACKET_OVERHEAD = utp::HEADER_LEN + 2 + utp::SELECTIVE_ACK_BITS / 8;
+
+constexpr size_t SEND_BUFFER = 256 * 1024;
+constexpr uint32_t RECEIVE_WINDOW = 1024 * 1024;
+constexpr size_t INITIAL_WINDOW_PACKETS = 4;
+// Out of order packets further ahead than this are dropped
+constexpr int16_t MAX_REORDER = 0x1000;
+
+constexpr Clock::duration TICK = 100ms;
+constexpr Clock::duration INITIAL_TIMEOUT = 1s;
+constexpr Clock::duration MIN_TIMEOUT = 500ms;
+constexpr Clock::duration MAX_TIMEOUT = 60s;
+constexpr uint32_t MAX_TIMEOUTS = 6;
+constexpr Clock::duration KEEPALIVE = 29s;
+constexpr size_t ACCEPT_BACKLOG = 32;
+// Packets acked after a missing one before it counts as lost
+constexpr size_t DUPLICATE_ACK_THRESHOLD = 3;
+
+uint32_t nowMicros() {
+    return static_cast<uint32_t>(
+        std::chrono::duration_cast<std::chrono::microseconds>(Clock::now().time_since_epoch())
+            .count());
+}
+
+int16_t seqDiff(uint16_t a, uint16_t b) {
+    return static_cast<int16_t>(static_cast<uint16_t>(a - b));
+}
+
+void put16(std::vector<uint8_t>& out, uint16_t value) {
+    out.push_back(static_cast<uint8_t>(value >> 8));
+    out.push_back(static_cast<uint8_t>(value));
+}
+
+void put32(std::vector<uint8_t>& out, uint32_t value) {
+    put16(out, static_cast<uint16_t>(value >> 16));
+    put16(out, static_cast<uint16_t>(value));
+}
+
+uint16_t get16(std::span<const uint8_t> in, size_t pos) {
+    return static_cast<uint16_t>(in[pos] << 8 | in[pos + 1]);
+}
+
+uint32_t get32(std::span<const uint8_t> in, size_t pos) {
+    return static_cast<uint32_t>(get16(in, pos)) << 16 | get16(in, pos + 2);
+}
+} // namespace
+
+namespace utp {
+std::vector<uint8_t> encodePacket(const PacketHeader& header, std::span<const uint8_t> selectiveAck,
+                                  std::span<const uint8_t> payload) {
+    std::vector<uint8_t> out;
+    out.reserve(HEADER_LEN + (selectiveAck.empty() ? 0 : 2 + selectiveAck.size()) +
+                payload.size());
+    out.push_back(static_cast<uint8_t>(static_cast<uint8_t>(header.type) << 4 | VERSION));
+    out.push_back(selectiveAck.empty() ? 0 : EXTENSION_SELECTIVE_ACK);
+    put16(out, header.connectionId);
+    put32(out, header.timestamp);
+    put32(out, header.timestampDiff);
+    put32(out, header.windowSize);
+    put16(out, header.seqNr);
+    put16(out, header.ackNr);
+    if (!selectiveAck.empty()) {
+        out.push_back(0); // No further extension
+        out.push_back(static_cast<uint8_t>(selectiveAck.size()));
+        out.insert(out.end(), selectiveAck.begin(), selectiveAck.end());
+    }
+    out.insert(out.end(), payload.begin(), payload.end());
+    return out;
+}
+
+std::optional<Packet> parsePacket(std::span<const uint8_t> datagram) {
+    if (datagram.size() < HEADER_LEN || (datagram[0] & 0x0F) != VERSION ||
+        (datagram[0] >> 4) > static_cast<uint8_t>(PacketType::SYN)) {
+        return std::nullopt;
+    }
+    Packet packet{.header = {.type = static_cast<PacketType>(datagram[0] >> 4),
+                             .connectionId = get16(datagram, 2),
+                             .timestamp = get32(datagram, 4),
+                             .timestampDiff = get32(datagram, 8),
+                             .windowSize = get32(datagram, 12),
+                             .seqNr = get16(datagram, 16),
+                             .ackNr = get16(datagram, 18)}};
+
+    // Extensions form a chain: type of the next one, length, data
+    uint8_t extension = datagram[1];
+    size_t pos = HEADER_LEN;
+    while (extension != 0) {
+        if (pos + 2 > datagram.size()) {
+            return std::nullopt;
+        }
+        uint8_t next = datagram[pos];
+        size_t len = datagram[pos + 1];
+        pos += 2;
+        if (pos + len > datagram.size()) {
+            return std::nullopt;
+        }
+        if (extension == EXTENSION_SELECTIVE_ACK) {
+            packet.selectiveAck.assign(datagram.begin() + pos, datagram.begin() + pos + len);
+        }
+        pos += len;
+        extension = next;
+    }
+    packet.payload = datagram.subspan(pos);
+    return packet;
+}
+} // namespace utp
+
+// -- UtpContext ------------------------------------------------------------------------------
+
+UtpContext::UtpContext(asio::io_context& io, Options options)
+    : _strand(asio::make_strand(io)), _udp(_strand), _tick(_strand), _options(options),
+      _random(std::random_device{}()) {}
+
+void UtpContext::start() {
+    asio::ip::udp::endpoint endpoint(asio::ip::udp::v4(), _options.port);
+    _udp.open(endpoint.protocol());
+    _udp.bind(endpoint);
+    _udp.non_blocking(true);
+    spdlog::debug("uTP on UDP port {}", getPort());
+
+    asio::co_spawn(
+        _strand, [self = shared_from_this()] { return self->_receiveLoop(); }, asio::detached);
+    asio::co_spawn(
+        _strand, [self = shared_from_this()] { return self->_tickLoop(); }, asio::detached);
+}
+
+void UtpContext::close() {
+    asio::dispatch(_strand, [self = shared_from_this()] { self->_close(); });
+}
+
+void UtpContext::_close() {
+    asio::error_code ec;
+    _tick.cancel();
+    _udp.close(ec);
+    auto sockets = std::move(_sockets);
+    _sockets.clear();
+    for (auto& [key, socket] : sockets) {
+        socket->_registered = false;
+        socket->_fail(asio::error::operation_aborted);
+    }
+    for (auto& waiter : _acceptWaiters) {
+        waiter(asio::error::operation_aborted, nullptr);
+    }
+    _acceptWaiters.clear();
+    _accepted.clear();
+}
+
+std::shared_ptr<UtpSocket> UtpContext::createSocket() {
+    return std::make_shared<UtpSocket>(shared_from_this());
+}
+
+uint16_t UtpContext::getPort() const {
+    asio::error_code ec;
+    auto endpoint = _udp.local_endpoint(ec);
+    return ec ? _options.port : endpoint.port();
+}
+
+asio::awaitable<void> UtpContext::_receiveLoop() {
+    std::vector<uint8_t> buffer(64 * 1024);
+    Endpoint from;
+    while (_udp.is_open()) {
+        auto [ec, n] = co_await _udp.async_receive_from(asio::buffer(buffer), from,
+                                                        asio::as_tuple(asio::use_awaitable));
+        if (ec == asio::error::operation_aborted || !_udp.is_open()) {
+            co_return;
+        }
+        if (ec) {
+            continue; // ICMP errors of earlier sends show up here
+        }
+        _onDatagram(from, std::span<const uint8_t>(buffer.data(), n));
+    }
+}
+
+asio::awaitable<void> UtpContext::_tickLoop() {
+    while (_udp.is_open()) {
+        _tick.expires_after(TICK);
+        auto [ec] = co_await _tick.async_wait(asio::as_tuple(asio::use_awaitable));
+        if (ec) {
+            co_return;
+        }
+        // Sockets may end while we go through them
+        std::vector<std::shared_ptr<UtpSocket>> sockets;
+        for (const auto& [key, socket] : _sockets) {
+            sockets.push_back(socket);
+        }
+        auto now = Clock::now();
+        for (const auto& socket : sockets) {
+            socket->_onTick(now);
+        }
+    }
+}
+
+void UtpContext::_onDatagram(const Endpoint& from, std::span<const uint8_t> datagram) {
+    auto packet = utp::parsePacket(datagram);
+    if (!packet) {
+        return;
+    }
+    const auto& header = packet->header;
+    auto now = Clock::now();
+
+    if (header.type == utp::PacketType::SYN) {
+        // The initiator receives on the id in its SYN and sends on the next one
+        Key key{from, static_cast<uint16_t>(header.connectionId + 1)};
+        if (auto it = _sockets.find(key); it != _sockets.end()) {
+            auto socket = it->second;
+            socket->_onPacket(*packet, now); // Our answer got lost
+            return;
+        }
+        if (!_options.acceptIncoming || _accepted.size() >= ACCEPT_BACKLOG) {
+            _sendReset(from, header.connectionId, header.seqNr);
+            return;
+        }
+        auto socket = createSocket();
+        socket->_acceptSyn(from, *packet, static_cast<uint16_t>(_random()));
+        _accept(socket);
+        return;
+    }
+
+    auto it = _sockets.find({from, header.connectionId});
+    if (it == _sockets.end() && header.type == utp::PacketType::RESET) {
+        // Resets may use either id of the connection
+        it = _sockets.find({from, static_cast<uint16_t>(header.connectionId + 1)});
+        if (it == _sockets.end()) {
+            it = _sockets.find({from, static_cast<uint16_t>(header.connectionId - 1)});
+        }
+    }
+    if (it == _sockets.end()) {
+        if (header.type != utp::PacketType::RESET) {
+            _sendReset(from, header.connectionId, header.seqNr);
+        }
+        return;
+    }
+    auto socket = it->second;
+    socket->_onPacket(*packet, now);
+}
+
+void UtpContext::_startAccept(AcceptHandler handler) {
+    if (!_udp.is_open()) {
+        handler(asio::error::operation_aborted, nullptr);
+        return;
+    }
+    if (!_accepted.empty()) {
+        auto socket = std::move(_accepted.front());
+        _accepted.pop_front();
+        handler({}, std::move(socket));
+        return;
+    }
+    _acceptWaiters.push_back(std::move(handler));
+}
+
+void UtpContext::_accept(std::shared_ptr<UtpSocket> socket) {
+    if (_acceptWaiters.empty()) {
+        _accepted.push_back(std::move(socket));
+        return;
+    }
+    auto waiter = std::move(_acceptWaiters.front());
+    _acceptWaiters.pop_front();
+    waiter({}, std::move(socket));
+}
+
+void UtpContext::_register(const Key& key, std::shared_ptr<UtpSocket> socket) {
+    _sockets[key] = std::move(socket);
+}
+
+void UtpContext::_unregister(const Key& key) {
+    _sockets.erase(key);
+}
+
+asio::error_code UtpContext::_send(const Endpoint& to, std::vector<uint8_t> datagram,
+                                   bool probe) {
+    if (_options.lossRate > 0.0 &&
+        std::uniform_real_distribution<double>(0.0, 1.0)(_random) < _options.lossRate) {
+        return {};
+    }
+    if (_options.sendDelay.count() > 0) {
+        auto timer = std::make_shared<asio::steady_timer>(_strand, _options.sendDelay);
+        timer->async_wait([self = shared_from_this(), timer, to, datagram = std::move(datagram),
+                           probe](const asio::error_code& ec) {
+            if (!ec && self->_udp.is_open()) {
+                self->_sendNow(to, datagram, probe);
+            }
+        });
+        return {};
+    }
+    return _sendNow(to, datagram, probe);
+}
+
+asio::error_code UtpContext::_sendNow(const Endpoint& to, std::span<const uint8_t> datagram,
+                                      bool probe) {
+#ifdef __linux__
+    if (probe != _dontFragment) {
+        // Probes must not be fragmented, or they would prove nothing
+        int value = probe ? IP_PMTUDISC_PROBE : IP_PMTUDISC_WANT;
+        ::setsockopt(_udp.native_handle(), IPPROTO_IP, IP_MTU_DISCOVER, &value, sizeof(value));
+        _dontFragment = probe;
+    }
+#endif
+    asio::error_code ec;
+    _udp.send_to(asio::buffer(datagram.data(), datagram.size()), to, 0, ec);
+    if (ec == asio::error::would_block) {
+        return {}; // Full socket buffer, same as a loss on the wire
+    }
+    return ec;
+}
+
+void UtpContext::_sendReset(const Endpoint& to, uint16_t connectionId, uint16_t ackNr) {
+    utp::PacketHeader header{.type = utp::PacketType::RESET,
+                             .connectionId = connectionId,
+                             .timestamp = nowMicros(),
+                             .timestampDiff = 0,
+                             .windowSize = 0,
+                             .seqNr = static_cast<uint16_t>(_random()),
+                             .ackNr = ackNr};
+    _sendNow(to, utp::encodePacket(header, {}, {}), false);
+}
+
+// -- UtpSocket -------------------------------------------------------------------------------
+
+UtpSocket::UtpSocket(std::shared_ptr<UtpContext> context)
+    : _context(context), _strand(context->getExecutor()), _peerWindow(RECEIVE_WINDOW),
+      _ledbat(MIN_DATAGRAM - PACKET_OVERHEAD,
+              INITIAL_WINDOW_PACKETS * (MIN_DATAGRAM - PACKET_OVERHEAD)),
+      _timeout(INITIAL_TIMEOUT), _mtuFloor(MIN_DATAGRAM),
+#ifdef __linux__
+      _mtuCeiling(MAX_DATAGRAM)
+#else
+      _mtuCeiling(MIN_DATAGRAM) // No way to set the don't-fragment bit, so no probing
+#endif
+{
+}
+
+void UtpSocket::close() {
+    _open = false;
+    asio::post(_strand, [self = shared_from_this()] { self->_close(); });
+}
+
+UtpSocket::Stats UtpSocket::stats() const {
+    return {.window = _ledbat.window(),
+            .queuingDelay = _ledbat.queuingDelay(),
+            .packetSize = _mtuFloor,
+            .retransmits = _retransmits,
+            .roundTrip = _roundTrip};
+}
+
+void UtpSocket::_startConnect(const Endpoint& remote, ConnectHandler handler) {
+    auto context = _context.lock();
+    if (!context || !context->_udp.is_open() || _state != State::IDLE || !_open) {
+        handler(asio::error::operation_aborted);
+        return;
+    }
+    _remote = remote;
+    do {
+        _recvId = static_cast<uint16_t>(context->_random());
+    } while (context->_sockets.contains({remote, _recvId}));
+    _sendId = static_cast<uint16_t>(_recvId + 1);
+    _seqNr = static_cast<uint16_t>(context->_random());
+    context->_register({remote, _recvId}, shared_from_this());
+    _registered = true;
+
+    _state = State::SYN_SENT;
+    _connectHandler = std::move(handler);
+    auto now = Clock::now();
+    _inFlight.push_back({.type = utp::PacketType::SYN, .seq = _seqNr++});
+    _sendPacket(_inFlight.back(), now);
+    _armTimeout(now);
+}
+
+void UtpSocket::_acceptSyn(const Endpoint& remote, const utp::Packet& syn, uint16_t seqNr) {
+    auto context = _context.lock();
+    _remote = remote;
+    _recvId = static_cast<uint16_t>(syn.header.connectionId + 1);
+    _sendId = syn.header.connectionId;
+    _ackNr = syn.header.seqNr;
+    _seqNr = seqNr;
+    _peerWindow = syn.header.windowSize;
+    _replyMicro = nowMicros() - syn.header.timestamp;
+    _state = State::CONNECTED;
+    context->_register({remote, _recvId}, shared_from_this());
+    _registered = true;
+    _lastSend = Clock::now();
+    _sendState();
+}
+
+void UtpSocket::_startRead(std::vector<asio::mutable_buffer> buffers, Handler handler) {
+    if (_readHandler) {
+        handler(asio::error::in_progress, 0);
+        return;
+    }
+    if (!_open) {
+        handler(asio::error::operation_aborted, 0);
+        return;
+    }
+    if (_state == State::IDLE || _state == State::SYN_SENT) {
+        handler(asio::error::not_connected, 0);
+        return;
+    }
+    _readBuffers = std::move(buffers);
+    _readHandler = std::move(handler);
+    _completeRead();
+}
+
+void UtpSocket::_startWrite(std::vector<asio::const_buffer> buffers, Handler handler) {
+    if (_writeHandler) {
+        handler(asio::error::in_progress, 0);
+        return;
+    }
+    if (!_open) {
+        handler(asio::error::operation_aborted, 0);
+        return;
+    }
+    if (_state != State::CONNECTED || _finQueued) {
+        handler(_error ? _error : asio::error::not_connected, 0);
+        return;
+    }
+    _writeBuffers = std::move(buffers);
+    _writeHandler = std::move(handler);
+    _completeWrite();
+    _flush();
+}
+
+void UtpSocket::_close() {
+    if (_connectHandler) {
+        std::exchange(_connectHandler, nullptr)(asio::error::operation_aborted);
+    }
+    if (_readHandler) {
+        std::exchange(_readHandler, nullptr)(asio::error::operation_aborted, 0);
+    }
+    if (_writeHandler) {
+        std::exchange(_writeHandler, nullptr)(asio::error::operation_aborted, 0);
+    }
+    _recvBuffer.clear();
+    _recvHead = 0;
+
+    if (_state != State::CONNECTED) {
+        _finish();
+        return;
+    }
+    // What was written still goes out, then the FIN
+    _finQueued = true;
+    _flush();
+}
+
+void UtpSocket::_onPacket(const utp::Packet& packet, Clock::time_point now) {
+    const auto& header = packet.header;
+    _replyMicro = nowMicros() - header.timestamp;
+    _peerWindow = header.windowSize;
+
+    switch (header.type) {
+    case utp::PacketType::RESET:
+        _fail(asio::error::connection_reset);
+        return;
+    case utp::PacketType::SYN:
+        if (_state == State::CONNECTED) {
+            _sendState();
+        }
+        return;
+    default:
+        break;
+    }
+
+    if (_state == State::SYN_SENT) {
+        if (header.type != utp::PacketType::STATE) {
+            return;
+        }
+        // The receiver's first packet will be its seq_nr, so that's where we are
+        _ackNr = static_cast<uint16_t>(header.seqNr - 1);
+        _state = State::CONNECTED;
+        _onAck(packet, now);
+        if (_connectHandler) {
+            std::exchange(_connectHandler, nullptr)({});
+        }
+        _flush();
+        return;
+    }
+    if (_state != State::CONNECTED) {
+        return;
+    }
+
+    _onAck(packet, now);
+    if (_state == State::CONNECTED &&
+        (header.type == utp::PacketType::DATA || header.type == utp::PacketType::FIN)) {
+        _onData(packet);
+    }
+}
+
+void UtpSocket::_onAck(const utp::Packet& packet, Clock::time_point now) {
+    const auto& header = packet.header;
+    size_t flightSize = _bytesInFlight;
+    size_t ackedBytes = 0;
+    bool advanced = false;
+
+    while (!_inFlight.empty() && seqDiff(_inFlight.front().seq, header.ackNr) <= 0) {
+        _acknowledge(_inFlight.front(), now, ackedBytes);
+        _inFlight.pop_front();
+        advanced = true;
+    }
+    if (!packet.selectiveAck.empty()) {
+        size_t bits = packet.selectiveAck.size() * 8;
+        for (auto& out : _inFlight) {
+            uint16_t bit = static_cast<uint16_t>(out.seq - header.ackNr - 2);
+            if (bit < bits && (packet.selectiveAck[bit / 8] >> (bit % 8)) & 1) {
+                _acknowledge(out, now, ackedBytes);
+            }
+        }
+    }
+    while (!_inFlight.empty() && _inFlight.front().acked) {
+        _inFlight.pop_front();
+    }
+
+    if (ackedBytes > 0 || advanced) {
+        if (ackedBytes > 0) {
+            _ledbat.onAck(ackedBytes, flightSize, header.timestampDiff, now);
+        }
+        _timeouts = 0;
+        _armTimeout(now);
+    }
+
+    // Loss: the front packet was skipped by three acks, or later packets were acked past it
+    bool duplicate = !advanced && ackedBytes == 0 && header.type == utp::PacketType::STATE &&
+                     header.ackNr == _lastAckNr && !_inFlight.empty();
+    _duplicateAcks = duplicate ? _duplicateAcks + 1 : (advanced ? 0 : _duplicateAcks);
+    _lastAckNr = header.ackNr;
+
+    size_t ackedAfter = 0;
+    for (auto it = _inFlight.rbegin(); it != _inFlight.rend(); ++it) {
+        if (it->acked) {
+            ++ackedAfter;
+            continue;
+        }
+        bool front = &*it == &_inFlight.front();
+        bool lost = ackedAfter >= DUPLICATE_ACK_THRESHOLD ||
+                    (front && _duplicateAcks >= DUPLICATE_ACK_THRESHOLD);
+        // Sent again at most once per round trip
+        if (lost && now - it->sentAt >= std::max(_roundTrip, Clock::duration(MIN_TIMEOUT / 10))) {
+            if (it->probe) {
+                _mtuCeiling = utp::HEADER_LEN + it->payload.size() - 1;
+                it->probe = false;
+                _probeSeq.reset();
+            } else {
+                _ledbat.onLoss(_roundTrip, now);
+            }
+            _resend(*it, now);
+            if (front) {
+                _duplicateAcks = 0;
+            }
+        }
+    }
+
+    if (_finSent && _inFlight.empty()) {
+        _finish(); // Our FIN is acked, nothing left to do
+        return;
+    }
+    if (ackedBytes > 0) {
+        _flush();
+        _completeWrite();
+    }
+}
+
+void UtpSocket::_acknowledge(OutPacket& packet, Clock::time_point now, size_t& ackedBytes) {
+    if (packet.acked) {
+        return;
+    }
+    packet.acked = true;
+    _bytesInFlight -= packet.payload.size();
+    ackedBytes += packet.payload.size();
+
+    if (packet.transmissions == 1) {
+        // Only packets sent once tell how long a round trip takes (Karn)
+        auto sample = now - packet.sentAt;
+        if (!_haveRoundTrip) {
+            _roundTrip = sample;
+            _roundTripVar = sample / 2;
+            _haveRoundTrip = true;
+        } else {
+            auto delta = _roundTrip > sample ? _roundTrip - sample : sample - _roundTrip;
+            _roundTripVar += (delta - _roundTripVar) / 4;
+            _roundTrip += (sample - _roundTrip) / 8;
+        }
+        _timeout = std::clamp(_roundTrip + 4 * _roundTripVar, MIN_TIMEOUT, MAX_TIMEOUT);
+
+        if (packet.probe) {
+            _mtuFloor = std::max(_mtuFloor, utp::HEADER_LEN + packet.payload.size());
+            _ledbat.setMinWindow(_maxPayload(_mtuFloor));
+            spdlog::debug("uTP path to {}:{} takes {} byte packets", _remote.address().to_string(),
+                          _remote.port(), _mtuFloor);
+        }
+    }
+    if (_probeSeq == packet.seq) {
+        _probeSeq.reset();
+    }
+}
+
+void UtpSocket::_onData(const utp::Packet& packet) {
+    const auto& header = packet.header;
+    if (_eof) {
+        _sendState();
+        return;
+    }
+    bool fin = header.type == utp::PacketType::FIN;
+    int16_t ahead = seqDiff(header.seqNr, _ackNr);
+    if (ahead == 1) {
+        _recvBuffer.insert(_recvBuffer.end(), packet.payload.begin(), packet.payload.end());
+        _ackNr = header.seqNr;
+        _eof = fin;
+        // The gap is closed, take everything that lined up behind it
+        for (auto it = _outOfOrder.find(static_cast<uint16_t>(_ackNr + 1));
+             !_eof && it != _outOfOrder.end();
+             it = _outOfOrder.find(static_cast<uint16_t>(_ackNr + 1))) {
+            _eof = it->second.empty();
+            _recvBuffer.insert(_recvBuffer.end(), it->second.begin(), it->second.end());
+            _outOfOrderBytes -= it->second.size();
+            _ackNr = it->first;
+            _outOfOrder.erase(it);
+        }
+        if (_eof) {
+            _outOfOrder.clear();
+            _outOfOrderBytes = 0;
+        }
+    } else if (ahead > 1 && ahead < MAX_REORDER && !_outOfOrder.contains(header.seqNr) &&
+               _outOfOrderBytes + packet.payload.size() <= RECEIVE_WINDOW) {
+        // FINs are kept as empty payloads, data packets are never empty
+        if (!fin && packet.payload.empty()) {
+            return;
+        }
+        _outOfOrder.emplace(header.seqNr,
+                            std::vector<uint8_t>(packet.payload.begin(), packet.payload.end()));
+        _outOfOrderBytes += packet.payload.size();
+    }
+
+    _completeRead();
+    // Data packets carry the ack, a state packet is only needed if none goes out
+    if (!_flush()) {
+        _sendState();
+    }
+}
+
+void UtpSocket::_onTick(Clock::time_point now) {
+    if (_state == State::CLOSED) {
+        return;
+    }
+    if (!_inFlight.empty() && now >= _timeoutAt) {
+        auto& front = _inFlight.front();
+        if (front.probe) {
+            // A lost probe says the packet was too large, not that the path is congested
+            _mtuCeiling = utp::HEADER_LEN + front.payload.size() - 1;
+            front.probe = false;
+            _probeSeq.reset();
+        } else {
+            if (++_timeouts > MAX_TIMEOUTS) {
+                spdlog::debug("uTP connection to {}:{} timed out", _remote.address().to_string(),
+                              _remote.port());
+                _fail(asio::error::timed_out);
+                return;
+            }
+            _ledbat.onTimeout();
+            _timeout = std::min(_timeout * 2, MAX_TIMEOUT);
+        }
+        _resend(front, now);
+        _armTimeout(now);
+        return;
+    }
+    if (_state == State::CONNECTED && now - _lastSend >= KEEPALIVE) {
+        _sendState();
+    }
+}
+
+bool UtpSocket::_flush() {
+    if (_state != State::CONNECTED) {
+        return false;
+    }
+    auto now = Clock::now();
+    bool sent = false;
+    size_t window = std::min<size_t>(_ledbat.window(), _peerWindow);
+
+    while (_sendHead < _sendQueue.size()) {
+        size_t queued = _sendQueue.size() - _sendHead;
+        size_t datagram = _mtuFloor;
+        bool probe = false;
+        if (!_probeSeq && _mtuCeiling >= _mtuFloor + MTU_PRECISION) {
+            size_t candidate = (_mtuFloor + _mtuCeiling) / 2;
+            if (queued >= _maxPayload(candidate)) {
+                datagram = candidate; // Only full packets make a useful probe
+                probe = true;
+            }
+        }
+        size_t size = std::min(queued, _maxPayload(datagram));
+        // A single packet may always be in flight, it doubles as a window probe
+        if (!_inFlight.empty() && _bytesInFlight + size > window) {
+            break;
+        }
+
+        auto begin = _sendQueue.begin() + _sendHead;
+        _inFlight.push_back({.type = utp::PacketType::DATA,
+                             .seq = _seqNr++,
+                             .payload = std::vector<uint8_t>(begin, begin + size),
+                             .probe = probe});
+        _sendHead += size;
+        _bytesInFlight += size;
+        if (probe) {
+            _probeSeq = _inFlight.back().seq;
+        }
+        if (_inFlight.size() == 1) {
+            _armTimeout(now);
+        }
+        _sendPacket(_inFlight.back(), now);
+        sent = true;
+    }
+
+    if (_sendHead == _sendQueue.size()) {
+        _sendQueue.clear();
+        _sendHead = 0;
+    } else if (_sendHead >= SEND_BUFFER / 2) {
+        _sendQueue.erase(_sendQueue.begin(), _sendQueue.begin() + _sendHead);
+        _sendHead = 0;
+    }
+
+    if (_finQueued && !_finSent && _sendQueue.empty()) {
+        _inFlight.push_back({.type = utp::PacketType::FIN, .seq = _seqNr++});
+        _finSent = true;
+        if (_inFlight.size() == 1) {
+            _armTimeout(now);
+        }
+        _sendPacket(_inFlight.back(), now);
+        sent = true;
+    }
+    return sent;
+}
+
+void UtpSocket::_sendPacket(OutPacket& packet, Clock::time_point now) {
+    auto context = _context.lock();
+    if (!context) {
+        return;
+    }
+    ++packet.transmissions;
+    packet.sentAt = now;
+    _lastSend = now;
+    bool probe = packet.probe && packet.transmissions == 1;
+    auto ec = context->_send(_remote, _encode(packet.type, packet.seq, packet.payload), probe);
+    if (ec == asio::error::message_size && probe) {
+        // Larger than our own interface allows
+        _mtuCeiling = utp::HEADER_LEN + packet.payload.size() - 1;
+        packet.probe = false;
+        _probeSeq.reset();
+        ec = context->_send(_remote, _encode(packet.type, packet.seq, packet.payload), false);
+    }
+    if (ec) {
+        spdlog::debug("uTP send to {}:{} failed: {}", _remote.address().to_string(),
+                      _remote.port(), ec.message());
+    }
+}
+
+void UtpSocket::_sendState() {
+    auto context = _context.lock();
+    if (!context || _state != State::CONNECTED) {
+        return;
+    }
+    _lastSend = Clock::now();
+    // State packets don't take a sequence number of their own
+    context->_send(_remote, _encode(utp::PacketType::STATE, _seqNr, {}), false);
+}
+
+std::vector<uint8_t> UtpSocket::_encode(utp::PacketType type, uint16_t seq,
+                                        std::span<const uint8_t> payload) {
+    utp::PacketHeader header{.type = type,
+                             .connectionId = type == utp::PacketType::SYN ? _recvId : _sendId,
+                             .timestamp = nowMicros(),
+                             .timestampDiff = _replyMicro,
+                             .windowSize = _receiveWindow(),
+                             .seqNr = seq,
+                             .ackNr = _ackNr};
+    std::array<uint8_t, utp::SELECTIVE_ACK_BITS / 8> selectiveAck{};
+    bool gaps = false;
+    for (const auto& [seqNr, data] : _outOfOrder) {
+        uint16_t bit = static_cast<uint16_t>(seqNr - _ackNr - 2);
+        if (bit < utp::SELECTIVE_ACK_BITS) {
+            selectiveAck[bit / 8] |= static_cast<uint8_t>(1 << (bit % 8));
+            gaps = true;
+        }
+    }
+    return utp::encodePacket(header,
+                             gaps ? std::span<const uint8_t>(selectiveAck)
+                                  : std::span<const uint8_t>(),
+                             payload);
+}
+
+void UtpSocket::_resend(OutPacket& packet, Clock::time_point now) {
+    ++_retransmits;
+    _sendPacket(packet, now);
+}
+
+void UtpSocket::_fail(asio::error_code ec) {
+    if (_state == State::CLOSED) {
+        return;
+    }
+    _error = ec;
+    if (_connectHandler) {
+        std::exchange(_connectHandler, nullptr)(ec);
+    }
+    if (_writeHandler) {
+        std::exchange(_writeHandler, nullptr)(ec, 0);
+    }
+    _finish();
+    _completeRead(); // Hands out what's buffered first
+}
+
+void UtpSocket::_finish() {
+    _state = State::CLOSED;
+    _inFlight.clear();
+    _bytesInFlight = 0;
+    if (_registered) {
+        _registered = false;
+        if (auto context = _context.lock()) {
+            context->_unregister({_remote, _recvId});
+        }
+    }
+}
+
+void UtpSocket::_completeRead() {
+    if (!_readHandler) {
+        return;
+    }
+    size_t available = _recvBuffer.size() - _recvHead;
+    if (available > 0 || asio::buffer_size(_readBuffers) == 0) {
+        bool windowWasShut = _receiveWindow() < _maxPayload(_mtuFloor);
+        size_t n = asio::buffer_copy(_readBuffers,
+                                     asio::buffer(_recvBuffer.data() + _recvHead, available));
+        _recvHead += n;
+        if (_recvHead == _recvBuffer.size()) {
+            _recvBuffer.clear();
+            _recvHead = 0;
+        } else if (_recvHead >= RECEIVE_WINDOW / 2) {
+            _recvBuffer.erase(_recvBuffer.begin(), _recvBuffer.begin() + _recvHead);
+            _recvHead = 0;
+        }
+        _readBuffers.clear();
+        std::exchange(_readHandler, nullptr)({}, n);
+        if (windowWasShut) {
+            _sendState(); // The peer is waiting for room
+        }
+        return;
+    }
+    if (_eof) {
+        std::exchange(_readHandler, nullptr)(asio::error::eof, 0);
+    } else if (_error) {
+        std::exchange(_readHandler, nullptr)(_error, 0);
+    }
+}
+
+void UtpSocket::_completeWrite() {
+    if (!_writeHandler || _state != State::CONNECTED) {
+        return;
+    }
+    size_t space = SEND_BUFFER - std::min(SEND_BUFFER, _sendQueue.size() - _sendHead);
+    size_t wanted = asio::buffer_size(_writeBuffers);
+    if (space == 0 && wanted > 0) {
+        return; // Waits for acks to make room
+    }
+    size_t n = std::min(space, wanted);
+    size_t offset = _sendQueue.size();
+    _sendQueue.resize(offset + n);
+    asio::buffer_copy(asio::buffer(_sendQueue.data() + offset, n), _writeBuffers);
+    _writeBuffers.clear();
+    std::exchange(_writeHandler, nullptr)({}, n);
+}
+
+uint32_t UtpSocket::_receiveWindow() const {
+    size_t buffered = _recvBuffer.size() - _recvHead + _outOfOrderBytes;
+    return RECEIVE_WINDOW - static_cast<uint32_t>(std::min<size_t>(buffered, RECEIVE_WINDOW));
+}
+
+size_t UtpSocket::_maxPayload(size_t datagramSize) const {
+    return datagramSize - PACKET_OVERHEAD;
+}
+
+void UtpSocket::_armTimeout(Clock::time_point now) {
+    _timeoutAt = now + _timeout;
+}
+} // namespace bt::core
@@ -1,3 +1,4 @@
+#include "app/client_config.hpp"
 #include "app/torrent_orchestrator.hpp"
 
 #include <argparse/argparse.hpp>
@@ -9,16 +10,53 @@
 struct Settings {
     std::string torrent_path;
     bool verbose;
+    bt::ClientConfig client;
 };
 
 static Settings parse_args(int argc, char* argv[]) {
     argparse::ArgumentParser app("bit-torrent-client");
 
-    app.add_argument("-t", "--torrent").required().help("Path to the torrent file");
+    app.add_argument("-t", "--torrent").required().help("Path to the torrent file, or a magnet link");
     app.add_argument("-v", "--verbose")
         .help("Verbose logs")
         .default_value(false)
         .implicit_value(true);
+    app.add_argument("-s", "--sequential")
+        .help("Download pieces in file order (streaming)")
+        .default_value(false)
+        .implicit_value(true);
+    app.add_argument("--seed")
+        .help("Keep seeding once the download is complete, until interrupted")
+        .default_value(false)
+        .implicit_value(true);
+    app.add_argument("-p", "--port")
+        .help("Port for incoming peer connections, 0 to accept none")
+        .default_value(uint16_t{6881})
+        .scan<'u', uint16_t>();
+    app.add_argument("--download-limit")
+        .help("Download rate limit in KiB/s, 0 for none")
+        .default_value(uint64_t{0})
+        .scan<'u', uint64_t>();
+    app.add_argument("--upload-limit")
+        .help("Upload rate limit in KiB/s, 0 for none")
+        .default_value(uint64_t{0})
+        .scan<'u', uint64_t>();
+    app.add_argument("--no-dht")
+        .help("Find peers through trackers only")
+        .default_value(false)
+        .implicit_value(true);
+    app.add_argument("--dht-port")
+        .help("UDP port of the DHT node, 0 for any")
+        .default_value(uint16_t{0})
+        .scan<'u', uint16_t>();
+    app.add_argument("--no-lsd")
+        .help("Don't look for peers on the local network")
+        .default_value(false)
+        .implicit_value(true);
+    app.add_argument("--io-threads")
+        .help("Threads for peer connections, 0 for one per core")
+        .default_value(0u)
+        .scan<'u', uint32_t>();
     try {
         app.parse_args(argc, argv);
     } catch (const std::exception& err) {
@@ -27,7 +65,21 @@ static Settings parse_args(int argc, char* argv[]) {
         std::exit(1);
     }
 
-    return {app.get<std::string>("--torrent"), app.get<bool>("--verbose")};
+    bt::ClientConfig client;
+    client.picker.sequential = app.get<bool>("--sequential");
+    client.io.threads = app.get<uint32_t>("--io-threads");
+    client.connection.listenPort = app.get<uint16_t>("--port");
+    client.connection.utp = true;
+    client.upload.zeroCopy = true;
+    client.upload.seedAfterDownload = app.get<bool>("--seed");
+    client.bandwidth.downloadRate = app.get<uint64_t>("--download-limit") * 1024;
+    client.bandwidth.uploadRate = app.get<uint64_t>("--upload-limit") * 1024;
+    client.dht.enabled = !app.get<bool>("--no-dht");
+    client.dht.port = app.get<uint16_t>("--dht-port");
+    client.dht.stateFile = "dht.dat";
+    client.lsd.enabled = !app.get<bool>("--no-lsd");
+
+    return {app.get<std::string>("--torrent"), app.get<bool>("--verbose"), client};
 }
 
 static void init_logging(bool verbose) {
@@ -48,7 +100,7 @@ int main(int argc, char* argv[]) {
 
     try {
         spdlog::debug("Starting torrent orchestrator");
-        TorrentOrchestrator to(settings.torrent_path, settings.verbose);
+        TorrentOrchestrator to(settings.torrent_path, settings.verbose, settings.client);
         to.download();
     } catch (const std::exception& e) {
         spdlog::critical("Fatal error: {}. Suggestion: re-run with -v for more details.", e.what());
@@ -1,11 +1,25 @@
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
 #include <doctest/doctest.h>
 
+#include "core/local_discovery.hpp"
 #include "core/torrent_metadata_loader.hpp"
+#include "core/tracker_announcer.hpp"
 #include "core/tracker_communicator.hpp"
+#include "core/udp_tracker.hpp"
+#include "core/utils.hpp"
 
+#include <asio.hpp>
+#include <chrono>
 #include <filesystem>
+#include <functional>
+#include <future>
+#include <set>
 #include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace std::chrono_literals;
 
 namespace {
 std::filesystem::path fixtureTorrentPath() {
@@ -13,6 +27,176 @@ std::filesystem::path fixtureTorrentPath() {
         std::filesystem::path(__FILE__).parent_path() / "debian-13.2.0-arm64-netinst.iso.torrent";
     return path;
 }
+
+std::string httpOk(const std::string& body) {
+    return "HTTP/1.1 200 OK\r\nContent-Length: " + std::to_string(body.size()) + "\r\n\r\n" +
+           body;
+}
+
+using Tiers = std::vector<std::vector<std::string>>;
+
+// Compact peers: 127.0.0.1:6881
+const std::string TRACKER_PEERS("\x7f\x00\x00\x01\x1a\xe1", 6);
+const std::string TRACKER_OK =
+    httpOk("d8:intervali1e12:min intervali1e5:peers6:" + TRACKER_PEERS + "e");
+
+// HTTP tracker on loopback: answers the n-th announce with answer(n), keeps the request lines
+struct LocalTracker {
+    asio::io_context& io;
+    std::function<std::string(size_t)> answer;
+    asio::ip::tcp::acceptor acceptor{io, {asio::ip::make_address("127.0.0.1"), 0}};
+    std::vector<std::string> requests;
+
+    std::string url() const {
+        return "http://127.0.0.1:" + std::to_string(acceptor.local_endpoint().port()) +
+               "/announce";
+    }
+
+    asio::awaitable<void> serve() {
+        for (;;) {
+            auto [ec, socket] = co_await acceptor.async_accept(asio::as_tuple(asio::use_awaitable));
+            if (ec) {
+                co_return;
+            }
+            std::string request;
+            co_await asio::async_read_until(socket, asio::dynamic_buffer(request), "\r\n\r\n",
+                                            asio::as_tuple(asio::use_awaitable));
+            requests.push_back(request.substr(0, request.find("\r\n")));
+            auto response = answer(requests.size() - 1);
+            co_await asio::async_write(socket, asio::buffer(response),
+                                       asio::as_tuple(asio::use_awaitable));
+        }
+    }
+};
+
+// Accepts connections but never answers, so announces to it time out
+struct SilentTracker {
+    asio::io_context& io;
+    asio::ip::tcp::acceptor acceptor{io, {asio::ip::make_address("127.0.0.1"), 0}};
+
+    std::string url() const {
+        return "http://127.0.0.1:" + std::to_string(acceptor.local_endpoint().port()) +
+               "/announce";
+    }
+};
+
+// URL of a loopback port nobody listens on
+std::string closedPortUrl(asio::io_context& io) {
+    asio::ip::tcp::acceptor acceptor{io, {asio::ip::make_address("127.0.0.1"), 0}};
+    return "http://127.0.0.1:" + std::to_string(acceptor.local_endpoint().port()) + "/announce";
+}
+
+bool contains(const std::string& text, const std::string& part) {
+    return text.find(part) != std::string::npos;
+}
+
+uint64_t readU64(bt::utils::ByteReader& reader) {
+    uint64_t high = reader.readU32();
+    return high << 32 | reader.readU32();
+}
+
+// UDP tracker (BEP 15) on loopback, answers every announce with 127.0.0.1:6881
+struct LocalUdpTracker {
+    static constexpr uint64_t CONNECTION_ID = 0x1122334455667788;
+
+    struct Announce {
+        bt::core::Sha1Hash infoHash;
+        uint32_t event;
+        uint64_t left;
+        uint32_t numWant;
+        asio::ip::udp::endpoint from;
+    };
+
+    asio::io_context& io;
+    asio::ip::udp::socket socket{io, {asio::ip::make_address("127.0.0.1"), 0}};
+    size_t drop = 0;    // Datagrams ignored before the tracker answers
+    std::string refuse; // Error sent in reply to announces, if set
+    size_t connects = 0;
+    std::vector<Announce> announces;
+
+    std::string url() const {
+        return "udp://127.0.0.1:" + std::to_string(socket.local_endpoint().port()) +
+               "/announce";
+    }
+
+    asio::awaitable<void> serve() {
+        std::vector<uint8_t> buffer(2048);
+        asio::ip::udp::endpoint from;
+        for (;;) {
+            auto [ec, n] = co_await socket.async_receive_from(
+                asio::buffer(buffer), from, asio::as_tuple(asio::use_awaitable));
+            if (ec) {
+                co_return;
+            }
+            if (drop > 0) {
+                --drop;
+                continue;
+            }
+            bt::utils::ByteReader reader(std::span<const uint8_t>(buffer.data(), n));
+            uint64_t id = readU64(reader);
+            uint32_t action = reader.readU32();
+            uint32_t transactionId = reader.readU32();
+
+            bt::utils::ByteWriter reply;
+            if (action == 0 && id == bt::core::udp_tracker::PROTOCOL_ID) {
+                ++connects;
+                reply.write_u32(0);
+                reply.write_u32(transactionId);
+                reply.write_u32(static_cast<uint32_t>(CONNECTION_ID >> 32));
+                reply.write_u32(static_cast<uint32_t>(CONNECTION_ID));
+            } else if (action == 1 && id == CONNECTION_ID) {
+                Announce announce{};
+                for (auto& byte : announce.infoHash) {
+                    byte = reader.readU8();
+                }
+                for (int i = 0; i < 20; ++i) {
+                    reader.readU8(); // Peer id
+                }
+                readU64(reader); // Downloaded
+                announce.left = readU64(reader);
+                readU64(reader); // Uploaded
+                announce.event = reader.readU32();
+                reader.readU32(); // IP
+                reader.readU32(); // Key
+                announce.numWant = reader.readU32();
+                announce.from = from;
+                announces.push_back(announce);
+
+                reply.write_u32(refuse.empty() ? 1 : 3);
+                reply.write_u32(transactionId);
+                if (refuse.empty()) {
+                    reply.write_u32(1800); // Interval
+                    reply.write_u32(0);
+                    reply.write_u32(1);
+                    for (char c : TRACKER_PEERS) {
+                        reply.write_u8(static_cast<uint8_t>(c));
+                    }
+                } else {
+                    for (char c : refuse) {
+                        reply.write_u8(static_cast<uint8_t>(c));
+                    }
+                }
+            } else {
+                continue;
+            }
+            co_await socket.async_send_to(asio::buffer(reply.data()), from,
+                                          asio::as_tuple(asio::use_awaitable));
+        }
+    }
+};
+
+// Runs `test` on `io` until it returns, rethrowing what it threw
+template <typename Test> void runOn(asio::io_context& io, Test test) {
+    std::exception_ptr failure;
+    asio::co_spawn(io, std::move(test), [&](std::exception_ptr error) {
+        failure = error;
+        io.stop();
+    });
+    io.run_for(10s);
+    if (failure) {
+        std::rethrow_exception(failure);
+    }
+}
 } // namespace
 
 TEST_CASE("generateId produces correct length and charset") {
@@ -37,7 +221,7 @@ TEST_CASE("buildTrackerUrl includes required parameters") {
     const auto metadata = bt::core::parseTorrentData(torrentPath.string());
     const auto peerId = bt::core::generateId(20);
 
-    const auto trackerUrl = bt::core::detail::buildTrackerUrl(metadata, peerId);
+    const auto trackerUrl = bt::core::detail::buildTrackerUrl(metadata, peerId, 6881);
 
     // Boost URL stores encoded URL in its buffer
     const std::string urlStr = std::string(trackerUrl);
@@ -45,6 +229,7 @@ TEST_CASE("buildTrackerUrl includes required parameters") {
     CHECK(urlStr.find("info_hash=") != std::string::npos);
     CHECK(urlStr.find("peer_id=") != std::string::npos);
     CHECK(urlStr.find(peerId) != std::string::npos);
+    CHECK(urlStr.find("port=6881") != std::string::npos);
     CHECK(urlStr.find("left=" + std::to_string(metadata.info.fileLength)) != std::string::npos);
     CHECK(urlStr.find("compact=1") != std::string::npos);
     CHECK(urlStr.find("uploaded=0") != std::string::npos);
@@ -56,3 +241,627 @@ TEST_CASE("announce throws on non-200 response") {
     CHECK_THROWS_AS(bt::core::detail::announceToTracker("https://httpbin.org/status/404"),
                     std::runtime_error);
 }
+
+TEST_CASE("parseTrackerResponse reads min interval and refusals") {
+    auto response = bt::core::detail::parseTrackerResponse(
+        "d8:intervali900e12:min intervali60e5:peers6:" + TRACKER_PEERS + "e");
+    CHECK(response.interval == 900);
+    REQUIRE(response.minInterval.has_value());
+    CHECK(*response.minInterval == 60);
+    CHECK(response.peersBlob.size() == 1);
+
+    CHECK_FALSE(bt::core::detail::parseTrackerResponse("d8:intervali900e5:peers0:e")
+                    .minInterval.has_value());
+    CHECK_THROWS_AS(bt::core::detail::parseTrackerResponse("d14:failure reason7:go awaye"),
+                    std::runtime_error);
+}
+
+TEST_CASE("TrackerAnnouncer re-announces on the interval with events and transfer figures") {
+    asio::io_context io;
+    auto work = asio::make_work_guard(io);
+    LocalTracker tracker{io, [](size_t) { return TRACKER_OK; }};
+    asio::co_spawn(io, tracker.serve(), asio::detached);
+
+    bt::core::Sha1Hash infoHash{};
+    std::vector<bt::core::Peer> received;
+    std::promise<void> answeredThree;
+    std::shared_ptr<bt::core::TrackerAnnouncer> announcer;
+    announcer = std::make_shared<bt::core::TrackerAnnouncer>(
+        io.get_executor(), Tiers{{tracker.url()}}, infoHash, bt::core::generateId(20), 6881,
+        [] {
+            return bt::core::TrackerAnnouncer::Stats{
+                .uploaded = 100, .downloaded = 200, .left = 300};
+        },
+        [&](std::vector<bt::core::Peer> peers) {
+            received.insert(received.end(), peers.begin(), peers.end());
+            if (received.size() == 2) {
+                announcer->completed();
+            } else if (received.size() == 3) {
+                answeredThree.set_value();
+            }
+        },
+        bt::core::TrackerAnnouncer::Options{});
+
+    std::thread runner([&] { io.run(); });
+    announcer->start();
+    auto answered = answeredThree.get_future().wait_for(10s);
+    auto stopped = announcer->stop().wait_for(5s);
+    work.reset();
+    io.stop();
+    runner.join();
+
+    REQUIRE(answered == std::future_status::ready);
+    REQUIRE(stopped == std::future_status::ready);
+    REQUIRE(tracker.requests.size() == 4);
+    const auto& first = tracker.requests[0];
+    CHECK(contains(first, "GET /announce?"));
+    CHECK(contains(first, "event=started"));
+    CHECK(contains(first, "uploaded=100"));
+    CHECK(contains(first, "downloaded=200"));
+    CHECK(contains(first, "left=300"));
+    CHECK(contains(first, "port=6881"));
+    CHECK_FALSE(contains(first, "numwant="));
+    CHECK_FALSE(contains(tracker.requests[1], "event="));
+    CHECK(contains(tracker.requests[2], "event=completed"));
+    CHECK(contains(tracker.requests[3], "event=stopped"));
+
+    bt::core::Peer expected{.port = 6881, .ip = {127, 0, 0, 1}};
+    CHECK(received.front() == expected);
+}
+
+TEST_CASE("TrackerAnnouncer backs off after failures and asks for peers when short") {
+    asio::io_context io;
+    auto work = asio::make_work_guard(io);
+    LocalTracker tracker{io, [](size_t n) -> std::string {
+                             if (n == 0) {
+                                 return httpOk("d14:failure reason7:go awaye");
+                             }
+                             if (n == 1) {
+                                 return "HTTP/1.1 503 Service Unavailable\r\n\r\n";
+                             }
+                             return TRACKER_OK;
+                         }};
+    asio::co_spawn(io, tracker.serve(), asio::detached);
+
+    bt::core::Sha1Hash infoHash{};
+    std::promise<void> answered;
+    auto announcer = std::make_shared<bt::core::TrackerAnnouncer>(
+        io.get_executor(), Tiers{{tracker.url()}}, infoHash, bt::core::generateId(20), 6881,
+        [] { return bt::core::TrackerAnnouncer::Stats{.left = 300, .numWant = 30}; },
+        [&](std::vector<bt::core::Peer>) { answered.set_value(); },
+        bt::core::TrackerAnnouncer::Options{.retryBackoff = 50ms, .timeout = 2000ms});
+
+    std::thread runner([&] { io.run(); });
+    auto begin = std::chrono::steady_clock::now();
+    announcer->start();
+    auto status = answered.get_future().wait_for(10s);
+    auto elapsed = std::chrono::steady_clock::now() - begin;
+    announcer->stop().wait_for(5s);
+    work.reset();
+    io.stop();
+    runner.join();
+
+    REQUIRE(status == std::future_status::ready);
+    CHECK(elapsed >= 150ms); // 50ms, then 100ms
+    REQUIRE(tracker.requests.size() == 4);
+    for (size_t i = 0; i < 3; ++i) {
+        CHECK(contains(tracker.requests[i], "event=started")); // Retried as it was
+        CHECK(contains(tracker.requests[i], "numwant=30"));
+    }
+    CHECK(contains(tracker.requests[3], "event=stopped"));
+}
+
+TEST_CASE("TrackerAnnouncer asks a whole tier at once and takes every tracker's peers") {
+    asio::io_context io;
+    auto work = asio::make_work_guard(io);
+    // 127.0.0.2:6882
+    const std::string otherPeers("\x7f\x00\x00\x02\x1a\xe2", 6);
+    LocalTracker first{io, [](size_t) { return TRACKER_OK; }};
+    LocalTracker second{io, [&](size_t) {
+                            return httpOk("d8:intervali60e5:peers6:" + otherPeers + "e");
+                        }};
+    SilentTracker silent{io};
+    asio::co_spawn(io, first.serve(), asio::detached);
+    asio::co_spawn(io, second.serve(), asio::detached);
+
+    bt::core::Sha1Hash infoHash{};
+    std::set<bt::core::Peer> received;
+    std::promise<void> answeredBoth;
+    auto announcer = std::make_shared<bt::core::TrackerAnnouncer>(
+        io.get_executor(), Tiers{{silent.url(), first.url(), second.url()}}, infoHash,
+        bt::core::generateId(20), 6881,
+        [] { return bt::core::TrackerAnnouncer::Stats{.left = 300}; },
+        [&](std::vector<bt::core::Peer> peers) {
+            received.insert(peers.begin(), peers.end());
+            if (received.size() == 2) {
+                answeredBoth.set_value();
+            }
+        },
+        bt::core::TrackerAnnouncer::Options{.timeout = 5000ms});
+
+    std::thread runner([&] { io.run(); });
+    auto begin = std::chrono::steady_clock::now();
+    announcer->start();
+    auto status = answeredBoth.get_future().wait_for(10s);
+    auto elapsed = std::chrono::steady_clock::now() - begin;
+    auto stopped = announcer->stop().wait_for(5s);
+    work.reset();
+    io.stop();
+    runner.join();
+
+    REQUIRE(status == std::future_status::ready);
+    CHECK(elapsed < 2s); // The silent tracker didn't hold the others up, wherever it was shuffled
+    CHECK(stopped == std::future_status::ready);
+    CHECK(received.contains(bt::core::Peer{.port = 6881, .ip = {127, 0, 0, 1}}));
+    CHECK(received.contains(bt::core::Peer{.port = 6882, .ip = {127, 0, 0, 2}}));
+    for (const auto* tracker : {&first, &second}) {
+        REQUIRE(tracker->requests.size() == 2);
+        CHECK(contains(tracker->requests[0], "event=started"));
+        CHECK(contains(tracker->requests[1], "event=stopped"));
+    }
+}
+
+TEST_CASE("TrackerAnnouncer fails over to the next tier") {
+    asio::io_context io;
+    auto work = asio::make_work_guard(io);
+    LocalTracker backup{io, [](size_t) { return TRACKER_OK; }};
+    asio::co_spawn(io, backup.serve(), asio::detached);
+
+    bt::core::Sha1Hash infoHash{};
+    std::promise<void> answeredTwice;
+    size_t answers = 0;
+    auto announcer = std::make_shared<bt::core::TrackerAnnouncer>(
+        io.get_executor(), Tiers{{closedPortUrl(io)}, {backup.url()}}, infoHash,
+        bt::core::generateId(20), 6881,
+        [] { return bt::core::TrackerAnnouncer::Stats{.left = 300}; },
+        [&](std::vector<bt::core::Peer>) {
+            if (++answers == 2) {
+                answeredTwice.set_value();
+            }
+        },
+        bt::core::TrackerAnnouncer::Options{.retryBackoff = 10s, .timeout = 2000ms});
+
+    std::thread runner([&] { io.run(); });
+    announcer->start();
+    auto status = answeredTwice.get_future().wait_for(10s);
+    announcer->stop().wait_for(5s);
+    work.reset();
+    io.stop();
+    runner.join();
+
+    REQUIRE(status == std::future_status::ready);
+    // The first tier's tracker is still backing off, the re-announce goes straight to the backup
+    REQUIRE(backup.requests.size() == 3);
+    CHECK(contains(backup.requests[0], "event=started"));
+    CHECK_FALSE(contains(backup.requests[1], "event="));
+    CHECK(contains(backup.requests[2], "event=stopped"));
+}
+
+TEST_CASE("TrackerAnnouncer follows HTTP redirects, but not forever") {
+    asio::io_context io;
+    auto work = asio::make_work_guard(io);
+    LocalTracker target{io, [](size_t) { return TRACKER_OK; }};
+    asio::co_spawn(io, target.serve(), asio::detached);
+    LocalTracker moved{io, [&](size_t) {
+                           return "HTTP/1.1 302 Found\r\nLocation: " + target.url() +
+                                  "?moved=1\r\nContent-Length: 0\r\n\r\n";
+                       }};
+    asio::co_spawn(io, moved.serve(), asio::detached);
+    LocalTracker looping{io, [](size_t) {
+                             return std::string("HTTP/1.1 301 Moved Permanently\r\n"
+                                                "location:  /announce \r\n\r\n");
+                         }};
+    asio::co_spawn(io, looping.serve(), asio::detached);
+
+    bt::core::Sha1Hash infoHash{};
+    std::promise<std::vector<bt::core::Peer>> answered;
+    auto announcer = std::make_shared<bt::core::TrackerAnnouncer>(
+        io.get_executor(), Tiers{{looping.url()}, {moved.url()}}, infoHash,
+        bt::core::generateId(20), 6881,
+        [] { return bt::core::TrackerAnnouncer::Stats{.left = 300}; },
+        [&](std::vector<bt::core::Peer> peers) { answered.set_value(peers); },
+        bt::core::TrackerAnnouncer::Options{.retryBackoff = 10s, .timeout = 2000ms});
+
+    std::thread runner([&] { io.run(); });
+    announcer->start();
+    auto peers = answered.get_future();
+    auto status = peers.wait_for(10s);
+    announcer->stop().wait_for(5s);
+    work.reset();
+    io.stop();
+    runner.join();
+
+    REQUIRE(status == std::future_status::ready);
+    CHECK(peers.get().size() == 1);
+    // Redirected until cpr gave up, then the next tier took over
+    CHECK(looping.requests.size() > 1);
+    CHECK(contains(looping.requests.back(), "GET /announce HTTP/1.1"));
+    REQUIRE_FALSE(target.requests.empty());
+    CHECK(contains(target.requests[0], "GET /announce?moved=1 HTTP/1.1"));
+    REQUIRE_FALSE(moved.requests.empty());
+    CHECK(contains(moved.requests[0], "event=started"));
+}
+
+TEST_CASE("UDP tracker messages follow BEP 15") {
+    using namespace bt::core::udp_tracker;
+    auto connect = encodeConnect(0xAABBCCDD);
+    REQUIRE(connect.size() == CONNECT_LEN);
+    bt::utils::ByteReader connectReader(connect);
+    CHECK(readU64(connectReader) == PROTOCOL_ID);
+    CHECK(connectReader.readU32() == 0);
+    CHECK(connectReader.readU32() == 0xAABBCCDD);
+
+    bt::core::Sha1Hash infoHash{};
+    infoHash.fill(7);
+    auto announce = encodeAnnounce(42, 9, infoHash, std::string(20, 'p'), 6881, 5,
+                                   {.uploaded = 1, .downloaded = 2, .left = 3,
+                                    .event = bt::core::AnnounceEvent::Stopped});
+    REQUIRE(announce.size() == ANNOUNCE_LEN);
+    bt::utils::ByteReader reader(announce);
+    CHECK(readU64(reader) == 42);
+    CHECK(reader.readU32() == 1);
+    CHECK(reader.readU32() == 9);
+    CHECK(reader.readU8() == 7);
+    CHECK(announce[16 + 20] == 'p');
+    CHECK(announce[97] == (6881 & 0xFF));
+    CHECK(announce[92] == 0xFF); // numwant -1, the tracker's default
+
+    std::vector<uint8_t> reply{0, 0, 0, 1, 0, 0, 0, 9, 0, 0, 0, 60, 0, 0, 0, 2, 0, 0, 0, 3,
+                               127, 0, 0, 1, 0x1a, 0xe1};
+    auto parsed = parseReply(reply);
+    REQUIRE(parsed.has_value());
+    CHECK(parsed->action == Action::ANNOUNCE);
+    CHECK(parsed->transactionId == 9);
+    auto response = parseAnnounceReply(parsed->body);
+    CHECK(response.interval == 60);
+    CHECK(response.peersBlob.size() == 1);
+    CHECK_FALSE(parseReply(std::vector<uint8_t>{0, 0, 0}).has_value());
+}
+
+TEST_CASE("UdpTrackerClient shares its socket and connection id between torrents") {
+    asio::io_context io;
+    LocalUdpTracker tracker{io};
+    asio::co_spawn(io, tracker.serve(), asio::detached);
+    auto client =
+        std::make_shared<bt::core::UdpTrackerClient>(io, bt::core::UdpTrackerClient::Options{});
+    client->start();
+
+    bt::core::Sha1Hash first{};
+    first.fill(1);
+    bt::core::Sha1Hash second{};
+    second.fill(2);
+    auto peerId = bt::core::generateId(20);
+    runOn(io, [&]() -> asio::awaitable<void> {
+        auto response = co_await client->announce(
+            tracker.url(), first, peerId, 6881,
+            {.left = 100, .event = bt::core::AnnounceEvent::Started, .numWant = 25});
+        CHECK(response.interval == 1800);
+        CHECK(response.peersBlob.size() == 1);
+        co_await client->announce(tracker.url(), second, peerId, 6881, {.left = 200});
+    });
+    client->close();
+
+    CHECK(tracker.connects == 1); // The second announce reused the connection id
+    REQUIRE(tracker.announces.size() == 2);
+    CHECK(tracker.announces[0].infoHash == first);
+    CHECK(tracker.announces[0].event == 2);
+    CHECK(tracker.announces[0].left == 100);
+    CHECK(tracker.announces[0].numWant == 25);
+    CHECK(tracker.announces[1].infoHash == second);
+    CHECK(tracker.announces[1].event == 0);
+    CHECK(tracker.announces[1].numWant == 0xFFFFFFFF);
+    CHECK(tracker.announces[0].from == tracker.announces[1].from);
+}
+
+TEST_CASE("UdpTrackerClient retransmits with growing timeouts and reports refusals") {
+    asio::io_context io;
+    LocalUdpTracker tracker{io};
+    tracker.drop = 2;
+    asio::co_spawn(io, tracker.serve(), asio::detached);
+    auto client = std::make_shared<bt::core::UdpTrackerClient>(
+        io, bt::core::UdpTrackerClient::Options{.baseTimeout = 50ms, .maxRetransmits = 2});
+    client->start();
+
+    bt::core::Sha1Hash infoHash{};
+    auto peerId = bt::core::generateId(20);
+    runOn(io, [&]() -> asio::awaitable<void> {
+        auto begin = std::chrono::steady_clock::now();
+        co_await client->announce(tracker.url(), infoHash, peerId, 6881, {});
+        CHECK(std::chrono::steady_clock::now() - begin >= 150ms); // 50ms, then 100ms
+
+        tracker.drop = 100;
+        bool gaveUp = false;
+        try {
+            co_await client->announce(tracker.url(), infoHash, peerId, 6881, {});
+        } catch (const std::runtime_error&) {
+            gaveUp = true;
+        }
+        CHECK(gaveUp);
+
+        tracker.drop = 0;
+        tracker.refuse = "torrent not registered";
+        bool refused = false;
+        try {
+            co_await client->announce(tracker.url(), infoHash, peerId, 6881, {});
+        } catch (const std::runtime_error& e) {
+            refused = contains(e.what(), "torrent not registered");
+        }
+        CHECK(refused);
+
+        tracker.refuse.clear();
+        co_await client->announce(tracker.url(), infoHash, peerId, 6881, {});
+    });
+    client->close();
+    CHECK(tracker.connects == 2); // The refusal dropped the connection id
+}
+
+TEST_CASE("TrackerAnnouncer picks the UDP tracker protocol from the URL") {
+    asio::io_context io;
+    auto work = asio::make_work_guard(io);
+    LocalUdpTracker tracker{io};
+    asio::co_spawn(io, tracker.serve(), asio::detached);
+    auto client =
+        std::make_shared<bt::core::UdpTrackerClient>(io, bt::core::UdpTrackerClient::Options{});
+    client->start();
+
+    bt::core::Sha1Hash infoHash{};
+    std::promise<std::vector<bt::core::Peer>> answered;
+    auto announcer = std::make_shared<bt::core::TrackerAnnouncer>(
+        io.get_executor(), Tiers{{tracker.url()}}, infoHash, bt::core::generateId(20), 6881,
+        [] { return bt::core::TrackerAnnouncer::Stats{.left = 300}; },
+        [&](std::vector<bt::core::Peer> peers) { answered.set_value(peers); },
+        bt::core::TrackerAnnouncer::Options{}, client);
+
+    std::thread runner([&] { io.run(); });
+    announcer->start();
+    auto peers = answered.get_future();
+    auto status = peers.wait_for(10s);
+    announcer->stop().wait_for(5s);
+    client->close();
+    work.reset();
+    io.stop();
+    runner.join();
+
+    REQUIRE(status == std::future_status::ready);
+    CHECK(peers.get().size() == 1);
+    REQUIRE(tracker.announces.size() == 2);
+    CHECK(tracker.announces[0].event == 2); // started
+    CHECK(tracker.announces[1].event == 3); // stopped
+}
+
+TEST_CASE("TrackerAnnouncer reports a round in which every tier failed") {
+    asio::io_context io;
+    auto work = asio::make_work_guard(io);
+
+    bt::core::Sha1Hash infoHash{};
+    std::promise<std::string> failed;
+    bool peers = false;
+    auto announcer = std::make_shared<bt::core::TrackerAnnouncer>(
+        io.get_executor(), Tiers{{closedPortUrl(io)}, {closedPortUrl(io)}}, infoHash,
+        bt::core::generateId(20), 6881,
+        [] { return bt::core::TrackerAnnouncer::Stats{.left = 300}; },
+        [&](std::vector<bt::core::Peer>) { peers = true; },
+        bt::core::TrackerAnnouncer::Options{.retryBackoff = 10s, .timeout = 2000ms}, nullptr,
+        [&](const std::string& error) { failed.set_value(error); });
+
+    std::thread runner([&] { io.run(); });
+    announcer->start();
+    auto error = failed.get_future();
+    auto status = error.wait_for(10s);
+    announcer->stop().wait_for(5s);
+    work.reset();
+    io.stop();
+    runner.join();
+
+    REQUIRE(status == std::future_status::ready);
+    CHECK_FALSE(error.get().empty());
+    CHECK_FALSE(peers);
+}
+
+TEST_CASE("TrackerAnnouncer gives up on a silent UDP tracker after the timeout") {
+    asio::io_context io;
+    auto work = asio::make_work_guard(io);
+    LocalUdpTracker silent{io};
+    silent.drop = 1000;
+    asio::co_spawn(io, silent.serve(), asio::detached);
+    LocalTracker backup{io, [](size_t) { return TRACKER_OK; }};
+    asio::co_spawn(io, backup.serve(), asio::detached);
+    // Left alone, the retransmissions would go on for hours
+    auto client =
+        std::make_shared<bt::core::UdpTrackerClient>(io, bt::core::UdpTrackerClient::Options{});
+    client->start();
+
+    bt::core::Sha1Hash infoHash{};
+    std::promise<void> answeredTwice;
+    size_t answers = 0;
+    auto announcer = std::make_shared<bt::core::TrackerAnnouncer>(
+        io.get_executor(), Tiers{{silent.url()}, {backup.url()}}, infoHash,
+        bt::core::generateId(20), 6881,
+        [] { return bt::core::TrackerAnnouncer::Stats{.left = 300}; },
+        [&](std::vector<bt::core::Peer>) {
+            if (++answers == 2) {
+                answeredTwice.set_value();
+            }
+        },
+        bt::core::TrackerAnnouncer::Options{.retryBackoff = 10s, .timeout = 300ms}, client);
+
+    std::thread runner([&] { io.run(); });
+    auto begin = std::chrono::steady_clock::now();
+    announcer->start();
+    auto status = answeredTwice.get_future().wait_for(10s);
+    auto elapsed = std::chrono::steady_clock::now() - begin;
+    announcer->stop().wait_for(5s);
+    client->close();
+    work.reset();
+    io.stop();
+    runner.join();
+
+    REQUIRE(status == std::future_status::ready);
+    CHECK(elapsed < 5s);
+    CHECK(silent.connects == 0);
+    // The silent tracker counted as failed, so the re-announce skipped it while it backs off
+    REQUIRE(backup.requests.size() == 3);
+    CHECK(contains(backup.requests[0], "event=started"));
+    CHECK_FALSE(contains(backup.requests[1], "event="));
+    CHECK(contains(backup.requests[2], "event=stopped"));
+}
+
+namespace {
+// Multicast over loopback, on a port of its own per test process
+bt::core::LocalDiscovery::Options lsdOptions(uint16_t offset) {
+    return {.port = static_cast<uint16_t>(40000 + (::getpid() % 10000) * 2 + offset),
+            .interface = asio::ip::address_v4::loopback()};
+}
+
+// Joined to the group, sees every announce sent to it
+asio::ip::udp::socket lsdListener(asio::io_context& io,
+                                  const bt::core::LocalDiscovery::Options& options) {
+    asio::ip::udp::socket socket(io, asio::ip::udp::v4());
+    socket.set_option(asio::ip::udp::socket::reuse_address(true));
+    socket.bind({asio::ip::address_v4::any(), options.port});
+    socket.set_option(asio::ip::multicast::join_group(options.group, options.interface));
+    socket.set_option(asio::ip::multicast::outbound_interface(options.interface));
+    return socket;
+}
+} // namespace
+
+TEST_CASE("Local service discovery announces follow BEP 14") {
+    using namespace bt::core::lsd;
+    bt::core::Sha1Hash first{};
+    first.fill(0xAB);
+    bt::core::Sha1Hash second{};
+    second.fill(0x01);
+    asio::ip::udp::endpoint group(asio::ip::make_address(MULTICAST_ADDRESS), MULTICAST_PORT);
+
+    auto message = encodeAnnounce({.port = 6881, .infoHashes = {first, second}, .cookie = "c0"},
+                                  group);
+    CHECK(message == "BT-SEARCH * HTTP/1.1\r\n"
+                     "Host: 239.192.152.143:6771\r\n"
+                     "Port: 6881\r\n"
+                     "Infohash: abababababababababababababababababababab\r\n"
+                     "Infohash: 0101010101010101010101010101010101010101\r\n"
+                     "cookie: c0\r\n\r\n\r\n");
+    auto announce = parseAnnounce(message);
+    REQUIRE(announce);
+    CHECK(announce->port == 6881);
+    CHECK(announce->infoHashes == std::vector<bt::core::Sha1Hash>{first, second});
+    CHECK(announce->cookie == "c0");
+
+    // Header names are case-insensitive, malformed info hashes are skipped
+    announce = parseAnnounce("BT-SEARCH * HTTP/1.1\r\nPORT:  51413 \r\n"
+                             "infohash: ABABABABABABABABABABABABABABABABABABABAB\r\n"
+                             "Infohash: 12345\r\n\r\n\r\n");
+    REQUIRE(announce);
+    CHECK(announce->port == 51413);
+    CHECK(announce->infoHashes == std::vector<bt::core::Sha1Hash>{first});
+    CHECK(announce->cookie.empty());
+
+    CHECK_FALSE(parseAnnounce("M-SEARCH * HTTP/1.1\r\nPort: 6881\r\n"
+                              "Infohash: abababababababababababababababababababab\r\n\r\n"));
+    CHECK_FALSE(parseAnnounce("BT-SEARCH * HTTP/1.1\r\nPort: 6881\r\n\r\n\r\n"));
+    CHECK_FALSE(parseAnnounce("BT-SEARCH * HTTP/1.1\r\nPort: none\r\n"
+                              "Infohash: abababababababababababababababababababab\r\n\r\n"));
+}
+
+TEST_CASE("LocalDiscovery finds the peers of a torrent on the LAN") {
+    asio::io_context io;
+    auto work = asio::make_work_guard(io);
+    auto options = lsdOptions(0);
+    auto first = std::make_shared<bt::core::LocalDiscovery>(io, options);
+    auto second = std::make_shared<bt::core::LocalDiscovery>(io, options);
+    first->start();
+    second->start();
+
+    bt::core::Sha1Hash infoHash{};
+    infoHash.fill(7);
+    bt::core::Sha1Hash other{};
+    other.fill(8);
+    std::vector<bt::core::Peer> firstFound;
+    std::vector<bt::core::Peer> secondFound;
+    std::promise<void> firstDone;
+    std::promise<void> secondDone;
+    first->add(infoHash, 6001, [&](bt::core::Peer peer) {
+        firstFound.push_back(peer);
+        if (firstFound.size() == 1) {
+            firstDone.set_value();
+        }
+    });
+    size_t strangers = 0; // Nobody else has `other`
+    second->add(other, 6002, [&](bt::core::Peer) { ++strangers; });
+    second->add(infoHash, 6002, [&](bt::core::Peer peer) {
+        secondFound.push_back(peer);
+        if (secondFound.size() == 1) {
+            secondDone.set_value();
+        }
+    });
+
+    std::thread runner([&] { io.run(); });
+    auto deadline = std::chrono::steady_clock::now() + 5s;
+    auto firstStatus = firstDone.get_future().wait_until(deadline);
+    auto secondStatus = secondDone.get_future().wait_until(deadline);
+    std::this_thread::sleep_for(200ms); // Late duplicates would arrive by now
+    first->close();
+    second->close();
+    work.reset();
+    io.stop();
+    runner.join();
+
+    REQUIRE(firstStatus == std::future_status::ready);
+    REQUIRE(secondStatus == std::future_status::ready);
+    bt::core::Peer firstPeer{.port = 6001, .ip = {127, 0, 0, 1}};
+    bt::core::Peer secondPeer{.port = 6002, .ip = {127, 0, 0, 1}};
+    // Their own announces are ignored, each hears the other's once
+    CHECK(firstFound == std::vector{secondPeer});
+    CHECK(secondFound == std::vector{firstPeer});
+    CHECK(strangers == 0);
+}
+
+TEST_CASE("LocalDiscovery rate limits announces per info hash") {
+    asio::io_context io;
+    auto options = lsdOptions(1);
+    auto listener = lsdListener(io, options);
+    auto discovery = std::make_shared<bt::core::LocalDiscovery>(io, options);
+    discovery->start();
+
+    bt::core::Sha1Hash infoHash{};
+    infoHash.fill(9);
+    std::vector<bt::core::Peer> found;
+    auto onPeer = [&](bt::core::Peer peer) { found.push_back(peer); };
+    discovery->add(infoHash, 6003, onPeer);
+
+    // A peer that announces far too often is passed on once
+    asio::ip::udp::endpoint group(options.group, options.port);
+    auto announce = bt::core::lsd::encodeAnnounce({.port = 7000, .infoHashes = {infoHash}}, group);
+    for (int i = 0; i < 3; ++i) {
+        listener.send_to(asio::buffer(announce), group);
+    }
+    io.run_for(100ms);
+
+    // Adding it again right away doesn't announce it again
+    discovery->remove(infoHash);
+    discovery->add(infoHash, 6003, onPeer);
+
+    size_t ours = 0;
+    std::vector<char> buffer(1500);
+    asio::ip::udp::endpoint from;
+    std::function<void()> receive = [&] {
+        listener.async_receive_from(asio::buffer(buffer), from, [&](asio::error_code ec, size_t n) {
+            if (ec) {
+                return;
+            }
+            auto heard = bt::core::lsd::parseAnnounce(std::string_view(buffer.data(), n));
+            if (heard && heard->port == 6003) {
+                ++ours;
+            }
+            receive();
+        });
+    };
+    receive();
+    io.run_for(500ms);
+    discovery->close();
+    listener.close();
+    io.run_for(100ms);
+
+    CHECK(ours == 1);
+    CHECK(found == std::vector{bt::core::Peer{.port = 7000, .ip = {127, 0, 0, 1}}});
+}
@@ -0,0 +1,295 @@
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+#include <doctest/doctest.h>
+
+#include "core/dht.hpp"
+
+#include <asio.hpp>
+#include <chrono>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unistd.h>
+#include <vector>
+
+using namespace std::chrono_literals;
+using namespace bt::core;
+
+namespace {
+dht::NodeId idWith(uint8_t first, uint8_t last) {
+    dht::NodeId id{};
+    id.front() = first;
+    id.back() = last;
+    return id;
+}
+
+dht::Endpoint loopback(uint16_t port) {
+    return {asio::ip::make_address("127.0.0.1"), port};
+}
+
+std::span<const uint8_t> bytes(std::string_view text) {
+    return {reinterpret_cast<const uint8_t*>(text.data()), text.size()};
+}
+
+std::string toString(const Sha1Hash& hash) {
+    return std::string(reinterpret_cast<const char*>(hash.data()), hash.size());
+}
+
+// Runs `test` on `io` until it returns, rethrowing what it threw
+template <typename Test> void runOn(asio::io_context& io, Test test) {
+    std::exception_ptr failure;
+    asio::co_spawn(io, std::move(test), [&](std::exception_ptr error) {
+        failure = error;
+        io.stop();
+    });
+    io.run_for(20s);
+    if (failure) {
+        std::rethrow_exception(failure);
+    }
+}
+
+asio::awaitable<void> sleepFor(std::chrono::milliseconds duration) {
+    asio::steady_timer timer(co_await asio::this_coro::executor, duration);
+    co_await timer.async_wait(asio::use_awaitable);
+}
+
+DhtNode::Options testOptions() {
+    return DhtNode::Options{.queryTimeout = 300ms};
+}
+
+// Nodes on loopback, each but the first bootstrapped from the first
+struct Cluster {
+    std::vector<std::shared_ptr<DhtNode>> nodes;
+
+    Cluster(asio::io_context& io, size_t size) {
+        for (size_t i = 0; i < size; ++i) {
+            nodes.push_back(std::make_shared<DhtNode>(io, testOptions()));
+            nodes.back()->start();
+        }
+    }
+
+    asio::awaitable<void> bootstrap() {
+        std::vector<dht::Endpoint> routers{loopback(nodes.front()->getPort())};
+        for (size_t i = 1; i < nodes.size(); ++i) {
+            co_await nodes[i]->bootstrap(routers);
+        }
+    }
+
+    void close() {
+        for (const auto& node : nodes) {
+            node->close();
+        }
+    }
+};
+
+// Sends one KRPC query from a plain socket and returns the answer
+asio::awaitable<dht::Message> rawQuery(asio::ip::udp::socket& socket, uint16_t port,
+                                       dht::Message query) {
+    auto datagram = dht::encodeMessage(query);
+    co_await socket.async_send_to(asio::buffer(datagram), loopback(port), asio::use_awaitable);
+    std::vector<uint8_t> buffer(2048);
+    dht::Endpoint from;
+    auto n = co_await socket.async_receive_from(asio::buffer(buffer), from, asio::use_awaitable);
+    co_return dht::parseMessage(std::span<const uint8_t>(buffer.data(), n));
+}
+} // namespace
+
+TEST_CASE("DHT ids are compared by XOR distance and common prefix") {
+    auto self = idWith(0x00, 0x00);
+    CHECK(dht::commonPrefix(self, self) == dht::ID_BITS);
+    CHECK(dht::commonPrefix(self, idWith(0x80, 0)) == 0);
+    CHECK(dht::commonPrefix(self, idWith(0x01, 0)) == 7);
+    CHECK(dht::commonPrefix(self, idWith(0x00, 0x01)) == dht::ID_BITS - 1);
+    CHECK(dht::distance(idWith(0x0F, 0xF0), idWith(0xFF, 0xF0)) == idWith(0xF0, 0x00));
+
+    std::mt19937 random(1);
+    dht::RoutingTable table(idWith(0xAA, 0x55));
+    for (size_t index : {0u, 5u, 42u, 159u}) {
+        CHECK(dht::commonPrefix(table.id(), table.randomIdIn(index, random)) == index);
+    }
+}
+
+TEST_CASE("RoutingTable holds K nodes per bucket and replaces failing ones") {
+    dht::RoutingTable table(idWith(0x00, 0x00));
+    auto now = dht::Clock::now();
+    // All share no prefix with us, so they land in bucket 0
+    for (uint8_t i = 0; i < dht::K; ++i) {
+        CHECK(table.onSeen({idWith(0x80, i), loopback(static_cast<uint16_t>(1000 + i))}, now));
+    }
+    dht::Node newcomer{idWith(0x80, 0xFF), loopback(2000)};
+    CHECK_FALSE(table.onSeen(newcomer, now));
+    CHECK(table.onSeen({idWith(0x01, 0x00), loopback(3000)}, now)); // Another bucket
+    CHECK(table.size() == dht::K + 1);
+
+    table.onFailed(idWith(0x80, 3));
+    CHECK(table.onSeen(newcomer, now));
+    CHECK(table.size() == dht::K + 1);
+
+    auto closest = table.closest(idWith(0x80, 0xFE), 2);
+    REQUIRE(closest.size() == 2);
+    CHECK(closest[0] == newcomer);
+    CHECK(closest[1].id == idWith(0x80, 0x06)); // 0x06 ^ 0xFE is the next smallest
+
+    // A node that keeps failing is dropped
+    for (uint32_t i = 0; i < dht::MAX_FAILURES; ++i) {
+        table.onFailed(idWith(0x01, 0x00));
+    }
+    CHECK(table.size() == dht::K);
+    CHECK(table.staleBuckets(now + 1s) == std::vector<size_t>{0, 1});
+}
+
+TEST_CASE("KRPC messages round trip and parse the BEP 5 examples") {
+    auto ping =
+        dht::parseMessage(bytes("d1:ad2:id20:abcdefghij0123456789e1:q4:ping1:t2:aa1:y1:qe"));
+    CHECK(ping.type == dht::Message::Type::QUERY);
+    CHECK(ping.method == "ping");
+    CHECK(ping.transactionId == "aa");
+    CHECK(std::get<std::string>(ping.body.values.at("id")) == "abcdefghij0123456789");
+
+    dht::Message error{.transactionId = "aa",
+                       .type = dht::Message::Type::ERROR,
+                       .errorCode = dht::ERROR_GENERIC,
+                       .errorMessage = "A Generic Error Ocurred"};
+    auto encoded = dht::encodeMessage(error);
+    CHECK(std::string(encoded.begin(), encoded.end()) ==
+          "d1:eli201e23:A Generic Error Ocurrede1:t2:aa1:y1:ee");
+    auto parsed = dht::parseMessage(encoded);
+    CHECK(parsed.type == dht::Message::Type::ERROR);
+    CHECK(parsed.errorCode == dht::ERROR_GENERIC);
+
+    std::vector<dht::Node> nodes{{idWith(1, 2), loopback(6881)}, {idWith(3, 4), loopback(80)}};
+    auto blob = dht::encodeNodes(nodes);
+    CHECK(blob.size() == 2 * dht::COMPACT_NODE_LEN);
+    CHECK(dht::parseNodes(blob) == nodes);
+    CHECK_THROWS_AS(dht::parseNodes(blob.substr(1)), std::invalid_argument);
+    CHECK_THROWS(dht::parseMessage(bytes("d1:y1:qe")));
+}
+
+TEST_CASE("TokenStore accepts tokens of the current and previous secret from the same IP") {
+    std::mt19937 random(7);
+    dht::TokenStore tokens(random);
+    auto ip = asio::ip::make_address("10.0.0.1");
+    auto token = tokens.make(ip);
+    CHECK(tokens.check(token, ip));
+    CHECK_FALSE(tokens.check(token, asio::ip::make_address("10.0.0.2")));
+    tokens.rotate();
+    CHECK(tokens.check(token, ip));
+    tokens.rotate();
+    CHECK_FALSE(tokens.check(token, ip));
+}
+
+TEST_CASE("A DHT cluster on loopback finds nodes and announced peers") {
+    asio::io_context io;
+    Cluster cluster(io, 12);
+    Sha1Hash infoHash{};
+    infoHash.fill(0x5A);
+
+    runOn(io, [&]() -> asio::awaitable<void> {
+        co_await cluster.bootstrap();
+        for (const auto& node : cluster.nodes) {
+            CHECK(co_await node->getNodeCount() >= dht::K / 2);
+        }
+
+        auto& target = cluster.nodes[5];
+        auto found = co_await cluster.nodes[9]->findNode(target->getId());
+        REQUIRE_FALSE(found.empty());
+        CHECK(found.front().id == target->getId());
+        CHECK(found.front().endpoint.port() == target->getPort());
+
+        CHECK((co_await cluster.nodes[7]->getPeers(infoHash)).empty());
+        co_await cluster.nodes[3]->announce(infoHash, 7000);
+        co_await cluster.nodes[4]->announce(infoHash, 0); // Port we send from
+        auto peers = co_await cluster.nodes[11]->getPeers(infoHash);
+        REQUIRE(peers.size() == 2);
+        CHECK(peers[0] == Peer{.port = 7000, .ip = {127, 0, 0, 1}});
+        CHECK(peers[1] == Peer{.port = cluster.nodes[4]->getPort(), .ip = {127, 0, 0, 1}});
+
+        CHECK(co_await cluster.nodes[1]->ping(loopback(cluster.nodes[2]->getPort())));
+        cluster.nodes[2]->close();
+        co_await sleepFor(50ms);
+        CHECK_FALSE(co_await cluster.nodes[1]->ping(loopback(cluster.nodes[2]->getPort())));
+        cluster.close();
+    });
+}
+
+TEST_CASE("DHT nodes refuse announces without a valid token") {
+    asio::io_context io;
+    auto node = std::make_shared<DhtNode>(io, testOptions());
+    node->start();
+    asio::ip::udp::socket socket(io, {asio::ip::make_address("127.0.0.1"), 0});
+    Sha1Hash infoHash{};
+    infoHash.fill(0x11);
+    auto me = toString(idWith(0x42, 0x42));
+
+    runOn(io, [&]() -> asio::awaitable<void> {
+        dht::Message announce{.transactionId = "an",
+                              .type = dht::Message::Type::QUERY,
+                              .method = "announce_peer"};
+        announce.body.values["id"] = me;
+        announce.body.values["info_hash"] = toString(infoHash);
+        announce.body.values["port"] = int64_t{6881};
+        announce.body.values["token"] = std::string("forged");
+        auto refused = co_await rawQuery(socket, node->getPort(), announce);
+        CHECK(refused.type == dht::Message::Type::ERROR);
+        CHECK(refused.errorCode == dht::ERROR_PROTOCOL);
+        CHECK(refused.transactionId == "an");
+
+        dht::Message getPeers{.transactionId = "gp",
+                              .type = dht::Message::Type::QUERY,
+                              .method = "get_peers"};
+        getPeers.body.values["id"] = me;
+        getPeers.body.values["info_hash"] = toString(infoHash);
+        auto answer = co_await rawQuery(socket, node->getPort(), getPeers);
+        REQUIRE(answer.type == dht::Message::Type::RESPONSE);
+        CHECK_FALSE(answer.body.values.contains("values"));
+
+        announce.body.values["token"] = answer.body.values.at("token");
+        auto accepted = co_await rawQuery(socket, node->getPort(), announce);
+        CHECK(accepted.type == dht::Message::Type::RESPONSE);
+
+        answer = co_await rawQuery(socket, node->getPort(), getPeers);
+        REQUIRE(answer.body.values.contains("values"));
+        const auto& values = std::get<bencode::List>(answer.body.values.at("values")).values;
+        REQUIRE(values.size() == 1);
+        CHECK(std::get<std::string>(values[0]) == std::string("\x7f\x00\x00\x01\x1a\xe1", 6));
+
+        dht::Message unknown{.transactionId = "uk",
+                             .type = dht::Message::Type::QUERY,
+                             .method = "vote"};
+        unknown.body.values["id"] = me;
+        auto error = co_await rawQuery(socket, node->getPort(), unknown);
+        CHECK(error.errorCode == dht::ERROR_METHOD_UNKNOWN);
+        node->close();
+    });
+}
+
+TEST_CASE("A DHT node bootstraps from the nodes it saved") {
+    auto stateFile = std::filesystem::temp_directory_path() /
+                     ("bt-dht-test-" + std::to_string(::getpid()) + ".dat");
+    std::filesystem::remove(stateFile);
+    asio::io_context io;
+    Cluster cluster(io, 6);
+    auto options = testOptions();
+    options.stateFile = stateFile;
+    auto first = std::make_shared<DhtNode>(io, options);
+    first->start();
+
+    runOn(io, [&]() -> asio::awaitable<void> {
+        co_await cluster.bootstrap();
+        std::vector<dht::Endpoint> routers{loopback(cluster.nodes.front()->getPort())};
+        CHECK(co_await first->bootstrap(routers) >= 5);
+        first->close();
+        co_await sleepFor(50ms);
+        REQUIRE(std::filesystem::exists(stateFile));
+
+        // Same id and the old nodes, no router needed
+        auto second = std::make_shared<DhtNode>(io, options);
+        second->start();
+        CHECK(second->getId() == first->getId());
+        CHECK(co_await second->getNodeCount() >= 5);
+        CHECK(co_await second->bootstrap(std::vector<dht::Endpoint>()) >= 5);
+        second->close();
+        cluster.close();
+    });
+    std::filesystem::remove(stateFile);
+}
@@ -1,11 +1,57 @@
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+#include "core/bandwidth_channel.hpp"
+#include "core/choker.hpp"
+#include "core/extension_protocol.hpp"
+#include "core/frame_decoder.hpp"
+#include "core/metadata_fetcher.hpp"
 #include "core/peer_communicator.hpp"
+#include "core/peer_listener.hpp"
+#include "core/peer_pool.hpp"
+#include "core/piece_cache.hpp"
+#include "core/request_pipeline.hpp"
+#include "core/utils.hpp"
+#include "core/utp.hpp"
 #include "doctest/doctest.h"
+#include <algorithm>
+#include <chrono>
+#include <future>
+#include <random>
+#include <set>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
 using namespace bt::core;
 
+namespace {
+std::vector<uint8_t> frameBytes(uint8_t id, size_t payloadLen, uint8_t fill = 0xAB) {
+    uint32_t len = static_cast<uint32_t>(payloadLen + 1);
+    std::vector<uint8_t> out = {static_cast<uint8_t>(len >> 24), static_cast<uint8_t>(len >> 16),
+                                static_cast<uint8_t>(len >> 8), static_cast<uint8_t>(len), id};
+    out.resize(out.size() + payloadLen, fill);
+    return out;
+}
+
+// Feed bytes into the decoder in chunks of at most chunkSize, collecting all frames
+std::vector<std::pair<msg::id, std::vector<uint8_t>>>
+decodeAll(FrameDecoder& decoder, const std::vector<uint8_t>& bytes, size_t chunkSize) {
+    std::vector<std::pair<msg::id, std::vector<uint8_t>>> frames;
+    size_t pos = 0;
+    while (pos < bytes.size()) {
+        auto space = decoder.prepare();
+        size_t n = std::min({space.size(), chunkSize, bytes.size() - pos});
+        std::copy_n(bytes.begin() + pos, n, space.begin());
+        decoder.commit(n);
+        pos += n;
+        while (auto frame = decoder.next()) {
+            frames.emplace_back(frame->id,
+                                std::vector<uint8_t>(frame->payload.begin(), frame->payload.end()));
+        }
+    }
+    return frames;
+}
+} // namespace
+
 TEST_CASE("Serialize Handshake") {
     // InfoHash and PeerID are 20 bytes long
     Sha1Hash info_hash = {0x12, 0x34, 0x56, 0x78, 0x9a, 0xbc, 0xde, 0xf0, 0x12, 0x34,
@@ -22,10 +68,13 @@ TEST_CASE("Serialize Handshake") {
     std::string proto_str(reinterpret_cast<char*>(&msg[1]), 19);
     CHECK(proto_str == "BitTorrent protocol");
 
-    // Check reserved bytes (8 bytes of 0)
-    for (int i = 20; i < 28; ++i) {
-        CHECK(msg[i] == 0);
+    // Check reserved bytes, only the Extension Protocol and Fast Extension bits are set
+    for (int i = 20; i < 27; ++i) {
+        CHECK(msg[i] == (i == 25 ? 0x10 : 0));
     }
+    CHECK(msg[27] == 0x04);
+    CHECK(supportsFastExtension(msg));
+    CHECK(supportsExtensionProtocol(msg));
 
     // Check info hash
     for (int i = 0; i < 20; ++i) {
@@ -91,3 +140,1010 @@ TEST_CASE("Verify Handshake") {
         CHECK(verifyHandshake(msg, expected_hash) == false);
     }
 }
+
+TEST_CASE("HeaderWriter serializes a REQUEST in network byte order") {
+    bt::utils::HeaderWriter request;
+    request.write_u32(13);
+    request.write_u8(static_cast<uint8_t>(msg::id::REQUEST));
+    request.write_u32(0x01020304);
+    request.write_u32(16384);
+    request.write_u32(16384);
+
+    std::vector<uint8_t> expected = {0, 0, 0, 13, 6, 1, 2, 3, 4, 0, 0, 0x40, 0, 0, 0, 0x40, 0};
+    auto written = request.data();
+    CHECK(std::vector<uint8_t>(written.begin(), written.end()) == expected);
+    CHECK(written.size() == bt::utils::HeaderWriter::CAPACITY);
+    CHECK_THROWS_AS(request.write_u8(0), std::length_error);
+
+    // What the writer produced decodes as the same message
+    FrameDecoder decoder;
+    auto frames = decodeAll(decoder, expected, expected.size());
+    REQUIRE(frames.size() == 1);
+    CHECK(frames[0].first == msg::id::REQUEST);
+    bt::utils::ByteReader reader{frames[0].second};
+    CHECK(reader.readU32() == 0x01020304);
+    CHECK(reader.readU32() == 16384);
+    CHECK(reader.readU32() == 16384);
+}
+
+TEST_CASE("FrameDecoder decodes several messages from one read") {
+    std::vector<uint8_t> stream;
+    for (auto part : {frameBytes(1, 0), frameBytes(4, 4), frameBytes(7, 8 + 16384)}) {
+        stream.insert(stream.end(), part.begin(), part.end());
+    }
+
+    FrameDecoder decoder;
+    auto frames = decodeAll(decoder, stream, stream.size());
+    REQUIRE(frames.size() == 3);
+    CHECK(frames[0].first == msg::id::UNCHOKE);
+    CHECK(frames[0].second.empty());
+    CHECK(frames[1].first == msg::id::HAVE);
+    CHECK(frames[1].second.size() == 4);
+    CHECK(frames[2].first == msg::id::PIECE);
+    CHECK(frames[2].second.size() == 8 + 16384);
+    CHECK(decoder.buffered() == 0);
+}
+
+TEST_CASE("FrameDecoder reassembles messages split across reads") {
+    std::vector<uint8_t> stream;
+    for (int i = 0; i < 20; ++i) {
+        auto part = frameBytes(7, 8 + 16384, static_cast<uint8_t>(i));
+        stream.insert(stream.end(), part.begin(), part.end());
+    }
+
+    FrameDecoder decoder(64 * 1024);
+    auto frames = decodeAll(decoder, stream, 1000);
+    REQUIRE(frames.size() == 20);
+    for (int i = 0; i < 20; ++i) {
+        CHECK(frames[i].second.size() == 8 + 16384);
+        CHECK(frames[i].second.back() == static_cast<uint8_t>(i));
+    }
+}
+
+TEST_CASE("FrameDecoder skips keep-alives") {
+    std::vector<uint8_t> stream = {0, 0, 0, 0};
+    auto choke = frameBytes(0, 0);
+    stream.insert(stream.end(), choke.begin(), choke.end());
+    stream.insert(stream.end(), {0, 0, 0, 0});
+
+    FrameDecoder decoder;
+    auto frames = decodeAll(decoder, stream, 3);
+    REQUIRE(frames.size() == 1);
+    CHECK(frames[0].first == msg::id::CHOKE);
+}
+
+TEST_CASE("FrameDecoder handles messages larger than its buffer") {
+    std::vector<uint8_t> stream = frameBytes(5, 10000, 0xFF);
+    auto have = frameBytes(4, 4);
+    stream.insert(stream.end(), have.begin(), have.end());
+
+    FrameDecoder decoder(1024);
+    auto frames = decodeAll(decoder, stream, 700);
+    REQUIRE(frames.size() == 2);
+    CHECK(frames[0].first == msg::id::BITFIELD);
+    CHECK(frames[0].second.size() == 10000);
+    CHECK(std::all_of(frames[0].second.begin(), frames[0].second.end(),
+                      [](uint8_t b) { return b == 0xFF; }));
+    CHECK(frames[1].first == msg::id::HAVE);
+}
+
+TEST_CASE("FrameDecoder hands out the rest of a large message until it is complete") {
+    std::vector<uint8_t> stream = frameBytes(5, 2000, 0xFF);
+    FrameDecoder decoder(1024);
+    auto space = decoder.prepare();
+    std::copy_n(stream.begin(), 1024, space.begin());
+    decoder.commit(1024);
+    CHECK_FALSE(decoder.assembling());
+
+    CHECK_FALSE(decoder.next());
+    CHECK(decoder.assembling());
+    CHECK(decoder.buffered() == 0);
+    // Only the last few bytes are missing, prepare() must not offer more
+    space = decoder.prepare();
+    REQUIRE(space.size() == stream.size() - 1024);
+    std::copy(stream.begin() + 1024, stream.end() - 5, space.begin());
+    decoder.commit(space.size() - 5);
+    CHECK_FALSE(decoder.next());
+    space = decoder.prepare();
+    CHECK(space.size() == 5);
+    std::copy(stream.end() - 5, stream.end(), space.begin());
+    decoder.commit(5);
+
+    auto frame = decoder.next();
+    REQUIRE(frame);
+    CHECK(frame->payload.size() == 2000);
+    CHECK(decoder.prepare().size() == 1024);
+    CHECK_FALSE(decoder.assembling());
+}
+
+TEST_CASE("FrameDecoder rejects absurd message lengths") {
+    FrameDecoder decoder;
+    std::vector<uint8_t> stream = {0xFF, 0xFF, 0xFF, 0xFF, 7};
+    CHECK_THROWS_AS(decodeAll(decoder, stream, stream.size()), std::runtime_error);
+}
+
+TEST_CASE("FrameDecoder detaches a partially received block") {
+    std::vector<uint8_t> stream = frameBytes(7, 8 + 16384, 0x11);
+    FrameDecoder decoder;
+    auto space = decoder.prepare();
+    std::copy_n(stream.begin(), 100, space.begin());
+    decoder.commit(100);
+
+    CHECK_FALSE(decoder.next());
+    CHECK_FALSE(decoder.takePartial(msg::id::HAVE, 8));
+
+    auto partial = decoder.takePartial(msg::id::PIECE, 8);
+    REQUIRE(partial);
+    CHECK(partial->header.size() == 8);
+    CHECK(partial->body.size() == 100 - 5 - 8);
+    CHECK(partial->missing == 16384 - partial->body.size());
+    CHECK(decoder.buffered() == 0);
+
+    // Decoding continues with the message after the block
+    auto have = frameBytes(4, 4);
+    std::vector<uint8_t> rest(have.begin(), have.end());
+    auto frames = decodeAll(decoder, rest, rest.size());
+    REQUIRE(frames.size() == 1);
+    CHECK(frames[0].first == msg::id::HAVE);
+}
+
+TEST_CASE("RequestPipeline follows the bandwidth-delay product") {
+    using namespace std::chrono_literals;
+    RequestPipeline pipeline(2, 256, 32, 16384);
+    CHECK(pipeline.depth() == 32);
+
+    // 1 MB/s over a 100 ms round trip is ~6 blocks in flight, twice that is requested
+    auto now = RequestPipeline::Clock::time_point{};
+    for (int i = 0; i <= 20; ++i) {
+        pipeline.onBlockReceived(10000, 100ms, now);
+        now += 10ms;
+    }
+    CHECK(pipeline.rate() == doctest::Approx(1e6).epsilon(0.05));
+    CHECK(pipeline.depth() == 13);
+
+    SUBCASE("Bounded by the configuration") {
+        RequestPipeline fast(2, 64, 32, 16384);
+        auto t = RequestPipeline::Clock::time_point{};
+        for (int i = 0; i <= 20; ++i) {
+            fast.onBlockReceived(1000000, 100ms, t);
+            t += 10ms;
+        }
+        CHECK(fast.depth() == 64);
+    }
+
+    SUBCASE("Bounded by the peer's reqq") {
+        pipeline.setPeerLimit(8);
+        CHECK(pipeline.depth() == 8);
+    }
+}
+
+namespace {
+const Peer peerA{.port = 1, .ip = {10, 0, 0, 1}};
+const Peer peerB{.port = 2, .ip = {10, 0, 0, 2}};
+const auto poolStart = PeerPool::Clock::time_point{} + std::chrono::hours(1);
+} // namespace
+
+TEST_CASE("PeerPool hands out proven peers first") {
+    using namespace std::chrono_literals;
+    PeerPool pool(1s, 4s, 3);
+    auto now = poolStart;
+    CHECK(pool.add(peerA));
+    CHECK(pool.add(peerB));
+    CHECK_FALSE(pool.add(peerA));
+
+    REQUIRE(pool.next(now));
+    REQUIRE(pool.next(now));
+    CHECK_FALSE(pool.next(now)); // Both are connecting
+    pool.onConnected(peerA);
+    pool.onConnected(peerB);
+    pool.onClosed(peerA, 1000.0, now);
+    pool.onClosed(peerB, 5000.0, now);
+
+    CHECK_FALSE(pool.next(now));
+    CHECK(pool.next(now + 1s) == peerB);
+    CHECK(pool.next(now + 1s) == peerA);
+}
+
+TEST_CASE("PeerPool hands out LAN peers first") {
+    using namespace std::chrono_literals;
+    PeerPool pool(1s, 4s, 3);
+    auto now = poolStart;
+    Peer peerC{.port = 6881, .ip = {192, 168, 1, 7}};
+    pool.add(peerA);
+    pool.add(peerB);
+    CHECK(pool.add(peerC, true));
+    CHECK_FALSE(pool.add(peerA, true)); // Known, but now local as well
+
+    auto first = pool.next(now);
+    auto second = pool.next(now);
+    REQUIRE(first);
+    REQUIRE(second);
+    CHECK(std::set<Peer>{*first, *second} == std::set<Peer>{peerA, peerC});
+    CHECK(pool.next(now) == peerB);
+
+    // A fast remote peer still ranks behind a slow local one
+    pool.onConnected(peerB);
+    pool.onConnected(peerC);
+    pool.onClosed(peerB, 5000.0, now);
+    pool.onClosed(peerC, 1000.0, now);
+    CHECK(pool.next(now + 1s) == peerC);
+    CHECK(pool.next(now + 1s) == peerB);
+}
+
+TEST_CASE("PeerPool backs off failing peers until it drops them") {
+    using namespace std::chrono_literals;
+    PeerPool pool(1s, 4s, 3);
+    auto now = poolStart;
+    pool.add(peerA);
+    pool.block(peerB);
+
+    REQUIRE(pool.next(now) == peerA);
+    pool.onFailed(peerA, now);
+    CHECK(pool.nextRetry() == now + 1s);
+
+    REQUIRE(pool.next(now + 1s) == peerA);
+    pool.onFailed(peerA, now + 1s);
+    CHECK(pool.nextRetry() == now + 3s);
+
+    REQUIRE(pool.next(now + 3s) == peerA);
+    pool.onFailed(peerA, now + 3s);
+    CHECK_FALSE(pool.nextRetry());
+    CHECK(pool.size() == 1); // Only the blocked peer is left
+}
+
+namespace {
+Peer chokePeer(uint8_t n) {
+    return Peer{.port = 6881, .ip = {10, 0, 1, n}};
+}
+} // namespace
+
+TEST_CASE("Choker unchokes the interested peers that give us the most") {
+    using namespace std::chrono_literals;
+    Choker choker(3, 3, 1);
+    auto now = poolStart;
+    std::vector<ChokeCandidate> peers = {
+        {chokePeer(1), true, 0, 0},
+        {chokePeer(2), true, 0, 0},
+        {chokePeer(3), false, 0, 0},
+        {chokePeer(4), true, 0, 0},
+    };
+    choker.rechoke(peers, false, now);
+
+    peers[0].downloaded = 1000;
+    peers[1].downloaded = 5000;
+    peers[2].downloaded = 9000; // Fastest, but doesn't want anything
+    peers[3].downloaded = 3000;
+    auto unchoked = choker.rechoke(peers, false, now + 10s);
+
+    // Two regular slots, the optimistic one goes to the only interested peer left
+    CHECK(unchoked.size() == 3);
+    CHECK(unchoked.contains(chokePeer(2)));
+    CHECK(unchoked.contains(chokePeer(4)));
+    CHECK(unchoked.contains(chokePeer(1)));
+    CHECK(choker.optimistic() == chokePeer(1));
+    CHECK_FALSE(unchoked.contains(chokePeer(3)));
+}
+
+TEST_CASE("Choker ranks by upload rate while seeding") {
+    using namespace std::chrono_literals;
+    Choker choker(2, 3, 1);
+    auto now = poolStart;
+    std::vector<ChokeCandidate> peers = {
+        {chokePeer(1), true, 0, 0},
+        {chokePeer(2), true, 0, 0},
+        {chokePeer(3), true, 0, 0},
+    };
+    choker.rechoke(peers, true, now);
+
+    peers[0].uploaded = 100;
+    peers[1].uploaded = 7000;
+    peers[2].downloaded = 9000;
+    auto unchoked = choker.rechoke(peers, true, now + 10s);
+    CHECK(unchoked.contains(chokePeer(2)));
+    CHECK(unchoked.size() == 2);
+}
+
+TEST_CASE("Choker keeps the optimistic unchoke for several rounds") {
+    using namespace std::chrono_literals;
+    Choker choker(2, 3, 7);
+    auto now = poolStart;
+    std::vector<ChokeCandidate> peers;
+    for (uint8_t n = 1; n <= 8; ++n) {
+        peers.push_back({chokePeer(n), true, 0, 0});
+    }
+
+    choker.rechoke(peers, false, now);
+    auto first = choker.optimistic();
+    REQUIRE(first);
+    choker.rechoke(peers, false, now + 10s);
+    CHECK(choker.optimistic() == first);
+    choker.rechoke(peers, false, now + 20s);
+    CHECK(choker.optimistic() == first);
+
+    // A peer that lost interest can't keep the slot
+    for (auto& peer : peers) {
+        if (peer.peer == *first) {
+            peer.interested = false;
+        }
+    }
+    auto unchoked = choker.rechoke(peers, false, now + 30s);
+    REQUIRE(choker.optimistic());
+    CHECK(choker.optimistic() != first);
+    CHECK(unchoked.size() == 2);
+}
+
+TEST_CASE("Choker without interested peers unchokes nobody") {
+    Choker choker(4, 3, 1);
+    std::vector<ChokeCandidate> peers = {{chokePeer(1), false, 500, 0}};
+    CHECK(choker.rechoke(peers, false, poolStart).empty());
+    CHECK_FALSE(choker.optimistic());
+}
+
+TEST_CASE("PieceCache serves blocks of cached pieces") {
+    PieceCache cache(1024);
+    std::vector<uint8_t> out(4);
+    CHECK_FALSE(cache.read(3, 0, out));
+
+    std::vector<uint8_t> piece(16);
+    for (size_t i = 0; i < piece.size(); ++i) {
+        piece[i] = static_cast<uint8_t>(i);
+    }
+    cache.insert(3, piece);
+    REQUIRE(cache.read(3, 8, out));
+    CHECK(out == std::vector<uint8_t>{8, 9, 10, 11});
+    CHECK_FALSE(cache.read(3, 14, out)); // Past the end of the piece
+
+    auto stats = cache.stats();
+    CHECK(stats.hits == 1);
+    CHECK(stats.misses == 2);
+    CHECK(stats.bytes == 16);
+}
+
+TEST_CASE("PieceCache evicts the least recently used pieces") {
+    PieceCache cache(300);
+    std::vector<uint8_t> out(1);
+    cache.insert(1, std::vector<uint8_t>(100));
+    cache.insert(2, std::vector<uint8_t>(100));
+    cache.insert(3, std::vector<uint8_t>(100));
+    CHECK(cache.read(1, 0, out)); // Piece 2 is now the oldest
+
+    cache.insert(4, std::vector<uint8_t>(150));
+    CHECK(cache.read(1, 0, out));
+    CHECK_FALSE(cache.read(2, 0, out));
+    CHECK_FALSE(cache.read(3, 0, out));
+    CHECK(cache.read(4, 0, out));
+
+    auto stats = cache.stats();
+    CHECK(stats.evictions == 2);
+    CHECK(stats.bytes == 250);
+
+    cache.insert(5, std::vector<uint8_t>(400)); // Bigger than the whole cache
+    CHECK_FALSE(cache.read(5, 0, out));
+    CHECK(cache.stats().bytes == 250);
+}
+
+namespace {
+const Sha1Hash listenerHash = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20};
+
+// Connects to the listener over loopback and sends a handshake for `infoHash`
+asio::ip::tcp::socket connectAndGreet(asio::io_context& io, uint16_t port,
+                                      const Sha1Hash& infoHash) {
+    asio::ip::tcp::socket socket(io);
+    socket.connect({asio::ip::address_v4::loopback(), port});
+    auto handshake = serializeHandshake(infoHash, "-BT0001-remote-peer!");
+    asio::write(socket, asio::buffer(handshake));
+    return socket;
+}
+} // namespace
+
+TEST_CASE("PeerListener hands incoming connections to their torrent") {
+    using namespace std::chrono_literals;
+    PeerListener listener(0, 5s);
+    std::promise<std::pair<Peer, HandshakeMsg>> accepted;
+    listener.addTorrent(listenerHash, [&](PeerStream stream, Peer peer,
+                                          const HandshakeMsg& handshake) {
+        // Answer like a session would, so the remote side sees the connection is alive
+        auto reply = serializeHandshake(listenerHash, "-BT0001-local-peer!!");
+        asio::write(stream.tcp(), asio::buffer(reply));
+        accepted.set_value({peer, handshake});
+    });
+    listener.start();
+    REQUIRE(listener.getPort() != 0);
+
+    asio::io_context io;
+    auto socket = connectAndGreet(io, listener.getPort(), listenerHash);
+    auto result = accepted.get_future();
+    REQUIRE(result.wait_for(5s) == std::future_status::ready);
+    auto [peer, handshake] = result.get();
+    CHECK(std::string(handshake.begin() + 48, handshake.end()) == "-BT0001-remote-peer!");
+    CHECK(supportsFastExtension(handshake));
+    CHECK(peer.getIpStr() == "127.0.0.1");
+    CHECK(peer.port == socket.local_endpoint().port());
+
+    HandshakeMsg reply{};
+    asio::read(socket, asio::buffer(reply));
+    CHECK(verifyHandshake(reply, listenerHash));
+    listener.stop();
+}
+
+TEST_CASE("PeerListener drops connections for unknown torrents") {
+    using namespace std::chrono_literals;
+    PeerListener listener(0, 5s);
+    bool called = false;
+    listener.addTorrent(listenerHash, [&](PeerStream, Peer, const HandshakeMsg&) {
+        called = true;
+    });
+    listener.start();
+
+    asio::io_context io;
+    Sha1Hash other = listenerHash;
+    other[0] = 0xFF;
+    auto socket = connectAndGreet(io, listener.getPort(), other);
+
+    std::array<uint8_t, 1> byte{};
+    asio::error_code ec;
+    asio::read(socket, asio::buffer(byte), ec);
+    CHECK(ec == asio::error::eof);
+    listener.stop();
+    CHECK_FALSE(called);
+}
+
+TEST_CASE("handshakeInfoHash reads the info hash of an incoming handshake") {
+    auto handshake = serializeHandshake(listenerHash, "-BT0001-remote-peer!");
+    auto infoHash = handshakeInfoHash(handshake);
+    REQUIRE(infoHash);
+    CHECK(*infoHash == listenerHash);
+
+    handshake[0] = 18;
+    CHECK_FALSE(handshakeInfoHash(handshake));
+}
+
+TEST_CASE("allowedFastSet matches the BEP 6 reference") {
+    // Example from BEP 6: 80.4.4.200, info hash of 0xAA bytes, 1313 pieces
+    Sha1Hash infoHash;
+    infoHash.fill(0xAA);
+    IpAddr ip = {80, 4, 4, 200};
+
+    CHECK(allowedFastSet(infoHash, ip, 1313, 7) ==
+          std::vector<uint32_t>{1059, 431, 808, 1217, 287, 376, 1188});
+    CHECK(allowedFastSet(infoHash, ip, 1313, 9) ==
+          std::vector<uint32_t>{1059, 431, 808, 1217, 287, 376, 1188, 353, 508});
+
+    // The last octet doesn't matter, and there can't be more pieces than the torrent has
+    CHECK(allowedFastSet(infoHash, {80, 4, 4, 1}, 1313, 7) ==
+          allowedFastSet(infoHash, ip, 1313, 7));
+    CHECK(allowedFastSet(infoHash, ip, 3, 10).size() == 3);
+}
+
+TEST_CASE("Extension handshake round trip") {
+    ExtensionHandshake handshake{.extensions = {{"ut_pex", 1}, {"ut_metadata", 2}},
+                                 .listenPort = 6881,
+                                 .client = "test client",
+                                 .maxRequests = 250};
+    auto encoded = encodeExtensionHandshake(handshake);
+    std::string text(encoded.begin(), encoded.end());
+    CHECK(text == "d1:md11:ut_metadatai2e6:ut_pexi1ee1:pi6881e4:reqqi250e1:v11:test cliente");
+
+    auto parsed = parseExtensionHandshake(encoded);
+    CHECK(parsed.extensions == handshake.extensions);
+    CHECK(parsed.listenPort == 6881);
+    CHECK(parsed.client == "test client");
+    CHECK(parsed.maxRequests == 250);
+
+    // Odd values are skipped, a payload that isn't a dictionary is rejected
+    std::string odd = "d1:md6:ut_pexi300ee1:pi0ee";
+    auto oddParsed = parseExtensionHandshake(
+        std::span(reinterpret_cast<const uint8_t*>(odd.data()), odd.size()));
+    CHECK(oddParsed.extensions.empty());
+    CHECK_FALSE(oddParsed.listenPort);
+    std::string list = "li1ee";
+    CHECK_THROWS(parseExtensionHandshake(
+        std::span(reinterpret_cast<const uint8_t*>(list.data()), list.size())));
+}
+
+TEST_CASE("ut_pex messages carry compact peers") {
+    PexMessage message{.added = {{.port = 6881, .ip = {10, 0, 0, 1}}},
+                       .dropped = {{.port = 51413, .ip = {192, 168, 1, 2}}}};
+    auto parsed = parsePex(encodePex(message));
+    CHECK(parsed.added == message.added);
+    CHECK(parsed.dropped == message.dropped);
+
+    CHECK(encodeCompactPeers(message.added) == std::string("\x0a\x00\x00\x01\x1a\xe1", 6));
+    CHECK_THROWS(parseCompactPeers(std::string(7, '\0')));
+
+    // Oversized lists are cut down
+    std::vector<Peer> many;
+    for (uint16_t port = 1; port <= 80; ++port) {
+        many.push_back({.port = port, .ip = {10, 0, 0, 1}});
+    }
+    CHECK(parsePex(encodePex({.added = many})).added.size() == ext::MAX_PEX_PEERS);
+}
+
+TEST_CASE("PexState only sends changes, once per interval") {
+    using namespace std::chrono_literals;
+    PexState state(60s);
+    auto now = PexState::Clock::now();
+    Peer a{.port = 1, .ip = {10, 0, 0, 1}};
+    Peer b{.port = 2, .ip = {10, 0, 0, 2}};
+
+    auto first = state.update({a, b}, now);
+    REQUIRE(first);
+    CHECK(first->added == std::vector<Peer>{a, b});
+    CHECK(first->dropped.empty());
+
+    // Too early, and nothing new once the interval is over
+    CHECK_FALSE(state.update({a}, now + 10s));
+    CHECK_FALSE(state.update({a, b}, now + 61s));
+
+    auto second = state.update({a}, now + 62s);
+    REQUIRE(second);
+    CHECK(second->added.empty());
+    CHECK(second->dropped == std::vector<Peer>{b});
+}
+
+TEST_CASE("ut_metadata messages carry the piece after the dictionary") {
+    std::vector<uint8_t> piece = {'d', 'a', 't', 'a'};
+    auto encoded = encodeMetadataMessage(
+        {.type = MetadataMessage::Type::DATA, .piece = 1, .totalSize = 16388}, piece);
+    std::string text(encoded.begin(), encoded.end());
+    CHECK(text == "d8:msg_typei1e5:piecei1e10:total_sizei16388eedata");
+
+    auto [message, data] = parseMetadataMessage(encoded);
+    CHECK(message.type == MetadataMessage::Type::DATA);
+    CHECK(message.piece == 1);
+    CHECK(message.totalSize == 16388);
+    CHECK(std::vector<uint8_t>(data.begin(), data.end()) == piece);
+
+    auto request = encodeMetadataMessage({.type = MetadataMessage::Type::REQUEST, .piece = 0});
+    CHECK(parseMetadataMessage(request).second.empty());
+    CHECK(metadataPieceCount(16384) == 1);
+    CHECK(metadataPieceCount(16385) == 2);
+}
+
+namespace {
+// Info dictionary spanning three ut_metadata pieces
+std::string sampleInfo() {
+    TorrentMetadata::Info info{.rawPieces = std::string(2000 * HASH_LENGTH, 'x'),
+                               .pieceLength = 262144,
+                               .fileLength = 2000 * 262144ull,
+                               .fileName = "sample.iso"};
+    return detail::encodeInfoDict(info);
+}
+
+Sha1Hash sha1Of(const std::string& data) {
+    Sha1Hash hash;
+    SHA1(reinterpret_cast<const unsigned char*>(data.data()), data.size(), hash.data());
+    return hash;
+}
+
+std::span<const uint8_t> pieceOf(const std::string& info, uint32_t piece) {
+    size_t offset = piece * ext::METADATA_PIECE_LEN;
+    return std::span(reinterpret_cast<const uint8_t*>(info.data()) + offset,
+                     std::min(ext::METADATA_PIECE_LEN, info.size() - offset));
+}
+} // namespace
+
+TEST_CASE("MetadataAssembler collects pieces and checks the info hash") {
+    auto info = sampleInfo();
+    REQUIRE(metadataPieceCount(info.size()) == 3);
+    MetadataAssembler assembler(sha1Of(info));
+
+    CHECK_FALSE(assembler.nextPiece());
+    CHECK_FALSE(assembler.setSize(0));
+    REQUIRE(assembler.setSize(info.size()));
+    CHECK_FALSE(assembler.setSize(info.size() + 1));
+
+    // Every piece goes out once before any is asked twice
+    CHECK(assembler.nextPiece() == 0u);
+    CHECK(assembler.nextPiece() == 1u);
+    CHECK(assembler.nextPiece({2}) == 0u);
+    CHECK(assembler.nextPiece() == 2u);
+
+    CHECK_FALSE(assembler.addPiece(0, pieceOf(info, 0)));
+    CHECK_FALSE(assembler.addPiece(1, pieceOf(info, 0).first(100))); // Wrong length
+    CHECK_FALSE(assembler.addPiece(1, pieceOf(info, 1)));
+    CHECK(assembler.addPiece(2, pieceOf(info, 2)));
+    CHECK(assembler.isComplete());
+    CHECK(assembler.data() == info);
+
+    // Garbage starts the whole thing over
+    MetadataAssembler corrupted(sha1Of(info));
+    REQUIRE(corrupted.setSize(info.size()));
+    std::vector<uint8_t> garbage(ext::METADATA_PIECE_LEN, 0);
+    corrupted.addPiece(0, garbage);
+    corrupted.addPiece(1, pieceOf(info, 1));
+    CHECK_FALSE(corrupted.addPiece(2, pieceOf(info, 2)));
+    CHECK_FALSE(corrupted.isComplete());
+    CHECK_FALSE(corrupted.size());
+}
+
+namespace {
+void writeExtended(asio::ip::tcp::socket& socket, uint8_t id, std::span<const uint8_t> payload) {
+    bt::utils::ByteWriter header;
+    header.write_u32(static_cast<uint32_t>(2 + payload.size()));
+    header.write_u8(static_cast<uint8_t>(msg::id::EXTENDED));
+    header.write_u8(id);
+    asio::write(socket, std::array{asio::buffer(header.data()), asio::buffer(payload.data(),
+                                                                             payload.size())});
+}
+
+// Plays a peer that answers ut_metadata requests with `info`, or rejects all of them
+void serveMetadata(asio::ip::tcp::socket& socket, const Sha1Hash& infoHash,
+                   const std::string& info, bool reject) {
+    constexpr uint8_t OUR_ID = 3;
+    auto reply = serializeHandshake(infoHash, "-BT0001-local-peer!!");
+    asio::write(socket, asio::buffer(reply));
+    writeExtended(socket, ext::HANDSHAKE_ID,
+                  encodeExtensionHandshake({.extensions = {{ext::UT_METADATA, OUR_ID}},
+                                            .metadataSize = info.size()}));
+
+    uint8_t remoteId = 0;
+    while (true) {
+        std::array<uint8_t, 4> length{};
+        asio::error_code ec;
+        asio::read(socket, asio::buffer(length), ec);
+        if (ec) {
+            return;
+        }
+        std::vector<uint8_t> payload(bt::utils::ByteReader{length}.readU32());
+        asio::read(socket, asio::buffer(payload), ec);
+        if (ec) {
+            return;
+        }
+        if (payload.size() < 2 || payload[0] != static_cast<uint8_t>(msg::id::EXTENDED)) {
+            continue;
+        }
+        auto body = std::span<const uint8_t>(payload).subspan(2);
+        if (payload[1] == ext::HANDSHAKE_ID) {
+            remoteId = parseExtensionHandshake(body).extensions[ext::UT_METADATA];
+            continue;
+        }
+        auto [request, data] = parseMetadataMessage(body);
+        if (reject) {
+            writeExtended(socket, remoteId,
+                          encodeMetadataMessage(
+                              {.type = MetadataMessage::Type::REJECT, .piece = request.piece}));
+        } else {
+            writeExtended(socket, remoteId,
+                          encodeMetadataMessage({.type = MetadataMessage::Type::DATA,
+                                                 .piece = request.piece,
+                                                 .totalSize = info.size()},
+                                                pieceOf(info, request.piece)));
+        }
+    }
+}
+} // namespace
+
+TEST_CASE("MetadataFetcher fetches the info dictionary from loopback peers") {
+    using namespace std::chrono_literals;
+    auto info = sampleInfo();
+    auto infoHash = sha1Of(info);
+
+    // One peer that has the metadata and one that turns every request down
+    PeerListener seeder(0, 5s);
+    PeerListener refuser(0, 5s);
+    seeder.addTorrent(infoHash, [&](PeerStream stream, Peer, const HandshakeMsg&) {
+        serveMetadata(stream.tcp(), infoHash, info, false);
+    });
+    refuser.addTorrent(infoHash, [&](PeerStream stream, Peer, const HandshakeMsg&) {
+        serveMetadata(stream.tcp(), infoHash, info, true);
+    });
+    seeder.start();
+    refuser.start();
+
+    std::vector<Peer> peers = {{.port = refuser.getPort(), .ip = {127, 0, 0, 1}},
+                               {.port = seeder.getPort(), .ip = {127, 0, 0, 1}}};
+    {
+        MetadataFetcher fetcher(infoHash, "-BT0001-magnet-peer!", {.maxPeers = 2});
+        auto fetched = fetcher.fetch(peers, 10s);
+        REQUIRE(fetched);
+        CHECK(*fetched == info);
+
+        auto metadata = parseInfoData(*fetched);
+        CHECK(metadata.infoHash == infoHash);
+        CHECK(metadata.info.fileName == "sample.iso");
+        CHECK(metadata.info.pieceHashes.size() == 2000);
+    }
+    seeder.stop();
+    refuser.stop();
+}
+
+TEST_CASE("MetadataFetcher gives up when no peer has the metadata") {
+    using namespace std::chrono_literals;
+    auto info = sampleInfo();
+    PeerListener refuser(0, 5s);
+    refuser.addTorrent(sha1Of(info), [&](PeerStream stream, Peer, const HandshakeMsg&) {
+        serveMetadata(stream.tcp(), sha1Of(info), info, true);
+    });
+    refuser.start();
+    {
+        MetadataFetcher fetcher(sha1Of(info), "-BT0001-magnet-peer!", {});
+        CHECK_FALSE(fetcher.fetch({{.port = refuser.getPort(), .ip = {127, 0, 0, 1}}}, 10s));
+    }
+    refuser.stop();
+}
+
+TEST_CASE("uTP packets keep their header, selective ack and payload") {
+    utp::PacketHeader header{.type = utp::PacketType::DATA,
+                             .connectionId = 0xBEEF,
+                             .timestamp = 0x01020304,
+                             .timestampDiff = 0xA0B0C0D0,
+                             .windowSize = 1 << 20,
+                             .seqNr = 0xFFFF,
+                             .ackNr = 7};
+    std::vector<uint8_t> selectiveAck = {0b101, 0, 0, 0x80};
+    std::vector<uint8_t> payload = {'a', 'b', 'c'};
+    auto datagram = utp::encodePacket(header, selectiveAck, payload);
+    CHECK(datagram.size() == utp::HEADER_LEN + 2 + 4 + 3);
+    CHECK(datagram[0] == 0x01); // DATA, version 1
+
+    auto packet = utp::parsePacket(datagram);
+    REQUIRE(packet);
+    CHECK(packet->header.type == utp::PacketType::DATA);
+    CHECK(packet->header.connectionId == 0xBEEF);
+    CHECK(packet->header.timestamp == 0x01020304);
+    CHECK(packet->header.timestampDiff == 0xA0B0C0D0);
+    CHECK(packet->header.windowSize == 1 << 20);
+    CHECK(packet->header.seqNr == 0xFFFF);
+    CHECK(packet->header.ackNr == 7);
+    CHECK(packet->selectiveAck == selectiveAck);
+    CHECK(std::vector<uint8_t>(packet->payload.begin(), packet->payload.end()) == payload);
+
+    auto plain = utp::parsePacket(utp::encodePacket(header, {}, {}));
+    REQUIRE(plain);
+    CHECK(plain->selectiveAck.empty());
+    CHECK(plain->payload.empty());
+
+    CHECK_FALSE(utp::parsePacket(std::span(datagram).first(utp::HEADER_LEN - 1)));
+    datagram[0] = 0x02; // Version 2
+    CHECK_FALSE(utp::parsePacket(datagram));
+    datagram[0] = 0x51; // No such type
+    CHECK_FALSE(utp::parsePacket(datagram));
+    datagram[0] = 0x01;
+    datagram[utp::HEADER_LEN + 1] = 40; // Extension runs past the end
+    CHECK_FALSE(utp::parsePacket(datagram));
+}
+
+TEST_CASE("Ledbat grows below the target delay and backs off above it") {
+    using namespace std::chrono_literals;
+    constexpr size_t PACKET = 1000;
+    Ledbat ledbat(PACKET, 4 * PACKET);
+    auto now = Ledbat::Clock::now();
+    // Clocks of the two sides are unrelated, only changes of the delay count
+    constexpr uint32_t BASE = 0xFFFFF000;
+
+    // Empty queues: slow start, the window grows by what was acked
+    ledbat.onAck(PACKET, 4 * PACKET, BASE, now);
+    CHECK(ledbat.inSlowStart());
+    CHECK(ledbat.window() == 5 * PACKET);
+    CHECK(ledbat.queuingDelay() == 0);
+
+    // The queue fills past the target: slow start ends and the window shrinks
+    size_t before = ledbat.window();
+    ledbat.onAck(PACKET, before, BASE + 200000, now + 10ms);
+    CHECK_FALSE(ledbat.inSlowStart());
+    CHECK(ledbat.queuingDelay() == 200000);
+    CHECK(ledbat.window() < before);
+
+    // Below the target it grows again, by at most MAX_GAIN per window
+    before = ledbat.window();
+    for (size_t acked = 0; acked < before; acked += PACKET) {
+        ledbat.onAck(PACKET, before, BASE + 20000, now + 20ms);
+    }
+    CHECK(ledbat.window() > before);
+    CHECK(ledbat.window() <= before + Ledbat::MAX_GAIN);
+
+    before = ledbat.window();
+    ledbat.onLoss(50ms, now + 30ms);
+    CHECK(ledbat.window() == before / 2);
+    ledbat.onLoss(50ms, now + 40ms); // Same round trip, same loss
+    CHECK(ledbat.window() == before / 2);
+    ledbat.onTimeout();
+    CHECK(ledbat.window() == PACKET);
+}
+
+namespace {
+// Sends `data` from one uTP context to another over loopback, both impaired the same way.
+// Returns what arrived and the sender's statistics.
+std::pair<std::vector<uint8_t>, UtpSocket::Stats>
+transferOverUtp(const std::vector<uint8_t>& data, std::chrono::milliseconds delay, double loss) {
+    asio::io_context io;
+    auto server = std::make_shared<UtpContext>(
+        io, UtpContext::Options{.acceptIncoming = true, .sendDelay = delay, .lossRate = loss});
+    auto client =
+        std::make_shared<UtpContext>(io, UtpContext::Options{.sendDelay = delay, .lossRate = loss});
+    server->start();
+    client->start();
+
+    std::vector<uint8_t> received;
+    bool done = false;
+    UtpSocket::Stats stats{};
+    asio::co_spawn(
+        io,
+        [&]() -> asio::awaitable<void> {
+            auto [ec, socket] = co_await server->async_accept(asio::as_tuple(asio::use_awaitable));
+            REQUIRE_FALSE(ec);
+            std::array<uint8_t, 4096> buffer{};
+            while (true) {
+                auto [readEc, n] = co_await socket->async_read_some(
+                    asio::buffer(buffer), asio::as_tuple(asio::use_awaitable));
+                received.insert(received.end(), buffer.begin(), buffer.begin() + n);
+                if (readEc) {
+                    CHECK(readEc == asio::error::eof);
+                    break;
+                }
+            }
+            socket->close();
+            done = true;
+        },
+        asio::detached);
+    asio::co_spawn(
+        io,
+        [&]() -> asio::awaitable<void> {
+            auto socket = client->createSocket();
+            auto [ec] = co_await socket->async_connect(
+                {asio::ip::address_v4::loopback(), server->getPort()},
+                asio::as_tuple(asio::use_awaitable));
+            REQUIRE_FALSE(ec);
+            auto [writeEc, n] = co_await asio::async_write(*socket, asio::buffer(data),
+                                                           asio::as_tuple(asio::use_awaitable));
+            CHECK_FALSE(writeEc);
+            socket->close(); // The FIN follows the data
+            asio::steady_timer wait(io);
+            while (!done) {
+                wait.expires_after(std::chrono::milliseconds(20));
+                co_await wait.async_wait(asio::use_awaitable);
+            }
+            stats = socket->stats();
+            server->close();
+            client->close();
+        },
+        asio::detached);
+
+    io.run_for(std::chrono::seconds(30));
+    return {received, stats};
+}
+
+std::vector<uint8_t> randomBytes(size_t size) {
+    std::mt19937 random(42);
+    std::vector<uint8_t> data(size);
+    for (auto& byte : data) {
+        byte = static_cast<uint8_t>(random());
+    }
+    return data;
+}
+} // namespace
+
+TEST_CASE("uTP transfers a stream between two local endpoints") {
+    using namespace std::chrono_literals;
+    auto data = randomBytes(512 * 1024);
+    auto [received, stats] = transferOverUtp(data, 0ms, 0.0);
+    CHECK(received == data);
+#ifdef __linux__
+    // Loopback takes full Ethernet sized packets, probing finds that out
+    CHECK(stats.packetSize > 1400);
+#endif
+}
+
+TEST_CASE("uTP recovers from delay and loss") {
+    using namespace std::chrono_literals;
+    auto data = randomBytes(256 * 1024);
+    auto [received, stats] = transferOverUtp(data, 10ms, 0.03);
+    CHECK(received == data);
+    CHECK(stats.retransmits > 0);
+    CHECK(stats.roundTrip >= 20ms);
+}
+
+TEST_CASE("BandwidthChannel holds peers to their shared and own limits") {
+    using namespace std::chrono_literals;
+    using Clock = BandwidthChannel::Clock;
+    constexpr uint64_t RATE = 1000000;
+    constexpr size_t BLOCK = 16384;
+    auto torrent = std::make_shared<BandwidthChannel>(RATE, 4 * BLOCK, nullptr, true);
+    // Two peers only limited by the torrent, one also limited on its own to a tenth of it
+    std::vector<std::shared_ptr<BandwidthChannel>> peers = {
+        std::make_shared<BandwidthChannel>(0, 0, torrent),
+        std::make_shared<BandwidthChannel>(0, 0, torrent),
+        std::make_shared<BandwidthChannel>(RATE / 10, 4 * BLOCK, torrent)};
+
+    // Every peer asks for blocks back to back, and again when it was told to
+    auto start = Clock::now();
+    std::vector<Clock::time_point> retry(peers.size(), start);
+    std::vector<uint64_t> granted(peers.size(), 0);
+    for (auto now = start; now < start + 10s; now += 1ms) {
+        for (size_t i = 0; i < peers.size(); ++i) {
+            while (now >= retry[i]) {
+                auto wait = peers[i]->request(BLOCK, now);
+                if (wait > Clock::duration::zero()) {
+                    retry[i] = now + wait;
+                } else {
+                    granted[i] += BLOCK;
+                }
+            }
+        }
+    }
+
+    uint64_t total = granted[0] + granted[1] + granted[2];
+    CHECK(total == doctest::Approx(10 * RATE).epsilon(0.02));
+    CHECK(granted[2] == doctest::Approx(RATE).epsilon(0.05));
+    // The unlimited peers take turns at the rest
+    CHECK(granted[0] == doctest::Approx(granted[1]).epsilon(0.05));
+}
+
+TEST_CASE("BandwidthChannel lets requests through while unlimited, and larger ones in debt") {
+    auto client = std::make_shared<BandwidthChannel>(0, 0);
+    auto peer = std::make_shared<BandwidthChannel>(0, 0, client, true);
+    auto now = BandwidthChannel::Clock::now();
+    for (int i = 0; i < 1000; ++i) {
+        CHECK(peer->request(1 << 20, now) == BandwidthChannel::Clock::duration::zero());
+    }
+    // A request larger than the burst waits for a full bucket, then leaves it in debt
+    BandwidthChannel small(1000, 500);
+    CHECK(small.request(2000, now) == BandwidthChannel::Clock::duration::zero());
+    CHECK(small.request(100, now) > std::chrono::milliseconds(1500));
+}
+
+TEST_CASE("BandwidthChannel keeps a loopback swarm at the target rate") {
+    using namespace std::chrono_literals;
+    constexpr uint64_t RATE = 2 * 1024 * 1024;
+    constexpr size_t BLOCK = 16384;
+    constexpr size_t BURST = 4 * BLOCK;
+    constexpr auto DURATION = 1500ms;
+    auto torrent = std::make_shared<BandwidthChannel>(RATE, BURST, nullptr, true);
+
+    // Peers upload blocks as fast as their channel lets them, over real connections
+    asio::io_context io;
+    asio::ip::tcp::acceptor acceptor(io, {asio::ip::address_v4::loopback(), 0});
+    constexpr size_t PEERS = 4;
+    std::vector<uint64_t> received(PEERS, 0);
+    uint64_t sent = 0;
+    auto start = BandwidthChannel::Clock::now();
+    for (size_t i = 0; i < PEERS; ++i) {
+        asio::co_spawn(
+            io,
+            [&, i]() -> asio::awaitable<void> {
+                asio::ip::tcp::socket socket(io);
+                co_await socket.async_connect(acceptor.local_endpoint(), asio::use_awaitable);
+                BandwidthChannel channel(0, 0, torrent);
+                std::vector<uint8_t> block(BLOCK, static_cast<uint8_t>(i));
+                asio::steady_timer wait(io);
+                while (BandwidthChannel::Clock::now() < start + DURATION) {
+                    auto delay = channel.request(BLOCK);
+                    if (delay > BandwidthChannel::Clock::duration::zero()) {
+                        wait.expires_after(delay);
+                        co_await wait.async_wait(asio::use_awaitable);
+                        continue;
+                    }
+                    co_await asio::async_write(socket, asio::buffer(block), asio::use_awaitable);
+                    sent += BLOCK;
+                }
+            },
+            asio::detached);
+        asio::co_spawn(
+            io,
+            [&, i]() -> asio::awaitable<void> {
+                auto socket = co_await acceptor.async_accept(asio::use_awaitable);
+                std::array<uint8_t, 65536> buffer{};
+                while (true) {
+                    auto [ec, n] = co_await socket.async_read_some(
+                        asio::buffer(buffer), asio::as_tuple(asio::use_awaitable));
+                    if (ec) {
+                        break;
+                    }
+                    received[i] += n;
+                }
+            },
+            asio::detached);
+    }
+    io.run_for(DURATION + 2s);
+
+    std::chrono::duration<double> seconds = DURATION;
+    double expected = BURST + RATE * seconds.count(); // The bucket starts full
+    uint64_t total = 0;
+    for (auto bytes : received) {
+        total += bytes;
+        CHECK(bytes == doctest::Approx(expected / PEERS).epsilon(0.1));
+    }
+    CHECK(total == sent);
+    CHECK(static_cast<double>(total) == doctest::Approx(expected).epsilon(0.03));
+}
@@ -0,0 +1,147 @@
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+#include <doctest/doctest.h>
+
+#include "app/client_config.hpp"
+#include "app/peer_manager.hpp"
+#include "app/piece_manager.hpp"
+#include "core/peer_communicator.hpp"
+
+#include <array>
+#include <asio.hpp>
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <openssl/sha.h>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace std::chrono_literals;
+using namespace bt;
+
+namespace {
+constexpr uint32_t PIECE_LEN = 2 * BLOCK_LEN;
+constexpr uint32_t NUM_PIECES = 4;
+
+// The piece manager stores its data in the working directory, keep that out of the build tree
+struct ScratchDir {
+    std::filesystem::path previous = std::filesystem::current_path();
+    std::filesystem::path path = std::filesystem::temp_directory_path() /
+                                 ("bt-peer-manager-test-" + std::to_string(::getpid()));
+
+    ScratchDir() {
+        std::filesystem::create_directories(path);
+        std::filesystem::current_path(path);
+    }
+    ~ScratchDir() {
+        std::filesystem::current_path(previous);
+        std::filesystem::remove_all(path);
+    }
+};
+
+core::TorrentMetadata makeMetadata() {
+    core::TorrentMetadata metadata{};
+    std::vector<uint8_t> piece(PIECE_LEN, 0x5a);
+    for (uint32_t i = 0; i < NUM_PIECES; ++i) {
+        core::Sha1Hash hash;
+        SHA1(piece.data(), piece.size(), hash.data());
+        metadata.info.pieceHashes.push_back(hash);
+    }
+    metadata.info.pieceLength = PIECE_LEN;
+    metadata.info.fileLength = uint64_t(PIECE_LEN) * NUM_PIECES;
+    metadata.infoHash.fill(0x42);
+    return metadata;
+}
+
+// A peer on loopback that answers the handshake and then never sends or reads anything. Its
+// connection stays open until hangUp().
+struct IdlePeer {
+    asio::io_context io;
+    asio::ip::tcp::acceptor acceptor{io, {asio::ip::make_address("127.0.0.1"), 0}};
+    asio::ip::tcp::socket socket{io};
+    core::HandshakeMsg theirs{};
+    core::HandshakeMsg ours;
+    std::thread thread;
+
+    IdlePeer(const core::Sha1Hash& infoHash, std::string_view peerId)
+        : ours(core::serializeHandshake(infoHash, peerId)) {
+        acceptor.async_accept(socket, [this](const asio::error_code& ec) {
+            if (ec) {
+                return;
+            }
+            asio::async_read(socket, asio::buffer(theirs),
+                             [this](const asio::error_code& ec, size_t) {
+                                 if (!ec) {
+                                     asio::async_write(socket, asio::buffer(ours), asio::detached);
+                                 }
+                             });
+        });
+        // Returns once the handshake is out, the socket outlives the thread
+        thread = std::thread([this] { io.run_for(10s); });
+    }
+    ~IdlePeer() {
+        hangUp();
+    }
+
+    void hangUp() {
+        if (thread.joinable()) {
+            thread.join();
+        }
+        asio::error_code ignored;
+        socket.close(ignored);
+        acceptor.close(ignored);
+    }
+
+    std::array<uint8_t, 6> compact() const {
+        uint16_t port = acceptor.local_endpoint().port();
+        return {127, 0, 0, 1, static_cast<uint8_t>(port >> 8), static_cast<uint8_t>(port)};
+    }
+};
+
+// Polls `done` until it holds, false if it doesn't within `timeout`
+bool eventually(const std::function<bool()>& done, std::chrono::milliseconds timeout = 5s) {
+    auto until = std::chrono::steady_clock::now() + timeout;
+    while (!done() && std::chrono::steady_clock::now() < until) {
+        std::this_thread::sleep_for(10ms);
+    }
+    return done();
+}
+} // namespace
+
+TEST_CASE("PeerManager spreads sessions over its io threads and stops while peers stay connected") {
+    ScratchDir dir;
+    core::TorrentMetadata metadata = makeMetadata();
+    std::condition_variable cv;
+    auto pieceManager =
+        std::make_shared<PieceManager>(metadata, cv, nullptr, PickerConfig{}, UploadConfig{});
+
+    ClientConfig config;
+    config.io.threads = 2;
+    // A peer that hung up isn't tried again while the test runs
+    config.connection.retryBackoff = 60s;
+    IdlePeer first(metadata.infoHash, "-XX0001-idlepeer0001");
+    IdlePeer second(metadata.infoHash, "-XX0001-idlepeer0002");
+    std::string peerId = "-BT0001-managertest1";
+    core::Sha1Hash infoHash = metadata.infoHash;
+    PeerManager manager({first.compact(), second.compact()}, infoHash, peerId, config);
+    manager.start(pieceManager);
+
+    REQUIRE(eventually([&] { return manager.getConnectedCount() == 2; }));
+    // Each session went to the shard with the fewest
+    CHECK(manager.getShardLoads() == std::vector<size_t>{1, 1});
+
+    first.hangUp();
+    REQUIRE(eventually([&] { return manager.getConnectedCount() == 1; }));
+    auto loads = manager.getShardLoads();
+    REQUIRE(loads.size() == 2);
+    CHECK(loads[0] + loads[1] == 1);
+
+    // The second peer never closes its end, stop() drops its session instead of waiting
+    auto before = std::chrono::steady_clock::now();
+    manager.stop();
+    CHECK(std::chrono::steady_clock::now() - before < 2s);
+    CHECK(second.socket.is_open());
+}
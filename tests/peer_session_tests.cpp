@@ -0,0 +1,646 @@
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+#include <doctest/doctest.h>
+
+#include "app/peer_session.hpp"
+#include "app/piece_manager.hpp"
+#include "core/frame_decoder.hpp"
+#include "core/peer_communicator.hpp"
+#include "core/utils.hpp"
+
+#include <algorithm>
+#include <asio.hpp>
+#include <chrono>
+#include <condition_variable>
+#include <fcntl.h>
+#include <filesystem>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <openssl/sha.h>
+#include <set>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace std::chrono_literals;
+using namespace bt;
+
+namespace {
+constexpr uint32_t PIECE_LEN = 2 * BLOCK_LEN;
+constexpr uint32_t NUM_PIECES = 4;
+constexpr size_t TOTAL_BLOCKS = NUM_PIECES * PIECE_LEN / BLOCK_LEN;
+
+// The piece manager stores its data in the working directory, keep that out of the build tree
+struct ScratchDir {
+    std::filesystem::path previous = std::filesystem::current_path();
+    std::filesystem::path path = std::filesystem::temp_directory_path() /
+                                 ("bt-peer-session-test-" + std::to_string(::getpid()));
+
+    ScratchDir() {
+        std::filesystem::create_directories(path);
+        std::filesystem::current_path(path);
+    }
+    ~ScratchDir() {
+        std::filesystem::current_path(previous);
+        std::filesystem::remove_all(path);
+    }
+};
+
+struct Torrent {
+    std::vector<std::vector<uint8_t>> pieces;
+    core::TorrentMetadata metadata{};
+
+    Torrent() {
+        for (uint32_t i = 0; i < NUM_PIECES; ++i) {
+            std::vector<uint8_t> piece(PIECE_LEN);
+            for (size_t k = 0; k < piece.size(); ++k) {
+                piece[k] = static_cast<uint8_t>(i * 31 + k * 7);
+            }
+            core::Sha1Hash hash;
+            SHA1(piece.data(), piece.size(), hash.data());
+            metadata.info.pieceHashes.push_back(hash);
+            pieces.push_back(std::move(piece));
+        }
+        metadata.info.pieceLength = PIECE_LEN;
+        metadata.info.fileLength = uint64_t(PIECE_LEN) * NUM_PIECES;
+        metadata.infoHash.fill(0x42);
+    }
+};
+
+void appendHeader(std::vector<uint8_t>& out, uint32_t len, core::msg::id id) {
+    utils::HeaderWriter header;
+    header.write_u32(len);
+    header.write_u8(static_cast<uint8_t>(id));
+    out.insert(out.end(), header.data().begin(), header.data().end());
+}
+
+// A message whose payload is a list of integers, like HAVE or REQUEST
+std::vector<uint8_t> message(core::msg::id id, std::initializer_list<uint32_t> values = {}) {
+    std::vector<uint8_t> out;
+    appendHeader(out, static_cast<uint32_t>(1 + 4 * values.size()), id);
+    for (uint32_t value : values) {
+        utils::HeaderWriter field;
+        field.write_u32(value);
+        out.insert(out.end(), field.data().begin(), field.data().end());
+    }
+    return out;
+}
+
+// PIECE message carrying `block` of the torrent
+void appendPiece(std::vector<uint8_t>& out, const Torrent& torrent, const Block& block) {
+    appendHeader(out, 9 + block.length, core::msg::id::PIECE);
+    utils::HeaderWriter header;
+    header.write_u32(block.pieceIndex);
+    header.write_u32(block.offset);
+    out.insert(out.end(), header.data().begin(), header.data().end());
+    const auto& piece = torrent.pieces[block.pieceIndex];
+    out.insert(out.end(), piece.begin() + block.offset,
+               piece.begin() + block.offset + block.length);
+}
+
+Block parseBlock(std::span<const uint8_t> payload) {
+    utils::ByteReader reader{payload};
+    return Block{.pieceIndex = reader.readU32(),
+                 .offset = reader.readU32(),
+                 .length = reader.readU32()};
+}
+
+// Runs `test` on `io` until it returns, rethrowing what it threw
+template <typename Test> void runOn(asio::io_context& io, Test test) {
+    std::exception_ptr failure;
+    asio::co_spawn(io, std::move(test), [&](std::exception_ptr error) {
+        failure = error;
+        io.stop();
+    });
+    io.run_for(20s);
+    if (failure) {
+        std::rethrow_exception(failure);
+    }
+}
+
+// A session on loopback and the remote end of its connection, which the test scripts
+struct Loopback {
+    struct Message {
+        core::msg::id id;
+        std::vector<uint8_t> payload;
+    };
+
+    ScratchDir dir;
+    Torrent torrent;
+    std::condition_variable cv;
+    std::shared_ptr<PieceManager> pieceManager;
+    asio::io_context io;
+    std::shared_ptr<PeerSession> session;
+    asio::ip::tcp::socket remote{io};
+    core::FrameDecoder decoder;
+    std::vector<Message> messages; // Everything the session sent, in order
+
+    explicit Loopback(const PipelineConfig& pipeline = {}, const UploadConfig& upload = {})
+        : pieceManager(
+              std::make_shared<PieceManager>(torrent.metadata, cv, nullptr, PickerConfig{}, upload)),
+          session(std::make_shared<PeerSession>(io, pieceManager, pipeline, upload)) {}
+
+    // Hands the session a connection as if the remote peer had dialed in, and runs it. A
+    // `sendBuffer` above 0 shrinks the session's socket send buffer to that many bytes.
+    void start(bool fastExtension = true, int sendBuffer = 0) {
+        asio::ip::tcp::acceptor acceptor(io, {asio::ip::make_address("127.0.0.1"), 0});
+        asio::ip::tcp::socket local(io);
+        local.connect(acceptor.local_endpoint());
+        acceptor.accept(remote);
+        if (sendBuffer > 0) {
+            local.set_option(asio::socket_base::send_buffer_size(sendBuffer));
+        }
+        prepare(local);
+
+        auto handshake =
+            core::serializeHandshake(torrent.metadata.infoHash, "-XX0001-remotepeer01");
+        if (!fastExtension) {
+            handshake[core::msg::FAST_EXTENSION_BYTE] &= ~core::msg::FAST_EXTENSION_BIT;
+        }
+        core::Peer peer{.port = remote.local_endpoint().port(), .ip = {127, 0, 0, 1}};
+        session->adopt(core::PeerStream(std::move(local)), peer);
+        asio::co_spawn(
+            io,
+            [this, handshake]() -> asio::awaitable<void> {
+                co_await session->answerHandshake(torrent.metadata.infoHash,
+                                                  "-BT0001-sessiontest1", handshake, 2000ms);
+                co_await session->run();
+            },
+            asio::detached);
+    }
+    // Runs on the session's socket before the session takes it over
+    std::function<void(asio::ip::tcp::socket&)> prepare = [](asio::ip::tcp::socket&) {};
+
+    asio::awaitable<void> readHandshake() {
+        core::HandshakeMsg handshake;
+        co_await asio::async_read(remote, asio::buffer(handshake), asio::use_awaitable);
+        CHECK(core::verifyHandshake(handshake, torrent.metadata.infoHash));
+    }
+
+    asio::awaitable<void> send(std::vector<uint8_t> bytes) {
+        co_await asio::async_write(remote, asio::buffer(bytes), asio::use_awaitable);
+    }
+
+    // Reads from the session until `done` holds, false if it doesn't within `timeout`
+    asio::awaitable<bool> readUntil(std::function<bool()> done,
+                                    std::chrono::milliseconds timeout = 5s) {
+        asio::steady_timer timer(io, timeout);
+        timer.async_wait([this](const asio::error_code& ec) {
+            if (!ec) {
+                remote.cancel();
+            }
+        });
+        while (!done()) {
+            auto space = decoder.prepare();
+            auto [ec, n] = co_await remote.async_read_some(asio::buffer(space),
+                                                           asio::as_tuple(asio::use_awaitable));
+            if (ec) {
+                break;
+            }
+            decoder.commit(n);
+            while (auto frame = decoder.next()) {
+                messages.push_back({frame->id, {frame->payload.begin(), frame->payload.end()}});
+            }
+        }
+        timer.cancel();
+        co_return done();
+    }
+
+    // Collects whatever the session sends for `duration`
+    asio::awaitable<void> readFor(std::chrono::milliseconds duration) {
+        co_await readUntil([] { return false; }, duration);
+    }
+
+    // Polls `done` until it holds, false if it doesn't within `timeout`
+    asio::awaitable<bool> waitFor(std::function<bool()> done,
+                                  std::chrono::milliseconds timeout = 5s) {
+        asio::steady_timer timer(io);
+        auto until = std::chrono::steady_clock::now() + timeout;
+        while (!done() && std::chrono::steady_clock::now() < until) {
+            timer.expires_after(10ms);
+            co_await timer.async_wait(asio::use_awaitable);
+        }
+        co_return done();
+    }
+
+    std::vector<Block> requests() const {
+        std::vector<Block> blocks;
+        for (const auto& message : messages) {
+            if (message.id == core::msg::id::REQUEST) {
+                blocks.push_back(parseBlock(message.payload));
+            }
+        }
+        return blocks;
+    }
+
+    size_t count(core::msg::id id) const {
+        return std::ranges::count_if(messages, [id](const auto& m) { return m.id == id; });
+    }
+
+    bool ended() const {
+        return session->getState() == PeerState::DISCONNECTED ||
+               session->getState() == PeerState::ERROR;
+    }
+
+    // Lets the session notice the hang-up and finish before the io_context stops
+    asio::awaitable<void> hangUp() {
+        asio::error_code ignored;
+        remote.close(ignored);
+        co_await waitFor([this] { return ended(); });
+        asio::steady_timer timer(io, 50ms);
+        co_await timer.async_wait(asio::use_awaitable);
+    }
+};
+
+// Gives the piece manager the pieces in `bitfield`, as if another peer had sent them
+void seed(PieceManager& pieceManager, const Torrent& torrent, uint8_t bitfield = 0xF0) {
+    std::vector<uint8_t> pieces{bitfield};
+    core::Peer source{.port = 6881, .ip = {10, 0, 0, 1}};
+    while (auto block = pieceManager.requestBlock(pieces, {.peer = source})) {
+        auto data = std::span<const uint8_t>(torrent.pieces[block->pieceIndex])
+                        .subspan(block->offset, block->length);
+        pieceManager.deliverBlock(block->pieceIndex, block->offset, data, source);
+    }
+}
+
+// Makes the session interested and lets it request everything
+std::vector<uint8_t> bitfieldAndUnchoke() {
+    std::vector<uint8_t> batch;
+    appendHeader(batch, 2, core::msg::id::BITFIELD);
+    batch.push_back(0xF0);
+    auto unchoke = message(core::msg::id::UNCHOKE);
+    batch.insert(batch.end(), unchoke.begin(), unchoke.end());
+    return batch;
+}
+} // namespace
+
+TEST_CASE("PeerSession sends the requests of a receive batch in one write and takes the blocks") {
+    Loopback loop;
+    loop.start();
+
+    runOn(loop.io, [&]() -> asio::awaitable<void> {
+        co_await loop.readHandshake();
+        const uint64_t writesBefore = loop.session->getWriteCount();
+
+        // One batch that makes the session interested and lets it request everything
+        co_await loop.send(bitfieldAndUnchoke());
+        bool requested =
+            co_await loop.readUntil([&] { return loop.requests().size() == TOTAL_BLOCKS; });
+        REQUIRE(requested);
+        CHECK(loop.count(core::msg::id::INTERESTED) == 1);
+        // Our bitfield and extension handshake, then INTERESTED with all the REQUESTs
+        CHECK(loop.session->getWriteCount() - writesBefore <= 2);
+
+        // Every block, back to back in a single write
+        std::vector<uint8_t> blocks;
+        for (const auto& block : loop.requests()) {
+            appendPiece(blocks, loop.torrent, block);
+        }
+        co_await loop.send(blocks);
+
+        bool complete = co_await loop.waitFor([&] { return loop.pieceManager->isComplete(); });
+        CHECK(complete);
+        CHECK(loop.pieceManager->getReceivedBytes() == loop.torrent.metadata.info.fileLength);
+        co_await loop.hangUp();
+    });
+}
+
+TEST_CASE("PeerSession returns the blocks of a peer that stops answering after requestTimeout") {
+    Loopback loop(PipelineConfig{.requestTimeout = 300ms});
+    loop.start();
+
+    runOn(loop.io, [&]() -> asio::awaitable<void> {
+        co_await loop.readHandshake();
+        co_await loop.send(bitfieldAndUnchoke());
+        bool requested =
+            co_await loop.readUntil([&] { return loop.requests().size() == TOTAL_BLOCKS; });
+        REQUIRE(requested);
+        CHECK(loop.pieceManager->getRequestedBlockCount() == TOTAL_BLOCKS);
+
+        // The peer never answers, the watchdog hands every request back to the picker
+        bool returned = co_await loop.waitFor(
+            [&] { return loop.pieceManager->getRequestedBlockCount() == 0; }, 3s);
+        CHECK(returned);
+        CHECK(loop.session->getState() == PeerState::READY);
+        co_await loop.hangUp();
+    });
+}
+
+TEST_CASE("PeerSession limits a peer that sends no data for snubTimeout to one request") {
+    Loopback loop(PipelineConfig{.snubTimeout = 300ms});
+    loop.start();
+
+    runOn(loop.io, [&]() -> asio::awaitable<void> {
+        co_await loop.readHandshake();
+        co_await loop.send(bitfieldAndUnchoke());
+        bool requested =
+            co_await loop.readUntil([&] { return loop.requests().size() == TOTAL_BLOCKS; });
+        REQUIRE(requested);
+
+        // Snubbed: the requests go back, then the peer gets one at a time
+        bool returned = co_await loop.waitFor(
+            [&] { return loop.pieceManager->getRequestedBlockCount() == 0; }, 3s);
+        CHECK(returned);
+        bool retried =
+            co_await loop.readUntil([&] { return loop.requests().size() == TOTAL_BLOCKS + 1; });
+        REQUIRE(retried);
+        co_await loop.readFor(1500ms); // A few more watchdog ticks
+        CHECK(loop.requests().size() == TOTAL_BLOCKS + 1);
+        CHECK(loop.pieceManager->getRequestedBlockCount() == 1);
+
+        // Data lifts the limit
+        std::vector<uint8_t> piece;
+        appendPiece(piece, loop.torrent, loop.requests().back());
+        co_await loop.send(piece);
+        bool refilled = co_await loop.readUntil(
+            [&] { return loop.requests().size() == 2 * TOTAL_BLOCKS; }, 2s);
+        CHECK(refilled);
+        CHECK(loop.pieceManager->getRequestedBlockCount() == TOTAL_BLOCKS - 1);
+        co_await loop.hangUp();
+    });
+}
+
+TEST_CASE("PeerSession returns every outstanding block when the peer chokes it") {
+    Loopback loop;
+    loop.start(false); // Without the Fast Extension a CHOKE drops all our requests
+
+    runOn(loop.io, [&]() -> asio::awaitable<void> {
+        co_await loop.readHandshake();
+        co_await loop.send(bitfieldAndUnchoke());
+        bool requested =
+            co_await loop.readUntil([&] { return loop.requests().size() == TOTAL_BLOCKS; });
+        REQUIRE(requested);
+        CHECK(loop.pieceManager->getRequestedBlockCount() == TOTAL_BLOCKS);
+
+        co_await loop.send(message(core::msg::id::CHOKE));
+        bool returned = co_await loop.waitFor(
+            [&] { return loop.pieceManager->getRequestedBlockCount() == 0; }, 500ms);
+        CHECK(returned);
+        // Nothing more is requested while choked, not even on a watchdog tick
+        co_await loop.readFor(1200ms);
+        CHECK(loop.requests().size() == TOTAL_BLOCKS);
+        co_await loop.hangUp();
+    });
+}
+
+TEST_CASE("PeerSession rejects a HAVE for a piece the torrent doesn't have") {
+    Loopback loop;
+    loop.start();
+
+    runOn(loop.io, [&]() -> asio::awaitable<void> {
+        co_await loop.readHandshake();
+        // A valid HAVE on its own makes the session interested
+        auto known = message(core::msg::id::HAVE, {NUM_PIECES - 1});
+        co_await loop.send(known);
+        bool interested =
+            co_await loop.readUntil([&] { return loop.count(core::msg::id::INTERESTED) == 1; });
+        CHECK(interested);
+        CHECK(loop.session->getState() != PeerState::ERROR);
+
+        auto unknown = message(core::msg::id::HAVE, {NUM_PIECES});
+        co_await loop.send(unknown);
+        bool dropped = co_await loop.waitFor([&] { return loop.ended(); });
+        CHECK(dropped);
+        CHECK(loop.session->getState() == PeerState::ERROR);
+        co_await loop.hangUp();
+    });
+}
+
+TEST_CASE("PeerSession refills its pipeline right after a REJECT") {
+    Loopback loop;
+    loop.start();
+
+    runOn(loop.io, [&]() -> asio::awaitable<void> {
+        co_await loop.readHandshake();
+        co_await loop.send(bitfieldAndUnchoke());
+        bool requested =
+            co_await loop.readUntil([&] { return loop.requests().size() == TOTAL_BLOCKS; });
+        REQUIRE(requested);
+
+        // The rejected block is the only one left, so it's asked for again without waiting
+        // for the watchdog
+        Block rejected = loop.requests().front();
+        auto reject = message(core::msg::id::REJECT_REQUEST,
+                              {rejected.pieceIndex, rejected.offset, rejected.length});
+        co_await loop.send(reject);
+        bool again = co_await loop.readUntil(
+            [&] { return loop.requests().size() == TOTAL_BLOCKS + 1; }, 300ms);
+        CHECK(again);
+        if (again) {
+            Block retried = loop.requests().back();
+            CHECK(retried.pieceIndex == rejected.pieceIndex);
+            CHECK(retried.offset == rejected.offset);
+        }
+        CHECK(loop.pieceManager->getRequestedBlockCount() == TOTAL_BLOCKS);
+        co_await loop.hangUp();
+    });
+}
+
+TEST_CASE("PeerSession uploads the same bytes with and without zero-copy") {
+    UploadConfig upload;
+    int sendBuffer = 0;
+    bool slowReader = false;
+    bool sendfileFails = false;
+    SUBCASE("Buffered") {
+        upload.zeroCopy = false;
+    }
+    SUBCASE("Zero-copy, waiting for a full socket to drain") {
+        // Small buffers on both ends and a peer that reads late make sendfile hit EAGAIN
+        upload.zeroCopy = true;
+        sendBuffer = 4096;
+        slowReader = true;
+    }
+    SUBCASE("Zero-copy, falling back to buffers when sendfile fails") {
+        upload.zeroCopy = true;
+        sendfileFails = true;
+    }
+
+    Loopback loop({}, upload);
+    seed(*loop.pieceManager, loop.torrent);
+    REQUIRE(loop.pieceManager->isComplete());
+    if (sendfileFails) {
+        // sendfile refuses sockets in append mode (EINVAL), plain writes don't mind
+        loop.prepare = [](asio::ip::tcp::socket& socket) {
+            int flags = ::fcntl(socket.native_handle(), F_GETFL);
+            ::fcntl(socket.native_handle(), F_SETFL, flags | O_APPEND);
+        };
+    }
+    loop.start(true, sendBuffer);
+    if (slowReader) {
+        loop.remote.set_option(asio::socket_base::receive_buffer_size(4096));
+    }
+
+    runOn(loop.io, [&]() -> asio::awaitable<void> {
+        co_await loop.readHandshake();
+        bool announced =
+            co_await loop.readUntil([&] { return loop.count(core::msg::id::HAVE_ALL) == 1; });
+        REQUIRE(announced);
+        asio::post(loop.session->getExecutor(), [&] { loop.session->setChoking(false); });
+        bool unchoked =
+            co_await loop.readUntil([&] { return loop.count(core::msg::id::UNCHOKE) == 1; });
+        REQUIRE(unchoked);
+
+        std::vector<uint8_t> requests = message(core::msg::id::INTERESTED);
+        for (uint32_t index = 0; index < NUM_PIECES; ++index) {
+            for (uint32_t offset = 0; offset < PIECE_LEN; offset += BLOCK_LEN) {
+                auto request = message(core::msg::id::REQUEST, {index, offset, BLOCK_LEN});
+                requests.insert(requests.end(), request.begin(), request.end());
+            }
+        }
+        co_await loop.send(requests);
+        if (slowReader) {
+            asio::steady_timer timer(loop.io, 300ms);
+            co_await timer.async_wait(asio::use_awaitable);
+        }
+
+        bool served =
+            co_await loop.readUntil([&] { return loop.count(core::msg::id::PIECE) == TOTAL_BLOCKS; });
+        REQUIRE(served);
+        size_t next = 0;
+        for (const auto& message : loop.messages) {
+            if (message.id != core::msg::id::PIECE) {
+                continue;
+            }
+            utils::ByteReader reader{message.payload};
+            uint32_t index = reader.readU32();
+            uint32_t offset = reader.readU32();
+            auto data = reader.readRemaining();
+            // Served in the order they were asked for
+            CHECK(index == next / 2);
+            CHECK(offset == next % 2 * BLOCK_LEN);
+            const auto& piece = loop.torrent.pieces[index];
+            CHECK(std::equal(data.begin(), data.end(), piece.begin() + offset,
+                             piece.begin() + offset + BLOCK_LEN));
+            CHECK(data.size() == BLOCK_LEN);
+            ++next;
+        }
+        CHECK(loop.pieceManager->getUploadedBytes() == loop.torrent.metadata.info.fileLength);
+        co_await loop.hangUp();
+    });
+}
+
+TEST_CASE("PeerSession's writer sends what the reader queues during a write, in order") {
+    Loopback loop;
+    seed(*loop.pieceManager, loop.torrent, 0xC0);
+    // Small buffers on both ends, the blocks below keep the writer busy for a while
+    loop.start(false, 4096);
+    loop.remote.set_option(asio::socket_base::receive_buffer_size(4096));
+
+    runOn(loop.io, [&]() -> asio::awaitable<void> {
+        co_await loop.readHandshake();
+        std::vector<uint8_t> bitfield;
+        appendHeader(bitfield, 2, core::msg::id::BITFIELD);
+        bitfield.push_back(0x30);
+        co_await loop.send(bitfield);
+        bool interested =
+            co_await loop.readUntil([&] { return loop.count(core::msg::id::INTERESTED) == 1; });
+        REQUIRE(interested);
+        asio::post(loop.session->getExecutor(), [&] { loop.session->setChoking(false); });
+        bool unchoked =
+            co_await loop.readUntil([&] { return loop.count(core::msg::id::UNCHOKE) == 1; });
+        REQUIRE(unchoked);
+
+        // Every block we have, twice, without reading any of them for now
+        std::vector<Block> asked;
+        std::vector<uint8_t> requests;
+        for (int round = 0; round < 2; ++round) {
+            for (uint32_t index = 0; index < 2; ++index) {
+                for (uint32_t offset = 0; offset < PIECE_LEN; offset += BLOCK_LEN) {
+                    asked.push_back({.pieceIndex = index, .offset = offset, .length = BLOCK_LEN});
+                    auto request = message(core::msg::id::REQUEST, {index, offset, BLOCK_LEN});
+                    requests.insert(requests.end(), request.begin(), request.end());
+                }
+            }
+        }
+        co_await loop.send(requests);
+        asio::steady_timer pause(loop.io, 300ms);
+        co_await pause.async_wait(asio::use_awaitable);
+
+        // The reader queues a REQUEST for every block of pieces 2 and 3 while the write hangs
+        co_await loop.send(message(core::msg::id::UNCHOKE));
+        pause.expires_after(300ms);
+        co_await pause.async_wait(asio::use_awaitable);
+
+        bool served = co_await loop.readUntil([&] {
+            return loop.count(core::msg::id::PIECE) == asked.size() &&
+                   loop.requests().size() == 4;
+        });
+        REQUIRE(served);
+        size_t next = 0;
+        for (const auto& message : loop.messages) {
+            if (message.id != core::msg::id::PIECE) {
+                continue;
+            }
+            utils::ByteReader reader{message.payload};
+            uint32_t index = reader.readU32();
+            uint32_t offset = reader.readU32();
+            auto data = reader.readRemaining();
+            CHECK(index == asked[next].pieceIndex);
+            CHECK(offset == asked[next].offset);
+            const auto& piece = loop.torrent.pieces[index];
+            CHECK(data.size() == BLOCK_LEN);
+            CHECK(std::equal(data.begin(), data.end(), piece.begin() + offset));
+            ++next;
+        }
+        std::set<Block> wanted;
+        for (const auto& block : loop.requests()) {
+            CHECK(block.pieceIndex >= 2);
+            wanted.insert(block);
+        }
+        CHECK(wanted.size() == 4);
+        CHECK(loop.pieceManager->getRequestedBlockCount() == 4);
+        co_await loop.hangUp();
+    });
+}
+
+TEST_CASE("PeerSession closes on a write error and returns its blocks exactly once") {
+    Loopback loop;
+    int sessionFd = -1;
+    loop.prepare = [&](asio::ip::tcp::socket& socket) { sessionFd = socket.native_handle(); };
+    loop.start(false);
+
+    runOn(loop.io, [&]() -> asio::awaitable<void> {
+        co_await loop.readHandshake();
+        // The peer has everything but piece 0, so that sendHave(0) queues a message
+        std::vector<uint8_t> batch;
+        appendHeader(batch, 2, core::msg::id::BITFIELD);
+        batch.push_back(0x70);
+        auto unchoke = message(core::msg::id::UNCHOKE);
+        batch.insert(batch.end(), unchoke.begin(), unchoke.end());
+        co_await loop.send(batch);
+        const size_t expected = TOTAL_BLOCKS - PIECE_LEN / BLOCK_LEN;
+        bool requested =
+            co_await loop.readUntil([&] { return loop.requests().size() == expected; });
+        REQUIRE(requested);
+
+        // The next write fails (EPIPE) while the reader still waits for data
+        REQUIRE(::shutdown(sessionFd, SHUT_WR) == 0);
+        asio::post(loop.session->getExecutor(), [&] { loop.session->sendHave(0); });
+        bool ended = co_await loop.waitFor([&] { return loop.ended(); });
+        REQUIRE(ended);
+        CHECK(loop.session->getState() == PeerState::ERROR);
+        bool returned = co_await loop.waitFor(
+            [&] { return loop.pieceManager->getRequestedBlockCount() == 0; });
+        CHECK(returned);
+
+        // Another peer gets each of those blocks once, nothing was handed back twice
+        std::vector<uint8_t> everything{0xF0};
+        core::Peer other{.port = 6882, .ip = {10, 0, 0, 2}};
+        std::vector<Block> again;
+        while (auto block = loop.pieceManager->requestBlock(everything, {.peer = other})) {
+            again.push_back(*block);
+            if (again.size() > TOTAL_BLOCKS) {
+                break;
+            }
+        }
+        CHECK(again.size() == TOTAL_BLOCKS);
+        std::set<Block> distinct(again.begin(), again.end());
+        CHECK(distinct.size() == again.size());
+        auto before = loop.requests();
+        for (const auto& block : before) {
+            CHECK(distinct.contains(block));
+        }
+        co_await loop.hangUp();
+    });
+}
@@ -0,0 +1,390 @@
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+#include <doctest/doctest.h>
+
+#include "app/file_handler.hpp"
+#include "app/piece_manager.hpp"
+#include "app/stream_reader.hpp"
+
+#include <algorithm>
+#include <asio.hpp>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <fcntl.h>
+#include <filesystem>
+#include <memory>
+#include <openssl/sha.h>
+#include <optional>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace std::chrono_literals;
+using namespace bt;
+
+namespace {
+constexpr uint32_t PIECE_LEN = 2 * BLOCK_LEN;
+constexpr uint32_t NUM_PIECES = 4;
+
+// The piece manager stores its data in the working directory, keep that out of the build tree
+struct ScratchDir {
+    std::filesystem::path previous = std::filesystem::current_path();
+    std::filesystem::path path = std::filesystem::temp_directory_path() /
+                                 ("bt-piece-manager-test-" + std::to_string(::getpid()));
+
+    ScratchDir() {
+        std::filesystem::create_directories(path);
+        std::filesystem::current_path(path);
+    }
+    ~ScratchDir() {
+        std::filesystem::current_path(previous);
+        std::filesystem::remove_all(path);
+    }
+};
+
+struct Torrent {
+    std::vector<std::vector<uint8_t>> pieces;
+    core::TorrentMetadata metadata{};
+
+    Torrent() {
+        for (uint32_t i = 0; i < NUM_PIECES; ++i) {
+            std::vector<uint8_t> piece(PIECE_LEN);
+            for (size_t k = 0; k < piece.size(); ++k) {
+                piece[k] = static_cast<uint8_t>(i * 31 + k * 7);
+            }
+            core::Sha1Hash hash;
+            SHA1(piece.data(), piece.size(), hash.data());
+            metadata.info.pieceHashes.push_back(hash);
+            pieces.push_back(std::move(piece));
+        }
+        metadata.info.pieceLength = PIECE_LEN;
+        metadata.info.fileLength = uint64_t(PIECE_LEN) * NUM_PIECES;
+    }
+
+    std::span<const uint8_t> block(const Block& block) const {
+        return std::span<const uint8_t>(pieces[block.pieceIndex]).subspan(block.offset,
+                                                                          block.length);
+    }
+};
+
+core::Peer peerAt(uint8_t host) {
+    return core::Peer{.port = 6881, .ip = {10, 0, 0, host}};
+}
+
+std::vector<uint8_t> allPieces() {
+    return std::vector<uint8_t>((NUM_PIECES + 7) / 8, 0xff);
+}
+
+// Delivers `block` as `from` sent it, with one byte flipped if it's corrupt
+bool deliver(PieceManager& pm, const Torrent& torrent, const Block& block,
+             const core::Peer& from, bool corrupt = false) {
+    auto data = std::vector<uint8_t>(torrent.block(block).begin(), torrent.block(block).end());
+    if (corrupt) {
+        data[0] ^= 0xff;
+    }
+    return pm.deliverBlock(block.pieceIndex, block.offset, data, from);
+}
+} // namespace
+
+TEST_CASE("A peer that alone sent a corrupt piece is banned after repeated failures") {
+    ScratchDir dir;
+    Torrent torrent;
+    std::condition_variable cv;
+    PieceManager pm(torrent.metadata, cv, nullptr, PickerConfig{.hashFailuresBeforeBan = 2});
+    auto bitfield = allPieces();
+    auto bad = peerAt(1);
+
+    for (int round = 0; round < 2; ++round) {
+        CHECK_FALSE(pm.isBanned(bad.ip));
+        auto first = pm.requestBlock(bitfield, {.peer = bad});
+        auto second = pm.requestBlock(bitfield, {.peer = bad});
+        REQUIRE(first);
+        REQUIRE(second);
+        CHECK(first->pieceIndex == second->pieceIndex);
+        CHECK(deliver(pm, torrent, *first, bad));
+        CHECK_FALSE(deliver(pm, torrent, *second, bad, true));
+    }
+
+    CHECK(pm.isBanned(bad.ip));
+    CHECK(pm.getWastedBytes() == 2 * PIECE_LEN);
+    CHECK_FALSE(pm.requestBlock(bitfield, {.peer = bad}));
+    CHECK(pm.getOpenPieceCount() == 0);
+}
+
+TEST_CASE("A shared piece that fails puts its peers on parole until a clean copy names the "
+          "culprit") {
+    ScratchDir dir;
+    Torrent torrent;
+    std::condition_variable cv;
+    PieceManager pm(torrent.metadata, cv, nullptr, PickerConfig{.hashFailuresBeforeBan = 1});
+    auto bitfield = allPieces();
+    auto honest = peerAt(1);
+    auto bad = peerAt(2);
+    auto helper = peerAt(3);
+    auto other = peerAt(4);
+
+    // Both peers work on the same piece, one of them corrupts its block
+    auto fromHonest = pm.requestBlock(bitfield, {.peer = honest});
+    auto fromBad = pm.requestBlock(bitfield, {.peer = bad});
+    REQUIRE(fromHonest);
+    REQUIRE(fromBad);
+    REQUIRE(fromHonest->pieceIndex == fromBad->pieceIndex);
+    const uint32_t failed = fromHonest->pieceIndex;
+    CHECK(deliver(pm, torrent, *fromHonest, honest));
+    CHECK_FALSE(deliver(pm, torrent, *fromBad, bad, true));
+    // Nobody can be blamed yet
+    CHECK_FALSE(pm.isBanned(honest.ip));
+    CHECK_FALSE(pm.isBanned(bad.ip));
+
+    SUBCASE("Suspects only get pieces to themselves") {
+        auto own = pm.requestBlock(bitfield, {.peer = bad});
+        REQUIRE(own);
+        auto next = pm.requestBlock(bitfield, {.peer = other});
+        REQUIRE(next);
+        CHECK(next->pieceIndex != own->pieceIndex);
+    }
+
+    SUBCASE("A clean copy from another peer bans the one whose block differed") {
+        // The failed piece goes to a single peer, which gets all of it
+        auto first = pm.requestBlock(bitfield, {.peer = helper});
+        auto second = pm.requestBlock(bitfield, {.peer = helper});
+        REQUIRE(first);
+        REQUIRE(second);
+        CHECK(first->pieceIndex == failed);
+        CHECK(second->pieceIndex == failed);
+        CHECK(deliver(pm, torrent, *first, helper));
+        CHECK(deliver(pm, torrent, *second, helper));
+        CHECK(pm.hasPiece(failed));
+
+        CHECK(pm.isBanned(bad.ip));
+        CHECK_FALSE(pm.isBanned(honest.ip));
+        CHECK_FALSE(pm.isBanned(helper.ip));
+        // A banned peer that is still connected gets nothing more
+        CHECK_FALSE(pm.requestBlock(bitfield, {.peer = bad}));
+        CHECK(pm.requestBlock(bitfield, {.peer = honest}));
+    }
+}
+
+TEST_CASE("Blocks of pieces that aren't open are dropped instead of opening them") {
+    ScratchDir dir;
+    Torrent torrent;
+    std::condition_variable cv;
+    PieceManager pm(torrent.metadata, cv, nullptr, PickerConfig{.maxOpenPieces = 1});
+    auto bitfield = allPieces();
+    auto peer = peerAt(1);
+
+    auto requested = pm.requestBlock(bitfield, {.peer = peer});
+    REQUIRE(requested);
+    REQUIRE(pm.getOpenPieceCount() == 1);
+
+    // Unsolicited, both the copying and the zero-copy way
+    Block unsolicited{.pieceIndex = (requested->pieceIndex + 1) % NUM_PIECES,
+                      .offset = 0,
+                      .length = BLOCK_LEN};
+    CHECK(deliver(pm, torrent, unsolicited, peer));
+    CHECK_FALSE(pm.beginBlock(unsolicited, torrent.block(unsolicited).first(8)));
+    CHECK(pm.getOpenPieceCount() == 1);
+    CHECK(pm.getBufferedBytes() == PIECE_LEN);
+    CHECK(pm.getReceivedBytes() == 0);
+
+    // The requested piece still takes its blocks
+    auto lease = pm.beginBlock(*requested, torrent.block(*requested).first(8));
+    REQUIRE(lease);
+    auto rest = torrent.block(*requested).subspan(8);
+    std::copy(rest.begin(), rest.end(), lease->rest.begin());
+    CHECK(pm.finishBlock(*lease, peer));
+    CHECK(pm.getReceivedBytes() == BLOCK_LEN);
+
+    // A returned block that arrives anyway is taken while its piece is open, but doesn't
+    // reopen the piece once it's done
+    auto second = pm.requestBlock(bitfield, {.peer = peer});
+    REQUIRE(second);
+    CHECK(pm.returnBlock(*second));
+    CHECK(pm.getOpenPieceCount() == 1); // The received block keeps it open
+    CHECK(deliver(pm, torrent, *second, peer));
+    CHECK(pm.hasPiece(requested->pieceIndex));
+    CHECK(pm.getOpenPieceCount() == 0);
+    CHECK(deliver(pm, torrent, *second, peer));
+    CHECK(pm.getOpenPieceCount() == 0);
+}
+
+TEST_CASE("A second peer joins the piece that is already open") {
+    ScratchDir dir;
+    Torrent torrent;
+    std::condition_variable cv;
+    PieceManager pm(torrent.metadata, cv, nullptr);
+    auto bitfield = allPieces();
+
+    auto first = pm.requestBlock(bitfield, {.peer = peerAt(1)});
+    auto second = pm.requestBlock(bitfield, {.peer = peerAt(2)});
+    REQUIRE(first);
+    REQUIRE(second);
+    CHECK(second->pieceIndex == first->pieceIndex);
+    CHECK(second->offset != first->offset);
+    CHECK(pm.getOpenPieceCount() == 1);
+}
+
+TEST_CASE("A fast peer gets a piece to itself, slower peers open others") {
+    ScratchDir dir;
+    Torrent torrent;
+    std::condition_variable cv;
+    PieceManager pm(torrent.metadata, cv, nullptr);
+    auto bitfield = allPieces();
+    PeerContext fast{.peer = peerAt(1), .downloadRate = 100000};
+    PeerContext slow{.peer = peerAt(2), .downloadRate = 1000};
+
+    auto fastBlock = pm.requestBlock(bitfield, fast);
+    auto slowBlock = pm.requestBlock(bitfield, slow);
+    REQUIRE(fastBlock);
+    REQUIRE(slowBlock);
+    CHECK(slowBlock->pieceIndex != fastBlock->pieceIndex);
+    CHECK(pm.getOpenPieceCount() == 2);
+
+    // The fast peer finishes its own piece first
+    auto next = pm.requestBlock(bitfield, fast);
+    REQUIRE(next);
+    CHECK(next->pieceIndex == fastBlock->pieceIndex);
+}
+
+TEST_CASE("At the open piece cap, peers help out on open pieces instead of idling") {
+    ScratchDir dir;
+    Torrent torrent;
+    std::condition_variable cv;
+    PieceManager pm(torrent.metadata, cv, nullptr, PickerConfig{.maxOpenPieces = 1});
+    auto bitfield = allPieces();
+    PeerContext fast{.peer = peerAt(1), .downloadRate = 100000};
+    PeerContext slow{.peer = peerAt(2), .downloadRate = 1000};
+
+    // The only piece that may be open belongs to the fast peer
+    auto owned = pm.requestBlock(bitfield, fast);
+    REQUIRE(owned);
+    REQUIRE(pm.getOpenPieceCount() == 1);
+
+    auto helping = pm.requestBlock(bitfield, slow);
+    REQUIRE(helping);
+    CHECK(helping->pieceIndex == owned->pieceIndex);
+    CHECK(helping->offset != owned->offset);
+    CHECK(pm.getOpenPieceCount() == 1);
+    // Every block of it is requested now, there is nothing left to help with
+    CHECK_FALSE(pm.requestBlock(bitfield, slow));
+}
+
+TEST_CASE("StreamReader fetches its range first and escalates overdue blocks to a fast peer") {
+    ScratchDir dir;
+    Torrent torrent;
+    std::condition_variable cv;
+    auto pm = std::make_shared<PieceManager>(
+        torrent.metadata, cv, nullptr,
+        PickerConfig{.sequential = true, .streamingWindow = 2, .deadlineStep = 10ms});
+    auto bitfield = allPieces();
+    PeerContext slow{.peer = peerAt(1), .downloadRate = 1000.0};
+    PeerContext fast{.peer = peerAt(2), .downloadRate = 100000.0};
+
+    // Spans the end of piece 2 and the start of piece 3
+    const uint64_t offset = 2 * PIECE_LEN + 100;
+    const uint64_t length = PIECE_LEN;
+    asio::io_context io;
+    StreamReader reader(pm);
+    std::optional<std::vector<uint8_t>> data;
+    asio::co_spawn(
+        io, [&]() -> asio::awaitable<void> { data = co_await reader.readRange(offset, length); },
+        asio::detached);
+    io.poll();
+    REQUIRE_FALSE(data);
+
+    // The read cursor skips ahead to the range
+    auto first = pm->requestBlock(bitfield, slow);
+    auto second = pm->requestBlock(bitfield, slow);
+    REQUIRE(first);
+    REQUIRE(second);
+    CHECK(first->pieceIndex == 2);
+    CHECK(second->pieceIndex == 2);
+
+    // Past its deadline with every block requested, a fast peer gets a duplicate request
+    std::this_thread::sleep_for(30ms);
+    auto escalated = pm->requestBlock(bitfield, fast);
+    REQUIRE(escalated);
+    CHECK(escalated->pieceIndex == 2);
+    CHECK(escalated->offset == first->offset);
+    // Each outstanding block is escalated once
+    auto other = pm->requestBlock(bitfield, fast);
+    REQUIRE(other);
+    CHECK(other->offset == second->offset);
+    CHECK(other->pieceIndex == 2);
+
+    CHECK(deliver(*pm, torrent, *escalated, fast.peer));
+    CHECK(deliver(*pm, torrent, *second, slow.peer));
+    CHECK(pm->hasPiece(2));
+    io.poll();
+    CHECK_FALSE(data); // Still waiting for piece 3
+
+    for (int k = 0; k < 2; ++k) {
+        auto block = pm->requestBlock(bitfield, fast);
+        REQUIRE(block);
+        CHECK(block->pieceIndex == 3);
+        CHECK(deliver(*pm, torrent, *block, fast.peer));
+    }
+    io.run_for(1s);
+
+    REQUIRE(data);
+    std::vector<uint8_t> expected(torrent.pieces[2].begin() + 100, torrent.pieces[2].end());
+    expected.insert(expected.end(), torrent.pieces[3].begin(), torrent.pieces[3].begin() + 100);
+    CHECK(*data == expected);
+}
+
+TEST_CASE("FileHandler::sendData sends file data to a socket, waiting out a full one") {
+    ScratchDir dir;
+    Torrent torrent;
+    FileHandler file("data.bin", PIECE_LEN, PIECE_LEN);
+    for (uint32_t index = 0; index < NUM_PIECES; ++index) {
+        file.writePiece(index, torrent.pieces[index]);
+    }
+
+    int fds[2];
+    REQUIRE(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    int small = 4096;
+    ::setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &small, sizeof(small));
+    ::fcntl(fds[0], F_SETFL, ::fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+
+    // Starts inside the first piece and runs to the end of the file
+    const uint64_t offset = 100;
+    const size_t length = NUM_PIECES * PIECE_LEN - offset;
+    std::vector<uint8_t> received;
+    std::vector<uint8_t> chunk(64 * 1024);
+    size_t sent = 0;
+    bool full = false;
+    while (sent < length) {
+        ssize_t n = file.sendData(fds[0], offset + sent, length - sent);
+        if (n > 0) {
+            sent += n;
+            continue;
+        }
+        REQUIRE(n < 0);
+        REQUIRE((errno == EAGAIN || errno == EWOULDBLOCK));
+        full = true;
+        ssize_t got = ::read(fds[1], chunk.data(), chunk.size());
+        REQUIRE(got > 0);
+        received.insert(received.end(), chunk.begin(), chunk.begin() + got);
+    }
+    ::close(fds[0]);
+    for (ssize_t got; (got = ::read(fds[1], chunk.data(), chunk.size())) > 0;) {
+        received.insert(received.end(), chunk.begin(), chunk.begin() + got);
+    }
+    ::close(fds[1]);
+
+    CHECK(full);
+    std::vector<uint8_t> expected;
+    for (const auto& piece : torrent.pieces) {
+        expected.insert(expected.end(), piece.begin(), piece.end());
+    }
+    expected.erase(expected.begin(), expected.begin() + offset);
+    CHECK(received == expected);
+    // Nothing left to send past the end of the file
+    int other[2];
+    REQUIRE(::socketpair(AF_UNIX, SOCK_STREAM, 0, other) == 0);
+    CHECK(file.sendData(other[0], NUM_PIECES * PIECE_LEN, BLOCK_LEN) == 0);
+    ::close(other[0]);
+    ::close(other[1]);
+}
@@ -2,6 +2,7 @@
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
 #include <doctest/doctest.h>
 
+#include "core/magnet_link.hpp"
 #include "core/torrent_metadata_loader.hpp"
 
 namespace {
@@ -70,4 +71,73 @@ TEST_CASE("parsePieceHashes splits contiguous hashes correctly") {
     REQUIRE(hashes.size() == 2);
     CHECK(hashes[0][0] == 0x01);
     CHECK(hashes[1][0] == 0xAA);
-}
\ No newline at end of file
+}
+TEST_CASE("parseInfoData rebuilds the metadata from the info dictionary alone") {
+    const auto metadata = bt::core::parseTorrentData(fixtureTorrentPath().string());
+    const auto fromInfo = bt::core::parseInfoData(metadata.rawInfo);
+
+    CHECK(fromInfo.infoHash == metadata.infoHash);
+    CHECK(fromInfo.info.fileName == metadata.info.fileName);
+    CHECK(fromInfo.info.pieceHashes == metadata.info.pieceHashes);
+    CHECK(fromInfo.announce.empty());
+}
+
+TEST_CASE("parseMagnetLink reads the info hash, name and trackers") {
+    const auto link = bt::core::parseMagnetLink(
+        "magnet:?xt=urn:btih:86f635034839f1ebe81ab96bee4ac59f61db9dde"
+        "&dn=debian-13.3.0-amd64-netinst.iso"
+        "&tr=http%3A%2F%2Fbttracker.debian.org%3A6969%2Fannounce&tr=udp://tracker.example:80");
+    CHECK(link.infoHash == hexToSha1("86f635034839f1ebe81ab96bee4ac59f61db9dde"));
+    CHECK(link.displayName == "debian-13.3.0-amd64-netinst.iso");
+    REQUIRE(link.trackers.size() == 2);
+    CHECK(link.trackers[0] == "http://bttracker.debian.org:6969/announce");
+    CHECK(link.trackers[1] == "udp://tracker.example:80");
+
+    // Base32 names the same hash
+    const auto base32 =
+        bt::core::parseMagnetLink("magnet:?xt=urn:btih:Q33DKA2IHHY6X2A2XFV64SWFT5Q5XHO6");
+    CHECK(base32.infoHash == link.infoHash);
+    CHECK(base32.trackers.empty());
+}
+
+TEST_CASE("parseMagnetLink rejects links without a BitTorrent info hash") {
+    CHECK_FALSE(bt::core::isMagnetLink("debian.torrent"));
+    CHECK_THROWS_AS(bt::core::parseMagnetLink("debian.torrent"), std::invalid_argument);
+    CHECK_THROWS_AS(bt::core::parseMagnetLink("magnet:?dn=nothing"), std::invalid_argument);
+    CHECK_THROWS_AS(bt::core::parseMagnetLink("magnet:?xt=urn:btih:1234"), std::invalid_argument);
+    CHECK_THROWS_AS(bt::core::parseMagnetLink("magnet:?xt=urn:btih:" + std::string(40, 'g')),
+                    std::invalid_argument);
+}
+
+TEST_CASE("parseRootMetadata reads the announce-list by tier") {
+    using namespace bt::core::bencode;
+    const auto metadata = bt::core::parseTorrentData(fixtureTorrentPath().string());
+    auto root = std::get<Dict>(parse(bt::core::detail::loadTorrentFile(fixtureTorrentPath())));
+
+    SUBCASE("without announce-list the announce URL is the only tier") {
+        const auto parsed = bt::core::detail::parseRootMetadata(root);
+        CHECK(parsed.announceList.empty());
+        CHECK(bt::core::trackerTiers(parsed) ==
+              std::vector<std::vector<std::string>>{{metadata.announce}});
+    }
+
+    SUBCASE("tiers keep their order and malformed entries are skipped") {
+        root.values.erase("announce");
+        root.values["announce-list"] =
+            List{{List{{std::string("http://a/announce"), std::string("udp://b:80")}},
+                  List{{int64_t{7}}}, std::string("not a tier"),
+                  List{{std::string("http://c/announce"), int64_t{1}}}}};
+        const auto parsed = bt::core::detail::parseRootMetadata(root);
+        const std::vector<std::vector<std::string>> expected{
+            {"http://a/announce", "udp://b:80"}, {"http://c/announce"}};
+        CHECK(parsed.announce.empty());
+        CHECK(parsed.announceList == expected);
+        CHECK(bt::core::trackerTiers(parsed) == expected);
+    }
+
+    SUBCASE("announce is still required without a usable announce-list") {
+        root.values.erase("announce");
+        root.values["announce-list"] = List{{List{}}};
+        CHECK_THROWS(bt::core::detail::parseRootMetadata(root));
+    }
+}